@@ -0,0 +1,43 @@
+#ifndef QRTZ_BENCH_H
+#define QRTZ_BENCH_H
+
+// for clock_gettime
+#define _POSIX_C_SOURCE 199309L
+
+// Benchmarks drive the VM's internals directly, like the tests, so only what is measured runs.
+#include "quartz.h"
+#include "common.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// results are added up here, so the work producing them can't be optimized away
+static volatile size_t benchSink;
+
+static double benchNow(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// prints how long ops operations took, in total and each
+static void benchReport(const char *name, double seconds, size_t ops) {
+	printf("  %-28s %8.3f s %10.2f ns/op\n", name, seconds, seconds * 1e9 / (double)ops);
+}
+
+static qrtz_Value benchGlobal(qrtz_VM *vm, int key) {
+	qrtz_Value v = QRTZ_MKNULL();
+	qrtz_mapget(vm, vm->globals, QRTZ_MKINT(key), &v);
+	return v;
+}
+
+static void benchSetGlobal(qrtz_VM *vm, int key, qrtz_Value v) {
+	if(qrtz_mapset(vm, vm->globals, QRTZ_MKINT(key), v) != QRTZ_OK) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+}
+
+#endif
@@ -0,0 +1,82 @@
+#include "bench.h"
+
+// Compares the two value layouts on what they change: how many values fit in memory and in cache.
+// It is built once against each, see CMakeLists.txt.
+
+#define ARRAYLEN (1 << 20)
+#define ARRAYPASSES 20
+#define MAPKEYS 200000
+#define STACKPUSHES 1000
+#define STACKROUNDS 2000
+
+static void arrays(qrtz_VM *vm) {
+	qrtz_Array *arr = qrtz_allocArrayObject(vm, ARRAYLEN);
+	benchSetGlobal(vm, 0, QRTZ_MKOBJ(arr));
+	arr->len = ARRAYLEN;
+	double start = benchNow();
+	for(size_t i = 0; i < ARRAYLEN; i++) arr->values[i] = QRTZ_MKINT((intptr_t)i);
+	benchReport("array fill", benchNow() - start, ARRAYLEN);
+
+	start = benchNow();
+	size_t sum = 0;
+	for(int pass = 0; pass < ARRAYPASSES; pass++) {
+		for(size_t i = 0; i < ARRAYLEN; i++) sum += (size_t)QRTZ_ASINT(arr->values[i]);
+	}
+	benchReport("array sum, ints", benchNow() - start, (size_t)ARRAYLEN * ARRAYPASSES);
+	benchSink += sum;
+
+	for(size_t i = 0; i < ARRAYLEN; i++) arr->values[i] = QRTZ_MKNUM((double)i / 2);
+	start = benchNow();
+	double total = 0;
+	for(int pass = 0; pass < ARRAYPASSES; pass++) {
+		for(size_t i = 0; i < ARRAYLEN; i++) total += QRTZ_ASNUM(arr->values[i]);
+	}
+	benchReport("array sum, floats", benchNow() - start, (size_t)ARRAYLEN * ARRAYPASSES);
+	benchSink += (size_t)total;
+}
+
+static void maps(qrtz_VM *vm) {
+	qrtz_Map *map = qrtz_allocMapObject(vm, 0);
+	benchSetGlobal(vm, 1, QRTZ_MKOBJ(map));
+	double start = benchNow();
+	for(intptr_t i = 0; i < MAPKEYS; i++) {
+		if(qrtz_mapset(vm, map, QRTZ_MKINT(i * 7919), QRTZ_MKINT(i)) != QRTZ_OK) exit(1);
+	}
+	benchReport("map insert", benchNow() - start, MAPKEYS);
+
+	start = benchNow();
+	size_t found = 0;
+	for(intptr_t i = 0; i < MAPKEYS; i++) {
+		qrtz_Value v;
+		if(qrtz_mapget(vm, map, QRTZ_MKINT(i * 7919), &v)) found += (size_t)QRTZ_ASINT(v);
+	}
+	benchReport("map lookup", benchNow() - start, MAPKEYS);
+	benchSink += found;
+}
+
+static void stack(qrtz_VM *vm) {
+	double start = benchNow();
+	for(int round = 0; round < STACKROUNDS; round++) {
+		for(int i = 0; i < STACKPUSHES; i++) qrtz_pushint(vm, i);
+		qrtz_popn(vm, STACKPUSHES);
+	}
+	benchReport("stack push and pop", benchNow() - start, (size_t)STACKPUSHES * STACKROUNDS);
+}
+
+int main(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+#ifdef QUARTZ_NANBOX
+	const char *layout = "NaN-boxed";
+#else
+	const char *layout = "tagged";
+#endif
+	printf("layout: %s, %zu bytes per value\n", layout, sizeof(qrtz_Value));
+	arrays(vm);
+	maps(vm);
+	stack(vm);
+	printf("  %-28s %8zu KB\n", "memory used", qrtz_getMemoryUsage(vm) / 1024);
+	qrtz_destroy(vm);
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include "bench.h"
+
+// Inserting, hits, misses, and churn which leaves removed slots behind, with int and string keys.
+
+#define KEYS 500000
+#define LOOKUPS 4
+// churn keeps this many entries, adding one and removing the oldest each time
+#define CHURNLIVE 1000
+#define CHURNOPS 2000000
+
+static qrtz_Value key(qrtz_VM *vm, bool strings, size_t i) {
+	if(!strings) return QRTZ_MKINT((intptr_t)(i * 2654435761u));
+	// long enough not to be interned, so comparing them looks at their bytes
+	qrtz_String *s = qrtz_allocFStringObject(vm, "key number %zu, long enough to be an object", i);
+	if(s == NULL) exit(1);
+	return QRTZ_MKOBJ(s);
+}
+
+static void run(qrtz_VM *vm, bool strings) {
+	printf("%s keys\n", strings ? "string" : "int");
+	// the keys are made up front, and kept alive through an array, so only the map is timed
+	// strings get fewer churn operations, as each one needs its own key
+	size_t count = KEYS * 2 + (strings ? CHURNOPS / 10 : CHURNOPS) + CHURNLIVE;
+	qrtz_Array *keys = qrtz_allocArrayObject(vm, count);
+	if(keys == NULL) exit(1);
+	benchSetGlobal(vm, 0, QRTZ_MKOBJ(keys));
+	keys->len = count;
+	for(size_t i = 0; i < count; i++) keys->values[i] = QRTZ_MKNULL();
+	for(size_t i = 0; i < count; i++) qrtz_arrayset(vm, keys, i, key(vm, strings, i));
+	qrtz_Value *k = keys->values;
+
+	qrtz_Map *map = qrtz_allocMapObject(vm, 0);
+	benchSetGlobal(vm, 1, QRTZ_MKOBJ(map));
+	double start = benchNow();
+	for(size_t i = 0; i < KEYS; i++) qrtz_mapset(vm, map, k[i], QRTZ_MKINT((intptr_t)i));
+	benchReport("insert", benchNow() - start, KEYS);
+
+	qrtz_Value v;
+	size_t found = 0;
+	start = benchNow();
+	for(int pass = 0; pass < LOOKUPS; pass++) {
+		for(size_t i = 0; i < KEYS; i++) found += qrtz_mapget(vm, map, k[i], &v);
+	}
+	benchReport("lookup, hit", benchNow() - start, (size_t)KEYS * LOOKUPS);
+
+	start = benchNow();
+	for(int pass = 0; pass < LOOKUPS; pass++) {
+		for(size_t i = KEYS; i < KEYS * 2; i++) found += qrtz_mapget(vm, map, k[i], &v);
+	}
+	benchReport("lookup, miss", benchNow() - start, (size_t)KEYS * LOOKUPS);
+
+	// a map which stays small while every slot gets used and removed again
+	qrtz_Map *churn = qrtz_allocMapObject(vm, 0);
+	benchSetGlobal(vm, 2, QRTZ_MKOBJ(churn));
+	qrtz_Value *ck = k + KEYS * 2;
+	size_t ops = count - KEYS * 2 - CHURNLIVE;
+	for(size_t i = 0; i < CHURNLIVE; i++) qrtz_mapset(vm, churn, ck[i], QRTZ_MKINT(0));
+	start = benchNow();
+	for(size_t i = 0; i < ops; i++) {
+		qrtz_mapset(vm, churn, ck[i + CHURNLIVE], QRTZ_MKINT(0));
+		qrtz_mapremove(vm, churn, ck[i]);
+		found += qrtz_mapget(vm, churn, ck[i + CHURNLIVE / 2], &v);
+	}
+	benchReport("churn, add+remove+hit", benchNow() - start, ops);
+	printf("  %-28s %8zu slots for %zu entries\n", "churned map", churn->cap, churn->len);
+	benchSink += found;
+	benchSetGlobal(vm, 0, QRTZ_MKNULL());
+	benchSetGlobal(vm, 1, QRTZ_MKNULL());
+	benchSetGlobal(vm, 2, QRTZ_MKNULL());
+	qrtz_gc(vm);
+}
+
+int main(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	run(vm, false);
+	run(vm, true);
+	qrtz_destroy(vm);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include "bench.h"
+
+// Throughput of the memory primitives against the C library's, from sizes which barely reach
+// the SIMD paths to ones which no longer fit in cache.
+
+// bytes each measurement goes through
+#define TOTALBYTES ((size_t)256 << 20)
+
+static const size_t sizes[] = {16, 64, 256, 4096, 65536, 1 << 20};
+
+static char *src;
+static char *dst;
+
+typedef enum Op {
+	OPMEMCPY,
+	OPMEMSET,
+	OPMEMCMP,
+	OPSTRLEN,
+} Op;
+
+static const char *opNames[] = {"memcpy", "memset", "memcmp", "strlen"};
+
+// Runs an operation on size bytes until TOTALBYTES went through, returning the GB/s.
+static double run(Op op, bool libc, size_t size) {
+	size_t rounds = TOTALBYTES / size;
+	size_t sum = 0;
+	double start = benchNow();
+	for(size_t i = 0; i < rounds; i++) {
+		switch(op) {
+		case OPMEMCPY:
+			if(libc) memcpy(dst, src, size);
+			else qrtz_memcpy(dst, src, size);
+			break;
+		case OPMEMSET:
+			if(libc) memset(dst, (int)(i & 0x7F), size);
+			else qrtz_memset(dst, (char)(i & 0x7F), size);
+			break;
+		case OPMEMCMP:
+			// equal buffers, so every byte is compared
+			sum += (size_t)(libc ? memcmp(dst, src, size) : qrtz_memcmp(dst, src, size));
+			break;
+		case OPSTRLEN:
+			sum += libc ? strlen(src) : qrtz_strlen(src);
+			break;
+		}
+	}
+	double seconds = benchNow() - start;
+	benchSink += sum + (size_t)dst[size - 1];
+	return (double)(rounds * size) / seconds / 1e9;
+}
+
+int main(void) {
+	size_t maxSize = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	src = malloc(maxSize + 1);
+	dst = malloc(maxSize + 1);
+	if(src == NULL || dst == NULL) return 1;
+	printf("memory primitives, GB/s\n");
+	printf("  %-8s %8s %10s %10s\n", "", "bytes", "quartz", "libc");
+	for(Op op = OPMEMCPY; op <= OPSTRLEN; op++) {
+		for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+			size_t size = sizes[i];
+			memset(src, 'a', size);
+			src[size] = '\0';
+			memcpy(dst, src, size + 1);
+			double quartz = run(op, false, size);
+			// memset changed it
+			memcpy(dst, src, size + 1);
+			double libc = run(op, true, size);
+			printf("  %-8s %8zu %10.2f %10.2f\n", opNames[op], size, quartz, libc);
+		}
+	}
+	free(src);
+	free(dst);
+	return 0;
+}
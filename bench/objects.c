@@ -0,0 +1,58 @@
+#include "bench.h"
+
+// How many bytes small objects really take, headers, size class rounding, mark bits and intern table slots included,
+// measured as the growth in memory usage once a million of them are alive after a full collection.
+
+#define OBJECTS 1000000
+
+// keeps OBJECTS objects alive, made by make, and returns the bytes each one added
+static double measure(qrtz_VM *vm, qrtz_Value make(qrtz_VM *vm, size_t i)) {
+	qrtz_gc(vm);
+	size_t before = qrtz_getMemoryUsage(vm);
+	qrtz_Array *arr = qrtz_allocArrayObject(vm, OBJECTS);
+	if(arr == NULL) exit(1);
+	benchSetGlobal(vm, 0, QRTZ_MKOBJ(arr));
+	arr->len = OBJECTS;
+	for(size_t i = 0; i < OBJECTS; i++) arr->values[i] = QRTZ_MKNULL();
+	size_t arrayBytes = qrtz_getMemoryUsage(vm) - before;
+	double start = benchNow();
+	for(size_t i = 0; i < OBJECTS; i++) {
+		qrtz_arrayset(vm, arr, i, make(vm, i));
+		// lets collections run as they would in a program
+		if(i % 4096 == 0) qrtz_safepoint(vm);
+	}
+	benchReport("allocate", benchNow() - start, OBJECTS);
+	qrtz_gc(vm);
+	double perObject = (double)(qrtz_getMemoryUsage(vm) - before - arrayBytes) / OBJECTS;
+	benchSetGlobal(vm, 0, QRTZ_MKNULL());
+	return perObject;
+}
+
+static qrtz_Value makeString(qrtz_VM *vm, size_t i) {
+	// 12 bytes, too long to fit in a value, and all different
+	char buf[13];
+	snprintf(buf, sizeof(buf), "s%011zu", i);
+	qrtz_String *s = qrtz_allocStringObject(vm, buf, 12);
+	if(s == NULL) exit(1);
+	return QRTZ_MKOBJ(s);
+}
+
+static qrtz_Value makePointer(qrtz_VM *vm, size_t i) {
+	qrtz_Pointer *p = qrtz_allocPointerObject(vm);
+	if(p == NULL) exit(1);
+	p->val = QRTZ_MKINT((intptr_t)i);
+	return QRTZ_MKOBJ(p);
+}
+
+int main(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	printf("bytes per object, with a %zu-byte header and %zu-byte values\n", sizeof(qrtz_Object), sizeof(qrtz_Value));
+	printf("12-byte strings, %zu bytes as a struct\n", sizeof(qrtz_String) + 12);
+	printf("  %-28s %8.1f bytes\n", "each", measure(vm, makeString));
+	printf("pointers, %zu bytes as a struct\n", sizeof(qrtz_Pointer));
+	printf("  %-28s %8.1f bytes\n", "each", measure(vm, makePointer));
+	qrtz_destroy(vm);
+	return 0;
+}
@@ -0,0 +1,74 @@
+#include "bench.h"
+
+// The slab context against the default one, first on the allocations the VM sends to its context
+// alone, then on a VM workload which makes lots of small maps and arrays.
+
+#define LIVE 4096
+#define CONTEXTOPS 20000000
+#define VMS 20
+#define VMOBJECTS 100000
+
+// Frees and allocates a random mix of the sizes the VM asks its context for: map data, lists,
+// task stacks and pages. The mix is the same for both contexts.
+static double contextMix(qrtz_Context *ctx) {
+	static const size_t sizes[] = {8 * 33, 16 * 33, 32 * 33, 64, 128, 512, 32 * sizeof(qrtz_Value), QRTZ_PAGESIZE};
+	void *blocks[LIVE] = {NULL};
+	size_t blockSizes[LIVE] = {0};
+	uint32_t rng = 1;
+	double start = benchNow();
+	for(size_t i = 0; i < CONTEXTOPS; i++) {
+		rng = rng * 1664525 + 1013904223;
+		size_t slot = (rng >> 8) % LIVE;
+		size_t size = sizes[(rng >> 24) % (sizeof(sizes) / sizeof(sizes[0]))];
+		if(blocks[slot] != NULL) ctx->alloc(ctx->data, blocks[slot], blockSizes[slot], 0);
+		blocks[slot] = ctx->alloc(ctx->data, NULL, 0, size);
+		if(blocks[slot] == NULL) exit(1);
+		blockSizes[slot] = size;
+		*(char *)blocks[slot] = (char)i;
+	}
+	double seconds = benchNow() - start;
+	for(size_t i = 0; i < LIVE; i++) {
+		if(blocks[i] != NULL) ctx->alloc(ctx->data, blocks[i], blockSizes[i], 0);
+	}
+	return seconds;
+}
+
+// Short-lived VMs, each making small maps and arrays, a few of which stay alive at a time.
+static double vmWorkload(qrtz_Context *ctx) {
+	double start = benchNow();
+	for(int r = 0; r < VMS; r++) {
+		qrtz_VM *vm = qrtz_create(ctx);
+		if(vm == NULL) exit(1);
+		qrtz_Array *arr = qrtz_allocArrayObject(vm, 4096);
+		arr->len = 4096;
+		for(int i = 0; i < 4096; i++) arr->values[i] = QRTZ_MKNULL();
+		benchSetGlobal(vm, 0, QRTZ_MKOBJ(arr));
+		for(int i = 0; i < VMOBJECTS; i++) {
+			qrtz_Map *m = qrtz_allocMapObject(vm, 0);
+			for(int k = 0; k < (i & 7); k++) qrtz_mapset(vm, m, QRTZ_MKINT(k), QRTZ_MKINT(i));
+			qrtz_Array *a = qrtz_allocArrayObject(vm, i & 15);
+			a->len = 0;
+			arr = (qrtz_Array *)QRTZ_ASOBJ(benchGlobal(vm, 0));
+			qrtz_arrayset(vm, arr, i & 4095, i & 1 ? QRTZ_MKOBJ(m) : QRTZ_MKOBJ(a));
+			qrtz_safepoint(vm);
+		}
+		qrtz_destroy(vm);
+	}
+	return benchNow() - start;
+}
+
+int main(void) {
+	qrtz_Context def;
+	qrtz_initContext(&def);
+	qrtz_Slab slab;
+	qrtz_Context slabCtx;
+	qrtz_initSlabContext(&slabCtx, &slab, &def);
+	printf("default context\n");
+	benchReport("context, random mix", contextMix(&def), CONTEXTOPS);
+	benchReport("VMs making maps and arrays", vmWorkload(&def), (size_t)VMS * VMOBJECTS);
+	printf("slab context\n");
+	benchReport("context, random mix", contextMix(&slabCtx), CONTEXTOPS);
+	benchReport("VMs making maps and arrays", vmWorkload(&slabCtx), (size_t)VMS * VMOBJECTS);
+	qrtz_freeSlab(&slab);
+	return 0;
+}
@@ -0,0 +1,310 @@
+#include "quartz.h"
+#include "common.h"
+#include "value.h"
+
+// the first stack slot of the current call frame
+static size_t qrtz_framebase(qrtz_VM *vm) {
+	qrtz_Task *task = vm->curTask;
+	if(task->calllen == 0) return 0;
+	return task->calls[task->calllen - 1].stacktop;
+}
+
+// gets a pointer to a stack slot.
+// Returns NULL for special indexes and indexes outside of the current frame.
+static qrtz_Value *qrtz_stackslot(qrtz_VM *vm, int idx) {
+	qrtz_Task *task = vm->curTask;
+	size_t base = qrtz_framebase(vm);
+	size_t i;
+	if(idx >= 0) {
+		i = base + (size_t)idx;
+	} else {
+		// special indexes are the most negative ones
+		if(idx <= QRTZ_IDXERROR) return NULL;
+		size_t back = (size_t)-(intptr_t)idx;
+		if(back > task->stacklen - base) return NULL;
+		i = task->stacklen - back;
+	}
+	if(i >= task->stacklen) return NULL;
+	return &task->stack[i];
+}
+
+// gets the value at an index, including special ones.
+// Returns false if the index is invalid.
+static bool qrtz_getvalue(qrtz_VM *vm, int idx, qrtz_Value *val) {
+	switch(idx) {
+	case QRTZ_IDXREGISTRY:
+		*val = QRTZ_MKOBJ(vm->registry);
+		return true;
+	case QRTZ_IDXGLOBALS:
+		*val = QRTZ_MKOBJ(vm->globals);
+		return true;
+	case QRTZ_IDXLOADED:
+		*val = QRTZ_MKOBJ(vm->loaded);
+		return true;
+	default:
+		break;
+	}
+	qrtz_Value *slot = qrtz_stackslot(vm, idx);
+	if(slot == NULL) return false;
+	*val = *slot;
+	return true;
+}
+
+static qrtz_Exit qrtz_pushval(qrtz_VM *vm, qrtz_Value val) {
+	qrtz_Task *task = vm->curTask;
+	if(task->stacklen == task->stackcap) {
+		if(task->stackcap >= QRTZ_STACKSIZE) return QRTZ_ENOSTACK;
+		size_t newCap = task->stackcap * 2;
+		if(newCap > QRTZ_STACKSIZE) newCap = QRTZ_STACKSIZE;
+		qrtz_Value *newStack = qrtz_realloc(vm, task->stack, sizeof(qrtz_Value), task->stackcap, newCap);
+		if(newStack == NULL) return QRTZ_ENOMEM;
+		task->stack = newStack;
+		task->stackcap = newCap;
+	}
+	task->stack[task->stacklen++] = val;
+	return QRTZ_OK;
+}
+
+static qrtz_Exit qrtz_pushobj(qrtz_VM *vm, void *obj) {
+	if(obj == NULL) return QRTZ_ENOMEM;
+	return qrtz_pushval(vm, QRTZ_MKOBJ(obj));
+}
+
+qrtz_Exit qrtz_pushint(qrtz_VM *vm, intptr_t n) {
+	return qrtz_pushval(vm, qrtz_mkint(n));
+}
+
+qrtz_Exit qrtz_pushnumber(qrtz_VM *vm, double n) {
+	return qrtz_pushval(vm, QRTZ_MKNUM(n));
+}
+
+qrtz_Exit qrtz_pushstring(qrtz_VM *vm, const char *str) {
+	return qrtz_pushlstring(vm, str, qrtz_strlen(str));
+}
+
+qrtz_Exit qrtz_pushlstring(qrtz_VM *vm, const char *str, size_t len) {
+	// short strings live in the value itself, no allocation needed
+	if(len <= QRTZ_SSTRMAX) return qrtz_pushval(vm, QRTZ_MKSSTR(str, len));
+	qrtz_checkGC(vm);
+	return qrtz_pushobj(vm, qrtz_allocStringObject(vm, str, len));
+}
+
+qrtz_Exit qrtz_pushexternstring(qrtz_VM *vm, const char *str, size_t len, qrtz_StringRelease *release, void *userdata) {
+	if(len <= QRTZ_SSTRMAX) {
+		qrtz_Exit err = qrtz_pushval(vm, QRTZ_MKSSTR(str, len));
+		if(err) return err;
+		if(release != NULL) release(userdata, str, len);
+		return QRTZ_OK;
+	}
+	qrtz_checkGC(vm);
+	return qrtz_pushobj(vm, qrtz_allocExternStringObject(vm, str, len, release, userdata));
+}
+
+qrtz_Exit qrtz_pushfstring(qrtz_VM *vm, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	qrtz_Exit err = qrtz_vpushfstring(vm, fmt, args);
+	va_end(args);
+	return err;
+}
+
+qrtz_Exit qrtz_vpushfstring(qrtz_VM *vm, const char *fmt, va_list args) {
+	qrtz_checkGC(vm);
+	qrtz_Value val;
+	if(!qrtz_vformatval(vm, &val, fmt, args)) return QRTZ_ENOMEM;
+	return qrtz_pushval(vm, val);
+}
+
+qrtz_Exit qrtz_pushvalue(qrtz_VM *vm, int idx) {
+	qrtz_Value val;
+	if(!qrtz_getvalue(vm, idx, &val)) return QRTZ_ERUNTIME;
+	return qrtz_pushval(vm, val);
+}
+
+qrtz_Exit qrtz_pin(qrtz_VM *vm, int idx) {
+	qrtz_checkGC(vm);
+	qrtz_Value val;
+	if(!qrtz_getvalue(vm, idx, &val)) return QRTZ_ERUNTIME;
+	if(!QRTZ_ISOBJ(val)) return QRTZ_OK;
+	if(QRTZ_ISYOUNG(vm, QRTZ_ASOBJ(val))) {
+		// Pinned objects must be old, as young ones move. Young ones are only left
+		// during a cycle after running out of memory, and the nursery is not collected then.
+		if(vm->gcState != QRTZ_GCIDLE) return QRTZ_ENOMEM;
+		qrtz_minorgc(vm, true);
+		qrtz_getvalue(vm, idx, &val);
+		if(QRTZ_ISYOUNG(vm, QRTZ_ASOBJ(val))) return QRTZ_ENOMEM;
+	}
+	if(!qrtz_pinObject(vm, QRTZ_ASOBJ(val))) return QRTZ_ENOMEM;
+	return QRTZ_OK;
+}
+
+qrtz_Exit qrtz_unpin(qrtz_VM *vm, int idx) {
+	qrtz_Value val;
+	if(!qrtz_getvalue(vm, idx, &val)) return QRTZ_ERUNTIME;
+	if(!QRTZ_ISOBJ(val)) return QRTZ_OK;
+	if(!qrtz_unpinObject(vm, QRTZ_ASOBJ(val))) return QRTZ_ERUNTIME;
+	return QRTZ_OK;
+}
+
+qrtz_Exit qrtz_setweak(qrtz_VM *vm, int idx, qrtz_WeakFlags flags) {
+	qrtz_Value val;
+	if(!qrtz_getvalue(vm, idx, &val) || !QRTZ_ISOBJ(val) || QRTZ_ASOBJ(val)->tag != QRTZ_OMAP) return QRTZ_ERUNTIME;
+	qrtz_setMapWeak(vm, (qrtz_Map *)QRTZ_ASOBJ(val), flags & (QRTZ_WEAK_KEYS | QRTZ_WEAK_VALUES));
+	return QRTZ_OK;
+}
+
+qrtz_Exit qrtz_pushuserdata(qrtz_VM *vm, void *pointer, const char *type, size_t associated) {
+	qrtz_checkGC(vm);
+	if(associated > qrtz_getstacksize(vm)) return QRTZ_ERUNTIME;
+	qrtz_Task *task = vm->curTask;
+	// The userdata takes the place of its associated values. If there are none, a slot is pushed first,
+	// so nothing can fail once it exists, as its finalizer would then run on a pointer the host still owns.
+	size_t slots = associated;
+	if(slots == 0) {
+		qrtz_Exit err = qrtz_pushval(vm, QRTZ_MKNULL());
+		if(err) return err;
+		slots = 1;
+	}
+	qrtz_Userdata *u = qrtz_allocUserdataObject(vm, pointer, type, associated);
+	if(u == NULL) {
+		if(associated == 0) task->stacklen--;
+		return QRTZ_ENOMEM;
+	}
+	task->stacklen -= slots;
+	qrtz_memcpy(u->associated, task->stack + task->stacklen, sizeof(qrtz_Value) * associated);
+	task->stack[task->stacklen++] = QRTZ_MKOBJ(u);
+	return QRTZ_OK;
+}
+
+// Concatenates strings which fit in a short string together straight into one, without allocating.
+// Returns false if they don't, or if something is not a string, which is left to qrtz_concat.
+static bool qrtz_concatShort(qrtz_VM *vm, qrtz_Value *vals, size_t n, qrtz_Value *out) {
+	char buf[QRTZ_SSTRMAX + 1];
+	size_t len = 0;
+	for(size_t i = 0; i < n; i++) {
+		const char *data;
+		size_t partLen;
+		if(QRTZ_VTAG(vals[i]) == QRTZ_VSSTR) {
+			data = QRTZ_SSTRDATA(&vals[i]);
+			partLen = QRTZ_SSTRLEN(vals[i]);
+		} else if(QRTZ_ISOBJ(vals[i]) && QRTZ_ASOBJ(vals[i])->tag == QRTZ_OSTR) {
+			qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(vals[i]);
+			// ropes are always longer, so this never allocates
+			if(s->len > QRTZ_SSTRMAX - len) return false;
+			data = qrtz_strdata(vm, s);
+			partLen = s->len;
+		} else {
+			return false;
+		}
+		if(partLen > QRTZ_SSTRMAX - len) return false;
+		qrtz_memcpy(buf + len, data, partLen);
+		len += partLen;
+	}
+	*out = QRTZ_MKSSTR(buf, len);
+	return true;
+}
+
+qrtz_Exit qrtz_concat(qrtz_VM *vm, size_t n) {
+	qrtz_checkGC(vm);
+	if(n > qrtz_getstacksize(vm)) return QRTZ_ERUNTIME;
+	if(n == 0) return qrtz_pushlstring(vm, "", 0);
+	qrtz_Task *task = vm->curTask;
+	// the operands stay on the stack until the end, but nothing collects in between anyways
+	qrtz_Value *vals = task->stack + task->stacklen - n;
+	qrtz_Value shortResult;
+	if(qrtz_concatShort(vm, vals, n, &shortResult)) {
+		task->stacklen -= n;
+		return qrtz_pushval(vm, shortResult);
+	}
+	qrtz_String *result = NULL;
+	for(size_t i = 0; i < n; i++) {
+		qrtz_String *s = qrtz_toStringObject(vm, vals[i]);
+		if(s == NULL) return QRTZ_ENOMEM;
+		result = result == NULL ? s : qrtz_concatStringObjects(vm, result, s);
+		if(result == NULL) return QRTZ_ENOMEM;
+	}
+	task->stacklen -= n;
+	return qrtz_pushval(vm, qrtz_strval(result));
+}
+
+qrtz_Exit qrtz_pushsubstring(qrtz_VM *vm, int idx, size_t start, size_t len) {
+	qrtz_checkGC(vm);
+	qrtz_Value *slot = qrtz_stackslot(vm, idx);
+	qrtz_Value val;
+	if(!qrtz_getvalue(vm, idx, &val)) return QRTZ_ERUNTIME;
+	if(QRTZ_VTAG(val) == QRTZ_VSSTR) {
+		if(start > QRTZ_SSTRLEN(val) || len > QRTZ_SSTRLEN(val) - start) return QRTZ_ERUNTIME;
+		return qrtz_pushval(vm, QRTZ_MKSSTR(QRTZ_SSTRDATA(slot) + start, len));
+	}
+	if(!QRTZ_ISOBJ(val) || QRTZ_ASOBJ(val)->tag != QRTZ_OSTR) return QRTZ_ERUNTIME;
+	qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(val);
+	if(start > s->len || len > s->len - start) return QRTZ_ERUNTIME;
+	if(len <= QRTZ_SSTRMAX) {
+		const char *data = qrtz_strdata(vm, s);
+		if(data == NULL) return QRTZ_ENOMEM;
+		return qrtz_pushval(vm, QRTZ_MKSSTR(data + start, len));
+	}
+	return qrtz_pushobj(vm, qrtz_substringObject(vm, s, start, len));
+}
+
+size_t qrtz_getstacksize(qrtz_VM *vm) {
+	return vm->curTask->stacklen - qrtz_framebase(vm);
+}
+
+qrtz_Exit qrtz_popn(qrtz_VM *vm, size_t n) {
+	if(n > qrtz_getstacksize(vm)) return QRTZ_ERUNTIME;
+	vm->curTask->stacklen -= n;
+	return QRTZ_OK;
+}
+
+qrtz_Exit qrtz_pop(qrtz_VM *vm) {
+	return qrtz_popn(vm, 1);
+}
+
+const char *qrtz_tostring(qrtz_VM *vm, int idx, qrtz_Exit *err) {
+	return qrtz_tolstring(vm, idx, NULL, err);
+}
+
+// The returned pointer is valid for as long as the string is reachable.
+// Short strings are stored in the stack slot itself, so they are copied to an object first.
+// The bytes are NUL-terminated, unless it is an external string and len is not NULL,
+// where the host's memory is returned as-is. Without len, a terminated copy is made once.
+// Ropes are flattened here, which is why this can run out of memory.
+const char *qrtz_tolstring(qrtz_VM *vm, int idx, size_t *len, qrtz_Exit *err) {
+	qrtz_Value val;
+	qrtz_Exit e = QRTZ_OK;
+	const char *data = NULL;
+	qrtz_Value *slot = qrtz_stackslot(vm, idx);
+	if(slot != NULL && QRTZ_VTAG(*slot) == QRTZ_VSSTR) {
+		// Short strings live in the slot, which changes along with the stack,
+		// so they are copied to an object, which takes their place.
+		qrtz_String *copy = qrtz_strobj(vm, *slot);
+		if(copy == NULL) {
+			e = QRTZ_ENOMEM;
+			goto done;
+		}
+		*slot = QRTZ_MKOBJ(&copy->obj);
+	}
+	if(!qrtz_getvalue(vm, idx, &val) || !QRTZ_ISOBJ(val) || QRTZ_ASOBJ(val)->tag != QRTZ_OSTR) {
+		e = QRTZ_ERUNTIME;
+		goto done;
+	}
+	// the bytes must not move once the host has a pointer to them
+	qrtz_String *s = qrtz_tenureString(vm, (qrtz_String *)QRTZ_ASOBJ(val));
+	if(s == NULL) {
+		e = QRTZ_ENOMEM;
+		goto done;
+	}
+	if(slot != NULL) *slot = QRTZ_MKOBJ(&s->obj);
+	// the length is the only way to know where the bytes end without a NUL
+	data = len != NULL ? qrtz_strdata(vm, s) : qrtz_strcstr(vm, s);
+	if(data == NULL) {
+		e = QRTZ_ENOMEM;
+		goto done;
+	}
+	if(len != NULL) *len = s->len;
+	qrtz_fixString(s, data);
+done:
+	if(err != NULL) *err = e;
+	return data;
+}
@@ -16,6 +16,10 @@ bool qrtz_sizeOverflows(size_t a, size_t b);
 size_t qrtz_strlen(const char *s);
 char *qrtz_strdup(qrtz_Context *ctx, const char *s);
 void qrtz_strfree(qrtz_Context *ctx, char *s);
+// dest and src must not overlap
 void qrtz_memcpy(void *dest, const void *src, size_t len);
+void qrtz_memset(void *dest, char c, size_t len);
+// like memcmp, compares the bytes as unsigned
+int qrtz_memcmp(const void *a, const void *b, size_t len);
 
 #endif
@@ -0,0 +1,1596 @@
+#include "quartz.h"
+#include "common.h"
+#include "value.h"
+
+// Appends to one of the VM's object lists, growing it if needed.
+// Returns false if it can't grow.
+static bool qrtz_pushObject(qrtz_VM *vm, qrtz_Object ***list, size_t *len, size_t *cap, qrtz_Object *obj) {
+	if(*len == *cap) {
+		size_t newCap = *cap == 0 ? 64 : *cap * 2;
+		qrtz_Object **newList = qrtz_realloc(vm, *list, sizeof(qrtz_Object *), *cap, newCap);
+		if(newList == NULL) return false;
+		*list = newList;
+		*cap = newCap;
+	}
+	(*list)[(*len)++] = obj;
+	return true;
+}
+
+// Grows one of a marker's lists. The memory usage can't be changed from other threads,
+// so parallel markers go through the context.
+static bool qrtz_growMarkList(qrtz_Marker *m, qrtz_Object ***list, size_t *cap) {
+	size_t newCap = *cap == 0 ? 64 : *cap * 2;
+	qrtz_Object **newList;
+	if(m->parallel) newList = qrtz_crealloc(&m->vm->ctx, *list, sizeof(qrtz_Object *), *cap, newCap);
+	else newList = qrtz_realloc(m->vm, *list, sizeof(qrtz_Object *), *cap, newCap);
+	if(newList == NULL) return false;
+	*list = newList;
+	*cap = newCap;
+	return true;
+}
+
+static void qrtz_pushGray(qrtz_Marker *m, qrtz_Object *obj) {
+	if(m->grayLen == m->grayCap && !qrtz_growMarkList(m, &m->gray, &m->grayCap)) {
+		// it stays marked, and is found again by scanning the heap
+		m->overflow = true;
+		return;
+	}
+	m->gray[m->grayLen++] = obj;
+}
+
+// The gray stack can get as big as the heap, so once it is empty, it is only kept if it is small.
+static void qrtz_trimGray(qrtz_VM *vm) {
+	if(vm->marker.grayCap <= 1024) return;
+	qrtz_freeArray(vm, vm->marker.gray, sizeof(qrtz_Object *), vm->marker.grayCap);
+	vm->marker.gray = NULL;
+	vm->marker.grayCap = 0;
+}
+
+#ifdef QRTZ_THREADS
+// qrtz_setMarked, for when other threads may be marking objects in the same page
+static bool qrtz_setMarkedAtomic(qrtz_Object *obj) {
+	if(obj->gcflags & QRTZ_GCLARGE) {
+		bool *marked = &((qrtz_LargeObject *)obj - 1)->marked;
+		if(__atomic_load_n(marked, __ATOMIC_RELAXED)) return true;
+		return __atomic_exchange_n(marked, true, __ATOMIC_RELAXED);
+	}
+	qrtz_Page *page = qrtz_pageOf(obj);
+	size_t g = QRTZ_GRANULE(page, obj);
+	uint64_t bit = 1ull << (g % 64);
+	uint64_t *word = &page->marked[g / 64];
+	// most objects are reached more than once, and reading is cheaper than an atomic or
+	if(__atomic_load_n(word, __ATOMIC_RELAXED) & bit) return true;
+	return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+// qrtz_isMarked, for when other threads may be marking objects in the same page
+static bool qrtz_isMarkedAtomic(qrtz_Object *obj) {
+	if(obj->gcflags & QRTZ_GCLARGE) return __atomic_load_n(&((qrtz_LargeObject *)obj - 1)->marked, __ATOMIC_RELAXED);
+	qrtz_Page *page = qrtz_pageOf(obj);
+	size_t g = QRTZ_GRANULE(page, obj);
+	return (__atomic_load_n(&page->marked[g / 64], __ATOMIC_RELAXED) >> (g % 64)) & 1;
+}
+#else
+#define qrtz_setMarkedAtomic qrtz_setMarked
+#define qrtz_isMarkedAtomic qrtz_isMarked
+#endif
+
+// Leaves a forwarding pointer in a young object which was moved.
+// It overwrites the start of the object, so it must not be used afterwards.
+static void qrtz_forward(qrtz_Object *obj, qrtz_Object *copy) {
+	obj->gcflags |= QRTZ_GCFORWARDED;
+	*(qrtz_Object **)(obj + 1) = copy;
+}
+
+// where a young object was moved to, or NULL if it was not
+static qrtz_Object *qrtz_forwarded(qrtz_VM *vm, qrtz_Object *obj) {
+	if(obj->gcflags & QRTZ_GCFORWARDED) return *(qrtz_Object **)(obj + 1);
+	if(obj->gcflags & QRTZ_GCTENURED) return vm->tenured[obj->idhash];
+	return NULL;
+}
+
+// the index of the young mark bit of an object in the nursery
+#define QRTZ_YOUNGMARK(vm, o) (((uintptr_t)(o) - (uintptr_t)(vm)->nursery) / QRTZ_NURSERYALIGN)
+
+// qrtz_setMarked, for objects left in the nursery when the cycle started
+static bool qrtz_setYoungMarked(qrtz_Marker *m, qrtz_Object *obj) {
+	qrtz_VM *vm = m->vm;
+	size_t b = QRTZ_YOUNGMARK(vm, obj);
+	uint64_t bit = 1ull << (b % 64);
+	uint64_t *word = &vm->youngMarks[b / 64];
+#ifdef QRTZ_THREADS
+	if(m->parallel) return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) != 0;
+#endif
+	bool was = (*word & bit) != 0;
+	*word |= bit;
+	return was;
+}
+
+// qrtz_isMarked, for objects which may be young
+static bool qrtz_isLive(qrtz_VM *vm, qrtz_Object *obj) {
+	if(!QRTZ_ISYOUNG(vm, obj)) return qrtz_isMarked(obj);
+	qrtz_Object *moved = qrtz_forwarded(vm, obj);
+	if(moved != NULL) return qrtz_isLive(vm, moved);
+	size_t b = QRTZ_YOUNGMARK(vm, obj);
+	return (vm->youngMarks[b / 64] >> (b % 64)) & 1;
+}
+
+#ifdef QRTZ_THREADS
+static bool qrtz_isLiveAtomic(qrtz_VM *vm, qrtz_Object *obj) {
+	if(!QRTZ_ISYOUNG(vm, obj)) return qrtz_isMarkedAtomic(obj);
+	qrtz_Object *moved = qrtz_forwarded(vm, obj);
+	if(moved != NULL) return qrtz_isLiveAtomic(vm, moved);
+	size_t b = QRTZ_YOUNGMARK(vm, obj);
+	return (__atomic_load_n(&vm->youngMarks[b / 64], __ATOMIC_RELAXED) >> (b % 64)) & 1;
+}
+#else
+#define qrtz_isLiveAtomic qrtz_isLive
+#endif
+
+static void qrtz_markObject(qrtz_Marker *m, qrtz_Object *obj) {
+	if(obj == NULL) return;
+	if(QRTZ_ISYOUNG(m->vm, obj)) {
+		// Objects left young only reference what moved through its old place, which is fixed
+		// by the next minor collection. What moved is what must stay alive.
+		qrtz_Object *moved = qrtz_forwarded(m->vm, obj);
+		if(moved != NULL) {
+			qrtz_markObject(m, moved);
+			return;
+		}
+		if(qrtz_setYoungMarked(m, obj)) return;
+	} else if(m->parallel ? qrtz_setMarkedAtomic(obj) : qrtz_setMarked(obj)) return;
+	// objects are only marked once, but can be scanned more than once, so they are counted here
+	m->liveCount[obj->tag]++;
+	m->liveBytes[obj->tag] += qrtz_objmemsizeof(obj);
+	qrtz_pushGray(m, obj);
+}
+
+static void qrtz_markValue(qrtz_Marker *m, qrtz_Value val) {
+	if(!QRTZ_ISOBJ(val)) return;
+	qrtz_markObject(m, QRTZ_ASOBJ(val));
+}
+
+static void qrtz_markValues(qrtz_Marker *m, qrtz_Value *vals, size_t len) {
+	for(size_t i = 0; i < len; i++) qrtz_markValue(m, vals[i]);
+}
+
+// the parent is marked by qrtz_markSliceParents, unless the slice can't be kept track of
+static void qrtz_pushSlice(qrtz_Marker *m, qrtz_SliceString *slice) {
+	if(m->slicesLen == m->slicesCap && !qrtz_growMarkList(m, &m->slices, &m->slicesCap)) {
+		qrtz_markObject(m, (qrtz_Object *)slice->parent);
+		return;
+	}
+	m->slices[m->slicesLen++] = (qrtz_Object *)slice;
+}
+
+// Strings are compared by content, so an equal one can always be made again, and they are never
+// held weakly. Neither is anything which is not an object.
+static bool qrtz_isWeakRef(qrtz_Value val) {
+	return QRTZ_ISOBJ(val) && QRTZ_ASOBJ(val)->tag != QRTZ_OSTR;
+}
+
+// weak maps are kept track of, so their dead entries can be removed once marking is over
+static bool qrtz_pushWeak(qrtz_Marker *m, qrtz_Map *map) {
+	if(m->weakLen == m->weakCap && !qrtz_growMarkList(m, &m->weak, &m->weakCap)) return false;
+	m->weak[m->weakLen++] = &map->obj;
+	return true;
+}
+
+// Marks the entries of a map. If it is weak, what it holds weakly is left unmarked,
+// and values of weak keys are only marked if their key already is.
+static void qrtz_markMap(qrtz_Marker *m, qrtz_Map *map, bool weak) {
+	bool weakKeys = weak && (map->weak & QRTZ_WEAK_KEYS);
+	bool weakValues = weak && (map->weak & QRTZ_WEAK_VALUES);
+	for(size_t i = 0; i < map->cap; i++) {
+		if(!QRTZ_MAPFULL(map, i)) continue;
+		qrtz_Value key = map->data[i];
+		qrtz_Value val = map->data[i + map->cap];
+		bool weakKey = weakKeys && qrtz_isWeakRef(key);
+		if(!weakKey) qrtz_markValue(m, key);
+		if(weakValues && qrtz_isWeakRef(val)) continue;
+		// the rest are marked by qrtz_markEphemerons, if their key ends up marked
+		if(weakKey && !(m->parallel ? qrtz_isLiveAtomic(m->vm, QRTZ_ASOBJ(key)) : qrtz_isLive(m->vm, QRTZ_ASOBJ(key)))) continue;
+		qrtz_markValue(m, val);
+	}
+}
+
+// Tasks and programs are written to all the time, without barriers, so they are
+// scanned again once incremental marking is over.
+static void qrtz_markAgain(qrtz_Marker *m, qrtz_Object *obj) {
+	qrtz_VM *vm = m->vm;
+	if(vm->gcState != QRTZ_GCMARK) return;
+	// rescanning every marked object covers these too
+	if(!qrtz_pushObject(vm, &vm->grayAgain, &vm->grayAgainLen, &vm->grayAgainCap, obj)) m->overflow = true;
+}
+
+// marks everything an object references
+static void qrtz_blackenObject(qrtz_Marker *m, qrtz_Object *obj) {
+	m->work += qrtz_objmemsizeof(obj);
+	switch(obj->tag) {
+	case QRTZ_OSTR: {
+		qrtz_String *s = (qrtz_String *)obj;
+		if(s->flags & QRTZ_SROPE) {
+			qrtz_Rope *r = (qrtz_Rope *)s;
+			qrtz_markObject(m, (qrtz_Object *)r->left);
+			qrtz_markObject(m, (qrtz_Object *)r->right);
+			qrtz_markObject(m, (qrtz_Object *)r->flat);
+		}
+		if(s->flags & QRTZ_SEXTERN) {
+			qrtz_markObject(m, (qrtz_Object *)((qrtz_ExternString *)s)->cstr);
+		}
+		if(s->flags & QRTZ_SSLICE) {
+			qrtz_SliceString *slice = (qrtz_SliceString *)s;
+			qrtz_markObject(m, (qrtz_Object *)slice->cstr);
+			qrtz_pushSlice(m, slice);
+		}
+		return;
+	}
+	case QRTZ_OARRAY: {
+		qrtz_Array *arr = (qrtz_Array *)obj;
+		qrtz_markValues(m, arr->values, arr->len);
+		return;
+	}
+	case QRTZ_OMAP: {
+		qrtz_Map *map = (qrtz_Map *)obj;
+		// if it can't be kept track of, it can't be cleared, so it is marked as a strong map
+		qrtz_markMap(m, map, map->weak != 0 && qrtz_pushWeak(m, map));
+		return;
+	}
+	case QRTZ_OPOINTER:
+		qrtz_markValue(m, ((qrtz_Pointer *)obj)->val);
+		return;
+	case QRTZ_OUSERDATA: {
+		qrtz_Userdata *u = (qrtz_Userdata *)obj;
+		qrtz_markValues(m, u->associated, u->associatedLen);
+		return;
+	}
+	case QRTZ_OTASK: {
+		qrtz_Task *task = (qrtz_Task *)obj;
+		qrtz_markValues(m, task->stack, task->stacklen);
+		qrtz_markValue(m, task->error);
+		qrtz_markObject(m, (qrtz_Object *)task->waitingFor);
+		qrtz_markObject(m, (qrtz_Object *)task->waitedBy);
+		qrtz_markAgain(m, obj);
+		return;
+	}
+	case QRTZ_OPROGRAM: {
+		qrtz_Program *prog = (qrtz_Program *)obj;
+		qrtz_markObject(m, (qrtz_Object *)prog->globals);
+		qrtz_markObject(m, (qrtz_Object *)prog->name);
+		for(size_t i = 0; i < prog->entryCount; i++) qrtz_markValue(m, prog->entries[i].val);
+		qrtz_markValues(m, prog->locals, prog->localCount);
+		qrtz_markAgain(m, obj);
+		return;
+	}
+	case QRTZ_ORECTYPE: {
+		qrtz_RecordType *ty = (qrtz_RecordType *)obj;
+		qrtz_markObject(m, (qrtz_Object *)ty->name);
+		qrtz_markValues(m, ty->fields, ty->fieldCount);
+		qrtz_markObject(m, (qrtz_Object *)ty->fieldIndex);
+		return;
+	}
+	case QRTZ_ORECORD: {
+		qrtz_Record *rec = (qrtz_Record *)obj;
+		qrtz_markObject(m, (qrtz_Object *)rec->type);
+		qrtz_markValues(m, rec->values, rec->type->fieldCount);
+		return;
+	}
+	case QRTZ_OFUNCTION:
+		qrtz_markObject(m, (qrtz_Object *)((qrtz_Function *)obj)->program);
+		return;
+	case QRTZ_OCLOSURE: {
+		qrtz_Closure *c = (qrtz_Closure *)obj;
+		qrtz_markValue(m, c->func);
+		for(size_t i = 0; i < c->upvalCount; i++) qrtz_markObject(m, (qrtz_Object *)c->upvals[i]);
+		return;
+	}
+	case QRTZ_ORECOPT:
+		return;
+	}
+}
+
+static void qrtz_markRoots(qrtz_VM *vm) {
+	qrtz_Marker *m = &vm->marker;
+	qrtz_markObject(m, (qrtz_Object *)vm->globals);
+	qrtz_markObject(m, (qrtz_Object *)vm->registry);
+	qrtz_markObject(m, (qrtz_Object *)vm->loaded);
+	qrtz_markObject(m, (qrtz_Object *)vm->resetGlobals);
+	qrtz_markObject(m, (qrtz_Object *)vm->resetRegistry);
+	qrtz_markObject(m, (qrtz_Object *)vm->resetLoaded);
+	qrtz_markObject(m, (qrtz_Object *)vm->mainTask);
+	qrtz_markObject(m, (qrtz_Object *)vm->curTask);
+	qrtz_markObject(m, (qrtz_Object *)vm->oomStr);
+	for(size_t i = 0; i < vm->pinnedLen; i++) qrtz_markObject(m, vm->pinned[i].obj);
+}
+
+static void qrtz_rescanMarked(qrtz_Object *obj, void *userdata) {
+	if(qrtz_isMarked(obj)) qrtz_blackenObject(userdata, obj);
+}
+
+// young objects are not in the heap, so they are found through their mark bits
+static void qrtz_rescanYoung(qrtz_VM *vm) {
+	if(!vm->youngLeft) return;
+	for(size_t w = 0; w < QRTZ_YOUNGMARKWORDS(vm->nurserySize); w++) {
+		uint64_t bits = vm->youngMarks[w];
+		for(size_t b = 0; bits != 0; b++, bits >>= 1) {
+			if((bits & 1) == 0) continue;
+			qrtz_blackenObject(&vm->marker, (qrtz_Object *)(vm->nursery + (w * 64 + b) * QRTZ_NURSERYALIGN));
+		}
+	}
+}
+
+static void qrtz_propagateMarks(qrtz_VM *vm) {
+	qrtz_Marker *m = &vm->marker;
+	while(true) {
+		while(m->grayLen > 0) qrtz_blackenObject(m, m->gray[--m->grayLen]);
+		if(!m->overflow) return;
+		// Some marked objects did not fit in the gray stack, and were never scanned.
+		// Scanning every marked object again finds them, and scanning twice is harmless.
+		m->overflow = false;
+		qrtz_heapEach(vm, qrtz_rescanMarked, m);
+		qrtz_rescanYoung(vm);
+	}
+}
+
+// Blackens gray objects until about budget bytes worth of them are done.
+// If the gray stack overflowed, the rest is found once marking finishes.
+static void qrtz_markStep(qrtz_VM *vm, size_t budget) {
+	qrtz_Marker *m = &vm->marker;
+	size_t start = m->work;
+	while(m->grayLen > 0 && m->work - start < budget) qrtz_blackenObject(m, m->gray[--m->grayLen]);
+}
+
+#ifdef QRTZ_THREADS
+
+// how many gray objects a thread lets others steal at once
+#define QRTZ_STEALMAX 256
+
+typedef struct qrtz_MarkThread {
+	qrtz_Marker marker;
+	struct qrtz_ParallelMark *mark;
+	// gray objects other threads can take, guarded by lock
+	qrtz_Object *shared[QRTZ_STEALMAX];
+	size_t sharedLen;
+	bool lock;
+	// NULL if the thread could not start, or is the calling thread
+	void *handle;
+} qrtz_MarkThread;
+
+typedef struct qrtz_ParallelMark {
+	qrtz_MarkThread *threads;
+	size_t count;
+	// threads which did start, and those out of work. Once all of them are, marking is over.
+	size_t running;
+	size_t idle;
+} qrtz_ParallelMark;
+
+// Moves up to half of a thread's gray objects where others can steal them.
+// Only the owner adds to its shared objects, and only once they were all taken.
+static void qrtz_shareGray(qrtz_MarkThread *t) {
+	qrtz_Marker *m = &t->marker;
+	if(m->grayLen < 2 || __atomic_load_n(&t->sharedLen, __ATOMIC_RELAXED) != 0) return;
+	size_t n = m->grayLen / 2;
+	if(n > QRTZ_STEALMAX) n = QRTZ_STEALMAX;
+	qrtz_spinLock(&t->lock);
+	m->grayLen -= n;
+	qrtz_memcpy(t->shared, m->gray + m->grayLen, n * sizeof(qrtz_Object *));
+	__atomic_store_n(&t->sharedLen, n, __ATOMIC_RELAXED);
+	qrtz_spinUnlock(&t->lock);
+}
+
+// Takes half of what another thread shared, or all of what a thread shared itself.
+static bool qrtz_takeGray(qrtz_MarkThread *t, qrtz_MarkThread *from) {
+	if(__atomic_load_n(&from->sharedLen, __ATOMIC_RELAXED) == 0) return false;
+	qrtz_spinLock(&from->lock);
+	size_t len = from->sharedLen;
+	size_t n = from == t ? len : (len + 1) / 2;
+	for(size_t i = len - n; i < len; i++) qrtz_pushGray(&t->marker, from->shared[i]);
+	__atomic_store_n(&from->sharedLen, len - n, __ATOMIC_RELAXED);
+	qrtz_spinUnlock(&from->lock);
+	return n > 0;
+}
+
+static bool qrtz_stealGray(qrtz_MarkThread *t) {
+	qrtz_ParallelMark *mark = t->mark;
+	size_t self = (size_t)(t - mark->threads);
+	for(size_t i = 1; i < mark->count; i++) {
+		if(qrtz_takeGray(t, &mark->threads[(self + i) % mark->count])) return true;
+	}
+	return false;
+}
+
+// Waits for another thread to share something, returning false once every thread is out of work.
+// Only threads with work share it, and they only run out once they took back what they shared,
+// so once every thread is waiting, nothing can be shared anymore.
+static bool qrtz_waitForGray(qrtz_ParallelMark *mark) {
+	__atomic_fetch_add(&mark->idle, 1, __ATOMIC_ACQ_REL);
+	while(__atomic_load_n(&mark->idle, __ATOMIC_ACQUIRE) < __atomic_load_n(&mark->running, __ATOMIC_ACQUIRE)) {
+		for(size_t i = 0; i < mark->count; i++) {
+			if(__atomic_load_n(&mark->threads[i].sharedLen, __ATOMIC_RELAXED) == 0) continue;
+			__atomic_fetch_sub(&mark->idle, 1, __ATOMIC_ACQ_REL);
+			return true;
+		}
+		qrtz_spinPause();
+	}
+	return false;
+}
+
+static void qrtz_markThread(void *arg) {
+	qrtz_MarkThread *t = arg;
+	qrtz_Marker *m = &t->marker;
+	while(true) {
+		while(m->grayLen > 0) {
+			qrtz_blackenObject(m, m->gray[--m->grayLen]);
+			qrtz_shareGray(t);
+		}
+		if(qrtz_takeGray(t, t) || qrtz_stealGray(t)) continue;
+		if(!qrtz_waitForGray(t->mark)) return;
+	}
+}
+
+// Blackens every gray object, and everything they reach, using the context's threads.
+// This only runs while no other marking happens, as barriers and qrtz_markAgain are not thread safe.
+// Anything which did not fit in the threads' stacks is left for qrtz_propagateMarks.
+static void qrtz_parallelMark(qrtz_VM *vm) {
+	qrtz_Context *ctx = &vm->ctx;
+	size_t count = vm->gcThreads;
+	qrtz_MarkThread *threads = qrtz_callocArray(ctx, sizeof(qrtz_MarkThread), count);
+	if(threads == NULL) return;
+	qrtz_ParallelMark mark;
+	mark.threads = threads;
+	mark.count = count;
+	mark.running = count;
+	mark.idle = 0;
+	for(size_t i = 0; i < count; i++) {
+		qrtz_MarkThread *t = &threads[i];
+		t->marker.vm = vm;
+		t->marker.gray = NULL;
+		t->marker.grayLen = 0;
+		t->marker.grayCap = 0;
+		t->marker.overflow = false;
+		t->marker.slices = NULL;
+		t->marker.slicesLen = 0;
+		t->marker.slicesCap = 0;
+		t->marker.weak = NULL;
+		t->marker.weakLen = 0;
+		t->marker.weakCap = 0;
+		t->marker.work = 0;
+		qrtz_memset(t->marker.liveCount, 0, sizeof(t->marker.liveCount));
+		qrtz_memset(t->marker.liveBytes, 0, sizeof(t->marker.liveBytes));
+		t->marker.parallel = true;
+		t->mark = &mark;
+		t->sharedLen = 0;
+		t->lock = false;
+		t->handle = NULL;
+	}
+	// the calling thread is the first one, and starts out with all the work, which the others steal
+	size_t grayCap = vm->marker.grayCap;
+	threads[0].marker.gray = vm->marker.gray;
+	threads[0].marker.grayLen = vm->marker.grayLen;
+	threads[0].marker.grayCap = grayCap;
+	for(size_t i = 1; i < count; i++) {
+		threads[i].handle = ctx->threadStart(ctx->data, qrtz_markThread, &threads[i]);
+		// the calling thread has not started marking, so the others can't be done yet
+		if(threads[i].handle == NULL) __atomic_fetch_sub(&mark.running, 1, __ATOMIC_ACQ_REL);
+	}
+	qrtz_markThread(&threads[0]);
+	for(size_t i = 1; i < count; i++) {
+		if(threads[i].handle != NULL) ctx->threadJoin(ctx->data, threads[i].handle);
+	}
+
+	vm->marker.gray = threads[0].marker.gray;
+	vm->marker.grayLen = threads[0].marker.grayLen;
+	vm->marker.grayCap = threads[0].marker.grayCap;
+	vm->memUsage += (vm->marker.grayCap - grayCap) * sizeof(qrtz_Object *);
+	for(size_t i = 0; i < count; i++) {
+		qrtz_Marker *m = &threads[i].marker;
+		vm->marker.work += m->work;
+		for(size_t k = 0; k < QRTZ_GCKINDS; k++) {
+			vm->marker.liveCount[k] += m->liveCount[k];
+			vm->marker.liveBytes[k] += m->liveBytes[k];
+		}
+		if(m->overflow) vm->marker.overflow = true;
+		for(size_t j = 0; j < m->slicesLen; j++) qrtz_pushSlice(&vm->marker, (qrtz_SliceString *)m->slices[j]);
+		for(size_t j = 0; j < m->weakLen; j++) {
+			qrtz_Map *map = (qrtz_Map *)m->weak[j];
+			if(!qrtz_pushWeak(&vm->marker, map)) qrtz_markMap(&vm->marker, map, false);
+		}
+		qrtz_cfreeArray(ctx, m->slices, sizeof(qrtz_Object *), m->slicesCap);
+		qrtz_cfreeArray(ctx, m->weak, sizeof(qrtz_Object *), m->weakCap);
+		if(i > 0) qrtz_cfreeArray(ctx, m->gray, sizeof(qrtz_Object *), m->grayCap);
+	}
+	qrtz_cfreeArray(ctx, threads, sizeof(qrtz_MarkThread), count);
+}
+
+#endif
+
+// Marks everything left to mark. Marking big heaps is split across threads, if the context can start them.
+static void qrtz_markAll(qrtz_VM *vm) {
+#ifdef QRTZ_THREADS
+	qrtz_Context *ctx = &vm->ctx;
+	bool canStart = ctx->threadStart != NULL && ctx->threadJoin != NULL;
+	// starting threads costs more than marking small heaps
+	if(vm->gcThreads > 1 && canStart && vm->memUsage >= QRTZ_PARALLELMARKMIN && vm->marker.grayLen > 0) {
+		qrtz_parallelMark(vm);
+	}
+#endif
+	qrtz_propagateMarks(vm);
+}
+
+// Values of weak keys are only marked once their key is. Marking them can mark more keys,
+// so this goes on until nothing new is marked.
+static void qrtz_markEphemerons(qrtz_VM *vm) {
+	qrtz_Marker *m = &vm->marker;
+	bool marked = true;
+	while(marked) {
+		marked = false;
+		// maps found by propagating marks are added to the list, and gone through as well
+		for(size_t i = 0; i < m->weakLen; i++) {
+			qrtz_Map *map = (qrtz_Map *)m->weak[i];
+			if(!(map->weak & QRTZ_WEAK_KEYS)) continue;
+			bool weakValues = map->weak & QRTZ_WEAK_VALUES;
+			for(size_t j = 0; j < map->cap; j++) {
+				if(!QRTZ_MAPFULL(map, j)) continue;
+				qrtz_Value key = map->data[j];
+				qrtz_Value val = map->data[j + map->cap];
+				if(!QRTZ_ISOBJ(val) || (weakValues && qrtz_isWeakRef(val))) continue;
+				if(!qrtz_isWeakRef(key) || !qrtz_isLive(vm, QRTZ_ASOBJ(key))) continue;
+				if(qrtz_isLive(vm, QRTZ_ASOBJ(val))) continue;
+				qrtz_markObject(m, QRTZ_ASOBJ(val));
+				marked = true;
+			}
+		}
+		qrtz_propagateMarks(vm);
+	}
+}
+
+// whether a map holds a value weakly, which is about to be freed
+static bool qrtz_weakDead(qrtz_VM *vm, qrtz_Map *map, qrtz_WeakFlags flag, qrtz_Value val) {
+	return (map->weak & flag) && qrtz_isWeakRef(val) && !qrtz_isLive(vm, QRTZ_ASOBJ(val));
+}
+
+// Removes the entries of weak maps which hold something that is about to be freed.
+static void qrtz_clearWeakMaps(qrtz_VM *vm) {
+	qrtz_Marker *m = &vm->marker;
+	// a map may be in the list more than once, but clearing it again does nothing
+	for(size_t i = 0; i < m->weakLen; i++) {
+		qrtz_Map *map = (qrtz_Map *)m->weak[i];
+		for(size_t j = 0; j < map->cap; j++) {
+			if(!QRTZ_MAPFULL(map, j)) continue;
+			bool dead = qrtz_weakDead(vm, map, QRTZ_WEAK_KEYS, map->data[j]);
+			dead = dead || qrtz_weakDead(vm, map, QRTZ_WEAK_VALUES, map->data[j + map->cap]);
+			if(dead) qrtz_mapremoveslot(map, j);
+		}
+	}
+	m->weakLen = 0;
+}
+
+// Userdata with finalizers which were not marked are moved past the live ones,
+// and their pointer is saved, as they are freed before their finalizer runs.
+static void qrtz_findFinalizable(qrtz_VM *vm) {
+	size_t i = 0;
+	while(i < vm->finalizableLen) {
+		qrtz_Finalizable *f = &vm->finalizable[i];
+		if(qrtz_isMarked(&f->obj->obj)) {
+			i++;
+			continue;
+		}
+		qrtz_Finalizable dead = *f;
+		dead.pointer = dead.obj->pointer;
+		dead.obj = NULL;
+		vm->finalizableLen--;
+		*f = vm->finalizable[vm->finalizableLen];
+		vm->finalizable[vm->finalizableLen] = dead;
+		vm->finalizePending++;
+	}
+}
+
+// Slices do not mark their parent right away. Once everything else is marked, we know which
+// parents are only kept alive by slices, and copy out the slices which only use a small part
+// of them, so the parent can be freed.
+static void qrtz_markSliceParents(qrtz_VM *vm) {
+	qrtz_Marker *m = &vm->marker;
+	// a slice may be in the list twice, in which case the second time, its parent is marked
+	for(size_t i = 0; i < m->slicesLen; i++) {
+		qrtz_SliceString *slice = (qrtz_SliceString *)m->slices[i];
+		// the host may have a pointer into the parent's bytes
+		bool shared = slice->flags & QRTZ_SSHARED;
+		if(shared || slice->parent->len / QRTZ_SLICECOMPACT < slice->len) {
+			qrtz_markObject(m, (qrtz_Object *)slice->parent);
+		}
+	}
+	for(size_t i = 0; i < m->slicesLen; i++) {
+		qrtz_SliceString *slice = (qrtz_SliceString *)m->slices[i];
+		qrtz_String *parent = slice->parent;
+		if(qrtz_isLive(vm, &parent->obj)) continue;
+		// parents are never ropes, so this never allocates
+		const char *data = qrtz_strdata(vm, parent) + slice->offset;
+		qrtz_String *copy = qrtz_allocStringObject(vm, data, slice->len);
+		if(copy == NULL) {
+			// no memory to compact it, so keep the parent
+			qrtz_markObject(m, (qrtz_Object *)parent);
+			continue;
+		}
+		qrtz_markObject(m, (qrtz_Object *)copy);
+		slice->parent = copy;
+		slice->offset = 0;
+	}
+	m->slicesLen = 0;
+	// parents can have children of their own
+	qrtz_propagateMarks(vm);
+}
+
+static bool qrtz_pacing(qrtz_VM *vm) {
+	return vm->ctx.clock != NULL && (vm->gcPauseTarget > 0 || vm->memLimit != 0);
+}
+
+static double qrtz_now(qrtz_VM *vm) {
+	return vm->ctx.clock(vm->ctx.data);
+}
+
+// Pauses are timed from the outermost call into the collector, so the ones it makes itself count once.
+static void qrtz_beginPause(qrtz_VM *vm) {
+	if(vm->gcPauseDepth++ == 0 && vm->ctx.clock != NULL) vm->gcPauseStart = qrtz_now(vm);
+}
+
+static void qrtz_endPause(qrtz_VM *vm) {
+	if(--vm->gcPauseDepth != 0 || vm->ctx.clock == NULL) return;
+	qrtz_GCStats *stats = &vm->gcStats;
+	double pause = qrtz_now(vm) - vm->gcPauseStart;
+	stats->totalPause += pause;
+	if(pause > stats->maxPause) stats->maxPause = pause;
+	size_t bucket = 0;
+	for(double limit = 1e-6; pause >= limit && bucket < QRTZ_GCPAUSEBUCKETS - 1; limit *= 2) bucket++;
+	stats->pauses[bucket]++;
+}
+
+// averages a rate over about the last 4 measurements
+static void qrtz_measureRate(qrtz_Rate *rate, double amount, double elapsed) {
+	if(elapsed <= 0) return;
+	rate->amount = rate->amount * 3 / 4 + amount;
+	rate->time = rate->time * 3 / 4 + elapsed;
+}
+
+static double qrtz_rate(qrtz_Rate *rate) {
+	return rate->time > 0 ? rate->amount / rate->time : 0;
+}
+
+// The least a soft limit leaves between the live heap and the goal. Cycles come every time allocating
+// fills it, and each one takes live / gcCollectRate seconds, so this keeps collecting under QRTZ_GCMAXCPU
+// percent of the time.
+static double qrtz_minHeadroom(qrtz_VM *vm, double live) {
+	// until the rates are measured, there is no telling, so a bit of headroom is kept
+	double collectRate = qrtz_rate(&vm->gcCollectRate), allocRate = qrtz_rate(&vm->gcAllocRate);
+	if(collectRate <= 0 || allocRate <= 0) return live / 16;
+	return live / collectRate * (100 - QRTZ_GCMAXCPU) / QRTZ_GCMAXCPU * allocRate;
+}
+
+// Sets the memory usage at which the next cycle starts, from what the last cycle found alive.
+// The pacer also picks how the next cycle steps.
+static void qrtz_setTarget(qrtz_VM *vm) {
+	// Memory in use also counts whatever was allocated since marking finished, what died until it
+	// is swept, and pages kept around to reuse, so going by it would have the goal creep up.
+	double live = (double)(vm->gcLive + sizeof(qrtz_VM) + vm->nurserySize);
+	if(live > (double)vm->memUsage) live = (double)vm->memUsage;
+	double goal = live * (1 + vm->gcPause / 100);
+	if(vm->memLimit != 0 && goal > (double)vm->memLimit) {
+		double least = live + qrtz_minHeadroom(vm, live);
+		goal = least > (double)vm->memLimit ? least : (double)vm->memLimit;
+	}
+	vm->gcPaceMul = vm->gcStepMul;
+	vm->gcPaceStep = vm->gcStepSize;
+	vm->memTarget = (size_t)goal;
+	if(!qrtz_pacing(vm)) return;
+	// a cycle which fits in a single pause is cheapest done all at once
+	double budget = vm->gcPauseTarget * qrtz_rate(&vm->gcCollectRate);
+	bool paused = budget > 0;
+	if(paused && budget >= live) {
+		vm->gcPaceStep = 0;
+		return;
+	}
+	if(!paused && vm->gcStepSize == 0) return;
+	// Marking takes live * 100 / gcPaceMul bytes of allocation, which have to fit between the start
+	// of the cycle and the goal, so cycles start that early. If they can't, steps do more work.
+	double headroom = goal - live;
+	if(headroom < 1) headroom = 1;
+	double runway = live * 100 / vm->gcPaceMul;
+	if(runway > headroom) {
+		vm->gcPaceMul = live * 100 / headroom;
+		runway = headroom;
+	}
+	vm->memTarget = (size_t)(goal - runway);
+	if(!paused) return;
+	// steps are as big as the pause target allows
+	double stepSize = budget * 100 / vm->gcPaceMul;
+	vm->gcPaceStep = stepSize < 1 ? 1 : (size_t)stepSize;
+}
+
+static void qrtz_startCycle(qrtz_VM *vm) {
+	// Major cycles mostly deal with the old generation, so the nursery is emptied,
+	// and stays unused until the cycle is over. If there is no memory to promote everything,
+	// the cycle marks through what is left, as it is most needed then.
+	bool pacing = qrtz_pacing(vm);
+	double start = pacing ? qrtz_now(vm) : 0;
+	vm->youngLeft = !qrtz_minorgc(vm, true);
+	// allocation is measured from the start of one cycle to the next, as cycles may run back to back
+	if(pacing) {
+		qrtz_measureRate(&vm->gcAllocRate, (double)(vm->gcAllocated - vm->gcCycleAllocated), start - vm->gcCycleStart);
+		vm->gcCycleStart = start;
+	}
+	vm->gcCycleAllocated = vm->gcAllocated;
+	vm->gcState = QRTZ_GCMARK;
+	vm->gcCycleTime = 0;
+	qrtz_memset(vm->marker.liveCount, 0, sizeof(vm->marker.liveCount));
+	qrtz_memset(vm->marker.liveBytes, 0, sizeof(vm->marker.liveBytes));
+	qrtz_markRoots(vm);
+	if(pacing) vm->gcCycleTime += qrtz_now(vm) - start;
+}
+
+// remembered objects can only be left after running out of memory in a minor collection
+static void qrtz_sweepRemembered(qrtz_VM *vm) {
+	size_t kept = 0;
+	for(size_t i = 0; i < vm->rememberedLen; i++) {
+		qrtz_Object *obj = vm->remembered[i];
+		if(qrtz_isMarked(obj)) vm->remembered[kept++] = obj;
+		else obj->gcflags &= ~QRTZ_GCREMEMBERED;
+	}
+	vm->rememberedLen = kept;
+}
+
+// Finishes marking. This must run at a safe point, as afterwards, anything unmarked is freed.
+static void qrtz_finishMark(qrtz_VM *vm) {
+	vm->gcState = QRTZ_GCATOMIC;
+	bool pacing = qrtz_pacing(vm);
+	double start = pacing ? qrtz_now(vm) : 0;
+	// roots and stacks are written to without barriers
+	qrtz_markRoots(vm);
+	for(size_t i = 0; i < vm->grayAgainLen; i++) qrtz_blackenObject(&vm->marker, vm->grayAgain[i]);
+	vm->grayAgainLen = 0;
+	qrtz_markAll(vm);
+	qrtz_markEphemerons(vm);
+	qrtz_markSliceParents(vm);
+	// everything which survives is marked, so what weak maps hold and is not, is dead
+	qrtz_clearWeakMaps(vm);
+	qrtz_findFinalizable(vm);
+	// interned strings are weak, and must not be found again between now and being swept
+	qrtz_sweepInterned(vm);
+	qrtz_sweepRemembered(vm);
+	qrtz_trimGray(vm);
+	if(vm->youngLeft) {
+		// what is left of the nursery is only reclaimed by minor collections
+		qrtz_memset(vm->youngMarks, 0, sizeof(uint64_t) * QRTZ_YOUNGMARKWORDS(vm->nurserySize));
+		vm->youngLeft = false;
+	}
+	qrtz_GCStats *stats = &vm->gcStats;
+	stats->cycles++;
+	vm->gcLive = 0;
+	for(size_t k = 0; k < QRTZ_GCKINDS; k++) {
+		stats->liveCount[k] = vm->marker.liveCount[k];
+		stats->liveBytes[k] = vm->marker.liveBytes[k];
+		vm->gcLive += vm->marker.liveBytes[k];
+	}
+	if(pacing) vm->gcCycleTime += qrtz_now(vm) - start;
+
+	vm->gcState = QRTZ_GCSWEEP;
+	qrtz_heapStartSweep(vm);
+	qrtz_setTarget(vm);
+}
+
+// Sweeps until about budget bytes worth of objects are done.
+// Once the whole heap is swept, the cycle is over.
+static void qrtz_sweepStep(qrtz_VM *vm, size_t budget) {
+	bool pacing = qrtz_pacing(vm);
+	double start = pacing ? qrtz_now(vm) : 0;
+	bool done = qrtz_heapSweep(vm, budget);
+	if(pacing) vm->gcCycleTime += qrtz_now(vm) - start;
+	if(!done) return;
+	vm->gcState = QRTZ_GCIDLE;
+	// The rate is over the whole cycle rather than each step, as steps only count the objects they
+	// scan, and not the roots, the nursery, the pause which ends marking, or sweeping.
+	if(pacing) qrtz_measureRate(&vm->gcCollectRate, (double)vm->gcLive, vm->gcCycleTime);
+	qrtz_setTarget(vm);
+}
+
+void qrtz_gc(qrtz_VM *vm) {
+	if(vm->gcRunning) return;
+	qrtz_beginPause(vm);
+	vm->gcRunning = true;
+	// An unfinished cycle may have marked objects which died since, so it is finished first.
+	// Marking is all left to qrtz_finishMark, which can split it across threads.
+	if(vm->gcState == QRTZ_GCMARK) qrtz_finishMark(vm);
+	if(vm->gcState == QRTZ_GCSWEEP) qrtz_sweepStep(vm, SIZE_MAX);
+	qrtz_startCycle(vm);
+	qrtz_finishMark(vm);
+	qrtz_sweepStep(vm, SIZE_MAX);
+	vm->gcRunning = false;
+	qrtz_endPause(vm);
+	qrtz_runFinalizers(vm);
+}
+
+// A stop-the-world cycle. Only marking happens in the pause, sweeping is left to allocation,
+// the background thread, and qrtz_checkGC once memory runs out again.
+static void qrtz_collect(qrtz_VM *vm) {
+	qrtz_beginPause(vm);
+	vm->gcRunning = true;
+	qrtz_startCycle(vm);
+	qrtz_finishMark(vm);
+	qrtz_heapSweepInBackground(vm);
+	vm->gcRunning = false;
+	qrtz_endPause(vm);
+}
+
+static size_t qrtz_stepBudget(qrtz_VM *vm) {
+	double budget = (double)vm->gcPaceStep * vm->gcPaceMul / 100;
+	return budget >= (double)SIZE_MAX ? SIZE_MAX : (size_t)budget;
+}
+
+void qrtz_gcstep(qrtz_VM *vm) {
+	if(vm->gcRunning) return;
+	qrtz_beginPause(vm);
+	vm->gcRunning = true;
+	if(vm->gcState == QRTZ_GCMARK) {
+		bool pacing = qrtz_pacing(vm);
+		double start = pacing ? qrtz_now(vm) : 0;
+		qrtz_markStep(vm, qrtz_stepBudget(vm));
+		if(pacing) vm->gcCycleTime += qrtz_now(vm) - start;
+	}
+	else if(vm->gcState == QRTZ_GCSWEEP) qrtz_sweepStep(vm, qrtz_stepBudget(vm));
+	vm->gcStepAt = vm->gcAllocated + vm->gcPaceStep;
+	vm->gcRunning = false;
+	qrtz_endPause(vm);
+}
+
+// qrtz_checkGC, without running finalizers
+static void qrtz_safePoint(qrtz_VM *vm) {
+	if(vm->minorPending && vm->gcState == QRTZ_GCIDLE) qrtz_minorgc(vm, false);
+	if(vm->gcState == QRTZ_GCSWEEP && vm->gcPaceStep == 0) {
+		if(vm->memUsage <= vm->memTarget && !qrtz_heapSweepDone(vm)) return;
+		qrtz_beginPause(vm);
+		vm->gcRunning = true;
+		qrtz_sweepStep(vm, SIZE_MAX);
+		vm->gcRunning = false;
+		qrtz_endPause(vm);
+	}
+	if(vm->gcState == QRTZ_GCIDLE) {
+		if(vm->memUsage <= vm->memTarget) return;
+		if(vm->gcPaceStep == 0) {
+			qrtz_collect(vm);
+			return;
+		}
+		qrtz_beginPause(vm);
+		qrtz_startCycle(vm);
+		qrtz_endPause(vm);
+		vm->gcStepAt = vm->gcAllocated;
+	}
+	if(vm->gcAllocated >= vm->gcStepAt) qrtz_gcstep(vm);
+	// marking can only finish at a safe point
+	if(vm->gcState == QRTZ_GCMARK && vm->marker.grayLen == 0) {
+		qrtz_beginPause(vm);
+		vm->gcRunning = true;
+		qrtz_finishMark(vm);
+		qrtz_heapSweepInBackground(vm);
+		vm->gcRunning = false;
+		qrtz_endPause(vm);
+	}
+}
+
+void qrtz_checkGC(qrtz_VM *vm) {
+	if(vm->gcRunning) return;
+	qrtz_safePoint(vm);
+	// finalizers run once the collector is done, so they never see it halfway through
+	qrtz_runFinalizers(vm);
+}
+
+void qrtz_safepoint(qrtz_VM *vm) {
+	qrtz_checkGC(vm);
+}
+
+void qrtz_barrier(qrtz_VM *vm, qrtz_Object *obj, qrtz_Value val) {
+	if(!QRTZ_ISOBJ(val)) return;
+	qrtz_barrierobj(vm, obj, QRTZ_ASOBJ(val));
+}
+
+void qrtz_barrierobj(qrtz_VM *vm, qrtz_Object *obj, qrtz_Object *child) {
+	if(child == NULL) return;
+	if(vm->gcState == QRTZ_GCMARK && qrtz_isLive(vm, obj)) qrtz_markObject(&vm->marker, child);
+	// minor collections only scan old objects in the remembered set
+	if(QRTZ_ISYOUNG(vm, child) && !QRTZ_ISYOUNG(vm, obj)) qrtz_remember(vm, obj);
+}
+
+void qrtz_remember(qrtz_VM *vm, qrtz_Object *obj) {
+	if(obj->gcflags & QRTZ_GCREMEMBERED) return;
+	if(!qrtz_pushObject(vm, &vm->remembered, &vm->rememberedLen, &vm->rememberedCap, obj)) {
+		vm->rememberedOverflow = true;
+		return;
+	}
+	obj->gcflags |= QRTZ_GCREMEMBERED;
+}
+
+bool qrtz_trackYoungString(qrtz_VM *vm, qrtz_String *s) {
+	if(vm->youngStringsLen == vm->youngStringsCap) {
+		size_t newCap = vm->youngStringsCap == 0 ? 64 : vm->youngStringsCap * 2;
+		qrtz_String **newList = qrtz_realloc(vm, vm->youngStrings, sizeof(qrtz_String *), vm->youngStringsCap, newCap);
+		if(newList == NULL) return false;
+		vm->youngStrings = newList;
+		vm->youngStringsCap = newCap;
+	}
+	vm->youngStrings[vm->youngStringsLen++] = s;
+	return true;
+}
+
+static void qrtz_visitValues(qrtz_RefVisitor *visitor, qrtz_Value *vals, size_t len) {
+	for(size_t i = 0; i < len; i++) visitor->value(visitor, &vals[i]);
+}
+
+#define QRTZ_VISITOBJ(visitor, ref) (visitor)->object((visitor), (qrtz_Object **)(ref))
+
+void qrtz_visitRefs(qrtz_RefVisitor *visitor, qrtz_Object *obj) {
+	switch(obj->tag) {
+	case QRTZ_OSTR: {
+		qrtz_String *s = (qrtz_String *)obj;
+		if(s->flags & QRTZ_SROPE) {
+			qrtz_Rope *r = (qrtz_Rope *)s;
+			QRTZ_VISITOBJ(visitor, &r->left);
+			QRTZ_VISITOBJ(visitor, &r->right);
+			QRTZ_VISITOBJ(visitor, &r->flat);
+		}
+		if(s->flags & QRTZ_SEXTERN) QRTZ_VISITOBJ(visitor, &((qrtz_ExternString *)s)->cstr);
+		if(s->flags & QRTZ_SSLICE) {
+			qrtz_SliceString *slice = (qrtz_SliceString *)s;
+			QRTZ_VISITOBJ(visitor, &slice->parent);
+			QRTZ_VISITOBJ(visitor, &slice->cstr);
+		}
+		return;
+	}
+	case QRTZ_OARRAY: {
+		qrtz_Array *arr = (qrtz_Array *)obj;
+		qrtz_visitValues(visitor, arr->values, arr->len);
+		return;
+	}
+	case QRTZ_OMAP: {
+		// keys are hashed by content or identity hash, never by address, so they can change in place
+		qrtz_Map *map = (qrtz_Map *)obj;
+		for(size_t i = 0; i < map->cap; i++) {
+			if(!QRTZ_MAPFULL(map, i)) continue;
+			visitor->value(visitor, &map->data[i]);
+			visitor->value(visitor, &map->data[i + map->cap]);
+		}
+		return;
+	}
+	case QRTZ_OPOINTER:
+		visitor->value(visitor, &((qrtz_Pointer *)obj)->val);
+		return;
+	case QRTZ_OUSERDATA: {
+		qrtz_Userdata *u = (qrtz_Userdata *)obj;
+		qrtz_visitValues(visitor, u->associated, u->associatedLen);
+		return;
+	}
+	case QRTZ_OTASK: {
+		qrtz_Task *task = (qrtz_Task *)obj;
+		qrtz_visitValues(visitor, task->stack, task->stacklen);
+		visitor->value(visitor, &task->error);
+		QRTZ_VISITOBJ(visitor, &task->waitingFor);
+		QRTZ_VISITOBJ(visitor, &task->waitedBy);
+		return;
+	}
+	case QRTZ_OPROGRAM: {
+		qrtz_Program *prog = (qrtz_Program *)obj;
+		QRTZ_VISITOBJ(visitor, &prog->globals);
+		QRTZ_VISITOBJ(visitor, &prog->name);
+		for(size_t i = 0; i < prog->entryCount; i++) visitor->value(visitor, &prog->entries[i].val);
+		qrtz_visitValues(visitor, prog->locals, prog->localCount);
+		return;
+	}
+	case QRTZ_ORECTYPE: {
+		qrtz_RecordType *ty = (qrtz_RecordType *)obj;
+		QRTZ_VISITOBJ(visitor, &ty->name);
+		qrtz_visitValues(visitor, ty->fields, ty->fieldCount);
+		QRTZ_VISITOBJ(visitor, &ty->fieldIndex);
+		return;
+	}
+	case QRTZ_ORECORD: {
+		qrtz_Record *rec = (qrtz_Record *)obj;
+		QRTZ_VISITOBJ(visitor, &rec->type);
+		qrtz_visitValues(visitor, rec->values, rec->type->fieldCount);
+		return;
+	}
+	case QRTZ_OFUNCTION:
+		QRTZ_VISITOBJ(visitor, &((qrtz_Function *)obj)->program);
+		return;
+	case QRTZ_OCLOSURE: {
+		qrtz_Closure *c = (qrtz_Closure *)obj;
+		visitor->value(visitor, &c->func);
+		for(size_t i = 0; i < c->upvalCount; i++) QRTZ_VISITOBJ(visitor, &c->upvals[i]);
+		return;
+	}
+	case QRTZ_ORECOPT:
+		return;
+	}
+}
+
+// copies an object into the old generation
+static qrtz_Object *qrtz_moveToOld(qrtz_VM *vm, qrtz_Object *obj, size_t size) {
+	qrtz_Object *copy = qrtz_heapalloc(vm, size);
+	if(copy == NULL) return NULL;
+	// the rest of the header belongs to the heap
+	copy->tag = obj->tag;
+	copy->idhash = obj->idhash;
+	qrtz_memcpy(copy + 1, obj + 1, size - sizeof(qrtz_Object));
+	return copy;
+}
+
+typedef struct qrtz_MinorGC {
+	qrtz_RefVisitor visitor;
+	bool promoteAll;
+	// an object could not be moved anywhere, so it stays where it is, as does the whole nursery
+	bool stuck;
+	// an object stayed in the nursery
+	bool keptYoung;
+	char *toTop;
+	char *toEnd;
+	// bytes copied into the survivor space
+	size_t copied;
+	// whether the last scanned object still references young objects
+	bool sawYoung;
+} qrtz_MinorGC;
+
+static size_t qrtz_nurseryAlign(size_t size) {
+	return (size + QRTZ_NURSERYALIGN - 1) / QRTZ_NURSERYALIGN * QRTZ_NURSERYALIGN;
+}
+
+// Copies a young object out of the nursery, and forwards it.
+// Promoted objects go on the gray stack, as their references still need fixing.
+// Old objects are left alone.
+static qrtz_Object *qrtz_evacuate(qrtz_MinorGC *gc, qrtz_Object *obj) {
+	qrtz_VM *vm = gc->visitor.vm;
+	if(obj == NULL || !QRTZ_ISYOUNG(vm, obj)) return obj;
+	qrtz_Object *moved = qrtz_forwarded(vm, obj);
+	if(moved != NULL) return moved;
+	size_t size = qrtz_objmemsizeof(obj);
+	size_t aligned = qrtz_nurseryAlign(size);
+	bool fits = (size_t)(gc->toEnd - gc->toTop) >= aligned;
+	if(!gc->promoteAll && fits && obj->age + 1 < QRTZ_NURSERYAGE) {
+		qrtz_Object *copy = (qrtz_Object *)gc->toTop;
+		gc->toTop += aligned;
+		gc->copied += aligned;
+		qrtz_memcpy(copy, obj, size);
+		copy->age++;
+		qrtz_forward(obj, copy);
+		gc->keptYoung = true;
+		return copy;
+	}
+	qrtz_Object *copy = qrtz_moveToOld(vm, obj, size);
+	if(copy != NULL) {
+		qrtz_forward(obj, copy);
+		qrtz_pushGray(&vm->marker, copy);
+		return copy;
+	}
+	// out of memory, so it stays young
+	gc->keptYoung = true;
+	if(fits) {
+		copy = (qrtz_Object *)gc->toTop;
+		gc->toTop += aligned;
+		gc->copied += aligned;
+		qrtz_memcpy(copy, obj, size);
+		qrtz_forward(obj, copy);
+		return copy;
+	}
+	gc->stuck = true;
+	return obj;
+}
+
+static void qrtz_minorValue(qrtz_RefVisitor *visitor, qrtz_Value *val) {
+	if(!QRTZ_ISOBJ(*val)) return;
+	qrtz_MinorGC *gc = (qrtz_MinorGC *)visitor;
+	qrtz_Object *obj = qrtz_evacuate(gc, QRTZ_ASOBJ(*val));
+	*val = QRTZ_MKOBJ(obj);
+	if(QRTZ_ISYOUNG(visitor->vm, obj)) gc->sawYoung = true;
+}
+
+static void qrtz_minorObject(qrtz_RefVisitor *visitor, qrtz_Object **ref) {
+	qrtz_MinorGC *gc = (qrtz_MinorGC *)visitor;
+	*ref = qrtz_evacuate(gc, *ref);
+	if(*ref != NULL && QRTZ_ISYOUNG(visitor->vm, *ref)) gc->sawYoung = true;
+}
+
+// fixes the references of an old object, which is remembered if it still has young ones
+static void qrtz_minorScanOld(qrtz_MinorGC *gc, qrtz_Object *obj) {
+	gc->sawYoung = false;
+	qrtz_visitRefs(&gc->visitor, obj);
+	if(gc->sawYoung) qrtz_remember(gc->visitor.vm, obj);
+}
+
+static void qrtz_minorScanEach(qrtz_Object *obj, void *userdata) {
+	qrtz_minorScanOld(userdata, obj);
+}
+
+// The intern table must not keep dead young strings, and must point to where the others moved.
+static void qrtz_minorStrings(qrtz_VM *vm) {
+	// Moved strings are fixed first, as removing dead ones shifts other entries around,
+	// which needs their hashes, and forwarding pointers overwrite them.
+	for(size_t i = 0; i < vm->youngStringsLen; i++) {
+		qrtz_String *s = vm->youngStrings[i];
+		qrtz_String *moved = (qrtz_String *)qrtz_forwarded(vm, &s->obj);
+		if(moved == NULL) continue;
+		size_t mask = vm->stringsCap - 1;
+		size_t j = moved->hash & mask;
+		while(vm->strings[j] != s) j = (j + 1) & mask;
+		vm->strings[j] = moved;
+	}
+	size_t kept = 0;
+	for(size_t i = 0; i < vm->youngStringsLen; i++) {
+		qrtz_String *s = vm->youngStrings[i];
+		qrtz_String *moved = (qrtz_String *)qrtz_forwarded(vm, &s->obj);
+		if(moved == NULL) {
+			// dead, or stuck in place after running out of memory, where it just stops being interned
+			qrtz_uninternString(vm, s);
+			continue;
+		}
+		if(QRTZ_ISYOUNG(vm, &moved->obj)) vm->youngStrings[kept++] = moved;
+	}
+	vm->youngStringsLen = kept;
+}
+
+bool qrtz_minorgc(qrtz_VM *vm, bool promoteAll) {
+	if(vm->nursery == NULL) return true;
+	qrtz_beginPause(vm);
+	bool wasRunning = vm->gcRunning;
+	vm->gcRunning = true;
+	vm->minorPending = false;
+
+	qrtz_MinorGC gc;
+	gc.visitor.value = qrtz_minorValue;
+	gc.visitor.object = qrtz_minorObject;
+	gc.visitor.vm = vm;
+	gc.promoteAll = promoteAll;
+	gc.stuck = false;
+	gc.keptYoung = vm->toUsed != 0;
+	char *toStart = vm->survivors[vm->toSpace];
+	char *scan = toStart + vm->toUsed;
+	gc.toTop = scan;
+	gc.toEnd = toStart + QRTZ_SURVIVORSIZE;
+	gc.copied = 0;
+
+	// Roots. The current and main tasks are written to without barriers.
+	// Switching tasks must remember the task being switched away from.
+	QRTZ_VISITOBJ(&gc.visitor, &vm->oomStr);
+	if(vm->mainTask != NULL) qrtz_minorScanOld(&gc, (qrtz_Object *)vm->mainTask);
+	if(vm->curTask != NULL && vm->curTask != vm->mainTask) qrtz_minorScanOld(&gc, (qrtz_Object *)vm->curTask);
+
+	// the remembered set is rebuilt as it is scanned, it never grows faster than it is read
+	size_t rememberedLen = vm->rememberedLen;
+	vm->rememberedLen = 0;
+	for(size_t i = 0; i < rememberedLen; i++) {
+		qrtz_Object *obj = vm->remembered[i];
+		obj->gcflags &= ~QRTZ_GCREMEMBERED;
+		qrtz_minorScanOld(&gc, obj);
+	}
+	if(vm->rememberedOverflow) {
+		vm->rememberedOverflow = false;
+		qrtz_heapEach(vm, qrtz_minorScanEach, &gc);
+	}
+
+	// Copied objects are scanned until nothing new is copied
+	while(true) {
+		while(scan < gc.toTop || vm->marker.grayLen > 0) {
+			while(scan < gc.toTop) {
+				qrtz_Object *obj = (qrtz_Object *)scan;
+				scan += qrtz_nurseryAlign(qrtz_objmemsizeof(obj));
+				qrtz_visitRefs(&gc.visitor, obj);
+			}
+			while(vm->marker.grayLen > 0) qrtz_minorScanOld(&gc, vm->marker.gray[--vm->marker.grayLen]);
+		}
+		if(!vm->marker.overflow) break;
+		// promoted objects which did not fit in the gray stack are found by scanning every old object
+		vm->marker.overflow = false;
+		qrtz_heapEach(vm, qrtz_minorScanEach, &gc);
+	}
+
+	qrtz_minorStrings(vm);
+	qrtz_trimGray(vm);
+
+	// copies count as allocated, and everything young which is left behind as freed
+	qrtz_GCStats *stats = &vm->gcStats;
+	stats->minorCycles++;
+	stats->allocated += gc.copied;
+	vm->youngBytes += gc.copied;
+	if(gc.stuck) {
+		// Objects left behind are still referenced, so nothing can be reused yet.
+		// The next collection carries on copying into the same survivor space.
+		vm->toUsed = gc.toTop - toStart;
+	} else {
+		size_t survived = gc.toTop - toStart;
+		stats->freed += vm->youngBytes - survived;
+		vm->youngBytes = survived;
+		vm->toSpace = !vm->toSpace;
+		vm->toUsed = 0;
+		vm->bump = vm->nursery;
+		vm->tenuredLen = 0;
+	}
+	vm->gcRunning = wasRunning;
+	qrtz_endPause(vm);
+	return !gc.keptYoung;
+}
+
+// moves a young object to the old generation, returning NULL if it runs out of memory
+static qrtz_Object *qrtz_tenure(qrtz_VM *vm, qrtz_Object *obj) {
+	if(obj == NULL || !QRTZ_ISYOUNG(vm, obj)) return obj;
+	if(obj->gcflags & QRTZ_GCTENURED) return vm->tenured[obj->idhash];
+	qrtz_Object *copy = qrtz_moveToOld(vm, obj, qrtz_objmemsizeof(obj));
+	if(copy == NULL) return NULL;
+	// Strings never use their identity hash, so it holds the index of the copy.
+	uint32_t index = (uint32_t)vm->tenuredLen;
+	if(!qrtz_pushObject(vm, &vm->tenured, &vm->tenuredLen, &vm->tenuredCap, copy)) return NULL;
+	// References to the young object are fixed by the next minor collection.
+	// Until then, both are valid, which is fine, as strings are immutable.
+	// A cycle marking through young objects left behind only marks the copy from now on.
+	qrtz_barrierobj(vm, obj, copy);
+	obj->gcflags |= QRTZ_GCTENURED;
+	obj->idhash = index;
+	qrtz_remember(vm, copy);
+	return copy;
+}
+
+qrtz_String *qrtz_tenureString(qrtz_VM *vm, qrtz_String *s) {
+	s = (qrtz_String *)qrtz_tenure(vm, &s->obj);
+	if(s == NULL) return NULL;
+	qrtz_String **holders[2] = {NULL, NULL};
+	if(s->flags & QRTZ_SROPE) holders[0] = &((qrtz_Rope *)s)->flat;
+	if(s->flags & QRTZ_SEXTERN) holders[0] = &((qrtz_ExternString *)s)->cstr;
+	if(s->flags & QRTZ_SSLICE) {
+		holders[0] = &((qrtz_SliceString *)s)->parent;
+		holders[1] = &((qrtz_SliceString *)s)->cstr;
+	}
+	for(int i = 0; i < 2; i++) {
+		if(holders[i] == NULL) continue;
+		qrtz_String *held = (qrtz_String *)qrtz_tenure(vm, (qrtz_Object *)*holders[i]);
+		if(held == NULL && *holders[i] != NULL) return NULL;
+		*holders[i] = held;
+	}
+	return s;
+}
+
+void qrtz_fixString(qrtz_String *s, const char *data) {
+	s->obj.gcflags |= QRTZ_GCFIXED;
+	qrtz_String *held[3] = {NULL, NULL, NULL};
+	if(s->flags & QRTZ_SROPE) held[0] = ((qrtz_Rope *)s)->flat;
+	if(s->flags & QRTZ_SEXTERN) held[0] = ((qrtz_ExternString *)s)->cstr;
+	if(s->flags & QRTZ_SSLICE) {
+		held[1] = ((qrtz_SliceString *)s)->parent;
+		held[2] = ((qrtz_SliceString *)s)->cstr;
+	}
+	for(int i = 0; i < 3; i++) {
+		qrtz_String *h = held[i];
+		if(h == NULL || data < h->data || data > h->data + h->len) continue;
+		h->obj.gcflags |= QRTZ_GCFIXED;
+		if(i == 1) s->flags |= QRTZ_SSHARED;
+	}
+}
+
+static size_t qrtz_pinHash(qrtz_Object *obj) {
+	// objects are at least 16 bytes apart
+	return (size_t)(((uint64_t)(uintptr_t)obj >> 4) * 0x9E3779B97F4A7C15ull >> 16);
+}
+
+// the slot of the index holding the position of a pinned object, or the empty one it would go in
+static size_t qrtz_pinSlot(qrtz_VM *vm, qrtz_Object *obj) {
+	size_t mask = vm->pinIndexCap - 1;
+	size_t i = qrtz_pinHash(obj) & mask;
+	while(vm->pinIndex[i] != 0 && vm->pinned[vm->pinIndex[i] - 1].obj != obj) i = (i + 1) & mask;
+	return i;
+}
+
+static bool qrtz_growPins(qrtz_VM *vm) {
+	if(vm->pinnedLen == vm->pinnedCap) {
+		size_t newCap = vm->pinnedCap == 0 ? 16 : vm->pinnedCap * 2;
+		qrtz_Pin *newPins = qrtz_realloc(vm, vm->pinned, sizeof(qrtz_Pin), vm->pinnedCap, newCap);
+		if(newPins == NULL) return false;
+		vm->pinned = newPins;
+		vm->pinnedCap = newCap;
+	}
+	if((vm->pinnedLen + 1) * 4 <= vm->pinIndexCap * 3) return true;
+	size_t newCap = vm->pinIndexCap == 0 ? 32 : vm->pinIndexCap * 2;
+	size_t *newIndex = qrtz_allocArray(vm, sizeof(size_t), newCap);
+	if(newIndex == NULL) return false;
+	for(size_t i = 0; i < newCap; i++) newIndex[i] = 0;
+	qrtz_freeArray(vm, vm->pinIndex, sizeof(size_t), vm->pinIndexCap);
+	vm->pinIndex = newIndex;
+	vm->pinIndexCap = newCap;
+	for(size_t i = 0; i < vm->pinnedLen; i++) vm->pinIndex[qrtz_pinSlot(vm, vm->pinned[i].obj)] = i + 1;
+	return true;
+}
+
+bool qrtz_pinObject(qrtz_VM *vm, qrtz_Object *obj) {
+	if(obj->gcflags & QRTZ_GCPINNED) {
+		vm->pinned[vm->pinIndex[qrtz_pinSlot(vm, obj)] - 1].count++;
+		return true;
+	}
+	if(!qrtz_growPins(vm)) return false;
+	vm->pinIndex[qrtz_pinSlot(vm, obj)] = vm->pinnedLen + 1;
+	vm->pinned[vm->pinnedLen].obj = obj;
+	vm->pinned[vm->pinnedLen].count = 1;
+	vm->pinnedLen++;
+	obj->gcflags |= QRTZ_GCPINNED;
+	// it may be found again after being marked black
+	if(vm->gcState == QRTZ_GCMARK) qrtz_markObject(&vm->marker, obj);
+	return true;
+}
+
+bool qrtz_unpinObject(qrtz_VM *vm, qrtz_Object *obj) {
+	if((obj->gcflags & QRTZ_GCPINNED) == 0) return false;
+	size_t i = qrtz_pinSlot(vm, obj);
+	size_t pos = vm->pinIndex[i] - 1;
+	if(--vm->pinned[pos].count > 0) return true;
+	obj->gcflags &= ~QRTZ_GCPINNED;
+	// backward-shift deletion, so we never need tombstones
+	size_t mask = vm->pinIndexCap - 1;
+	size_t j = i;
+	while(true) {
+		j = (j + 1) & mask;
+		if(vm->pinIndex[j] == 0) break;
+		size_t home = qrtz_pinHash(vm->pinned[vm->pinIndex[j] - 1].obj) & mask;
+		// move it back if its home slot is not cyclically within (i, j]
+		bool inRange = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+		if(!inRange) {
+			vm->pinIndex[i] = vm->pinIndex[j];
+			i = j;
+		}
+	}
+	vm->pinIndex[i] = 0;
+	// the last one takes its place
+	vm->pinnedLen--;
+	if(pos != vm->pinnedLen) {
+		vm->pinned[pos] = vm->pinned[vm->pinnedLen];
+		vm->pinIndex[qrtz_pinSlot(vm, vm->pinned[pos].obj)] = pos + 1;
+	}
+	return true;
+}
+
+void qrtz_setMapWeak(qrtz_VM *vm, qrtz_Map *map, unsigned char weak) {
+	map->weak = weak;
+	// it may have been scanned already, with what it now holds strongly left unmarked
+	if(vm->gcState == QRTZ_GCMARK && qrtz_isMarked(&map->obj)) qrtz_pushGray(&vm->marker, &map->obj);
+}
+
+static qrtz_FinalizerType *qrtz_finalizerType(qrtz_VM *vm, const char *type) {
+	size_t len = qrtz_strlen(type);
+	for(size_t i = 0; i < vm->finalizerTypesLen; i++) {
+		qrtz_FinalizerType *t = &vm->finalizerTypes[i];
+		if(qrtz_strlen(t->type) == len && qrtz_memcmp(t->type, type, len) == 0) return t;
+	}
+	return NULL;
+}
+
+bool qrtz_trackFinalizer(qrtz_VM *vm, qrtz_Userdata *u) {
+	qrtz_FinalizerType *t = qrtz_finalizerType(vm, u->typestr);
+	if(t == NULL) return true;
+	size_t total = vm->finalizableLen + vm->finalizePending;
+	if(total == vm->finalizableCap) {
+		size_t newCap = vm->finalizableCap == 0 ? 16 : vm->finalizableCap * 2;
+		qrtz_Finalizable *newList = qrtz_realloc(vm, vm->finalizable, sizeof(qrtz_Finalizable), vm->finalizableCap, newCap);
+		if(newList == NULL) return false;
+		vm->finalizable = newList;
+		vm->finalizableCap = newCap;
+	}
+	// the first dead one makes room for it, by moving to the end
+	vm->finalizable[total] = vm->finalizable[vm->finalizableLen];
+	qrtz_Finalizable *f = &vm->finalizable[vm->finalizableLen++];
+	f->obj = u;
+	f->pointer = NULL;
+	f->finalizer = t->finalizer;
+	f->userdata = t->userdata;
+	return true;
+}
+
+void qrtz_runFinalizers(qrtz_VM *vm) {
+	while(vm->finalizePending > 0) {
+		qrtz_Finalizable f = vm->finalizable[vm->finalizableLen + --vm->finalizePending];
+		f.finalizer(f.userdata, f.pointer);
+	}
+}
+
+void qrtz_finalizeAll(qrtz_VM *vm) {
+	qrtz_runFinalizers(vm);
+	while(vm->finalizableLen > 0) {
+		qrtz_Finalizable f = vm->finalizable[--vm->finalizableLen];
+		f.finalizer(f.userdata, f.obj->pointer);
+	}
+}
+
+qrtz_Exit qrtz_setfinalizer(qrtz_VM *vm, const char *type, qrtz_Finalizer *finalizer, void *userdata) {
+	qrtz_FinalizerType *t = qrtz_finalizerType(vm, type);
+	if(finalizer == NULL) {
+		if(t == NULL) return QRTZ_OK;
+		qrtz_free(vm, t->type, qrtz_strlen(t->type) + 1);
+		*t = vm->finalizerTypes[--vm->finalizerTypesLen];
+		return QRTZ_OK;
+	}
+	if(t == NULL) {
+		if(vm->finalizerTypesLen == vm->finalizerTypesCap) {
+			size_t newCap = vm->finalizerTypesCap == 0 ? 8 : vm->finalizerTypesCap * 2;
+			qrtz_FinalizerType *newTypes = qrtz_realloc(vm, vm->finalizerTypes, sizeof(qrtz_FinalizerType), vm->finalizerTypesCap, newCap);
+			if(newTypes == NULL) return QRTZ_ENOMEM;
+			vm->finalizerTypes = newTypes;
+			vm->finalizerTypesCap = newCap;
+		}
+		size_t len = qrtz_strlen(type);
+		char *copy = qrtz_alloc(vm, len + 1);
+		if(copy == NULL) return QRTZ_ENOMEM;
+		qrtz_memcpy(copy, type, len + 1);
+		t = &vm->finalizerTypes[vm->finalizerTypesLen++];
+		t->type = copy;
+	}
+	t->finalizer = finalizer;
+	t->userdata = userdata;
+	return QRTZ_OK;
+}
+
+typedef struct qrtz_Compaction {
+	qrtz_RefVisitor visitor;
+	size_t moved;
+} qrtz_Compaction;
+
+// Only objects which can be young are moved, as the rest may be referenced from C between safe points.
+// Those which can be young already move in minor collections, so nothing holds them across safe points.
+static bool qrtz_canMove(qrtz_Object *obj) {
+	if(obj->gcflags & (QRTZ_GCPINNED | QRTZ_GCFIXED)) return false;
+	switch(obj->tag) {
+	case QRTZ_OSTR:
+	case QRTZ_OARRAY:
+	case QRTZ_OPOINTER:
+	case QRTZ_ORECORD:
+	case QRTZ_OCLOSURE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void qrtz_evacuateOld(qrtz_Object *obj, void *userdata) {
+	qrtz_Compaction *comp = userdata;
+	qrtz_VM *vm = comp->visitor.vm;
+	if(!qrtz_canMove(obj)) return;
+	size_t size = qrtz_objmemsizeof(obj);
+	// the pages being emptied are not available, so this never lands in one of them
+	qrtz_Object *copy = qrtz_heapalloc(vm, size);
+	// out of memory, so it stays where it is
+	if(copy == NULL) return;
+	copy->tag = obj->tag;
+	copy->gcflags |= obj->gcflags & QRTZ_GCREMEMBERED;
+	copy->idhash = obj->idhash;
+	qrtz_memcpy(copy + 1, obj + 1, size - sizeof(qrtz_Object));
+	qrtz_forward(obj, copy);
+	comp->moved++;
+}
+
+static qrtz_Object *qrtz_compactFix(qrtz_Object *obj) {
+	if(obj != NULL && (obj->gcflags & QRTZ_GCFORWARDED)) return *(qrtz_Object **)(obj + 1);
+	return obj;
+}
+
+static void qrtz_compactValue(qrtz_RefVisitor *visitor, qrtz_Value *val) {
+	(void)visitor;
+	if(!QRTZ_ISOBJ(*val)) return;
+	qrtz_Object *obj = QRTZ_ASOBJ(*val);
+	if(obj->gcflags & QRTZ_GCFORWARDED) *val = QRTZ_MKOBJ(qrtz_compactFix(obj));
+}
+
+static void qrtz_compactObject(qrtz_RefVisitor *visitor, qrtz_Object **ref) {
+	(void)visitor;
+	*ref = qrtz_compactFix(*ref);
+}
+
+static void qrtz_compactEach(qrtz_Object *obj, void *userdata) {
+	// moved objects are dead, and their bodies were overwritten
+	if(obj->gcflags & QRTZ_GCFORWARDED) return;
+	qrtz_visitRefs(userdata, obj);
+}
+
+// moves objects out of mostly empty pages, once a full cycle left only live objects in them
+static void qrtz_evacuatePages(qrtz_VM *vm) {
+	// references from young objects are not fixed, so there must be none left
+	if(vm->gcState != QRTZ_GCIDLE || vm->youngBytes != 0) return;
+	vm->gcRunning = true;
+	if(!qrtz_heapStartEvacuation(vm)) {
+		vm->gcRunning = false;
+		return;
+	}
+	qrtz_Compaction comp;
+	comp.visitor.value = qrtz_compactValue;
+	comp.visitor.object = qrtz_compactObject;
+	comp.visitor.vm = vm;
+	comp.moved = 0;
+	qrtz_heapEachEvacuated(vm, qrtz_evacuateOld, &comp);
+
+	if(comp.moved > 0) {
+		QRTZ_VISITOBJ(&comp.visitor, &vm->globals);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->registry);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->loaded);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->resetGlobals);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->resetRegistry);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->resetLoaded);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->mainTask);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->curTask);
+		QRTZ_VISITOBJ(&comp.visitor, &vm->oomStr);
+		// strings keep their hash, so they stay in the same slot of the intern table
+		for(size_t i = 0; i < vm->stringsCap; i++) {
+			QRTZ_VISITOBJ(&comp.visitor, &vm->strings[i]);
+		}
+		for(size_t i = 0; i < vm->rememberedLen; i++) {
+			vm->remembered[i] = qrtz_compactFix(vm->remembered[i]);
+		}
+		qrtz_heapEach(vm, qrtz_compactEach, &comp.visitor);
+	}
+	qrtz_heapFinishEvacuation(vm);
+	qrtz_setTarget(vm);
+	vm->gcRunning = false;
+}
+
+void qrtz_compact(qrtz_VM *vm) {
+	if(vm->gcRunning) return;
+	qrtz_beginPause(vm);
+	// Marking and sweeping first leaves only live objects to move.
+	// The nursery is emptied by it, so only old objects reference what moves.
+	qrtz_gc(vm);
+	qrtz_evacuatePages(vm);
+	qrtz_endPause(vm);
+}
+
+size_t qrtz_getMemoryUsage(qrtz_VM *vm) {
+	return vm->memUsage;
+}
+
+size_t qrtz_getMemoryTarget(qrtz_VM *vm) {
+	return vm->memTarget;
+}
+
+void qrtz_setMemoryTarget(qrtz_VM *vm, size_t target) {
+	vm->memTarget = target;
+}
+
+void qrtz_setGCPause(qrtz_VM *vm, double pause) {
+	vm->gcPause = pause;
+}
+
+void qrtz_setGCStepSize(qrtz_VM *vm, size_t stepSize) {
+	vm->gcStepSize = stepSize;
+	vm->gcPaceStep = stepSize;
+}
+
+void qrtz_setGCStepMul(qrtz_VM *vm, double stepMul) {
+	vm->gcStepMul = stepMul;
+	vm->gcPaceMul = stepMul;
+}
+
+void qrtz_setGCPauseTarget(qrtz_VM *vm, double seconds) {
+	vm->gcPauseTarget = seconds > 0 ? seconds : 0;
+}
+
+void qrtz_setMemoryLimit(qrtz_VM *vm, size_t limit) {
+	vm->memLimit = limit;
+	// the next cycle is not waited for, as memory may be over it already
+	if(limit != 0 && vm->memTarget > limit) vm->memTarget = limit;
+}
+
+void qrtz_setGCThreads(qrtz_VM *vm, size_t threads) {
+	vm->gcThreads = threads == 0 ? 1 : threads;
+}
+
+void qrtz_setGCBackgroundSweep(qrtz_VM *vm, bool enabled) {
+	vm->gcBackgroundSweep = enabled;
+}
+
+void qrtz_getGCStats(qrtz_VM *vm, qrtz_GCStats *stats) {
+	*stats = vm->gcStats;
+}
+
+// in the order of qrtz_ObjTag
+static const char *qrtz_gcKindNames[] = {
+	"string", "array", "map", "pointer", "userdata", "task",
+	"program", "record", "type", "record options", "function", "closure",
+};
+_Static_assert(sizeof(qrtz_gcKindNames) / sizeof(qrtz_gcKindNames[0]) == QRTZ_GCKINDS, "every kind needs a name");
+
+const char *qrtz_gcKindName(size_t kind) {
+	return kind < QRTZ_GCKINDS ? qrtz_gcKindNames[kind] : NULL;
+}
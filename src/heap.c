@@ -0,0 +1,564 @@
+#include "quartz.h"
+#include "common.h"
+#include "value.h"
+
+// Old objects are grouped by size class into pages, so sweeping goes through memory in order,
+// and allocating is popping a free list. Objects too big for any class are allocated on their own.
+
+static const size_t qrtz_sizeClasses[QRTZ_SIZECLASSES] = {16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256};
+
+// the size class of sizes up to i * 8
+static const unsigned char qrtz_sizeClassOf[QRTZ_SMALLOBJMAX / 8 + 1] = {
+	0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 8, 8, 9, 9, 10, 10,
+	11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14,
+};
+
+#define QRTZ_GRANULEBIT(g) (1ull << ((g) % 64))
+
+static qrtz_Page *qrtz_newPage(qrtz_VM *vm, size_t sizeClass) {
+	qrtz_Page *page = qrtz_alloc(vm, QRTZ_PAGESIZE);
+	if(page == NULL) return NULL;
+	size_t header = (sizeof(qrtz_Page) + 15) / 16 * 16;
+	page->sizeClass = sizeClass;
+	page->slotSize = qrtz_sizeClasses[sizeClass];
+	page->slotCount = (QRTZ_PAGESIZE - header) / page->slotSize;
+	page->slots = (char *)page + header;
+	page->free = NULL;
+	page->fresh = 0;
+	page->used = 0;
+	page->evacuating = false;
+	qrtz_memset(page->allocated, 0, sizeof(page->allocated));
+	qrtz_memset(page->marked, 0, sizeof(page->marked));
+	page->next = vm->pages[sizeClass];
+	vm->pages[sizeClass] = page;
+	page->nextAvail = vm->availPages[sizeClass];
+	vm->availPages[sizeClass] = page;
+	return page;
+}
+
+static void *qrtz_largealloc(qrtz_VM *vm, size_t size) {
+	if(size > SIZE_MAX - sizeof(qrtz_LargeObject)) return NULL;
+	qrtz_LargeObject *large = qrtz_alloc(vm, sizeof(qrtz_LargeObject) + size);
+	if(large == NULL) return NULL;
+	qrtz_memset(large + 1, 0, size);
+	((qrtz_Object *)(large + 1))->gcflags = QRTZ_GCLARGE;
+	large->size = size;
+	large->marked = false;
+	vm->gcStats.allocated += size;
+	large->next = vm->largeObjects;
+	vm->largeObjects = large;
+	return large + 1;
+}
+
+void qrtz_heapStartSweep(qrtz_VM *vm) {
+	// objects allocated from now on go in fresh pages and lists, so they are not swept
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		vm->sweepPages[c] = vm->pages[c];
+		vm->pages[c] = NULL;
+		vm->availPages[c] = NULL;
+	}
+	vm->sweepLarge = vm->largeObjects;
+	vm->largeObjects = NULL;
+}
+
+// Frees the unmarked objects of a page, and clears its marks, returning how many bytes were freed.
+// Free slots are linked backwards, so they are handed out in address order.
+static size_t qrtz_sweepPage(qrtz_VM *vm, qrtz_Page *page) {
+	size_t freed = 0;
+	page->free = NULL;
+	for(size_t i = page->fresh; i-- > 0;) {
+		char *slot = page->slots + i * page->slotSize;
+		size_t g = QRTZ_GRANULE(page, slot);
+		uint64_t bit = QRTZ_GRANULEBIT(g);
+		if(page->allocated[g / 64] & bit) {
+			if(page->marked[g / 64] & bit) continue;
+			qrtz_objrelease(vm, (qrtz_Object *)slot);
+			page->allocated[g / 64] &= ~bit;
+			page->used--;
+			freed += page->slotSize;
+		}
+		*(void **)slot = page->free;
+		page->free = slot;
+	}
+	qrtz_memset(page->marked, 0, sizeof(page->marked));
+	return freed;
+}
+
+// puts a swept page back with the others of its size class
+static void qrtz_keepPage(qrtz_VM *vm, qrtz_Page *page) {
+	size_t c = page->sizeClass;
+	page->next = vm->pages[c];
+	vm->pages[c] = page;
+	if(page->free != NULL || page->fresh < page->slotCount) {
+		page->nextAvail = vm->availPages[c];
+		vm->availPages[c] = page;
+	}
+}
+
+static qrtz_Page *qrtz_popPage(qrtz_VM *vm, qrtz_Page **list) {
+	qrtz_spinLock(&vm->sweepLock);
+	qrtz_Page *page = *list;
+	if(page != NULL) *list = page->next;
+	qrtz_spinUnlock(&vm->sweepLock);
+	return page;
+}
+
+static void qrtz_pushPage(qrtz_VM *vm, qrtz_Page **list, qrtz_Page *page) {
+	qrtz_spinLock(&vm->sweepLock);
+	page->next = *list;
+	*list = page;
+	qrtz_spinUnlock(&vm->sweepLock);
+}
+
+// takes back the pages the background thread swept, and the memory it freed
+static void qrtz_collectSwept(qrtz_VM *vm) {
+#ifdef QRTZ_THREADS
+	if(vm->sweepThread == NULL && vm->sweptPages == NULL) return;
+	qrtz_spinLock(&vm->sweepLock);
+	qrtz_Page *page = vm->sweptPages;
+	vm->sweptPages = NULL;
+	qrtz_spinUnlock(&vm->sweepLock);
+	while(page != NULL) {
+		qrtz_Page *next = page->next;
+		qrtz_keepPage(vm, page);
+		page = next;
+	}
+	vm->memUsage -= __atomic_exchange_n(&vm->sweptBytes, 0, __ATOMIC_ACQ_REL);
+	vm->gcStats.freed += __atomic_exchange_n(&vm->sweptObjectBytes, 0, __ATOMIC_ACQ_REL);
+#else
+	(void)vm;
+#endif
+}
+
+// Sweeps pages of a size class until one has a free slot, so dead objects are reused before
+// more memory is asked for. Empty pages are kept, as a new one would be needed otherwise.
+static qrtz_Page *qrtz_lazySweep(qrtz_VM *vm, size_t sizeClass) {
+	qrtz_collectSwept(vm);
+	if(vm->availPages[sizeClass] != NULL) return vm->availPages[sizeClass];
+	while(true) {
+		qrtz_Page *page = qrtz_popPage(vm, &vm->sweepPages[sizeClass]);
+		if(page == NULL) return NULL;
+		vm->gcStats.freed += qrtz_sweepPage(vm, page);
+		qrtz_keepPage(vm, page);
+		if(vm->availPages[sizeClass] == page) return page;
+	}
+}
+
+void *qrtz_heapalloc(qrtz_VM *vm, size_t size) {
+	if(size > QRTZ_SMALLOBJMAX) return qrtz_largealloc(vm, size);
+	size_t sizeClass = qrtz_sizeClassOf[(size + 7) / 8];
+	qrtz_Page *page = vm->availPages[sizeClass];
+	// full pages stop being available until they are swept
+	while(page != NULL && page->free == NULL && page->fresh == page->slotCount) {
+		page = page->nextAvail;
+		vm->availPages[sizeClass] = page;
+	}
+	if(page == NULL && vm->gcState == QRTZ_GCSWEEP) page = qrtz_lazySweep(vm, sizeClass);
+	if(page == NULL) {
+		page = qrtz_newPage(vm, sizeClass);
+		if(page == NULL) return NULL;
+	}
+	char *slot;
+	if(page->free != NULL) {
+		slot = page->free;
+		page->free = *(void **)slot;
+	} else {
+		slot = page->slots + page->fresh * page->slotSize;
+		page->fresh++;
+	}
+	size_t g = QRTZ_GRANULE(page, slot);
+	page->allocated[g / 64] |= QRTZ_GRANULEBIT(g);
+	page->used++;
+	vm->gcAllocated += page->slotSize;
+	vm->gcStats.allocated += page->slotSize;
+	qrtz_memset(slot, 0, page->slotSize);
+	((qrtz_Object *)slot)->pageOffset = (unsigned short)((slot - (char *)page) / 8);
+	return slot;
+}
+
+#ifdef QRTZ_THREADS
+
+// whether a page has dead objects with something to release
+static bool qrtz_pageNeedsRelease(qrtz_Page *page) {
+	for(size_t w = 0; w < (QRTZ_PAGEGRANULES + 63) / 64; w++) {
+		uint64_t dead = page->allocated[w] & ~page->marked[w];
+		while(dead != 0) {
+			size_t g = w * 64 + (size_t)__builtin_ctzll(dead);
+			dead &= dead - 1;
+			if(qrtz_objNeedsRelease((qrtz_Object *)((char *)page + g * 16))) return true;
+		}
+	}
+	return false;
+}
+
+// Sweeps pages on a thread of its own. It never releases anything, so it only touches the pages it
+// takes, and the lists they go back on. Freed pages go straight to the context.
+static void qrtz_backgroundSweep(void *arg) {
+	qrtz_VM *vm = arg;
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		while(!__atomic_load_n(&vm->sweepStop, __ATOMIC_RELAXED)) {
+			qrtz_Page *page = qrtz_popPage(vm, &vm->sweepPages[c]);
+			if(page == NULL) break;
+			if(qrtz_pageNeedsRelease(page)) {
+				qrtz_pushPage(vm, &vm->releasePages, page);
+				continue;
+			}
+			__atomic_fetch_add(&vm->sweptObjectBytes, qrtz_sweepPage(vm, page), __ATOMIC_ACQ_REL);
+			if(page->used > 0) {
+				qrtz_pushPage(vm, &vm->sweptPages, page);
+				continue;
+			}
+			qrtz_cfree(&vm->ctx, page, QRTZ_PAGESIZE);
+			__atomic_fetch_add(&vm->sweptBytes, QRTZ_PAGESIZE, __ATOMIC_ACQ_REL);
+		}
+	}
+	__atomic_store_n(&vm->sweepDone, true, __ATOMIC_RELEASE);
+}
+
+void qrtz_heapSweepInBackground(qrtz_VM *vm) {
+	qrtz_Context *ctx = &vm->ctx;
+	if(!vm->gcBackgroundSweep || ctx->threadStart == NULL || ctx->threadJoin == NULL) return;
+	if(vm->sweepThread != NULL) return;
+	vm->sweepStop = false;
+	vm->sweepDone = false;
+	vm->sweepThread = ctx->threadStart(ctx->data, qrtz_backgroundSweep, vm);
+}
+
+// Waits for the background thread, leaving what it did not get to for the calling thread.
+static void qrtz_stopSweeper(qrtz_VM *vm) {
+	if(vm->sweepThread == NULL) return;
+	__atomic_store_n(&vm->sweepStop, true, __ATOMIC_RELAXED);
+	vm->ctx.threadJoin(vm->ctx.data, vm->sweepThread);
+	vm->sweepThread = NULL;
+	qrtz_collectSwept(vm);
+}
+
+#else
+
+void qrtz_heapSweepInBackground(qrtz_VM *vm) {
+	(void)vm;
+}
+
+static void qrtz_stopSweeper(qrtz_VM *vm) {
+	(void)vm;
+}
+
+#endif
+
+bool qrtz_heapSweepDone(qrtz_VM *vm) {
+	if(vm->sweepLarge != NULL) return false;
+#ifdef QRTZ_THREADS
+	// the lists are only safe to read once the thread is done with them
+	if(vm->sweepThread != NULL && !__atomic_load_n(&vm->sweepDone, __ATOMIC_ACQUIRE)) return false;
+#endif
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		if(vm->sweepPages[c] != NULL) return false;
+	}
+	return vm->releasePages == NULL;
+}
+
+// sweeps a page on the VM's thread, freeing it if nothing in it is left
+static void qrtz_sweepOwnPage(qrtz_VM *vm, qrtz_Page *page) {
+	vm->gcStats.freed += qrtz_sweepPage(vm, page);
+	if(page->used == 0) qrtz_free(vm, page, QRTZ_PAGESIZE);
+	else qrtz_keepPage(vm, page);
+}
+
+bool qrtz_heapSweep(qrtz_VM *vm, size_t budget) {
+	// the rest is done right away, so the thread would only get in the way
+	if(budget == SIZE_MAX || qrtz_heapSweepDone(vm)) qrtz_stopSweeper(vm);
+	qrtz_collectSwept(vm);
+	size_t work = 0;
+	while(work < budget) {
+		qrtz_Page *page = qrtz_popPage(vm, &vm->releasePages);
+		if(page == NULL) break;
+		work += page->fresh * page->slotSize;
+		qrtz_sweepOwnPage(vm, page);
+	}
+	for(size_t c = 0; c < QRTZ_SIZECLASSES && work < budget; c++) {
+		while(work < budget) {
+			qrtz_Page *page = qrtz_popPage(vm, &vm->sweepPages[c]);
+			if(page == NULL) break;
+			work += page->fresh * page->slotSize;
+			qrtz_sweepOwnPage(vm, page);
+		}
+	}
+	while(vm->sweepLarge != NULL && work < budget) {
+		qrtz_LargeObject *large = vm->sweepLarge;
+		qrtz_Object *obj = (qrtz_Object *)(large + 1);
+		vm->sweepLarge = large->next;
+		work += large->size;
+		if(large->marked) {
+			large->marked = false;
+			large->next = vm->largeObjects;
+			vm->largeObjects = large;
+			continue;
+		}
+		qrtz_objrelease(vm, obj);
+		vm->gcStats.freed += large->size;
+		qrtz_free(vm, large, sizeof(qrtz_LargeObject) + large->size);
+	}
+	return vm->sweepThread == NULL && qrtz_heapSweepDone(vm);
+}
+
+static void qrtz_pageEach(qrtz_Page *page, void (*fn)(qrtz_Object *obj, void *userdata), void *userdata) {
+	for(; page != NULL; page = page->next) {
+		for(size_t i = 0; i < page->fresh; i++) {
+			char *slot = page->slots + i * page->slotSize;
+			size_t g = QRTZ_GRANULE(page, slot);
+			if(page->allocated[g / 64] & QRTZ_GRANULEBIT(g)) fn((qrtz_Object *)slot, userdata);
+		}
+	}
+}
+
+static void qrtz_largeEach(qrtz_LargeObject *large, void (*fn)(qrtz_Object *obj, void *userdata), void *userdata) {
+	for(; large != NULL; large = large->next) fn((qrtz_Object *)(large + 1), userdata);
+}
+
+void qrtz_heapEach(qrtz_VM *vm, void (*fn)(qrtz_Object *obj, void *userdata), void *userdata) {
+	// pages can't be walked while another thread sweeps them
+	qrtz_stopSweeper(vm);
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		qrtz_pageEach(vm->pages[c], fn, userdata);
+		qrtz_pageEach(vm->sweepPages[c], fn, userdata);
+	}
+	qrtz_pageEach(vm->releasePages, fn, userdata);
+	qrtz_largeEach(vm->largeObjects, fn, userdata);
+	qrtz_largeEach(vm->sweepLarge, fn, userdata);
+}
+
+// Pages less than QRTZ_COMPACTMAX percent full are emptied, as long as their objects fit in
+// fewer pages than they take up now, counting the free slots of the other pages.
+static bool qrtz_pickEvacuated(qrtz_VM *vm, size_t c) {
+	size_t candidates = 0, live = 0, free = 0, slotCount = 0;
+	for(qrtz_Page *page = vm->pages[c]; page != NULL; page = page->next) {
+		slotCount = page->slotCount;
+		if(page->used * 100 < page->slotCount * QRTZ_COMPACTMAX) {
+			candidates++;
+			live += page->used;
+		} else {
+			free += page->slotCount - page->used;
+		}
+	}
+	if(candidates == 0) return false;
+	size_t needed = live > free ? (live - free + slotCount - 1) / slotCount : 0;
+	if(needed >= candidates) return false;
+	// they are no longer available, so moved objects never land in them
+	vm->availPages[c] = NULL;
+	for(qrtz_Page *page = vm->pages[c]; page != NULL; page = page->next) {
+		page->evacuating = page->used * 100 < page->slotCount * QRTZ_COMPACTMAX;
+		if(page->evacuating) continue;
+		if(page->free != NULL || page->fresh < page->slotCount) {
+			page->nextAvail = vm->availPages[c];
+			vm->availPages[c] = page;
+		}
+	}
+	return true;
+}
+
+bool qrtz_heapStartEvacuation(qrtz_VM *vm) {
+	bool any = false;
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		if(qrtz_pickEvacuated(vm, c)) any = true;
+	}
+	return any;
+}
+
+void qrtz_heapEachEvacuated(qrtz_VM *vm, void (*fn)(qrtz_Object *obj, void *userdata), void *userdata) {
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		for(qrtz_Page *page = vm->pages[c]; page != NULL; page = page->next) {
+			if(!page->evacuating) continue;
+			for(size_t i = 0; i < page->fresh; i++) {
+				char *slot = page->slots + i * page->slotSize;
+				size_t g = QRTZ_GRANULE(page, slot);
+				if(page->allocated[g / 64] & QRTZ_GRANULEBIT(g)) fn((qrtz_Object *)slot, userdata);
+			}
+		}
+	}
+}
+
+void qrtz_heapFinishEvacuation(qrtz_VM *vm) {
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		qrtz_Page **link = &vm->pages[c];
+		while(*link != NULL) {
+			qrtz_Page *page = *link;
+			if(!page->evacuating) {
+				link = &page->next;
+				continue;
+			}
+			page->evacuating = false;
+			// what moved is dead, and owns nothing anymore, as the copy took it over
+			for(size_t i = 0; i < page->fresh; i++) {
+				char *slot = page->slots + i * page->slotSize;
+				size_t g = QRTZ_GRANULE(page, slot);
+				uint64_t bit = QRTZ_GRANULEBIT(g);
+				if(!(page->allocated[g / 64] & bit)) continue;
+				if(!(((qrtz_Object *)slot)->gcflags & QRTZ_GCFORWARDED)) {
+					page->marked[g / 64] |= bit;
+					continue;
+				}
+				page->allocated[g / 64] &= ~bit;
+				page->used--;
+				vm->gcStats.freed += page->slotSize;
+			}
+			*link = page->next;
+			if(page->used == 0) {
+				qrtz_free(vm, page, QRTZ_PAGESIZE);
+				continue;
+			}
+			// rebuilds the free list, keeping whatever is still allocated
+			qrtz_sweepPage(vm, page);
+			qrtz_keepPage(vm, page);
+		}
+	}
+}
+
+static void qrtz_freePages(qrtz_VM *vm, qrtz_Page *page) {
+	while(page != NULL) {
+		qrtz_Page *next = page->next;
+		for(size_t i = 0; i < page->fresh; i++) {
+			char *slot = page->slots + i * page->slotSize;
+			size_t g = QRTZ_GRANULE(page, slot);
+			if(page->allocated[g / 64] & QRTZ_GRANULEBIT(g)) qrtz_objrelease(vm, (qrtz_Object *)slot);
+		}
+		qrtz_free(vm, page, QRTZ_PAGESIZE);
+		page = next;
+	}
+}
+
+static void qrtz_freeLarge(qrtz_VM *vm, qrtz_LargeObject *large) {
+	while(large != NULL) {
+		qrtz_LargeObject *next = large->next;
+		qrtz_objrelease(vm, (qrtz_Object *)(large + 1));
+		qrtz_free(vm, large, sizeof(qrtz_LargeObject) + large->size);
+		large = next;
+	}
+}
+
+static void qrtz_releaseExtern(qrtz_Object *obj, void *userdata) {
+	qrtz_String *s = (qrtz_String *)obj;
+	if(obj->tag == QRTZ_OSTR && (s->flags & QRTZ_SEXTERN)) qrtz_objrelease(userdata, obj);
+}
+
+void qrtz_heapAbandon(qrtz_VM *vm) {
+	qrtz_stopSweeper(vm);
+	// most VMs never get external strings, and then nothing is walked
+	if(vm->externStrings > 0) qrtz_heapEach(vm, qrtz_releaseExtern, vm);
+}
+
+static size_t qrtz_blockSlot(const char *from, size_t mask) {
+	// pages are aligned at least as much as the allocator aligns, so the low bits say little
+	return (size_t)(((uint64_t)(uintptr_t)from * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+static void qrtz_addBlock(qrtz_HeapCopy *copy, char *from, char *to) {
+	size_t mask = copy->cap - 1;
+	size_t i = qrtz_blockSlot(from, mask);
+	while(copy->blocks[i].from != NULL) i = (i + 1) & mask;
+	copy->blocks[i].from = from;
+	copy->blocks[i].to = to;
+}
+
+qrtz_Object *qrtz_heapCopyOf(qrtz_HeapCopy *copy, qrtz_Object *obj) {
+	char *from = (obj->gcflags & QRTZ_GCLARGE) ? (char *)obj - sizeof(qrtz_LargeObject) : (char *)qrtz_pageOf(obj);
+	size_t mask = copy->cap - 1;
+	for(size_t i = qrtz_blockSlot(from, mask);; i = (i + 1) & mask) {
+		qrtz_HeapBlock *block = &copy->blocks[i];
+		if(block->from == from) return (qrtz_Object *)(block->to + ((char *)obj - from));
+		if(block->from == NULL) return NULL;
+	}
+}
+
+// The copy's own flags are the only ones which still hold, as nothing pins or remembers it yet.
+// If an object can't get its own copy of what it owns, it and the rest of the page are left out.
+static bool qrtz_clonePage(qrtz_VM *vm, qrtz_Page *page) {
+	for(size_t i = 0; i < page->fresh; i++) {
+		char *slot = page->slots + i * page->slotSize;
+		size_t g = QRTZ_GRANULE(page, slot);
+		if((page->allocated[g / 64] & QRTZ_GRANULEBIT(g)) == 0) continue;
+		qrtz_Object *obj = (qrtz_Object *)slot;
+		obj->gcflags = 0;
+		if(qrtz_objclone(vm, obj)) continue;
+		for(; i < page->fresh; i++) {
+			g = QRTZ_GRANULE(page, page->slots + i * page->slotSize);
+			if((page->allocated[g / 64] & QRTZ_GRANULEBIT(g)) == 0) continue;
+			page->allocated[g / 64] &= ~QRTZ_GRANULEBIT(g);
+			page->used--;
+		}
+		return false;
+	}
+	return true;
+}
+
+bool qrtz_heapClone(qrtz_VM *vm, qrtz_VM *from, qrtz_HeapCopy *copy) {
+	qrtz_stopSweeper(from);
+	size_t blocks = 0;
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		for(qrtz_Page *page = from->pages[c]; page != NULL; page = page->next) blocks++;
+	}
+	for(qrtz_LargeObject *large = from->largeObjects; large != NULL; large = large->next) blocks++;
+	copy->cap = 16;
+	while(copy->cap < blocks * 2) copy->cap *= 2;
+	// only needed while cloning, so it is not counted as the VM's memory
+	copy->blocks = qrtz_callocArray(&vm->ctx, sizeof(qrtz_HeapBlock), copy->cap);
+	if(copy->blocks == NULL) {
+		copy->cap = 0;
+		return false;
+	}
+	for(size_t i = 0; i < copy->cap; i++) copy->blocks[i].from = NULL;
+
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		for(qrtz_Page *page = from->pages[c]; page != NULL; page = page->next) {
+			qrtz_Page *p = qrtz_alloc(vm, QRTZ_PAGESIZE);
+			if(p == NULL) return false;
+			// slots past fresh have never been used, so there is nothing to copy there
+			qrtz_memcpy(p, page, (size_t)(page->slots - (char *)page) + page->fresh * page->slotSize);
+			p->slots = (char *)p + (page->slots - (char *)page);
+			// free slots are linked through the original page
+			for(void **link = &p->free; *link != NULL; link = *link) *link = (char *)p + ((char *)*link - (char *)page);
+			p->next = vm->pages[c];
+			vm->pages[c] = p;
+			p->nextAvail = vm->availPages[c];
+			vm->availPages[c] = p;
+			qrtz_addBlock(copy, (char *)page, (char *)p);
+			if(!qrtz_clonePage(vm, p)) return false;
+		}
+	}
+	for(qrtz_LargeObject *large = from->largeObjects; large != NULL; large = large->next) {
+		size_t size = sizeof(qrtz_LargeObject) + large->size;
+		qrtz_LargeObject *l = qrtz_alloc(vm, size);
+		if(l == NULL) return false;
+		qrtz_memcpy(l, large, size);
+		qrtz_Object *obj = (qrtz_Object *)(l + 1);
+		obj->gcflags = QRTZ_GCLARGE;
+		if(!qrtz_objclone(vm, obj)) {
+			qrtz_free(vm, l, size);
+			return false;
+		}
+		l->next = vm->largeObjects;
+		vm->largeObjects = l;
+		qrtz_addBlock(copy, (char *)large, (char *)l);
+	}
+	return true;
+}
+
+void qrtz_freeHeapCopy(qrtz_VM *vm, qrtz_HeapCopy *copy) {
+	qrtz_cfreeArray(&vm->ctx, copy->blocks, sizeof(qrtz_HeapBlock), copy->cap);
+}
+
+void qrtz_heapDestroy(qrtz_VM *vm) {
+	qrtz_stopSweeper(vm);
+	for(size_t c = 0; c < QRTZ_SIZECLASSES; c++) {
+		qrtz_freePages(vm, vm->pages[c]);
+		vm->pages[c] = NULL;
+		vm->availPages[c] = NULL;
+		qrtz_freePages(vm, vm->sweepPages[c]);
+		vm->sweepPages[c] = NULL;
+	}
+	qrtz_freePages(vm, vm->releasePages);
+	vm->releasePages = NULL;
+	qrtz_freeLarge(vm, vm->largeObjects);
+	vm->largeObjects = NULL;
+	qrtz_freeLarge(vm, vm->sweepLarge);
+	vm->sweepLarge = NULL;
+}
@@ -2,3 +2,7 @@
 
 #include "utils.c"
 #include "value.c"
+#include "heap.c"
+#include "gc.c"
+#include "profile.c"
+#include "api.c"
@@ -0,0 +1,151 @@
+#include "quartz.h"
+#include "common.h"
+#include "value.h"
+#include "stb_sprintf.h"
+
+// Picks how many bytes to allocate until the next sample, uniformly up to twice the rate,
+// so allocations repeating at the rate's period are not always or never sampled.
+static void qrtz_nextSample(qrtz_VM *vm) {
+	uint64_t x = vm->profileSeed;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	vm->profileSeed = x;
+	size_t gap = 1 + (size_t)(x % ((uint64_t)vm->profileRate * 2));
+	size_t allocated = vm->profileAllocated;
+	vm->profileAt = gap > SIZE_MAX - allocated ? SIZE_MAX - 1 : allocated + gap;
+}
+
+static qrtz_Exit qrtz_putFrame(qrtz_Buffer *buf, qrtz_CallEntry *call) {
+	if(call->name == NULL) return qrtz_puts(buf, call->isC ? "[C]" : "?");
+	qrtz_Exit err = qrtz_puts(buf, call->name);
+	if(err || call->line == 0) return err;
+	char line[32];
+	int len = stbsp_snprintf(line, sizeof(line), ":%zu", call->line);
+	return qrtz_putls(buf, line, (size_t)len);
+}
+
+// the frames of the current task, from the outermost one, then the kind of object
+static qrtz_Exit qrtz_putStack(qrtz_Buffer *buf, qrtz_VM *vm, qrtz_ObjTag tag) {
+	qrtz_Task *task = vm->curTask;
+	qrtz_Exit err = qrtz_puts(buf, task == vm->mainTask ? "main" : "task");
+	if(err) return err;
+	size_t first = 0;
+	if(task->calllen > QRTZ_PROFILEDEPTH) {
+		first = task->calllen - QRTZ_PROFILEDEPTH;
+		err = qrtz_puts(buf, ";...");
+		if(err) return err;
+	}
+	for(size_t i = first; i < task->calllen; i++) {
+		err = qrtz_putc(buf, ';');
+		if(err) return err;
+		err = qrtz_putFrame(buf, &task->calls[i]);
+		if(err) return err;
+	}
+	err = qrtz_putc(buf, ';');
+	if(err) return err;
+	return qrtz_puts(buf, qrtz_gcKindName(tag));
+}
+
+static qrtz_ProfileSite *qrtz_findSite(qrtz_VM *vm, const char *stack, size_t len, size_t hash) {
+	if(vm->profileIndexCap == 0) return NULL;
+	size_t mask = vm->profileIndexCap - 1;
+	for(size_t i = hash & mask; vm->profileIndex[i] != 0; i = (i + 1) & mask) {
+		qrtz_ProfileSite *site = &vm->profile[vm->profileIndex[i] - 1];
+		if(site->hash == hash && site->len == len && qrtz_memcmp(site->stack, stack, len) == 0) return site;
+	}
+	return NULL;
+}
+
+static void qrtz_indexSite(size_t *index, size_t cap, size_t hash, size_t site) {
+	size_t mask = cap - 1;
+	size_t i = hash & mask;
+	while(index[i] != 0) i = (i + 1) & mask;
+	index[i] = site + 1;
+}
+
+// Returns NULL if it runs out of memory, in which case the sample is just lost.
+static qrtz_ProfileSite *qrtz_addSite(qrtz_VM *vm, const char *stack, size_t len, size_t hash) {
+	if((vm->profileLen + 1) * 4 > vm->profileIndexCap * 3) {
+		size_t newCap = vm->profileIndexCap == 0 ? 32 : vm->profileIndexCap * 2;
+		size_t *newIndex = qrtz_callocArray(&vm->ctx, sizeof(size_t), newCap);
+		if(newIndex == NULL) return NULL;
+		for(size_t i = 0; i < newCap; i++) newIndex[i] = 0;
+		for(size_t i = 0; i < vm->profileLen; i++) qrtz_indexSite(newIndex, newCap, vm->profile[i].hash, i);
+		qrtz_cfreeArray(&vm->ctx, vm->profileIndex, sizeof(size_t), vm->profileIndexCap);
+		vm->profileIndex = newIndex;
+		vm->profileIndexCap = newCap;
+	}
+	if(vm->profileLen == vm->profileCap) {
+		size_t newCap = vm->profileCap == 0 ? 16 : vm->profileCap * 2;
+		qrtz_ProfileSite *newSites = qrtz_crealloc(&vm->ctx, vm->profile, sizeof(qrtz_ProfileSite), vm->profileCap, newCap);
+		if(newSites == NULL) return NULL;
+		vm->profile = newSites;
+		vm->profileCap = newCap;
+	}
+	char *copy = qrtz_calloc(&vm->ctx, len);
+	if(copy == NULL) return NULL;
+	qrtz_memcpy(copy, stack, len);
+	qrtz_indexSite(vm->profileIndex, vm->profileIndexCap, hash, vm->profileLen);
+	qrtz_ProfileSite *site = &vm->profile[vm->profileLen++];
+	site->stack = copy;
+	site->len = len;
+	site->hash = hash;
+	site->bytes = 0;
+	return site;
+}
+
+void qrtz_sampleAlloc(qrtz_VM *vm, qrtz_ObjTag tag, size_t size) {
+	qrtz_nextSample(vm);
+	qrtz_Buffer buf;
+	if(qrtz_initBufCap(&buf, &vm->ctx, 128)) return;
+	if(qrtz_putStack(&buf, vm, tag) == QRTZ_OK) {
+		size_t hash = qrtz_strhash(buf.buf, buf.len, 0);
+		qrtz_ProfileSite *site = qrtz_findSite(vm, buf.buf, buf.len, hash);
+		if(site == NULL) site = qrtz_addSite(vm, buf.buf, buf.len, hash);
+		if(site != NULL) {
+			// small objects are sampled about once per rate bytes, and big ones about every time
+			site->bytes += size > vm->profileRate ? size : vm->profileRate;
+		}
+	}
+	qrtz_freeBuf(&buf);
+}
+
+void qrtz_setAllocProfile(qrtz_VM *vm, size_t rate) {
+	vm->profileRate = rate;
+	if(rate == 0) {
+		vm->profileAt = SIZE_MAX;
+		return;
+	}
+	if(vm->profileSeed == 0) vm->profileSeed = (uint64_t)vm->hashSeed | 1;
+	qrtz_nextSample(vm);
+}
+
+qrtz_Exit qrtz_writeAllocProfile(qrtz_VM *vm, qrtz_Buffer *buf) {
+	for(size_t i = 0; i < vm->profileLen; i++) {
+		qrtz_ProfileSite *site = &vm->profile[i];
+		qrtz_Exit err = qrtz_putls(buf, site->stack, site->len);
+		if(err) return err;
+		char bytes[32];
+		int len = stbsp_snprintf(bytes, sizeof(bytes), " %zu\n", site->bytes);
+		err = qrtz_putls(buf, bytes, (size_t)len);
+		if(err) return err;
+	}
+	return QRTZ_OK;
+}
+
+void qrtz_clearAllocProfile(qrtz_VM *vm) {
+	for(size_t i = 0; i < vm->profileLen; i++) qrtz_cfree(&vm->ctx, vm->profile[i].stack, vm->profile[i].len);
+	vm->profileLen = 0;
+	for(size_t i = 0; i < vm->profileIndexCap; i++) vm->profileIndex[i] = 0;
+}
+
+void qrtz_freeAllocProfile(qrtz_VM *vm) {
+	qrtz_clearAllocProfile(vm);
+	qrtz_cfreeArray(&vm->ctx, vm->profile, sizeof(qrtz_ProfileSite), vm->profileCap);
+	vm->profile = NULL;
+	vm->profileCap = 0;
+	qrtz_cfreeArray(&vm->ctx, vm->profileIndex, sizeof(size_t), vm->profileIndexCap);
+	vm->profileIndex = NULL;
+	vm->profileIndexCap = 0;
+}
@@ -25,6 +25,125 @@
 #define QRTZ_CHECKINTERVAL 10000
 #endif
 
+// memory usage at which the first GC cycle starts
+#ifndef QRTZ_GCTARGET
+#define QRTZ_GCTARGET (200 * 1024)
+#endif
+
+// default ratio for new memory targets, see qrtz_setGCPause
+#ifndef QRTZ_GCPAUSE
+#define QRTZ_GCPAUSE 100
+#endif
+
+// With a soft memory limit, cycles start often enough to stay under it, but never so often that
+// collecting takes more than this percent of the time. Memory goes over the limit instead.
+#ifndef QRTZ_GCMAXCPU
+#define QRTZ_GCMAXCPU 50
+#endif
+
+// default amount of bytes allocated between incremental GC steps
+#ifndef QRTZ_GCSTEPSIZE
+#define QRTZ_GCSTEPSIZE (16 * 1024)
+#endif
+
+// default amount of work done by each incremental GC step, as a percentage of the step size
+#ifndef QRTZ_GCSTEPMUL
+#define QRTZ_GCSTEPMUL 200
+#endif
+
+// Size of the nursery, where small objects are bump-allocated.
+// Objects which survive a minor collection are copied to a survivor space, or promoted to the old
+// generation once they survived QRTZ_NURSERYAGE of them. 0 disables the nursery.
+#ifndef QRTZ_NURSERYSIZE
+#define QRTZ_NURSERYSIZE (256 * 1024)
+#endif
+
+// size of each of the 2 survivor spaces
+#ifndef QRTZ_SURVIVORSIZE
+#define QRTZ_SURVIVORSIZE (32 * 1024)
+#endif
+
+#ifndef QRTZ_NURSERYAGE
+#define QRTZ_NURSERYAGE 2
+#endif
+
+// objects bigger than this always go in the old generation
+#ifndef QRTZ_NURSERYOBJMAX
+#define QRTZ_NURSERYOBJMAX 1024
+#endif
+
+// Small old objects are grouped by size in pages of this many bytes.
+// Must hold at least a few of the biggest size class, which is 256 bytes,
+// and be at most 512K, as objects store their offset in their page in 16 bits.
+#ifndef QRTZ_PAGESIZE
+#define QRTZ_PAGESIZE (16 * 1024)
+#endif
+
+// heaps smaller than this, in bytes, are always marked on 1 thread, as starting more would take longer
+#ifndef QRTZ_PARALLELMARKMIN
+#define QRTZ_PARALLELMARKMIN (8 * 1024 * 1024)
+#endif
+
+// qrtz_compact empties pages which are less than this percent full
+#ifndef QRTZ_COMPACTMAX
+#define QRTZ_COMPACTMAX 50
+#endif
+
+// arenas get memory from their parent context in blocks of this many bytes, or bigger ones if needed
+#ifndef QRTZ_ARENABLOCK
+#define QRTZ_ARENABLOCK (64 * 1024)
+#endif
+
+// Allocations up to this many bytes come from a slab's pools, bigger ones straight from its parent.
+// By default, the GC's pages fit. At most 16MB.
+#ifndef QRTZ_SLABMAX
+#define QRTZ_SLABMAX QRTZ_PAGESIZE
+#endif
+
+// slabs get memory from their parent context in chunks of this many bytes
+#ifndef QRTZ_SLABCHUNK
+#define QRTZ_SLABCHUNK (256 * 1024)
+#endif
+
+// allocation profiles keep at most this many of the innermost frames of each call stack
+#ifndef QRTZ_PROFILEDEPTH
+#define QRTZ_PROFILEDEPTH 64
+#endif
+
+// enough size classes for the biggest QRTZ_SLABMAX
+#define QRTZ_SLABCLASSES 32
+
+// strings up to this length are interned, making them unique per VM
+#ifndef QRTZ_INTERNLIMIT
+#define QRTZ_INTERNLIMIT 40
+#endif
+
+// record types with more fields than this index them with a map, instead of scanning them
+#ifndef QRTZ_RECSCANMAX
+#define QRTZ_RECSCANMAX 8
+#endif
+
+// concatenations shorter than this are copied, longer ones make ropes
+#ifndef QRTZ_ROPEMIN
+#define QRTZ_ROPEMIN 64
+#endif
+
+// ropes deeper than this are rebalanced
+#ifndef QRTZ_ROPEMAXDEPTH
+#define QRTZ_ROPEMAXDEPTH 48
+#endif
+
+// substrings shorter than this are copied, longer ones reference the original string
+#ifndef QRTZ_SLICEMIN
+#define QRTZ_SLICEMIN 32
+#endif
+
+// when only substrings keep a string alive, the GC copies out the substrings which are
+// this many times smaller than it, so they do not keep it alive
+#ifndef QRTZ_SLICECOMPACT
+#define QRTZ_SLICECOMPACT 4
+#endif
+
 // pass as a stack index to use other values
 typedef enum qrtz_SpecialIndex {
 	// registry map
@@ -47,11 +166,59 @@ typedef enum qrtz_SpecialIndex {
 // oldSize is passed in so bookkeeping need not necessarily be done.
 typedef void *qrtz_Alloc(void *data, void *memory, size_t oldSize, size_t newSize);
 
+// Frees everything qrtz_Alloc gave out at once.
+typedef void qrtz_FreeAll(void *data);
+
+// Returns the time in seconds, from any fixed point.
+typedef double qrtz_Clock(void *data);
+
+// Runs fn(arg) on a new thread, returning what qrtz_ThreadJoin takes, or NULL if it can't.
+typedef void *qrtz_ThreadStart(void *data, void fn(void *arg), void *arg);
+// Waits for a thread started by qrtz_ThreadStart to return.
+typedef void qrtz_ThreadJoin(void *data, void *thread);
+
 typedef struct qrtz_Context {
 	void *data;
 	qrtz_Alloc *alloc;
+	// Optional, NULL by default, in which case the VM never uses other threads.
+	// If set, the GC can mark and sweep on other threads, and alloc may then be called from them concurrently.
+	qrtz_ThreadStart *threadStart;
+	qrtz_ThreadJoin *threadJoin;
+	// Used by the GC to pace itself. Without the C library, this is NULL by default,
+	// in which case pause targets do nothing.
+	qrtz_Clock *clock;
+	// Optional, NULL by default. If set, destroying a VM frees its memory with it, instead of one
+	// allocation at a time, so the context must not be shared with anything else.
+	qrtz_FreeAll *freeAll;
 } qrtz_Context;
 
+// A context which hands out memory by bumping a pointer through big blocks, and never frees
+// anything on its own, besides the last allocation. Everything goes at once when the VM is destroyed.
+// Memory the VM frees while running is not reused, so it is best for short-lived VMs.
+typedef struct qrtz_Arena {
+	// where blocks come from, and go back to
+	qrtz_Context parent;
+	// the newest block, which links to older ones
+	struct qrtz_Block *blocks;
+	// the free part of the block allocations are bumped through
+	char *top;
+	char *end;
+} qrtz_Arena;
+
+// A context which keeps blocks of a few sizes around once freed, in a list per size, so most
+// allocations are popping a list. Blocks are never given back to the parent until the slab is freed.
+typedef struct qrtz_Slab {
+	qrtz_Context parent;
+	// free blocks of each size class, linked through their first word
+	void *free[QRTZ_SLABCLASSES];
+	// the newest chunk, which new blocks are cut from, and links to older ones
+	struct qrtz_Block *chunks;
+	char *top;
+	char *end;
+	// guards all of the above, as threads the parent lets the GC start can allocate too
+	bool lock;
+} qrtz_Slab;
+
 typedef enum qrtz_Type {
 	// null
 	QRTZ_TNULL,
@@ -100,6 +267,21 @@ typedef enum qrtz_Exit {
 
 typedef qrtz_Exit qrtz_CFunction(qrtz_VM *vm, size_t argc);
 
+// called once an external string is collected, to release its memory
+typedef void qrtz_StringRelease(void *userdata, const char *str, size_t len);
+
+// Called with the pointer of a userdata once it is collected, after the collector is done.
+// It must not use the VM, as it also runs while the VM is being destroyed.
+typedef void qrtz_Finalizer(void *userdata, void *pointer);
+
+typedef enum qrtz_WeakFlags {
+	// Keys do not keep their entry alive. Their values are only kept alive by the map
+	// while the key is reachable some other way.
+	QRTZ_WEAK_KEYS = 1<<0,
+	// values do not keep their entry alive
+	QRTZ_WEAK_VALUES = 1<<1,
+} qrtz_WeakFlags;
+
 typedef enum qrtz_CallFlags {
 	// Does not push return value
 	QRTZ_CALL_STATIC = 1<<0,
@@ -168,22 +350,57 @@ size_t qrtz_sizeofContext();
 
 // load the default context
 void qrtz_initContext(qrtz_Context *ctx);
+// Loads a context which allocates from an arena, which gets its blocks from parent.
+// Destroying the VM gives them back to it, but one, which the next VM using the arena reuses.
+// The arena is not thread safe, so the context never starts threads.
+void qrtz_initArenaContext(qrtz_Context *ctx, qrtz_Arena *arena, qrtz_Context *parent);
+// gives every block of an arena back to its parent
+void qrtz_freeArena(qrtz_Arena *arena);
+// Loads a context which allocates from a slab, which gets its chunks from parent, and starts threads
+// and reads the clock with it. Allocations of up to QRTZ_SLABMAX bytes are rounded up to one of the
+// slab's size classes, so it relies on the old size qrtz_Alloc is passed.
+void qrtz_initSlabContext(qrtz_Context *ctx, qrtz_Slab *slab, qrtz_Context *parent);
+// Gives every chunk of a slab back to its parent. No VM may be using it anymore.
+void qrtz_freeSlab(qrtz_Slab *slab);
 
 // create a new instance of a VM, using a specific context.
 qrtz_VM *qrtz_create(qrtz_Context *ctx);
 // destroy a VM instance.
 void qrtz_destroy(qrtz_VM *vm);
 qrtz_Context *qrtz_contextOf(qrtz_VM *vm);
+// Creates a VM using ctx which is a copy of vm, objects and all, which is much faster than setting up another one again.
+// The copy has the same GC settings, and the same reset point. If vm is in the middle of a GC cycle, the cycle is finished first.
+// Userdata keep their pointers, and only the original calls finalizers on its own userdata, while those made by the copy
+// get them like they would in vm. Pins and allocation samples are not copied. Returns NULL if it runs out of memory.
+qrtz_VM *qrtz_clone(qrtz_VM *vm, qrtz_Context *ctx);
+// Makes qrtz_reset go back to the globals, registry and loaded modules there are now, such as once libraries are loaded.
+// Without a reset point, qrtz_reset empties them, like they are after qrtz_create.
+// If it runs out of memory, there is no reset point anymore.
+qrtz_Exit qrtz_setResetPoint(qrtz_VM *vm);
+// Returns the VM to the reset point, which is much cheaper than destroying it and creating another.
+// The main task gets an empty stack, other tasks and pins are dropped, and everything else allocated since is garbage,
+// which young collections free right away, and the rest of it is left to the collector, unless qrtz_gc is called.
+// The stacks and maps keep their capacity, and finalizers and GC settings are kept as well.
+// Values the reset point refers to are kept as they are, so changes made inside modules are not undone.
+// Maps too small for what they go back to are grown first; if that runs out of memory, the VM is left unchanged.
+qrtz_Exit qrtz_reset(qrtz_VM *vm);
 
 // basic API
 
 // pushes an integer on the stack.
+// With QUARTZ_NANBOX, ints are 48 bits, and ones which don't fit are pushed as floats instead.
 qrtz_Exit qrtz_pushint(qrtz_VM *vm, intptr_t n);
 qrtz_Exit qrtz_pushnumber(qrtz_VM *vm, double n);
 qrtz_Exit qrtz_pushstring(qrtz_VM *vm, const char *str);
 qrtz_Exit qrtz_pushlstring(qrtz_VM *vm, const char *str, size_t len);
 qrtz_Exit qrtz_pushfstring(qrtz_VM *vm, const char *fmt, ...);
 qrtz_Exit qrtz_vpushfstring(qrtz_VM *vm, const char *fmt, va_list args); 
+// pushes a string referencing host memory, without copying it.
+// str must stay valid and unchanged until release is called, which happens once
+// the string is collected. release may be NULL.
+// Strings short enough to be stored inline are copied, and released immediately.
+// If this fails, release is not called, and the memory is still owned by the host.
+qrtz_Exit qrtz_pushexternstring(qrtz_VM *vm, const char *str, size_t len, qrtz_StringRelease *release, void *userdata);
 qrtz_Exit qrtz_pushglobal(qrtz_VM *vm, const char *name);
 qrtz_Exit qrtz_pushcfunction(qrtz_VM *vm, qrtz_CFunction *f);
 // pushes a C closure with a certain amount of upvalues available.
@@ -207,6 +424,13 @@ qrtz_Exit qrtz_pushstackarray(qrtz_VM *vm, size_t len, size_t cap);
 qrtz_Exit qrtz_pushmap(qrtz_VM *vm, size_t len, size_t cap);
 // pushes the value at an index.
 qrtz_Exit qrtz_pushvalue(qrtz_VM *vm, int idx);
+// pops n values and pushes them concatenated as a string.
+// Values which are not strings are converted first.
+// This is cheap even for very long strings, as the bytes are only copied when needed.
+qrtz_Exit qrtz_concat(qrtz_VM *vm, size_t n);
+// pushes len bytes of the string at idx, starting at start.
+// This does not copy the bytes, unless the substring is short.
+qrtz_Exit qrtz_pushsubstring(qrtz_VM *vm, int idx, size_t start, size_t len);
 // pushes a pointer to a value.
 // This does not work on special indexes like QRTZ_IDXGLOBAL.
 qrtz_Exit qrtz_pushpointer(qrtz_VM *vm, int idx);
@@ -214,6 +438,7 @@ qrtz_Exit qrtz_pushpointer(qrtz_VM *vm, int idx);
 // type is copied.
 // It will also pop [associated] values, storing them as an array
 // of associated values.
+// If its type has a finalizer, it is called with pointer once the userdata is collected.
 qrtz_Exit qrtz_pushuserdata(qrtz_VM *vm, void *pointer, const char *type, size_t associated);
 // pushes an instance of the Result record.
 // isError determines if it is an instance of Ok, or an instance of Error.
@@ -348,11 +573,36 @@ qrtz_Exit qrtz_openbuffers(qrtz_VM *vm);
 
 // Memory-related stuff
 
+// Allocating never collects by itself. The collector, and finalizers, only run at safe points, which are
+// API calls that may allocate objects, such as the qrtz_push* functions, qrtz_concat and qrtz_pin,
+// along with qrtz_reset and the calls below which collect on purpose.
+// Memory can go over the target until the next one, so native code which does a lot of work without
+// going through one can call qrtz_safepoint now and then.
+
 // returns the amount of memory owned by this value
 // this is O(1), as it is not recursive
 size_t qrtz_memsizeof(qrtz_VM *vm, int val);
-// run a full stop-the-world GC cycle
+// Does whatever collecting is due, like any other safe point, and runs pending finalizers.
+void qrtz_safepoint(qrtz_VM *vm);
+// run a full stop-the-world GC cycle.
+// If an incremental cycle is in progress, it is finished first.
 void qrtz_gc(qrtz_VM *vm);
+// Runs a full GC cycle, then moves objects out of pages which are mostly empty, so those can be freed.
+// Meant to be called now and then by long-running hosts, to keep memory proportional to what is live.
+// Pinned objects, and strings whose bytes were returned by qrtz_tostring or qrtz_tolstring, never move.
+void qrtz_compact(qrtz_VM *vm);
+// Pins the object at idx, which keeps it alive, and at the same address, until it is unpinned.
+// Every pin needs its own qrtz_unpin. Values which are not objects are left alone.
+qrtz_Exit qrtz_pin(qrtz_VM *vm, int idx);
+// Removes a pin from the object at idx. Returns QRTZ_ERUNTIME if it was not pinned.
+qrtz_Exit qrtz_unpin(qrtz_VM *vm, int idx);
+// Makes the map at idx hold its keys, values or both weakly, or strongly again with 0.
+// Entries are removed once what they hold weakly is collected, which only major cycles do.
+// Strings, and values which are not objects, are always held strongly, as an equal one can always be made.
+qrtz_Exit qrtz_setweak(qrtz_VM *vm, int idx, qrtz_WeakFlags flags);
+// Sets the finalizer of a userdata type, or removes it if finalizer is NULL.
+// Only userdata pushed afterwards use it. Every one left once the VM is destroyed is finalized then.
+qrtz_Exit qrtz_setfinalizer(qrtz_VM *vm, const char *type, qrtz_Finalizer *finalizer, void *userdata);
 // gets the amount of bytes allocated by the VM.
 size_t qrtz_getMemoryUsage(qrtz_VM *vm);
 // Gets the current memory target.
@@ -362,8 +612,71 @@ size_t qrtz_getMemoryTarget(qrtz_VM *vm);
 void qrtz_setMemoryTarget(qrtz_VM *vm, size_t target);
 // sets the ratio for determining new memory targets.
 // Effectively, the formula is
-// target = current * (1 + pause / 100).
+// target = live * (1 + pause / 100),
+// where live is the memory the last cycle found in use.
 // This means a pause of 100 will wait for memory usage to double.
 void qrtz_setGCPause(qrtz_VM *vm, double pause);
+// Sets the longest pause the GC aims for, in seconds, or turns the pacer off with 0, the default.
+// The pacer measures how fast objects are marked and memory is allocated, and from those picks the
+// step size, how much work steps do, and how early cycles start, so they are done before memory
+// reaches the next target. It overrides qrtz_setGCStepSize, and cycles which fit in one pause are
+// done stop-the-world. Only incremental steps are kept under the target, finishing marking is not.
+void qrtz_setGCPauseTarget(qrtz_VM *vm, double seconds);
+// Sets a soft limit on memory usage, or removes it with 0, the default.
+// Memory targets are kept under it, so cycles come more often, and steps do more work, as memory
+// gets close to it. Memory goes over it instead of collecting more than QRTZ_GCMAXCPU percent of the time.
+void qrtz_setMemoryLimit(qrtz_VM *vm, size_t limit);
+// Sets how many bytes are allocated between incremental GC steps.
+// Smaller steps mean shorter pauses, but more of them.
+// 0 disables incremental collection, making every cycle stop-the-world.
+void qrtz_setGCStepSize(qrtz_VM *vm, size_t stepSize);
+// Sets how much work each incremental step does, as a percentage of the step size.
+// The collector must outpace allocation, so this should be above 100.
+void qrtz_setGCStepMul(qrtz_VM *vm, double stepMul);
+// Sets how many threads, the calling one included, may mark at once when a cycle finishes.
+// This defaults to 1, and only does anything if the context can start threads.
+// Marking is only split across threads for heaps of at least QRTZ_PARALLELMARKMIN bytes.
+void qrtz_setGCThreads(qrtz_VM *vm, size_t threads);
+// Lets a thread started by the context sweep while the VM keeps running, once a cycle
+// which was not started by qrtz_gc is done marking. Off by default.
+void qrtz_setGCBackgroundSweep(qrtz_VM *vm, bool enabled);
+
+// how many buckets pause times are counted in, see qrtz_GCStats
+#define QRTZ_GCPAUSEBUCKETS 20
+// how many kinds of objects live objects are counted by, see qrtz_gcKindName
+#define QRTZ_GCKINDS 12
+
+typedef struct qrtz_GCStats {
+	// major cycles which finished marking, and minor collections
+	size_t cycles;
+	size_t minorCycles;
+	// Time spent in the collector, in seconds, from the calls which ran it.
+	// Pauses are only timed if the context has a clock.
+	double totalPause;
+	double maxPause;
+	// pauses[i] counts pauses under 2^i microseconds, and the last bucket all the longer ones
+	size_t pauses[QRTZ_GCPAUSEBUCKETS];
+	// Bytes of objects allocated and freed so far, not counting what they own, like the items of an array.
+	// Moving an object counts as both.
+	size_t allocated;
+	size_t freed;
+	// Objects the last major cycle found alive, by kind, and the memory they own, as qrtz_memsizeof counts it.
+	size_t liveCount[QRTZ_GCKINDS];
+	size_t liveBytes[QRTZ_GCKINDS];
+} qrtz_GCStats;
+
+// Gets what the GC counted so far. Counting is always on, and costs next to nothing.
+void qrtz_getGCStats(qrtz_VM *vm, qrtz_GCStats *stats);
+// the name of a kind of object, from 0 to QRTZ_GCKINDS - 1
+const char *qrtz_gcKindName(size_t kind);
+
+// Starts sampling allocated objects, about one every rate bytes, or stops with 0, which is the default.
+// A sample records the call stack and the kind of object. While stopped, allocating only does one more addition and comparison.
+void qrtz_setAllocProfile(qrtz_VM *vm, size_t rate);
+// Writes the samples in the collapsed stack format flame graph tools read: one line per call stack and kind of object,
+// with the frames from the outermost one and then the kind separated by ';', then a space and the estimated bytes.
+qrtz_Exit qrtz_writeAllocProfile(qrtz_VM *vm, qrtz_Buffer *buf);
+// forgets every sample taken so far
+void qrtz_clearAllocProfile(qrtz_VM *vm);
 
 #endif
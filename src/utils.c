@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include "quartz.h"
 #include "common.h"
+#include "value.h"
 
 #define STB_SPRINTF_IMPLEMENTATION
 #include "stb_sprintf.h"
@@ -9,12 +10,270 @@
 #ifndef QUARTZ_NOLIBC
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define QRTZ_WORDWIDE
+// unaligned word loads/stores. These are inlined, they never call into libc.
+#define QRTZ_LOADWORD(w, p) __builtin_memcpy(&(w), (p), sizeof(size_t))
+#define QRTZ_STOREWORD(p, w) __builtin_memcpy((p), &(w), sizeof(size_t))
+#define QRTZ_CTZ(x) __builtin_ctz(x)
+#endif
+
+#if defined(QRTZ_WORDWIDE) && defined(__x86_64__) && !defined(QUARTZ_NOSIMD)
+#define QRTZ_X86SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
+// strlen reads whole aligned words past the terminator, which can't fault
+// since they never cross a page, but ASan does not know that.
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define QRTZ_NOASAN __attribute__((no_sanitize("address")))
+#endif
+#endif
+#if !defined(QRTZ_NOASAN) && defined(__SANITIZE_ADDRESS__)
+#define QRTZ_NOASAN __attribute__((no_sanitize_address))
+#endif
+#ifndef QRTZ_NOASAN
+#define QRTZ_NOASAN
+#endif
+
+// below this, the setup of the wide versions costs more than it saves
+#define QRTZ_SMALLMEM 16
+
+#ifdef QRTZ_X86SIMD
+
+typedef enum qrtz_SimdLevel {
+	QRTZ_SIMD_UNKNOWN = 0,
+	QRTZ_SIMD_SSE2,
+	QRTZ_SIMD_AVX2,
+} qrtz_SimdLevel;
+
+// Detected once, on first use. Racing threads all store the same value.
+static qrtz_SimdLevel qrtz_simdLevel = QRTZ_SIMD_UNKNOWN;
+
+static qrtz_SimdLevel qrtz_detectSimd() {
+	unsigned int a, b, c, d;
+	// SSE2 is part of x86-64
+	qrtz_SimdLevel level = QRTZ_SIMD_SSE2;
+#ifdef QUARTZ_NOAVX2
+	return level;
+#endif
+	if(!__get_cpuid(1, &a, &b, &c, &d)) return level;
+	// the OS must save the YMM registers (OSXSAVE + XCR0 bits 1 and 2)
+	if((c & bit_OSXSAVE) == 0) return level;
+	unsigned int xlo, xhi;
+	__asm__ volatile("xgetbv" : "=a"(xlo), "=d"(xhi) : "c"(0));
+	(void)xhi;
+	if((xlo & 6) != 6) return level;
+	if(!__get_cpuid_count(7, 0, &a, &b, &c, &d)) return level;
+	if(b & bit_AVX2) level = QRTZ_SIMD_AVX2;
+	return level;
+}
+
+static qrtz_SimdLevel qrtz_getSimdLevel() {
+	qrtz_SimdLevel level = __atomic_load_n(&qrtz_simdLevel, __ATOMIC_RELAXED);
+	if(level == QRTZ_SIMD_UNKNOWN) {
+		level = qrtz_detectSimd();
+		__atomic_store_n(&qrtz_simdLevel, level, __ATOMIC_RELAXED);
+	}
+	return level;
+}
+
+#endif
+
+#ifdef QRTZ_WORDWIDE
+
+#define QRTZ_ONES ((size_t)-1 / 0xFF)
+#define QRTZ_HIGHS (QRTZ_ONES * 0x80)
+#define QRTZ_HASZERO(w) (((w) - QRTZ_ONES) & ~(w) & QRTZ_HIGHS)
+
+static void qrtz_memcpyWord(char *d, const char *s, size_t len) {
+	size_t i = 0;
+	for(; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+		size_t w;
+		QRTZ_LOADWORD(w, s + i);
+		QRTZ_STOREWORD(d + i, w);
+	}
+	for(; i < len; i++) d[i] = s[i];
+}
+
+static void qrtz_memsetWord(char *d, char c, size_t len) {
+	size_t w = QRTZ_ONES * (unsigned char)c;
+	size_t i = 0;
+	for(; i + sizeof(size_t) <= len; i += sizeof(size_t)) QRTZ_STOREWORD(d + i, w);
+	for(; i < len; i++) d[i] = c;
+}
+
+static int qrtz_memcmpWord(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t i = 0;
+	for(; i + sizeof(size_t) <= len; i += sizeof(size_t)) {
+		size_t wa, wb;
+		QRTZ_LOADWORD(wa, a + i);
+		QRTZ_LOADWORD(wb, b + i);
+		// the byte loop below finds which byte differs
+		if(wa != wb) break;
+	}
+	for(; i < len; i++) {
+		if(a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+static QRTZ_NOASAN size_t qrtz_strlenWord(const char *s) {
+	const char *p = s;
+	while((uintptr_t)p % sizeof(size_t) != 0) {
+		if(*p == '\0') return p - s;
+		p++;
+	}
+	while(true) {
+		size_t w;
+		QRTZ_LOADWORD(w, p);
+		if(QRTZ_HASZERO(w)) break;
+		p += sizeof(size_t);
+	}
+	while(*p) p++;
+	return p - s;
+}
+
+#endif
+
+#ifdef QRTZ_X86SIMD
+
+// The copy loops overlap the last vector with the one before it,
+// so the tail never needs a scalar loop. They all require len >= the vector size.
+
+static void qrtz_memcpySSE2(char *d, const char *s, size_t len) {
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16) {
+		_mm_storeu_si128((__m128i *)(d + i), _mm_loadu_si128((const __m128i *)(s + i)));
+	}
+	if(i < len) {
+		_mm_storeu_si128((__m128i *)(d + len - 16), _mm_loadu_si128((const __m128i *)(s + len - 16)));
+	}
+}
+
+static void qrtz_memsetSSE2(char *d, char c, size_t len) {
+	__m128i v = _mm_set1_epi8(c);
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16) _mm_storeu_si128((__m128i *)(d + i), v);
+	if(i < len) _mm_storeu_si128((__m128i *)(d + len - 16), v);
+}
+
+static int qrtz_memcmpSSE2(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		unsigned int eq = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if(eq != 0xFFFF) {
+			size_t at = i + QRTZ_CTZ(~eq);
+			return a[at] < b[at] ? -1 : 1;
+		}
+	}
+	for(; i < len; i++) {
+		if(a[i] != b[i]) return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+static QRTZ_NOASAN size_t qrtz_strlenSSE2(const char *s) {
+	// aligned loads never cross into another page
+	uintptr_t misalign = (uintptr_t)s % 16;
+	const char *p = s - misalign;
+	__m128i zero = _mm_setzero_si128();
+	unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+	// ignore the bytes before the start of the string
+	mask >>= misalign;
+	if(mask != 0) return QRTZ_CTZ(mask);
+	while(true) {
+		p += 16;
+		mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_load_si128((const __m128i *)p), zero));
+		if(mask != 0) return (p - s) + QRTZ_CTZ(mask);
+	}
+}
+
+__attribute__((target("avx2")))
+static void qrtz_memcpyAVX2(char *d, const char *s, size_t len) {
+	if(len < 32) {
+		qrtz_memcpySSE2(d, s, len);
+		return;
+	}
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32) {
+		_mm256_storeu_si256((__m256i *)(d + i), _mm256_loadu_si256((const __m256i *)(s + i)));
+	}
+	if(i < len) {
+		_mm256_storeu_si256((__m256i *)(d + len - 32), _mm256_loadu_si256((const __m256i *)(s + len - 32)));
+	}
+}
+
+__attribute__((target("avx2")))
+static void qrtz_memsetAVX2(char *d, char c, size_t len) {
+	if(len < 32) {
+		qrtz_memsetSSE2(d, c, len);
+		return;
+	}
+	__m256i v = _mm256_set1_epi8(c);
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32) _mm256_storeu_si256((__m256i *)(d + i), v);
+	if(i < len) _mm256_storeu_si256((__m256i *)(d + len - 32), v);
+}
+
+__attribute__((target("avx2")))
+static int qrtz_memcmpAVX2(const unsigned char *a, const unsigned char *b, size_t len) {
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+		unsigned int eq = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if(eq != 0xFFFFFFFFu) {
+			size_t at = i + QRTZ_CTZ(~eq);
+			return a[at] < b[at] ? -1 : 1;
+		}
+	}
+	return qrtz_memcmpSSE2(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static QRTZ_NOASAN size_t qrtz_strlenAVX2(const char *s) {
+	uintptr_t misalign = (uintptr_t)s % 32;
+	const char *p = s - misalign;
+	__m256i zero = _mm256_setzero_si256();
+	unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+	mask >>= misalign;
+	if(mask != 0) return QRTZ_CTZ(mask);
+	while(true) {
+		p += 32;
+		mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_load_si256((const __m256i *)p), zero));
+		if(mask != 0) return (p - s) + QRTZ_CTZ(mask);
+	}
+}
+
 #endif
 
 size_t qrtz_strlen(const char *s) {
+#ifdef QRTZ_X86SIMD
+	switch(qrtz_getSimdLevel()) {
+	case QRTZ_SIMD_AVX2:
+		return qrtz_strlenAVX2(s);
+	case QRTZ_SIMD_SSE2:
+		return qrtz_strlenSSE2(s);
+	default:
+		break;
+	}
+#endif
+#ifdef QRTZ_WORDWIDE
+	return qrtz_strlenWord(s);
+#else
 	size_t len = 0;
 	while(s[len]) len++;
 	return len;
+#endif
 }
 
 char *qrtz_strdup(qrtz_Context *ctx, const char *s) {
@@ -35,7 +294,78 @@ void qrtz_memcpy(void *dest, const void *src, size_t len) {
 	char *destBytes = (char *)dest;
 	const char *srcBytes = (const char *)src;
 
+	if(len < QRTZ_SMALLMEM) {
+		for(size_t i = 0; i < len; i++) destBytes[i] = srcBytes[i];
+		return;
+	}
+#ifdef QRTZ_X86SIMD
+	switch(qrtz_getSimdLevel()) {
+	case QRTZ_SIMD_AVX2:
+		qrtz_memcpyAVX2(destBytes, srcBytes, len);
+		return;
+	case QRTZ_SIMD_SSE2:
+		qrtz_memcpySSE2(destBytes, srcBytes, len);
+		return;
+	default:
+		break;
+	}
+#endif
+#ifdef QRTZ_WORDWIDE
+	qrtz_memcpyWord(destBytes, srcBytes, len);
+#else
 	for(size_t i = 0; i < len; i++) destBytes[i] = srcBytes[i];
+#endif
+}
+
+void qrtz_memset(void *dest, char c, size_t len) {
+	char *destBytes = (char *)dest;
+
+	if(len < QRTZ_SMALLMEM) {
+		for(size_t i = 0; i < len; i++) destBytes[i] = c;
+		return;
+	}
+#ifdef QRTZ_X86SIMD
+	switch(qrtz_getSimdLevel()) {
+	case QRTZ_SIMD_AVX2:
+		qrtz_memsetAVX2(destBytes, c, len);
+		return;
+	case QRTZ_SIMD_SSE2:
+		qrtz_memsetSSE2(destBytes, c, len);
+		return;
+	default:
+		break;
+	}
+#endif
+#ifdef QRTZ_WORDWIDE
+	qrtz_memsetWord(destBytes, c, len);
+#else
+	for(size_t i = 0; i < len; i++) destBytes[i] = c;
+#endif
+}
+
+int qrtz_memcmp(const void *a, const void *b, size_t len) {
+	const unsigned char *aBytes = (const unsigned char *)a;
+	const unsigned char *bBytes = (const unsigned char *)b;
+
+	if(len >= QRTZ_SMALLMEM) {
+#ifdef QRTZ_X86SIMD
+		switch(qrtz_getSimdLevel()) {
+		case QRTZ_SIMD_AVX2:
+			return qrtz_memcmpAVX2(aBytes, bBytes, len);
+		case QRTZ_SIMD_SSE2:
+			return qrtz_memcmpSSE2(aBytes, bBytes, len);
+		default:
+			break;
+		}
+#endif
+#ifdef QRTZ_WORDWIDE
+		return qrtz_memcmpWord(aBytes, bBytes, len);
+#endif
+	}
+	for(size_t i = 0; i < len; i++) {
+		if(aBytes[i] != bBytes[i]) return aBytes[i] < bBytes[i] ? -1 : 1;
+	}
+	return 0;
 }
 
 size_t qrtz_sizeofContext() {
@@ -48,6 +378,7 @@ static void *qrtz_defaultAlloc(void *_, void *mem, size_t oldSize, size_t newSiz
 #ifdef QUARTZ_NOLIBC
 	(void)mem;
 	(void)newSize;
+	return NULL;
 #else
 	if(newSize == 0) {
 		free(mem);
@@ -58,9 +389,232 @@ static void *qrtz_defaultAlloc(void *_, void *mem, size_t oldSize, size_t newSiz
 #endif
 }
 
+#ifndef QUARTZ_NOLIBC
+static double qrtz_defaultClock(void *_) {
+	(void)_;
+	struct timespec ts;
+	timespec_get(&ts, TIME_UTC);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+#endif
+
 void qrtz_initContext(qrtz_Context *ctx) {
 	ctx->data = NULL;
 	ctx->alloc = qrtz_defaultAlloc;
+	ctx->threadStart = NULL;
+	ctx->threadJoin = NULL;
+#ifdef QUARTZ_NOLIBC
+	ctx->clock = NULL;
+#else
+	ctx->clock = qrtz_defaultClock;
+#endif
+	ctx->freeAll = NULL;
+}
+
+typedef struct qrtz_Block {
+	struct qrtz_Block *prev;
+	size_t size;
+} qrtz_Block;
+
+// everything is kept aligned to this, as the VM may put anything anywhere
+#define QRTZ_ARENAALIGN 16
+#define QRTZ_ARENAROUND(n) (((n) + QRTZ_ARENAALIGN - 1) / QRTZ_ARENAALIGN * QRTZ_ARENAALIGN)
+#define QRTZ_ARENAHEADER QRTZ_ARENAROUND(sizeof(qrtz_Block))
+
+// Makes room for size more bytes. Blocks too big for the usual size go behind the newest block,
+// so what is left of it can still be used.
+static char *qrtz_arenaBlock(qrtz_Arena *arena, size_t size) {
+	size_t blockSize = QRTZ_ARENAHEADER + size;
+	bool big = blockSize > QRTZ_ARENABLOCK;
+	if(!big) blockSize = QRTZ_ARENABLOCK;
+	qrtz_Block *block = qrtz_calloc(&arena->parent, blockSize);
+	if(block == NULL) return NULL;
+	block->size = blockSize;
+	char *start = (char *)block + QRTZ_ARENAHEADER;
+	if(big && arena->blocks != NULL) {
+		block->prev = arena->blocks->prev;
+		arena->blocks->prev = block;
+		return start;
+	}
+	block->prev = arena->blocks;
+	arena->blocks = block;
+	arena->top = start + size;
+	arena->end = (char *)block + blockSize;
+	return start;
+}
+
+static void *qrtz_arenaAlloc(void *data, void *memory, size_t oldSize, size_t newSize) {
+	qrtz_Arena *arena = data;
+	char *old = memory;
+	if(newSize > SIZE_MAX - QRTZ_ARENAHEADER - QRTZ_ARENAALIGN) return NULL;
+	newSize = QRTZ_ARENAROUND(newSize);
+	// the last allocation can shrink and grow in place, or be freed
+	bool last = old != NULL && old + QRTZ_ARENAROUND(oldSize) == arena->top;
+	if(last && newSize <= (size_t)(arena->end - old)) {
+		arena->top = old + newSize;
+		return newSize == 0 ? NULL : old;
+	}
+	if(newSize == 0) return NULL;
+	if(old != NULL && newSize <= QRTZ_ARENAROUND(oldSize)) return old;
+	char *p;
+	if(newSize <= (size_t)(arena->end - arena->top)) {
+		p = arena->top;
+		arena->top += newSize;
+	} else {
+		p = qrtz_arenaBlock(arena, newSize);
+		if(p == NULL) return NULL;
+	}
+	if(old != NULL) qrtz_memcpy(p, old, oldSize);
+	return p;
+}
+
+static void qrtz_freeBlocks(qrtz_Context *parent, qrtz_Block *block) {
+	while(block != NULL) {
+		qrtz_Block *prev = block->prev;
+		qrtz_cfree(parent, block, block->size);
+		block = prev;
+	}
+}
+
+// Frees every block but the newest, which is kept for the next VM, unless it is one of the big ones.
+// Blocks only stop being used once the VM is gone, so this is the one loop over them.
+static void qrtz_arenaFreeAll(void *data) {
+	qrtz_Arena *arena = data;
+	qrtz_Block *kept = arena->blocks;
+	if(kept != NULL && kept->size != QRTZ_ARENABLOCK) kept = NULL;
+	qrtz_freeBlocks(&arena->parent, kept == NULL ? arena->blocks : kept->prev);
+	arena->blocks = kept;
+	arena->top = NULL;
+	arena->end = NULL;
+	if(kept == NULL) return;
+	kept->prev = NULL;
+	arena->top = (char *)kept + QRTZ_ARENAHEADER;
+	arena->end = (char *)kept + kept->size;
+}
+
+void qrtz_initArenaContext(qrtz_Context *ctx, qrtz_Arena *arena, qrtz_Context *parent) {
+	arena->parent = *parent;
+	arena->blocks = NULL;
+	arena->top = NULL;
+	arena->end = NULL;
+	ctx->data = arena;
+	ctx->alloc = qrtz_arenaAlloc;
+	ctx->threadStart = NULL;
+	ctx->threadJoin = NULL;
+	ctx->clock = parent->clock;
+	ctx->freeAll = qrtz_arenaFreeAll;
+}
+
+void qrtz_freeArena(qrtz_Arena *arena) {
+	qrtz_freeBlocks(&arena->parent, arena->blocks);
+	arena->blocks = NULL;
+	arena->top = NULL;
+	arena->end = NULL;
+}
+
+// Sizes go up 16 bytes at a time until 256, then double.
+static size_t qrtz_slabClass(size_t size) {
+	if(size <= 256) return size <= 16 ? 0 : (size - 1) / 16;
+	size_t c = 16;
+	for(size_t classSize = 512; classSize < size; classSize *= 2) c++;
+	return c;
+}
+
+static size_t qrtz_slabClassSize(size_t c) {
+	return c < 16 ? (c + 1) * 16 : (size_t)512 << (c - 16);
+}
+
+#define QRTZ_SLABTOP qrtz_slabClass(QRTZ_SLABMAX)
+
+// the biggest class which fits in size bytes, which must be at least 16
+static size_t qrtz_slabFitClass(size_t size) {
+	size_t c = qrtz_slabClass(size);
+	if(qrtz_slabClassSize(c) > size) c--;
+	return c < QRTZ_SLABTOP ? c : QRTZ_SLABTOP;
+}
+
+// Takes a new chunk from the parent. What is left of the old one goes in the free lists, biggest blocks first.
+static bool qrtz_slabGrow(qrtz_Slab *slab) {
+	size_t chunkSize = QRTZ_ARENAHEADER + qrtz_slabClassSize(QRTZ_SLABTOP);
+	if(chunkSize < QRTZ_SLABCHUNK) chunkSize = QRTZ_SLABCHUNK;
+	qrtz_Block *chunk = qrtz_calloc(&slab->parent, chunkSize);
+	if(chunk == NULL) return false;
+	while((size_t)(slab->end - slab->top) >= 16) {
+		size_t c = qrtz_slabFitClass(slab->end - slab->top);
+		*(void **)slab->top = slab->free[c];
+		slab->free[c] = slab->top;
+		slab->top += qrtz_slabClassSize(c);
+	}
+	chunk->size = chunkSize;
+	chunk->prev = slab->chunks;
+	slab->chunks = chunk;
+	slab->top = (char *)chunk + QRTZ_ARENAHEADER;
+	slab->end = (char *)chunk + chunkSize;
+	return true;
+}
+
+static void *qrtz_slabGet(qrtz_Slab *slab, size_t size) {
+	size_t c = qrtz_slabClass(size);
+	size_t classSize = qrtz_slabClassSize(c);
+	qrtz_spinLock(&slab->lock);
+	void *p = slab->free[c];
+	if(p != NULL) {
+		slab->free[c] = *(void **)p;
+	} else if((size_t)(slab->end - slab->top) >= classSize || qrtz_slabGrow(slab)) {
+		p = slab->top;
+		slab->top += classSize;
+	}
+	qrtz_spinUnlock(&slab->lock);
+	return p;
+}
+
+static void qrtz_slabPut(qrtz_Slab *slab, void *memory, size_t size) {
+	size_t c = qrtz_slabClass(size);
+	qrtz_spinLock(&slab->lock);
+	*(void **)memory = slab->free[c];
+	slab->free[c] = memory;
+	qrtz_spinUnlock(&slab->lock);
+}
+
+// The size class of a block is found from the size it is freed with, so blocks need no header.
+static void *qrtz_slabAlloc(void *data, void *memory, size_t oldSize, size_t newSize) {
+	qrtz_Slab *slab = data;
+	qrtz_Context *parent = &slab->parent;
+	bool oldSmall = memory != NULL && oldSize <= QRTZ_SLABMAX;
+	bool newSmall = newSize != 0 && newSize <= QRTZ_SLABMAX;
+	if(!oldSmall && !newSmall) return parent->alloc(parent->data, memory, oldSize, newSize);
+	if(oldSmall && newSmall && qrtz_slabClass(oldSize) == qrtz_slabClass(newSize)) return memory;
+	void *p = NULL;
+	if(newSize != 0) {
+		p = newSmall ? qrtz_slabGet(slab, newSize) : qrtz_calloc(parent, newSize);
+		if(p == NULL) return NULL;
+	}
+	if(memory == NULL) return p;
+	if(p != NULL) qrtz_memcpy(p, memory, oldSize < newSize ? oldSize : newSize);
+	if(oldSmall) qrtz_slabPut(slab, memory, oldSize);
+	else qrtz_cfree(parent, memory, oldSize);
+	return p;
+}
+
+void qrtz_initSlabContext(qrtz_Context *ctx, qrtz_Slab *slab, qrtz_Context *parent) {
+	slab->parent = *parent;
+	for(size_t c = 0; c < QRTZ_SLABCLASSES; c++) slab->free[c] = NULL;
+	slab->chunks = NULL;
+	slab->top = NULL;
+	slab->end = NULL;
+	slab->lock = false;
+	*ctx = *parent;
+	ctx->data = slab;
+	ctx->alloc = qrtz_slabAlloc;
+	ctx->freeAll = NULL;
+}
+
+void qrtz_freeSlab(qrtz_Slab *slab) {
+	qrtz_freeBlocks(&slab->parent, slab->chunks);
+	for(size_t c = 0; c < QRTZ_SLABCLASSES; c++) slab->free[c] = NULL;
+	slab->chunks = NULL;
+	slab->top = NULL;
+	slab->end = NULL;
 }
 
 bool qrtz_sizeOverflows(size_t a, size_t b) {
@@ -126,7 +680,7 @@ char *qrtz_reserveBuf(qrtz_Buffer *buf, size_t amount) {
 		return mem;
 	}
 	size_t needed = buf->len + amount;
-	size_t capNeeded = buf->cap;
+	size_t capNeeded = buf->cap == 0 ? 16 : buf->cap;
 	while(capNeeded < needed) capNeeded *= 2;
 	if(capNeeded > buf->cap) {
 		char *newMem = qrtz_crealloc(buf->ctx, buf->buf, sizeof(char), buf->cap, capNeeded);
@@ -150,7 +704,7 @@ qrtz_Exit qrtz_putc(qrtz_Buffer *buf, char c) {
 qrtz_Exit qrtz_putcn(qrtz_Buffer *buf, char c, size_t rep) {
 	char *p = qrtz_reserveBuf(buf, rep);
 	if(p == NULL) return QRTZ_ENOMEM;
-	for(size_t i = 0; i < rep; i++) p[i] = c;
+	qrtz_memset(p, c, rep);
 	return QRTZ_OK;
 }
 
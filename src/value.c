@@ -4,13 +4,31 @@
 #include <math.h>
 #include "stb_sprintf.h"
 
+// SSE2 is part of x86-64, so maps use it without checking for it at runtime
+#if defined(__SSE2__) && !defined(QUARTZ_NOSIMD)
+#define QRTZ_MAPSSE2
+#include <emmintrin.h>
+#endif
+
+// unaligned little-endian load. Compilers turn this into a single load.
+static uint64_t qrtz_read64(const unsigned char *p) {
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24)
+		| ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static uint64_t qrtz_rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
 void *qrtz_alloc(qrtz_VM *vm, size_t len) {
 	vm->memUsage += len;
+	vm->gcAllocated += len;
 	return qrtz_calloc(&vm->ctx, len);
 }
 
 void *qrtz_allocArray(qrtz_VM *vm, size_t len, size_t count) {
 	vm->memUsage += len * count;
+	vm->gcAllocated += len * count;
 	return qrtz_callocArray(&vm->ctx, len, count);
 }
 
@@ -27,32 +45,430 @@ void qrtz_freeArray(qrtz_VM *vm, void *memory, size_t len, size_t count) {
 void *qrtz_realloc(qrtz_VM *vm, void *memory, size_t len, size_t oldCount, size_t newCount) {
 	vm->memUsage -= len * oldCount;
 	vm->memUsage += len * newCount;
+	if(newCount > oldCount) vm->gcAllocated += len * (newCount - oldCount);
 	return qrtz_crealloc(&vm->ctx, memory, len, oldCount, newCount);
 }
 
-qrtz_Object *qrtz_allocObject(qrtz_VM *vm, qrtz_ObjTag tag, size_t objSize) {
-	qrtz_Object *o = qrtz_alloc(vm, objSize);
+qrtz_Object *qrtz_allocOldObject(qrtz_VM *vm, qrtz_ObjTag tag, size_t objSize) {
+	qrtz_Object *o = qrtz_heapalloc(vm, objSize);
 	if(o == NULL) return NULL;
-	o->next = vm->heap;
-	o->nextGray = NULL;
 	o->tag = tag;
-	o->marked = false;
-	vm->heap = o;
+	vm->profileAllocated += objSize;
+	if(vm->profileAllocated >= vm->profileAt) qrtz_sampleAlloc(vm, tag, objSize);
+	// it may be initialized with references to young objects, which don't go through barriers
+	if(vm->nursery != NULL && vm->gcState == QRTZ_GCIDLE) qrtz_remember(vm, o);
 	return o;
 }
 
+// objects in the nursery must not own anything besides their own memory, as nothing frees them
+static bool qrtz_canBeYoung(qrtz_ObjTag tag) {
+	return tag == QRTZ_OSTR || tag == QRTZ_OARRAY || tag == QRTZ_OPOINTER || tag == QRTZ_ORECORD || tag == QRTZ_OCLOSURE;
+}
+
+qrtz_Object *qrtz_allocObject(qrtz_VM *vm, qrtz_ObjTag tag, size_t objSize) {
+	// stepping before linking it in, so the collector never sees it half-initialized
+	if(vm->gcState != QRTZ_GCIDLE && vm->gcAllocated >= vm->gcStepAt) qrtz_gcstep(vm);
+	if(vm->nursery != NULL && vm->gcState == QRTZ_GCIDLE && objSize <= QRTZ_NURSERYOBJMAX && qrtz_canBeYoung(tag)) {
+		size_t size = (objSize + QRTZ_NURSERYALIGN - 1) / QRTZ_NURSERYALIGN * QRTZ_NURSERYALIGN;
+		if((size_t)(vm->bumpEnd - vm->bump) >= size) {
+			qrtz_Object *o = (qrtz_Object *)vm->bump;
+			vm->bump += size;
+			vm->youngBytes += size;
+			vm->gcStats.allocated += size;
+			qrtz_memset(o, 0, size);
+			o->tag = tag;
+			vm->profileAllocated += size;
+			if(vm->profileAllocated >= vm->profileAt) qrtz_sampleAlloc(vm, tag, size);
+			return o;
+		}
+		// collections move objects, so they have to wait for a safe point
+		vm->minorPending = true;
+	}
+	return qrtz_allocOldObject(vm, tag, objSize);
+}
+
+static qrtz_String *qrtz_findInterned(qrtz_VM *vm, const char *data, size_t len, size_t hash) {
+	if(vm->stringsCap == 0) return NULL;
+	size_t mask = vm->stringsCap - 1;
+	size_t i = hash & mask;
+	while(vm->strings[i] != NULL) {
+		qrtz_String *s = vm->strings[i];
+		if(s->hash == hash && s->len == len && qrtz_memcmp(s->data, data, len) == 0) return s;
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+static void qrtz_insertInterned(qrtz_String **strings, size_t cap, qrtz_String *s) {
+	size_t mask = cap - 1;
+	size_t i = s->hash & mask;
+	while(strings[i] != NULL) i = (i + 1) & mask;
+	strings[i] = s;
+}
+
+// Adds a string to the intern table.
+// If the table can't grow, the string is simply not interned.
+static void qrtz_internString(qrtz_VM *vm, qrtz_String *s) {
+	if((vm->stringsLen + 1) * 4 > vm->stringsCap * 3) {
+		size_t newCap = vm->stringsCap == 0 ? 64 : vm->stringsCap * 2;
+		qrtz_String **newStrings = qrtz_allocArray(vm, sizeof(qrtz_String *), newCap);
+		if(newStrings == NULL) return;
+		for(size_t i = 0; i < newCap; i++) newStrings[i] = NULL;
+		for(size_t i = 0; i < vm->stringsCap; i++) {
+			if(vm->strings[i] != NULL) qrtz_insertInterned(newStrings, newCap, vm->strings[i]);
+		}
+		qrtz_freeArray(vm, vm->strings, sizeof(qrtz_String *), vm->stringsCap);
+		vm->strings = newStrings;
+		vm->stringsCap = newCap;
+	}
+	qrtz_insertInterned(vm->strings, vm->stringsCap, s);
+	vm->stringsLen++;
+	s->flags |= QRTZ_SINTERNED;
+}
+
+void qrtz_uninternString(qrtz_VM *vm, qrtz_String *s) {
+	if((s->flags & QRTZ_SINTERNED) == 0) return;
+	s->flags &= ~QRTZ_SINTERNED;
+	if(vm->stringsCap == 0) return;
+	size_t mask = vm->stringsCap - 1;
+	size_t i = s->hash & mask;
+	while(vm->strings[i] != s) {
+		if(vm->strings[i] == NULL) return;
+		i = (i + 1) & mask;
+	}
+	// backward-shift deletion, so we never need tombstones
+	size_t j = i;
+	while(true) {
+		j = (j + 1) & mask;
+		if(vm->strings[j] == NULL) break;
+		size_t home = vm->strings[j]->hash & mask;
+		// move it back if its home slot is not cyclically within (i, j]
+		bool inRange = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+		if(!inRange) {
+			vm->strings[i] = vm->strings[j];
+			i = j;
+		}
+	}
+	vm->strings[i] = NULL;
+	vm->stringsLen--;
+}
+
+void qrtz_sweepInterned(qrtz_VM *vm) {
+	size_t i = 0;
+	while(i < vm->stringsCap) {
+		qrtz_String *s = vm->strings[i];
+		// young ones are left to minor collections
+		if(s == NULL || QRTZ_ISYOUNG(vm, &s->obj) || qrtz_isMarked(&s->obj)) {
+			i++;
+			continue;
+		}
+		// this shifts later entries back into slot i, so it is checked again
+		qrtz_uninternString(vm, s);
+	}
+}
+
 qrtz_String *qrtz_allocStringObject(qrtz_VM *vm, const char *data, size_t len) {
+	size_t hash = 0;
+	bool intern = data != NULL && len <= QRTZ_INTERNLIMIT;
+	if(intern) {
+		hash = qrtz_strhash(data, len, vm->hashSeed);
+		qrtz_String *existing = qrtz_findInterned(vm, data, len, hash);
+		if(existing != NULL) return existing;
+	}
 	qrtz_String *s = (qrtz_String *)qrtz_allocObject(vm, QRTZ_OSTR, sizeof(qrtz_String) + len + 1);
 	if(s == NULL) return NULL;
 	s->len = len;
-	if(data != NULL) {
-		qrtz_memcpy(s->data, data, len);
-		s->hash = qrtz_strhash(data, len);
+	s->flags = 0;
+	if(data != NULL) qrtz_memcpy(s->data, data, len);
+	s->data[len] = '\0';
+	if(intern) {
+		s->hash = hash;
+		s->flags |= QRTZ_SHASHED;
+		if(!QRTZ_ISYOUNG(vm, &s->obj) || qrtz_trackYoungString(vm, s)) qrtz_internString(vm, s);
 	}
+	return s;
+}
+
+// Caches hold the bytes of their owner, and are allocated in the same generation,
+// so the bytes of old strings never move. They are never interned.
+static qrtz_String *qrtz_allocCacheString(qrtz_VM *vm, qrtz_String *owner, size_t len) {
+	size_t size = sizeof(qrtz_String) + len + 1;
+	qrtz_String *s;
+	if(QRTZ_ISYOUNG(vm, &owner->obj)) s = (qrtz_String *)qrtz_allocObject(vm, QRTZ_OSTR, size);
+	else s = (qrtz_String *)qrtz_allocOldObject(vm, QRTZ_OSTR, size);
+	if(s == NULL) return NULL;
+	s->len = len;
+	s->flags = 0;
 	s->data[len] = '\0';
 	return s;
 }
 
+// flattened ropes are just their flat copy
+static qrtz_String *qrtz_strunwrap(qrtz_String *s) {
+	if((s->flags & QRTZ_SROPE) == 0) return s;
+	qrtz_Rope *r = (qrtz_Rope *)s;
+	if(r->flat != NULL) return r->flat;
+	return s;
+}
+
+// the bytes of a string which is not a rope.
+// Only plain strings are guaranteed to be NUL-terminated.
+static const char *qrtz_leafdata(qrtz_String *s) {
+	if(s->flags & QRTZ_SEXTERN) return ((qrtz_ExternString *)s)->ptr;
+	if(s->flags & QRTZ_SSLICE) {
+		qrtz_SliceString *slice = (qrtz_SliceString *)s;
+		return qrtz_leafdata(slice->parent) + slice->offset;
+	}
+	return s->data;
+}
+
+static size_t qrtz_strdepth(qrtz_String *s) {
+	s = qrtz_strunwrap(s);
+	if((s->flags & QRTZ_SROPE) == 0) return 0;
+	return ((qrtz_Rope *)s)->depth;
+}
+
+static qrtz_String *qrtz_allocRopeObject(qrtz_VM *vm, qrtz_String *left, qrtz_String *right) {
+	qrtz_Rope *r = (qrtz_Rope *)qrtz_allocObject(vm, QRTZ_OSTR, sizeof(qrtz_Rope));
+	if(r == NULL) return NULL;
+	r->hash = 0;
+	r->len = left->len + right->len;
+	r->flags = QRTZ_SROPE;
+	r->left = left;
+	r->right = right;
+	r->flat = NULL;
+	size_t leftDepth = qrtz_strdepth(left), rightDepth = qrtz_strdepth(right);
+	r->depth = (leftDepth > rightDepth ? leftDepth : rightDepth) + 1;
+	return (qrtz_String *)r;
+}
+
+// copies the bytes of a rope into buf.
+// It recurses into the shallower child and loops on the deeper one, so even ropes which
+// could not be rebalanced do not overflow the C stack.
+static void qrtz_ropeCopy(qrtz_String *s, char *buf) {
+	while(true) {
+		s = qrtz_strunwrap(s);
+		if((s->flags & QRTZ_SROPE) == 0) break;
+		qrtz_Rope *r = (qrtz_Rope *)s;
+		if(qrtz_strdepth(r->left) > qrtz_strdepth(r->right)) {
+			qrtz_ropeCopy(r->right, buf + r->left->len);
+			s = r->left;
+		} else {
+			qrtz_ropeCopy(r->left, buf);
+			buf += r->left->len;
+			s = r->right;
+		}
+	}
+	qrtz_memcpy(buf, qrtz_leafdata(s), s->len);
+}
+
+const char *qrtz_strdata(qrtz_VM *vm, qrtz_String *s) {
+	if((s->flags & QRTZ_SROPE) == 0) return qrtz_leafdata(s);
+	qrtz_Rope *r = (qrtz_Rope *)s;
+	if(r->flat == NULL) {
+		qrtz_String *flat = qrtz_allocCacheString(vm, s, r->len);
+		if(flat == NULL) return NULL;
+		qrtz_ropeCopy(s, flat->data);
+		r->flat = flat;
+		qrtz_barrierobj(vm, &s->obj, &flat->obj);
+		// let the children die
+		r->left = NULL;
+		r->right = NULL;
+	}
+	return r->flat->data;
+}
+
+const char *qrtz_strcstr(qrtz_VM *vm, qrtz_String *s) {
+	qrtz_String **cstr;
+	if(s->flags & QRTZ_SEXTERN) {
+		cstr = &((qrtz_ExternString *)s)->cstr;
+	} else if(s->flags & QRTZ_SSLICE) {
+		cstr = &((qrtz_SliceString *)s)->cstr;
+	} else {
+		return qrtz_strdata(vm, s);
+	}
+	if(*cstr == NULL) {
+		*cstr = qrtz_allocCacheString(vm, s, s->len);
+		if(*cstr == NULL) return NULL;
+		qrtz_memcpy((*cstr)->data, qrtz_leafdata(s), s->len);
+		qrtz_barrierobj(vm, &s->obj, &(*cstr)->obj);
+	}
+	return (*cstr)->data;
+}
+
+// a and b must not be ropes
+static qrtz_String *qrtz_concatFlat(qrtz_VM *vm, qrtz_String *a, qrtz_String *b) {
+	size_t len = a->len + b->len;
+	if(len <= QRTZ_INTERNLIMIT) {
+		// build it on the stack so it gets interned
+		char buf[QRTZ_INTERNLIMIT];
+		qrtz_memcpy(buf, qrtz_leafdata(a), a->len);
+		qrtz_memcpy(buf + a->len, qrtz_leafdata(b), b->len);
+		return qrtz_allocStringObject(vm, buf, len);
+	}
+	qrtz_String *s = qrtz_allocStringObject(vm, NULL, len);
+	if(s == NULL) return NULL;
+	qrtz_memcpy(s->data, qrtz_leafdata(a), a->len);
+	qrtz_memcpy(s->data + a->len, qrtz_leafdata(b), b->len);
+	return s;
+}
+
+qrtz_String *qrtz_allocExternStringObject(qrtz_VM *vm, const char *str, size_t len, qrtz_StringRelease *release, void *userdata) {
+	// it has to be released once it dies, which the nursery can't do
+	qrtz_ExternString *e = (qrtz_ExternString *)qrtz_allocOldObject(vm, QRTZ_OSTR, sizeof(qrtz_ExternString));
+	if(e == NULL) return NULL;
+	e->hash = 0;
+	e->len = len;
+	e->flags = QRTZ_SEXTERN;
+	e->ptr = str;
+	e->release = release;
+	e->userdata = userdata;
+	e->cstr = NULL;
+	if(release != NULL) vm->externStrings++;
+	return (qrtz_String *)e;
+}
+
+// Rebalancing is the one from Boehm et al's "Ropes: an Alternative to Strings".
+// Ropes are inserted into a forest of balanced ropes, where slot i holds a rope
+// of at least qrtz_ropeMinLen(i) bytes, and the forest is concatenated back at the end.
+// Subtrees which are already balanced are inserted whole, so only the parts appended
+// since the last rebalance are walked.
+#define QRTZ_ROPEFOREST 90
+
+// fibonacci numbers, starting at 1, 2
+static size_t qrtz_ropeMinLen(size_t i) {
+	static size_t minLen[QRTZ_ROPEFOREST] = {0};
+	if(minLen[0] == 0) {
+		size_t a = 1, b = 2;
+		for(size_t j = 0; j < QRTZ_ROPEFOREST; j++) {
+			minLen[j] = a;
+			// saturate instead of overflowing on 32-bit
+			size_t c = a > SIZE_MAX - b ? SIZE_MAX : a + b;
+			a = b;
+			b = c;
+		}
+	}
+	return minLen[i];
+}
+
+static qrtz_String *qrtz_ropeJoin(qrtz_VM *vm, qrtz_String *left, qrtz_String *right) {
+	if(left == NULL) return right;
+	if(right == NULL) return left;
+	return qrtz_allocRopeObject(vm, left, right);
+}
+
+static bool qrtz_ropeAddLeaf(qrtz_VM *vm, qrtz_String **forest, qrtz_String *s) {
+	qrtz_String *insertee = NULL;
+	size_t i = 0;
+	// everything in smaller slots is to the left of s
+	for(; i < QRTZ_ROPEFOREST - 1 && s->len >= qrtz_ropeMinLen(i + 1); i++) {
+		if(forest[i] == NULL) continue;
+		insertee = qrtz_ropeJoin(vm, forest[i], insertee);
+		if(insertee == NULL) return false;
+		forest[i] = NULL;
+	}
+	insertee = qrtz_ropeJoin(vm, insertee, s);
+	if(insertee == NULL) return false;
+	for(;; i++) {
+		if(forest[i] != NULL) {
+			insertee = qrtz_ropeJoin(vm, forest[i], insertee);
+			if(insertee == NULL) return false;
+			forest[i] = NULL;
+		}
+		if(i == QRTZ_ROPEFOREST - 1 || insertee->len < qrtz_ropeMinLen(i + 1)) {
+			forest[i] = insertee;
+			return true;
+		}
+	}
+}
+
+static bool qrtz_ropeAddToForest(qrtz_VM *vm, qrtz_String **forest, qrtz_String *s) {
+	s = qrtz_strunwrap(s);
+	size_t depth = qrtz_strdepth(s);
+	if(depth == 0 || s->len >= qrtz_ropeMinLen(depth)) {
+		return qrtz_ropeAddLeaf(vm, forest, s);
+	}
+	qrtz_Rope *r = (qrtz_Rope *)s;
+	if(!qrtz_ropeAddToForest(vm, forest, r->left)) return false;
+	return qrtz_ropeAddToForest(vm, forest, r->right);
+}
+
+// if it runs out of memory, the unbalanced rope is returned as-is, as it is still valid.
+static qrtz_String *qrtz_rebalanceRope(qrtz_VM *vm, qrtz_String *s) {
+	qrtz_String *forest[QRTZ_ROPEFOREST] = {NULL};
+	if(!qrtz_ropeAddToForest(vm, forest, s)) return s;
+	qrtz_String *result = NULL;
+	for(size_t i = 0; i < QRTZ_ROPEFOREST; i++) {
+		if(forest[i] == NULL) continue;
+		result = qrtz_ropeJoin(vm, forest[i], result);
+		if(result == NULL) return s;
+	}
+	return result;
+}
+
+qrtz_String *qrtz_substringObject(qrtz_VM *vm, qrtz_String *s, size_t start, size_t len) {
+	if(start == 0 && len == s->len) return s;
+	const char *data = qrtz_strdata(vm, s);
+	if(data == NULL) return NULL;
+	if(len < QRTZ_SLICEMIN) return qrtz_allocStringObject(vm, data + start, len);
+	// point straight at the bytes, not at a chain of slices or ropes
+	s = qrtz_strunwrap(s);
+	if(s->flags & QRTZ_SSLICE) {
+		qrtz_SliceString *parentSlice = (qrtz_SliceString *)s;
+		start += parentSlice->offset;
+		s = parentSlice->parent;
+	}
+	qrtz_SliceString *slice = (qrtz_SliceString *)qrtz_allocObject(vm, QRTZ_OSTR, sizeof(qrtz_SliceString));
+	if(slice == NULL) return NULL;
+	slice->hash = 0;
+	slice->len = len;
+	slice->flags = QRTZ_SSLICE;
+	slice->parent = s;
+	slice->offset = start;
+	slice->cstr = NULL;
+	return (qrtz_String *)slice;
+}
+
+qrtz_String *qrtz_concatStringObjects(qrtz_VM *vm, qrtz_String *a, qrtz_String *b) {
+	a = qrtz_strunwrap(a);
+	b = qrtz_strunwrap(b);
+	if(a->len == 0) return b;
+	if(b->len == 0) return a;
+	if(a->len > SIZE_MAX - b->len) return NULL;
+	size_t len = a->len + b->len;
+	// ropes are never shorter than QRTZ_ROPEMIN
+	if(len < QRTZ_ROPEMIN) return qrtz_concatFlat(vm, a, b);
+	// Appending a short string to a rope ending in a short string merges the two,
+	// so building a string piece by piece does not make a leaf per piece.
+	if((a->flags & QRTZ_SROPE) && b->len < QRTZ_ROPEMIN) {
+		qrtz_Rope *r = (qrtz_Rope *)a;
+		qrtz_String *tail = qrtz_strunwrap(r->right);
+		if((tail->flags & QRTZ_SROPE) == 0 && tail->len + b->len < QRTZ_ROPEMIN) {
+			qrtz_String *merged = qrtz_concatFlat(vm, tail, b);
+			if(merged == NULL) return NULL;
+			a = qrtz_strunwrap(r->left);
+			b = merged;
+		}
+	}
+	qrtz_String *s = qrtz_allocRopeObject(vm, a, b);
+	if(s == NULL) return NULL;
+	if(qrtz_strdepth(s) > QRTZ_ROPEMAXDEPTH) return qrtz_rebalanceRope(vm, s);
+	return s;
+}
+
+qrtz_Value qrtz_strval(qrtz_String *s) {
+	s = qrtz_strunwrap(s);
+	// ropes are always longer
+	if(s->len <= QRTZ_SSTRMAX) return QRTZ_MKSSTR(qrtz_leafdata(s), s->len);
+	return QRTZ_MKOBJ(s);
+}
+
+qrtz_String *qrtz_strobj(qrtz_VM *vm, qrtz_Value val) {
+	if(QRTZ_VTAG(val) == QRTZ_VSSTR) return qrtz_allocStringObject(vm, QRTZ_SSTRDATA(&val), QRTZ_SSTRLEN(val));
+	if(!QRTZ_ISOBJ(val) || QRTZ_ASOBJ(val)->tag != QRTZ_OSTR) return NULL;
+	return (qrtz_String *)QRTZ_ASOBJ(val);
+}
+
 qrtz_Array *qrtz_allocArrayObject(qrtz_VM *vm, size_t cap) {
 	qrtz_Array *arr = (qrtz_Array *)qrtz_allocObject(vm, QRTZ_OARRAY, sizeof(qrtz_Array) + sizeof(qrtz_Value) * cap);
 	if(arr == NULL) return NULL;
@@ -61,30 +477,65 @@ qrtz_Array *qrtz_allocArrayObject(qrtz_VM *vm, size_t cap) {
 	return arr;
 }
 
+// the smallest capacity which can hold len entries
+static size_t qrtz_mapcapfor(size_t len) {
+	if(len == 0) return 0;
+	size_t cap = QRTZ_MAPGROUP;
+	while(cap / 8 * 7 < len) {
+		if(cap > SIZE_MAX / 2) return 0;
+		cap *= 2;
+	}
+	return cap;
+}
+
+// allocates the keys, values and control bytes of a map.
+// Returns false if out of memory.
+static bool qrtz_mapalloc(qrtz_VM *vm, qrtz_Map *map, size_t cap) {
+	map->used = 0;
+	map->len = 0;
+	map->cap = cap;
+	map->data = NULL;
+	map->ctrl = NULL;
+	if(cap == 0) return true;
+	size_t slotSize = sizeof(qrtz_Value) * 2 + 1;
+	if(qrtz_sizeOverflows(cap, slotSize)) return false;
+	qrtz_Value *backing = qrtz_alloc(vm, cap * slotSize);
+	if(backing == NULL) return false;
+	map->data = backing;
+	map->ctrl = (unsigned char *)(backing + cap * 2);
+	qrtz_memset(map->ctrl, QRTZ_CEMPTY, cap);
+	return true;
+}
+
+static void qrtz_mapfree(qrtz_VM *vm, qrtz_Value *data, size_t cap) {
+	if(cap == 0) return;
+	qrtz_free(vm, data, cap * (sizeof(qrtz_Value) * 2 + 1));
+}
+
+// cap is how many entries it should fit without growing
 qrtz_Map *qrtz_allocMapObject(qrtz_VM *vm, size_t cap) {
-	if(qrtz_sizeOverflows(cap, 2)) return NULL;
-	qrtz_Value *backing = qrtz_allocArray(vm, sizeof(qrtz_Value), cap * 2);
-	if(backing == NULL) return NULL;
+	size_t slots = qrtz_mapcapfor(cap);
+	if(cap != 0 && slots == 0) return NULL;
+	qrtz_Map tmp;
+	if(!qrtz_mapalloc(vm, &tmp, slots)) return NULL;
 	qrtz_Map *m = (qrtz_Map *)qrtz_allocObject(vm, QRTZ_OMAP, sizeof(qrtz_Map));
 	if(m == NULL) {
-		qrtz_freeArray(vm, backing, sizeof(qrtz_Value), cap * 2);
+		qrtz_mapfree(vm, tmp.data, slots);
 		return NULL;
 	}
-	m->used = 0;
-	m->len = 0;
-	m->cap = cap;
-	m->data = backing;
-	for(size_t i = 0; i < cap; i++) {
-		// mark keys as unallocated
-		m->data[i].tag = QRTZ_VILLEGAL;
-	}
+	m->used = tmp.used;
+	m->len = tmp.len;
+	m->cap = tmp.cap;
+	m->data = tmp.data;
+	m->ctrl = tmp.ctrl;
+	m->weak = 0;
 	return m;
 }
 
 qrtz_Pointer *qrtz_allocPointerObject(qrtz_VM *vm) {
 	qrtz_Pointer *p = (qrtz_Pointer *)qrtz_allocObject(vm, QRTZ_OPOINTER, sizeof(qrtz_Pointer));
 	if(p == NULL) return NULL;
-	p->val.tag = QRTZ_VNULL;
+	p->val = QRTZ_MKNULL();
 	return p;
 }
 
@@ -114,51 +565,425 @@ qrtz_Task *qrtz_allocTaskObject(qrtz_VM *vm, qrtz_Map *globals) {
 	t->deadline = 0;
 	t->checkcounter = 0;
 	t->checkinterval = 0;
-	t->error.tag = QRTZ_VILLEGAL;
+	t->error = QRTZ_MKILLEGAL();
 	return t;
 }
 
-static void qrtz_objfree(qrtz_VM *vm, qrtz_Object *obj) {
+// whether two of the fields have the same name, for types which scan their fields
+static bool qrtz_duplicateField(qrtz_VM *vm, const qrtz_Value *fields, size_t fieldCount) {
+	for(size_t i = 1; i < fieldCount; i++) {
+		for(size_t j = 0; j < i; j++) {
+			if(qrtz_valeq(vm, fields[i], fields[j])) return true;
+		}
+	}
+	return false;
+}
+
+qrtz_RecordType *qrtz_allocRecordTypeObject(qrtz_VM *vm, qrtz_String *name, const qrtz_Value *fields, size_t fieldCount) {
+	qrtz_Value *names = NULL;
+	if(fieldCount > 0) {
+		names = qrtz_allocArray(vm, sizeof(qrtz_Value), fieldCount);
+		if(names == NULL) return NULL;
+		for(size_t i = 0; i < fieldCount; i++) names[i] = fields[i];
+	}
+	qrtz_Map *index = NULL;
+	if(fieldCount > QRTZ_RECSCANMAX) {
+		// if this fails or finds a name twice, the index is just garbage
+		index = qrtz_allocMapObject(vm, fieldCount);
+		for(size_t i = 0; index != NULL && i < fieldCount; i++) {
+			qrtz_Value seen;
+			if(qrtz_mapget(vm, index, names[i], &seen)) index = NULL;
+			else if(qrtz_mapset(vm, index, names[i], QRTZ_MKINT(i))) index = NULL;
+		}
+	}
+	bool duplicate = fieldCount <= QRTZ_RECSCANMAX && qrtz_duplicateField(vm, names, fieldCount);
+	if(duplicate || (fieldCount > QRTZ_RECSCANMAX && index == NULL)) {
+		qrtz_freeArray(vm, names, sizeof(qrtz_Value), fieldCount);
+		return NULL;
+	}
+	qrtz_RecordType *ty = (qrtz_RecordType *)qrtz_allocObject(vm, QRTZ_ORECTYPE, sizeof(qrtz_RecordType));
+	if(ty == NULL) {
+		qrtz_freeArray(vm, names, sizeof(qrtz_Value), fieldCount);
+		return NULL;
+	}
+	ty->name = name;
+	ty->fieldCount = fieldCount;
+	ty->fields = names;
+	ty->fieldIndex = index;
+	return ty;
+}
+
+qrtz_Record *qrtz_allocRecordObject(qrtz_VM *vm, qrtz_RecordType *type) {
+	size_t n = type->fieldCount;
+	if(qrtz_sizeOverflows(n, sizeof(qrtz_Value))) return NULL;
+	qrtz_Record *rec = (qrtz_Record *)qrtz_allocObject(vm, QRTZ_ORECORD, sizeof(qrtz_Record) + sizeof(qrtz_Value) * n);
+	if(rec == NULL) return NULL;
+	rec->type = type;
+	for(size_t i = 0; i < n; i++) rec->values[i] = QRTZ_MKNULL();
+	return rec;
+}
+
+qrtz_Userdata *qrtz_allocUserdataObject(qrtz_VM *vm, void *pointer, const char *type, size_t associatedLen) {
+	if(qrtz_sizeOverflows(associatedLen, sizeof(qrtz_Value))) return NULL;
+	size_t typeLen = qrtz_strlen(type);
+	char *typestr = qrtz_alloc(vm, typeLen + 1);
+	if(typestr == NULL) return NULL;
+	qrtz_memcpy(typestr, type, typeLen + 1);
+	qrtz_Userdata *u = (qrtz_Userdata *)qrtz_allocObject(vm, QRTZ_OUSERDATA, sizeof(qrtz_Userdata) + sizeof(qrtz_Value) * associatedLen);
+	if(u == NULL) {
+		qrtz_free(vm, typestr, typeLen + 1);
+		return NULL;
+	}
+	u->typestr = typestr;
+	u->pointer = pointer;
+	u->associatedLen = associatedLen;
+	for(size_t i = 0; i < associatedLen; i++) u->associated[i] = QRTZ_MKNULL();
+	// it is garbage if this fails, and sweeping it frees the type
+	if(!qrtz_trackFinalizer(vm, u)) return NULL;
+	return u;
+}
+
+// frees the entries of a program, with their names
+static void qrtz_freeProgramEntries(qrtz_VM *vm, qrtz_ProgramEntry *entries, size_t count) {
+	if(entries == NULL) return;
+	for(size_t i = 0; i < count; i++) {
+		if(entries[i].name != NULL) qrtz_free(vm, entries[i].name, entries[i].len);
+	}
+	qrtz_freeArray(vm, entries, sizeof(qrtz_ProgramEntry), count);
+}
+
+void qrtz_objrelease(qrtz_VM *vm, qrtz_Object *obj) {
 	if(obj->tag == QRTZ_OSTR) {
 		qrtz_String *s = (qrtz_String *)obj;
-		qrtz_free(vm, s, sizeof(qrtz_String) + s->len + 1);
-		return;
-	}
-	if(obj->tag == QRTZ_OARRAY) {
-		qrtz_Array *arr = (qrtz_Array *)obj;
-		qrtz_free(vm, arr, sizeof(qrtz_Array) + sizeof(qrtz_Array) * arr->cap);
+		if(s->flags & QRTZ_SEXTERN) {
+			qrtz_ExternString *e = (qrtz_ExternString *)s;
+			if(e->release == NULL) return;
+			e->release(e->userdata, e->ptr, e->len);
+			vm->externStrings--;
+			return;
+		}
+		if(s->flags & (QRTZ_SROPE | QRTZ_SSLICE)) return;
+		qrtz_uninternString(vm, s);
 		return;
 	}
 	if(obj->tag == QRTZ_OMAP) {
 		qrtz_Map *map = (qrtz_Map *)obj;
-		qrtz_freeArray(vm, map->data, sizeof(qrtz_Value), map->cap * 2);
-		qrtz_free(vm, map, sizeof(qrtz_Map));
-		return;
-	}
-	if(obj->tag == QRTZ_OPOINTER) {
-		qrtz_Pointer *ptr = (qrtz_Pointer *)obj;
-		qrtz_free(vm, ptr, sizeof(qrtz_Pointer));
+		qrtz_mapfree(vm, map->data, map->cap);
 		return;
 	}
 	if(obj->tag == QRTZ_OTASK) {
 		qrtz_Task *task = (qrtz_Task *)obj;
 		qrtz_freeArray(vm, task->stack, sizeof(qrtz_Value), task->stackcap);
-		qrtz_freeArray(vm, task->calls, sizeof(qrtz_Value), task->callcap);
-		qrtz_free(vm, task, sizeof(qrtz_Pointer));
+		qrtz_freeArray(vm, task->calls, sizeof(qrtz_CallEntry), task->callcap);
+		return;
+	}
+	if(obj->tag == QRTZ_ORECTYPE) {
+		qrtz_RecordType *ty = (qrtz_RecordType *)obj;
+		qrtz_freeArray(vm, ty->fields, sizeof(qrtz_Value), ty->fieldCount);
+		return;
+	}
+	if(obj->tag == QRTZ_OPROGRAM) {
+		qrtz_Program *prog = (qrtz_Program *)obj;
+		qrtz_freeProgramEntries(vm, prog->entries, prog->entryCount);
+		qrtz_freeArray(vm, prog->locals, sizeof(qrtz_Value), prog->localCount);
+		return;
+	}
+	if(obj->tag == QRTZ_OUSERDATA) {
+		// finalizers are called later, with a copy of the pointer
+		char *typestr = ((qrtz_Userdata *)obj)->typestr;
+		qrtz_free(vm, typestr, qrtz_strlen(typestr) + 1);
 		return;
 	}
 }
 
-qrtz_VM *qrtz_create(qrtz_Context *ctx) {
+bool qrtz_objNeedsRelease(qrtz_Object *obj) {
+	switch(obj->tag) {
+	case QRTZ_OSTR: {
+		qrtz_String *s = (qrtz_String *)obj;
+		// dead strings were already removed from the intern table once marking finished
+		return (s->flags & (QRTZ_SEXTERN | QRTZ_SINTERNED)) != 0;
+	}
+	case QRTZ_OMAP:
+	case QRTZ_OTASK:
+	case QRTZ_ORECTYPE:
+	case QRTZ_OPROGRAM:
+	case QRTZ_OUSERDATA:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void qrtz_releaseCopy(void *userdata, const char *str, size_t len) {
+	qrtz_free(userdata, (char *)str, len);
+}
+
+bool qrtz_objclone(qrtz_VM *vm, qrtz_Object *obj) {
+	switch(obj->tag) {
+	case QRTZ_OSTR: {
+		qrtz_String *s = (qrtz_String *)obj;
+		if((s->flags & QRTZ_SEXTERN) == 0) return true;
+		qrtz_ExternString *e = (qrtz_ExternString *)s;
+		// without a release function, the host keeps the bytes around for good, so they can be shared
+		if(e->release == NULL) return true;
+		// otherwise it only expects them released once, so the copy gets its own
+		if(e->len == 0) {
+			e->ptr = "";
+			e->release = NULL;
+			return true;
+		}
+		char *bytes = qrtz_alloc(vm, e->len);
+		if(bytes == NULL) return false;
+		qrtz_memcpy(bytes, e->ptr, e->len);
+		e->ptr = bytes;
+		e->release = qrtz_releaseCopy;
+		e->userdata = vm;
+		vm->externStrings++;
+		return true;
+	}
+	case QRTZ_OMAP: {
+		qrtz_Map *map = (qrtz_Map *)obj;
+		if(map->cap == 0) return true;
+		size_t size = map->cap * (sizeof(qrtz_Value) * 2 + 1);
+		qrtz_Value *data = qrtz_alloc(vm, size);
+		if(data == NULL) return false;
+		qrtz_memcpy(data, map->data, size);
+		map->data = data;
+		map->ctrl = (unsigned char *)(data + map->cap * 2);
+		return true;
+	}
+	case QRTZ_OTASK: {
+		qrtz_Task *task = (qrtz_Task *)obj;
+		qrtz_Value *stack = qrtz_allocArray(vm, sizeof(qrtz_Value), task->stackcap);
+		if(stack == NULL) return false;
+		qrtz_CallEntry *calls = qrtz_allocArray(vm, sizeof(qrtz_CallEntry), task->callcap);
+		if(calls == NULL) {
+			qrtz_freeArray(vm, stack, sizeof(qrtz_Value), task->stackcap);
+			return false;
+		}
+		qrtz_memcpy(stack, task->stack, sizeof(qrtz_Value) * task->stacklen);
+		qrtz_memcpy(calls, task->calls, sizeof(qrtz_CallEntry) * task->calllen);
+		task->stack = stack;
+		task->calls = calls;
+		return true;
+	}
+	case QRTZ_ORECTYPE: {
+		qrtz_RecordType *ty = (qrtz_RecordType *)obj;
+		if(ty->fieldCount == 0) return true;
+		qrtz_Value *fields = qrtz_allocArray(vm, sizeof(qrtz_Value), ty->fieldCount);
+		if(fields == NULL) return false;
+		qrtz_memcpy(fields, ty->fields, sizeof(qrtz_Value) * ty->fieldCount);
+		ty->fields = fields;
+		return true;
+	}
+	case QRTZ_OUSERDATA: {
+		qrtz_Userdata *u = (qrtz_Userdata *)obj;
+		size_t len = qrtz_strlen(u->typestr) + 1;
+		char *typestr = qrtz_alloc(vm, len);
+		if(typestr == NULL) return false;
+		qrtz_memcpy(typestr, u->typestr, len);
+		u->typestr = typestr;
+		return true;
+	}
+	case QRTZ_OPROGRAM: {
+		qrtz_Program *prog = (qrtz_Program *)obj;
+		qrtz_ProgramEntry *entries = NULL;
+		qrtz_Value *locals = NULL;
+		if(prog->entryCount > 0) {
+			entries = qrtz_allocArray(vm, sizeof(qrtz_ProgramEntry), prog->entryCount);
+			if(entries == NULL) return false;
+			for(size_t i = 0; i < prog->entryCount; i++) {
+				entries[i] = prog->entries[i];
+				if(entries[i].name == NULL) continue;
+				entries[i].name = qrtz_alloc(vm, entries[i].len);
+				if(entries[i].name == NULL) {
+					// the rest were not copied yet
+					for(size_t j = i + 1; j < prog->entryCount; j++) entries[j].name = NULL;
+					qrtz_freeProgramEntries(vm, entries, prog->entryCount);
+					return false;
+				}
+				qrtz_memcpy(entries[i].name, prog->entries[i].name, entries[i].len);
+			}
+		}
+		if(prog->localCount > 0) {
+			locals = qrtz_allocArray(vm, sizeof(qrtz_Value), prog->localCount);
+			if(locals == NULL) {
+				qrtz_freeProgramEntries(vm, entries, prog->entryCount);
+				return false;
+			}
+			qrtz_memcpy(locals, prog->locals, sizeof(qrtz_Value) * prog->localCount);
+		}
+		prog->entries = entries;
+		prog->locals = locals;
+		return true;
+	}
+	case QRTZ_OFUNCTION: {
+		// the instructions were copied along with the function, but still point to the original ones
+		qrtz_Function *fn = (qrtz_Function *)obj;
+		fn->inst = (qrtz_Instruction *)(fn + 1);
+		return true;
+	}
+	default:
+		return true;
+	}
+}
+
+// There is no libc randomness to rely on, so we mix in addresses, which are randomized by ASLR,
+// and a counter, so VMs created by the same process still get different seeds.
+static size_t qrtz_randomSeed(qrtz_VM *vm) {
+	static size_t counter = 0;
+	int local;
+	uint64_t seed = (uint64_t)(uintptr_t)vm;
+	seed = qrtz_rotl64(seed * 0x9E3779B97F4A7C15ull, 31) ^ (uint64_t)(uintptr_t)&local;
+	seed = qrtz_rotl64(seed * 0x9E3779B97F4A7C15ull, 31) ^ (uint64_t)(uintptr_t)&qrtz_randomSeed;
+	seed = qrtz_rotl64(seed * 0x9E3779B97F4A7C15ull, 31) ^ (uint64_t)counter++;
+	return (size_t)qrtz_strhash((const char *)&seed, sizeof(seed), (size_t)seed);
+}
+
+// a VM with nothing in it yet, not even its roots
+static qrtz_VM *qrtz_createEmpty(qrtz_Context *ctx) {
 	qrtz_VM *vm = qrtz_calloc(ctx, sizeof(*vm));
 	if(vm == NULL) return NULL;
 	vm->ctx = *ctx;
-	vm->heap = NULL;
-	vm->graySet = NULL;
+	for(size_t i = 0; i < QRTZ_SIZECLASSES; i++) {
+		vm->pages[i] = NULL;
+		vm->availPages[i] = NULL;
+	}
+	vm->largeObjects = NULL;
+	for(size_t i = 0; i < QRTZ_SIZECLASSES; i++) vm->sweepPages[i] = NULL;
+	vm->sweepLarge = NULL;
+	vm->gcBackgroundSweep = false;
+	vm->sweepThread = NULL;
+	vm->sweepLock = false;
+	vm->sweepStop = false;
+	vm->sweepDone = false;
+	vm->sweptPages = NULL;
+	vm->releasePages = NULL;
+	vm->sweptBytes = 0;
+	vm->sweptObjectBytes = 0;
+	vm->marker.vm = vm;
+	vm->marker.gray = NULL;
+	vm->marker.grayLen = 0;
+	vm->marker.grayCap = 0;
+	vm->marker.overflow = false;
+	vm->marker.slices = NULL;
+	vm->marker.slicesLen = 0;
+	vm->marker.slicesCap = 0;
+	vm->marker.weak = NULL;
+	vm->marker.weakLen = 0;
+	vm->marker.weakCap = 0;
+	vm->marker.work = 0;
+	qrtz_memset(vm->marker.liveCount, 0, sizeof(vm->marker.liveCount));
+	qrtz_memset(vm->marker.liveBytes, 0, sizeof(vm->marker.liveBytes));
+	vm->marker.parallel = false;
 	vm->memUsage = sizeof(qrtz_VM);
-	vm->memTarget = 200 * 1024;
-	vm->gcPause = 2;
+	vm->memTarget = QRTZ_GCTARGET;
+	vm->gcPause = QRTZ_GCPAUSE;
+	vm->globals = NULL;
+	vm->registry = NULL;
+	vm->loaded = NULL;
+	vm->resetGlobals = NULL;
+	vm->resetRegistry = NULL;
+	vm->resetLoaded = NULL;
+	vm->mainTask = NULL;
+	vm->curTask = NULL;
+	vm->oomStr = NULL;
+	vm->strings = NULL;
+	vm->stringsLen = 0;
+	vm->stringsCap = 0;
+	vm->gcRunning = false;
+	vm->gcState = QRTZ_GCIDLE;
+	vm->grayAgain = NULL;
+	vm->grayAgainLen = 0;
+	vm->grayAgainCap = 0;
+	vm->gcAllocated = 0;
+	vm->gcStepAt = 0;
+	vm->gcStepSize = QRTZ_GCSTEPSIZE;
+	vm->gcPaceStep = QRTZ_GCSTEPSIZE;
+	vm->gcStepMul = QRTZ_GCSTEPMUL;
+	vm->gcPaceMul = QRTZ_GCSTEPMUL;
+	vm->gcPauseTarget = 0;
+	vm->memLimit = 0;
+	vm->gcCollectRate.amount = 0;
+	vm->gcCollectRate.time = 0;
+	vm->gcAllocRate.amount = 0;
+	vm->gcAllocRate.time = 0;
+	vm->gcCycleTime = 0;
+	vm->gcLive = 0;
+	vm->gcCycleStart = ctx->clock != NULL ? ctx->clock(ctx->data) : 0;
+	vm->gcCycleAllocated = 0;
+	vm->gcThreads = 1;
+	qrtz_memset(&vm->gcStats, 0, sizeof(vm->gcStats));
+	vm->gcPauseDepth = 0;
+	vm->gcPauseStart = 0;
+	vm->nursery = NULL;
+	vm->nurserySize = 0;
+	vm->bump = NULL;
+	vm->bumpEnd = NULL;
+	vm->toSpace = 0;
+	vm->toUsed = 0;
+	vm->youngBytes = 0;
+	vm->minorPending = false;
+	vm->youngMarks = NULL;
+	vm->youngLeft = false;
+	vm->remembered = NULL;
+	vm->rememberedLen = 0;
+	vm->rememberedCap = 0;
+	vm->rememberedOverflow = false;
+	vm->youngStrings = NULL;
+	vm->youngStringsLen = 0;
+	vm->youngStringsCap = 0;
+	vm->tenured = NULL;
+	vm->tenuredLen = 0;
+	vm->tenuredCap = 0;
+	vm->pinned = NULL;
+	vm->pinnedLen = 0;
+	vm->pinnedCap = 0;
+	vm->pinIndex = NULL;
+	vm->pinIndexCap = 0;
+	vm->finalizerTypes = NULL;
+	vm->finalizerTypesLen = 0;
+	vm->finalizerTypesCap = 0;
+	vm->finalizable = NULL;
+	vm->finalizableLen = 0;
+	vm->finalizePending = 0;
+	vm->finalizableCap = 0;
+	vm->externStrings = 0;
+	vm->profileRate = 0;
+	vm->profileAt = SIZE_MAX;
+	vm->profileAllocated = 0;
+	vm->profileSeed = 0;
+	vm->profile = NULL;
+	vm->profileLen = 0;
+	vm->profileCap = 0;
+	vm->profileIndex = NULL;
+	vm->profileIndexCap = 0;
+	vm->lastIdHash = 0;
+	vm->hashSeed = qrtz_randomSeed(vm);
 
+	if(QRTZ_NURSERYSIZE > 0) {
+		size_t size = QRTZ_NURSERYSIZE + QRTZ_SURVIVORSIZE * 2;
+		vm->nursery = qrtz_alloc(vm, size);
+		if(vm->nursery == NULL) goto fail;
+		vm->nurserySize = size;
+		vm->bump = vm->nursery;
+		vm->bumpEnd = vm->nursery + QRTZ_NURSERYSIZE;
+		vm->survivors[0] = vm->bumpEnd;
+		vm->survivors[1] = vm->bumpEnd + QRTZ_SURVIVORSIZE;
+		// allocated up front, as it is needed after running out of memory
+		vm->youngMarks = qrtz_allocArray(vm, sizeof(uint64_t), QRTZ_YOUNGMARKWORDS(size));
+		if(vm->youngMarks == NULL) goto fail;
+		qrtz_memset(vm->youngMarks, 0, sizeof(uint64_t) * QRTZ_YOUNGMARKWORDS(size));
+	}
+	return vm;
+fail:
+	qrtz_destroy(vm);
+	return NULL;
+}
+
+qrtz_VM *qrtz_create(qrtz_Context *ctx) {
+	qrtz_VM *vm = qrtz_createEmpty(ctx);
+	if(vm == NULL) return NULL;
 	vm->globals = qrtz_allocMapObject(vm, 16);
 	if(vm->globals == NULL) goto fail;
 	vm->registry = qrtz_allocMapObject(vm, 16);
@@ -178,19 +1003,255 @@ fail:
 	return NULL;
 }
 
+typedef struct qrtz_Relocation {
+	qrtz_RefVisitor visitor;
+	qrtz_HeapCopy *copy;
+} qrtz_Relocation;
+
+static void qrtz_relocateValue(qrtz_RefVisitor *visitor, qrtz_Value *val) {
+	if(!QRTZ_ISOBJ(*val)) return;
+	qrtz_Object *obj = qrtz_heapCopyOf(((qrtz_Relocation *)visitor)->copy, QRTZ_ASOBJ(*val));
+	*val = obj != NULL ? QRTZ_MKOBJ(obj) : QRTZ_MKNULL();
+}
+
+static void qrtz_relocateObject(qrtz_RefVisitor *visitor, qrtz_Object **ref) {
+	if(*ref != NULL) *ref = qrtz_heapCopyOf(((qrtz_Relocation *)visitor)->copy, *ref);
+}
+
+static void qrtz_relocateEach(qrtz_Object *obj, void *userdata) {
+	qrtz_Relocation *reloc = userdata;
+	qrtz_visitRefs(&reloc->visitor, obj);
+	// pins are held by the original's host, and the copy starts with none
+	obj->gcflags &= ~QRTZ_GCPINNED;
+	if(obj->tag != QRTZ_OSTR) return;
+	qrtz_String *s = (qrtz_String *)obj;
+	if(s->flags & QRTZ_SINTERNED) {
+		// the table is as big as the original's, so it never has to grow
+		qrtz_VM *vm = reloc->visitor.vm;
+		qrtz_insertInterned(vm->strings, vm->stringsCap, s);
+		vm->stringsLen++;
+	}
+}
+
+static bool qrtz_cloneFinalizerTypes(qrtz_VM *vm, qrtz_VM *from) {
+	if(from->finalizerTypesLen == 0) return true;
+	vm->finalizerTypes = qrtz_allocArray(vm, sizeof(qrtz_FinalizerType), from->finalizerTypesLen);
+	if(vm->finalizerTypes == NULL) return false;
+	vm->finalizerTypesCap = from->finalizerTypesLen;
+	for(size_t i = 0; i < from->finalizerTypesLen; i++) {
+		qrtz_FinalizerType t = from->finalizerTypes[i];
+		size_t len = qrtz_strlen(t.type) + 1;
+		char *type = qrtz_alloc(vm, len);
+		if(type == NULL) return false;
+		qrtz_memcpy(type, t.type, len);
+		t.type = type;
+		vm->finalizerTypes[vm->finalizerTypesLen++] = t;
+	}
+	return true;
+}
+
+static qrtz_Object *qrtz_rootCopy(qrtz_HeapCopy *copy, void *root) {
+	return root != NULL ? qrtz_heapCopyOf(copy, root) : NULL;
+}
+
+qrtz_VM *qrtz_clone(qrtz_VM *vm, qrtz_Context *ctx) {
+	// Objects are copied page by page, so they must all be in the old generation, with sweeping over.
+	// Whatever died since the last cycle is copied too, and left to the copy's collector.
+	if(vm->gcState != QRTZ_GCIDLE) qrtz_gc(vm);
+	if(!qrtz_minorgc(vm, true)) return NULL;
+
+	qrtz_VM *clone = qrtz_createEmpty(ctx);
+	if(clone == NULL) return NULL;
+	// maps are copied as they are, so keys must hash the same
+	clone->hashSeed = vm->hashSeed;
+	clone->lastIdHash = vm->lastIdHash;
+	clone->memTarget = vm->memTarget;
+	clone->gcPause = vm->gcPause;
+	clone->gcStepSize = vm->gcStepSize;
+	clone->gcPaceStep = vm->gcPaceStep;
+	clone->gcStepMul = vm->gcStepMul;
+	clone->gcPaceMul = vm->gcPaceMul;
+	clone->gcPauseTarget = vm->gcPauseTarget;
+	clone->memLimit = vm->memLimit;
+	clone->gcLive = vm->gcLive;
+
+	qrtz_HeapCopy copy;
+	bool ok = qrtz_heapClone(clone, vm, &copy) && qrtz_cloneFinalizerTypes(clone, vm);
+	if(ok && vm->stringsCap > 0) {
+		clone->strings = qrtz_allocArray(clone, sizeof(qrtz_String *), vm->stringsCap);
+		ok = clone->strings != NULL;
+		if(ok) {
+			clone->stringsCap = vm->stringsCap;
+			for(size_t i = 0; i < clone->stringsCap; i++) clone->strings[i] = NULL;
+		}
+	}
+	if(ok) {
+		qrtz_Relocation reloc;
+		reloc.visitor.value = qrtz_relocateValue;
+		reloc.visitor.object = qrtz_relocateObject;
+		reloc.visitor.vm = clone;
+		reloc.copy = &copy;
+		qrtz_heapEach(clone, qrtz_relocateEach, &reloc);
+		clone->globals = (qrtz_Map *)qrtz_rootCopy(&copy, vm->globals);
+		clone->registry = (qrtz_Map *)qrtz_rootCopy(&copy, vm->registry);
+		clone->loaded = (qrtz_Map *)qrtz_rootCopy(&copy, vm->loaded);
+		clone->resetGlobals = (qrtz_Map *)qrtz_rootCopy(&copy, vm->resetGlobals);
+		clone->resetRegistry = (qrtz_Map *)qrtz_rootCopy(&copy, vm->resetRegistry);
+		clone->resetLoaded = (qrtz_Map *)qrtz_rootCopy(&copy, vm->resetLoaded);
+		clone->mainTask = (qrtz_Task *)qrtz_rootCopy(&copy, vm->mainTask);
+		clone->curTask = (qrtz_Task *)qrtz_rootCopy(&copy, vm->curTask);
+		clone->oomStr = (qrtz_String *)qrtz_rootCopy(&copy, vm->oomStr);
+	}
+	qrtz_freeHeapCopy(clone, &copy);
+	if(!ok) {
+		qrtz_destroy(clone);
+		return NULL;
+	}
+	return clone;
+}
+
 void qrtz_destroy(qrtz_VM *vm) {
 	qrtz_Context ctx = vm->ctx;
 
-	qrtz_Object *obj = vm->heap;
-	while(obj != NULL) {
-		qrtz_Object *cur = obj;
-		obj = obj->next;
-		qrtz_objfree(vm, cur);
+	// the host's resources are released while the userdata are still around to get their pointers from
+	qrtz_finalizeAll(vm);
+	if(ctx.freeAll != NULL) {
+		qrtz_heapAbandon(vm);
+		ctx.freeAll(ctx.data);
+		return;
 	}
 
+	// everything dies, so there is no point in keeping the intern table up to date
+	qrtz_freeArray(vm, vm->strings, sizeof(qrtz_String *), vm->stringsCap);
+	vm->strings = NULL;
+	vm->stringsCap = 0;
+
+	qrtz_heapDestroy(vm);
+	// young objects own nothing besides their memory
+	qrtz_free(vm, vm->nursery, vm->nurserySize);
+	if(vm->youngMarks != NULL) qrtz_freeArray(vm, vm->youngMarks, sizeof(uint64_t), QRTZ_YOUNGMARKWORDS(vm->nurserySize));
+	qrtz_freeArray(vm, vm->remembered, sizeof(qrtz_Object *), vm->rememberedCap);
+	qrtz_freeArray(vm, vm->tenured, sizeof(qrtz_Object *), vm->tenuredCap);
+	qrtz_freeArray(vm, vm->pinned, sizeof(qrtz_Pin), vm->pinnedCap);
+	qrtz_freeArray(vm, vm->pinIndex, sizeof(size_t), vm->pinIndexCap);
+	for(size_t i = 0; i < vm->finalizerTypesLen; i++) {
+		char *type = vm->finalizerTypes[i].type;
+		qrtz_free(vm, type, qrtz_strlen(type) + 1);
+	}
+	qrtz_freeArray(vm, vm->finalizerTypes, sizeof(qrtz_FinalizerType), vm->finalizerTypesCap);
+	qrtz_freeArray(vm, vm->finalizable, sizeof(qrtz_Finalizable), vm->finalizableCap);
+	qrtz_freeArray(vm, vm->marker.gray, sizeof(qrtz_Object *), vm->marker.grayCap);
+	qrtz_freeArray(vm, vm->marker.slices, sizeof(qrtz_Object *), vm->marker.slicesCap);
+	qrtz_freeArray(vm, vm->marker.weak, sizeof(qrtz_Object *), vm->marker.weakCap);
+	qrtz_freeArray(vm, vm->grayAgain, sizeof(qrtz_Object *), vm->grayAgainCap);
+	qrtz_freeArray(vm, vm->youngStrings, sizeof(qrtz_String *), vm->youngStringsCap);
+	qrtz_freeAllocProfile(vm);
+
 	qrtz_cfree(&ctx, vm, sizeof(qrtz_VM));
 }
 
+// Makes dst hold the entries of src. It only allocates if dst can't fit them.
+static qrtz_Exit qrtz_mapcopy(qrtz_VM *vm, qrtz_Map *dst, qrtz_Map *src) {
+	if(dst->cap == src->cap && dst->cap > 0) {
+		// keys hash the same in the same VM, so the slots can be copied as they are
+		qrtz_memcpy(dst->data, src->data, sizeof(qrtz_Value) * 2 * src->cap);
+		qrtz_memcpy(dst->ctrl, src->ctrl, src->cap);
+		dst->used = src->used;
+		dst->len = src->len;
+		for(size_t i = 0; i < src->cap; i++) {
+			if(!QRTZ_MAPFULL(src, i)) continue;
+			qrtz_barrier(vm, &dst->obj, src->data[i]);
+			qrtz_barrier(vm, &dst->obj, src->data[i + src->cap]);
+		}
+		return QRTZ_OK;
+	}
+	qrtz_mapclear(dst);
+	for(size_t i = 0; i < src->cap; i++) {
+		if(!QRTZ_MAPFULL(src, i)) continue;
+		qrtz_Exit err = qrtz_mapset(vm, dst, src->data[i], src->data[i + src->cap]);
+		if(err) return err;
+	}
+	return QRTZ_OK;
+}
+
+// Copies a map into a reset point slot. The slot is a root, so the copy is never collected half-made.
+static qrtz_Exit qrtz_saveMap(qrtz_VM *vm, qrtz_Map **slot, qrtz_Map *map) {
+	*slot = qrtz_allocMapObject(vm, map->len);
+	if(*slot == NULL) return QRTZ_ENOMEM;
+	return qrtz_mapcopy(vm, *slot, map);
+}
+
+qrtz_Exit qrtz_setResetPoint(qrtz_VM *vm) {
+	vm->resetGlobals = NULL;
+	vm->resetRegistry = NULL;
+	vm->resetLoaded = NULL;
+	if(qrtz_saveMap(vm, &vm->resetGlobals, vm->globals) || qrtz_saveMap(vm, &vm->resetRegistry, vm->registry)
+		|| qrtz_saveMap(vm, &vm->resetLoaded, vm->loaded)) {
+		vm->resetGlobals = NULL;
+		vm->resetRegistry = NULL;
+		vm->resetLoaded = NULL;
+		return QRTZ_ENOMEM;
+	}
+	return QRTZ_OK;
+}
+
+// Allocates storage for a map to be restored into, if it is too small to hold what it is restored to.
+// Restoring into a map which fits never allocates, so a reset can make sure it won't fail before changing anything.
+static bool qrtz_reserveRestore(qrtz_VM *vm, qrtz_Map *map, qrtz_Map *saved, qrtz_Map *storage) {
+	if(saved == NULL || qrtz_mapcapfor(saved->len) <= map->cap) return true;
+	return qrtz_mapalloc(vm, storage, saved->cap);
+}
+
+static void qrtz_restoreMap(qrtz_VM *vm, qrtz_Map *map, qrtz_Map *saved, qrtz_Map *storage) {
+	if(storage->cap > 0) {
+		qrtz_mapfree(vm, map->data, map->cap);
+		map->data = storage->data;
+		map->ctrl = storage->ctrl;
+		map->cap = storage->cap;
+	}
+	if(saved == NULL) {
+		qrtz_mapclear(map);
+		return;
+	}
+	// the map has room for all of it, so this can't run out of memory
+	qrtz_mapcopy(vm, map, saved);
+}
+
+qrtz_Exit qrtz_reset(qrtz_VM *vm) {
+	qrtz_Map storage[3];
+	for(int i = 0; i < 3; i++) storage[i].cap = 0;
+	bool reserved = qrtz_reserveRestore(vm, vm->globals, vm->resetGlobals, &storage[0])
+		&& qrtz_reserveRestore(vm, vm->registry, vm->resetRegistry, &storage[1])
+		&& qrtz_reserveRestore(vm, vm->loaded, vm->resetLoaded, &storage[2]);
+	if(!reserved) {
+		for(int i = 0; i < 3; i++) {
+			if(storage[i].cap > 0) qrtz_mapfree(vm, storage[i].data, storage[i].cap);
+		}
+		return QRTZ_ENOMEM;
+	}
+	qrtz_Task *task = vm->mainTask;
+	task->stacklen = 0;
+	task->calllen = 0;
+	task->waitingFor = NULL;
+	task->waitedBy = NULL;
+	task->deadline = 0;
+	task->checkcounter = 0;
+	task->checkinterval = 0;
+	task->error = QRTZ_MKILLEGAL();
+	vm->curTask = task;
+	for(size_t i = 0; i < vm->pinnedLen; i++) vm->pinned[i].obj->gcflags &= ~QRTZ_GCPINNED;
+	vm->pinnedLen = 0;
+	for(size_t i = 0; i < vm->pinIndexCap; i++) vm->pinIndex[i] = 0;
+	qrtz_restoreMap(vm, vm->globals, vm->resetGlobals, &storage[0]);
+	qrtz_restoreMap(vm, vm->registry, vm->resetRegistry, &storage[1]);
+	qrtz_restoreMap(vm, vm->loaded, vm->resetLoaded, &storage[2]);
+	// Most of what was allocated since is still in the nursery, and dies without being looked at.
+	// The rest is left to the collector like any garbage, as collecting it all now costs as much as a new VM.
+	if(vm->gcState == QRTZ_GCIDLE) qrtz_minorgc(vm, false);
+	qrtz_checkGC(vm);
+	return QRTZ_OK;
+}
+
 qrtz_Context *qrtz_contextOf(qrtz_VM *vm) {
 	return &vm->ctx;
 }
@@ -207,64 +1268,431 @@ qrtz_String *qrtz_allocFStringObject(qrtz_VM *vm, const char *fmt, ...) {
 	return s;
 }
 
-qrtz_String *qrtz_vallocFStringObject(qrtz_VM *vm, const char *fmt, va_list args) {
-	int n = stbsp_vsnprintf(NULL, 0, fmt, args);
-	if(n < 0) return NULL;
+// Formats into buf, which holds QRTZ_INTERNLIMIT + 1 bytes, and returns the whole length.
+// Longer strings are cut short, and formatted again by qrtz_formatObject.
+static int qrtz_formatShort(char *buf, const char *fmt, va_list args) {
+	va_list measure;
+	va_copy(measure, args);
+	int n = stbsp_vsnprintf(buf, QRTZ_INTERNLIMIT + 1, fmt, measure);
+	va_end(measure);
+	return n;
+}
+
+static qrtz_String *qrtz_formatObject(qrtz_VM *vm, const char *buf, int n, const char *fmt, va_list args) {
+	// short enough to be interned, so it is formatted already
+	if(n <= QRTZ_INTERNLIMIT) return qrtz_allocStringObject(vm, buf, n);
 	qrtz_String *s = qrtz_allocStringObject(vm, NULL, n);
 	if(s == NULL) return NULL;
 	stbsp_vsprintf(s->data, fmt, args);
-	s->hash = qrtz_strhash(s->data, s->len);
 	return s;
 }
 
-size_t qrtz_objmemsizeof(qrtz_Object *obj);
+qrtz_String *qrtz_vallocFStringObject(qrtz_VM *vm, const char *fmt, va_list args) {
+	char buf[QRTZ_INTERNLIMIT + 1];
+	int n = qrtz_formatShort(buf, fmt, args);
+	if(n < 0) return NULL;
+	return qrtz_formatObject(vm, buf, n, fmt, args);
+}
 
-size_t qrtz_strhash(const char *s, size_t len) {
-	// slightly modified version of https://en.wikipedia.org/wiki/Jenkins_hash_function
-	size_t hash = 53;
-	for(size_t i = 0; i < len; i++) {
-		hash += (unsigned char)s[i];
-		hash += hash << 10;
-		hash ^= hash >> 6;
+bool qrtz_vformatval(qrtz_VM *vm, qrtz_Value *out, const char *fmt, va_list args) {
+	char buf[QRTZ_INTERNLIMIT + 1];
+	int n = qrtz_formatShort(buf, fmt, args);
+	if(n < 0) return false;
+	if((size_t)n <= QRTZ_SSTRMAX) {
+		*out = QRTZ_MKSSTR(buf, (size_t)n);
+		return true;
 	}
-	hash += hash << 3;
-	hash ^= hash >> 11;
-	hash += hash << 15;
-	return hash;
+	qrtz_String *s = qrtz_formatObject(vm, buf, n, fmt, args);
+	if(s == NULL) return false;
+	*out = QRTZ_MKOBJ(&s->obj);
+	return true;
 }
 
-size_t qrtz_valhash(qrtz_Value val) {
-	if(val.tag == QRTZ_VNULL) return 0;
-	if(val.tag == QRTZ_VBOOL) return val.boolean ? 1 : 0;
-	if(val.tag == QRTZ_VINT) return val.integer;
-	if(val.tag == QRTZ_VNUMBER) {
-		if(isnan(val.number)) return 0;
-		if(isinf(val.number)) return 0;
-		return val.number;
+// the bytes owned by an object, matching what freeing it gives back
+size_t qrtz_objmemsizeof(qrtz_Object *obj) {
+	switch(obj->tag) {
+	case QRTZ_OSTR: {
+		qrtz_String *s = (qrtz_String *)obj;
+		if(s->flags & QRTZ_SROPE) return sizeof(qrtz_Rope);
+		if(s->flags & QRTZ_SEXTERN) return sizeof(qrtz_ExternString);
+		if(s->flags & QRTZ_SSLICE) return sizeof(qrtz_SliceString);
+		return sizeof(qrtz_String) + s->len + 1;
+	}
+	case QRTZ_OARRAY:
+		return sizeof(qrtz_Array) + sizeof(qrtz_Value) * ((qrtz_Array *)obj)->cap;
+	case QRTZ_OMAP:
+		return sizeof(qrtz_Map) + (sizeof(qrtz_Value) * 2 + 1) * ((qrtz_Map *)obj)->cap;
+	case QRTZ_OPOINTER:
+		return sizeof(qrtz_Pointer);
+	case QRTZ_OUSERDATA:
+		return sizeof(qrtz_Userdata) + sizeof(qrtz_Value) * ((qrtz_Userdata *)obj)->associatedLen;
+	case QRTZ_OTASK: {
+		qrtz_Task *task = (qrtz_Task *)obj;
+		return sizeof(qrtz_Task) + sizeof(qrtz_Value) * task->stackcap + sizeof(qrtz_CallEntry) * task->callcap;
 	}
-	if(val.tag == QRTZ_VCFUNC) return (size_t)val.cfunc;
-	if(val.tag != QRTZ_VOBJ) return 0;
-	qrtz_Object *o = val.object;
-	if(o->tag != QRTZ_OSTR) {
-		return ((qrtz_String *)o)->hash;
+	case QRTZ_OPROGRAM: {
+		qrtz_Program *prog = (qrtz_Program *)obj;
+		return sizeof(qrtz_Program) + sizeof(qrtz_ProgramEntry) * prog->entryCount + sizeof(qrtz_Value) * prog->localCount;
 	}
-	return (size_t)o;
+	case QRTZ_ORECORD:
+		return sizeof(qrtz_Record) + sizeof(qrtz_Value) * ((qrtz_Record *)obj)->type->fieldCount;
+	case QRTZ_ORECTYPE:
+		return sizeof(qrtz_RecordType) + sizeof(qrtz_Value) * ((qrtz_RecordType *)obj)->fieldCount;
+	case QRTZ_ORECOPT:
+		return sizeof(qrtz_Object);
+	case QRTZ_OFUNCTION:
+		return sizeof(qrtz_Function) + sizeof(qrtz_Instruction) * ((qrtz_Function *)obj)->codesize;
+	case QRTZ_OCLOSURE:
+		return sizeof(qrtz_Closure) + sizeof(qrtz_Pointer *) * ((qrtz_Closure *)obj)->upvalCount;
+	}
+	return sizeof(qrtz_Object);
+}
+
+size_t qrtz_strhash(const char *s, size_t len, size_t seed) {
+	// two independent multiply-rotate lanes, eating 16 bytes per step,
+	// then a murmur3 finalizer to spread the bits around.
+	const uint64_t k1 = 0x9E3779B97F4A7C15ull, k2 = 0xC2B2AE3D27D4EB4Full;
+	const unsigned char *p = (const unsigned char *)s;
+	uint64_t a = (uint64_t)seed ^ k1 ^ (uint64_t)len;
+	uint64_t b = (uint64_t)seed + k2;
+	size_t left = len;
+	while(left >= 16) {
+		a = qrtz_rotl64((a ^ qrtz_read64(p)) * k1, 29);
+		b = qrtz_rotl64((b ^ qrtz_read64(p + 8)) * k2, 31);
+		p += 16;
+		left -= 16;
+	}
+	if(left >= 8) {
+		a = qrtz_rotl64((a ^ qrtz_read64(p)) * k1, 29);
+		p += 8;
+		left -= 8;
+	}
+	uint64_t tail = 0;
+	for(size_t i = 0; i < left; i++) tail |= (uint64_t)p[i] << (i * 8);
+	b = qrtz_rotl64((b ^ tail) * k2, 31);
+
+	uint64_t h = a ^ qrtz_rotl64(b, 17);
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ull;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+size_t qrtz_strgethash(qrtz_VM *vm, qrtz_String *s) {
+	if((s->flags & QRTZ_SHASHED) == 0) {
+		const char *data = qrtz_strdata(vm, s);
+		// out of memory, this is rare enough to not bother caching
+		if(data == NULL) return 0;
+		s->hash = qrtz_strhash(data, s->len, vm->hashSeed);
+		s->flags |= QRTZ_SHASHED;
+	}
+	return s->hash;
+}
+
+size_t qrtz_valhash(qrtz_VM *vm, qrtz_Value val) {
+	qrtz_ValTag tag = QRTZ_VTAG(val);
+	if(tag == QRTZ_VNULL) return 0;
+	if(tag == QRTZ_VBOOL) return QRTZ_ASBOOL(val) ? 1 : 0;
+	if(tag == QRTZ_VINT) return QRTZ_ASINT(val);
+	if(tag == QRTZ_VNUMBER) {
+		double n = QRTZ_ASNUM(val);
+		if(isnan(n)) return 0;
+		if(isinf(n)) return 0;
+		return n;
+	}
+	if(tag == QRTZ_VCFUNC) return (size_t)QRTZ_ASCFUNC(val);
+	// hashed like the equivalent string object, as they are equal
+	if(tag == QRTZ_VSSTR) return qrtz_strhash(QRTZ_SSTRDATA(&val), QRTZ_SSTRLEN(val), vm->hashSeed);
+	if(tag != QRTZ_VOBJ) return 0;
+	qrtz_Object *o = QRTZ_ASOBJ(val);
+	if(o->tag == QRTZ_OSTR) {
+		return qrtz_strgethash(vm, (qrtz_String *)o);
+	}
+	// objects move, so their address can't be used
+	if(o->idhash == 0) {
+		vm->lastIdHash++;
+		if(vm->lastIdHash == 0) vm->lastIdHash++;
+		o->idhash = vm->lastIdHash;
+	}
+	return o->idhash;
+}
+
+// compares a short string against any value
+static bool qrtz_sstreq(qrtz_VM *vm, qrtz_Value *sstr, qrtz_Value other) {
+	size_t len = QRTZ_SSTRLEN(*sstr);
+	if(QRTZ_VTAG(other) == QRTZ_VSSTR) {
+		return len == QRTZ_SSTRLEN(other) && qrtz_memcmp(QRTZ_SSTRDATA(sstr), QRTZ_SSTRDATA(&other), len) == 0;
+	}
+	if(!QRTZ_ISOBJ(other) || QRTZ_ASOBJ(other)->tag != QRTZ_OSTR) return false;
+	qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(other);
+	if(s->len != len) return false;
+	const char *data = qrtz_strdata(vm, s);
+	if(data == NULL) return false;
+	return qrtz_memcmp(QRTZ_SSTRDATA(sstr), data, len) == 0;
+}
+
+bool qrtz_streq(qrtz_VM *vm, qrtz_String *a, qrtz_String *b) {
+	if(a == b) return true;
+	// interned strings are unique
+	if((a->flags & QRTZ_SINTERNED) && (b->flags & QRTZ_SINTERNED)) return false;
+	if(a->len != b->len) return false;
+	// only compare hashes we already have, computing them would be slower than comparing
+	if((a->flags & QRTZ_SHASHED) && (b->flags & QRTZ_SHASHED) && a->hash != b->hash) return false;
+	const char *aData = qrtz_strdata(vm, a);
+	const char *bData = qrtz_strdata(vm, b);
+	if(aData == NULL || bData == NULL) return false;
+	return qrtz_memcmp(aData, bData, a->len) == 0;
+}
+
+bool qrtz_valeq(qrtz_VM *vm, qrtz_Value a, qrtz_Value b) {
+	qrtz_ValTag tag = QRTZ_VTAG(a);
+	// short strings can still equal string objects
+	if(tag == QRTZ_VSSTR) return qrtz_sstreq(vm, &a, b);
+	if(QRTZ_VTAG(b) == QRTZ_VSSTR) return qrtz_sstreq(vm, &b, a);
+	if(tag != QRTZ_VTAG(b)) return false;
+	if(tag == QRTZ_VNULL) return true;
+	if(tag == QRTZ_VILLEGAL) return true;
+	if(tag == QRTZ_VBOOL) return QRTZ_ASBOOL(a) == QRTZ_ASBOOL(b);
+	if(tag == QRTZ_VINT) return QRTZ_ASINT(a) == QRTZ_ASINT(b);
+	if(tag == QRTZ_VNUMBER) return QRTZ_ASNUM(a) == QRTZ_ASNUM(b);
+	if(tag == QRTZ_VCFUNC) return QRTZ_ASCFUNC(a) == QRTZ_ASCFUNC(b);
+	qrtz_Object *oa = QRTZ_ASOBJ(a), *ob = QRTZ_ASOBJ(b);
+	if(oa == ob) return true;
+	if(oa->tag == QRTZ_OSTR && ob->tag == QRTZ_OSTR) {
+		return qrtz_streq(vm, (qrtz_String *)oa, (qrtz_String *)ob);
+	}
+	return false;
+}
+
+// Bitmasks of the slots in a group whose control byte matches, one bit per slot.
+// Full control bytes never have the high bit set, so empty and removed slots are found with it alone.
+static unsigned int qrtz_groupMatch(const unsigned char *group, unsigned char c) {
+#ifdef QRTZ_MAPSSE2
+	__m128i g = _mm_loadu_si128((const __m128i *)group);
+	return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+#else
+	unsigned int mask = 0;
+	for(int i = 0; i < QRTZ_MAPGROUP; i++) mask |= (unsigned int)(group[i] == c) << i;
+	return mask;
+#endif
+}
+
+static unsigned int qrtz_groupFree(const unsigned char *group) {
+#ifdef QRTZ_MAPSSE2
+	return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+	unsigned int mask = 0;
+	for(int i = 0; i < QRTZ_MAPGROUP; i++) mask |= (unsigned int)(group[i] >> 7) << i;
+	return mask;
+#endif
+}
+
+static int qrtz_lowestBit(unsigned int mask) {
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctz(mask);
+#else
+	int i = 0;
+	while(!(mask & 1)) {
+		mask >>= 1;
+		i++;
+	}
+	return i;
+#endif
+}
+
+// valhash is the identity for some values, so the bits are mixed before being split into
+// the group index and the control byte.
+static size_t qrtz_maphash(qrtz_VM *vm, qrtz_Value key) {
+	uint64_t h = qrtz_valhash(vm, key);
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDull;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+// Groups are probed in triangular steps, which visit every group since their count is a power of 2.
+// Returns the slot of the key, or cap if it is not present.
+static size_t qrtz_mapfind(qrtz_VM *vm, qrtz_Map *map, qrtz_Value key, size_t hash) {
+	size_t groupMask = map->cap / QRTZ_MAPGROUP - 1;
+	size_t group = (hash >> 7) & groupMask;
+	unsigned char h2 = (unsigned char)(hash & 0x7F);
+	for(size_t step = 1; step <= groupMask + 1; step++) {
+		const unsigned char *ctrl = map->ctrl + group * QRTZ_MAPGROUP;
+		unsigned int matches = qrtz_groupMatch(ctrl, h2);
+		while(matches != 0) {
+			size_t i = group * QRTZ_MAPGROUP + qrtz_lowestBit(matches);
+			if(qrtz_valeq(vm, map->data[i], key)) return i;
+			matches &= matches - 1;
+		}
+		// an empty slot means the key was never pushed further
+		if(qrtz_groupMatch(ctrl, QRTZ_CEMPTY) != 0) return map->cap;
+		group = (group + step) & groupMask;
+	}
+	return map->cap;
+}
+
+// finds the first empty or removed slot on the key's probe sequence
+static size_t qrtz_mapinsertslot(qrtz_Map *map, size_t hash) {
+	size_t groupMask = map->cap / QRTZ_MAPGROUP - 1;
+	size_t group = (hash >> 7) & groupMask;
+	for(size_t step = 1;; step++) {
+		unsigned int avail = qrtz_groupFree(map->ctrl + group * QRTZ_MAPGROUP);
+		if(avail != 0) return group * QRTZ_MAPGROUP + qrtz_lowestBit(avail);
+		group = (group + step) & groupMask;
+	}
+}
+
+bool qrtz_mapget(qrtz_VM *vm, qrtz_Map *map, qrtz_Value key, qrtz_Value *val) {
+	if(map->len == 0) return false;
+	size_t i = qrtz_mapfind(vm, map, key, qrtz_maphash(vm, key));
+	if(i == map->cap) return false;
+	*val = map->data[i + map->cap];
+	return true;
+}
+
+// rehashes into a new table of newCap slots, which drops every removed slot
+static qrtz_Exit qrtz_mapresize(qrtz_VM *vm, qrtz_Map *map, size_t newCap) {
+	qrtz_Map old = *map;
+	if(!qrtz_mapalloc(vm, map, newCap)) {
+		*map = old;
+		return QRTZ_ENOMEM;
+	}
+	for(size_t i = 0; i < old.cap; i++) {
+		if(!QRTZ_MAPFULL(&old, i)) continue;
+		size_t hash = qrtz_maphash(vm, old.data[i]);
+		size_t slot = qrtz_mapinsertslot(map, hash);
+		map->ctrl[slot] = hash & 0x7F;
+		map->data[slot] = old.data[i];
+		map->data[slot + newCap] = old.data[i + old.cap];
+		map->used++;
+		map->len++;
+	}
+	qrtz_mapfree(vm, old.data, old.cap);
+	return QRTZ_OK;
+}
+
+qrtz_Exit qrtz_mapset(qrtz_VM *vm, qrtz_Map *map, qrtz_Value key, qrtz_Value val) {
+	if(QRTZ_ISOBJ(key) && QRTZ_ASOBJ(key)->tag == QRTZ_OSTR) {
+		// hashing ropes needs their bytes, and that can't report running out of memory
+		if(qrtz_strdata(vm, (qrtz_String *)QRTZ_ASOBJ(key)) == NULL) return QRTZ_ENOMEM;
+	}
+	size_t hash = qrtz_maphash(vm, key);
+	if(map->len != 0) {
+		size_t i = qrtz_mapfind(vm, map, key, hash);
+		if(i != map->cap) {
+			map->data[i + map->cap] = val;
+			qrtz_barrier(vm, &map->obj, val);
+			return QRTZ_OK;
+		}
+	}
+	size_t i = map->cap == 0 ? 0 : qrtz_mapinsertslot(map, hash);
+	// reusing a removed slot never needs to grow
+	if(map->cap == 0 || (map->ctrl[i] == QRTZ_CEMPTY && map->used + 1 > map->cap / 8 * 7)) {
+		// if removed slots take up most of the table, rehashing at the same size is enough
+		size_t newCap = map->cap;
+		if(newCap == 0) newCap = QRTZ_MAPGROUP;
+		else if((map->len + 1) * 16 > map->cap * 7) {
+			if(map->cap > SIZE_MAX / 2) return QRTZ_ENOMEM;
+			newCap = map->cap * 2;
+		}
+		qrtz_Exit err = qrtz_mapresize(vm, map, newCap);
+		if(err) return err;
+		i = qrtz_mapinsertslot(map, hash);
+	}
+	if(map->ctrl[i] == QRTZ_CEMPTY) map->used++;
+	map->ctrl[i] = hash & 0x7F;
+	map->data[i] = key;
+	map->data[i + map->cap] = val;
+	map->len++;
+	qrtz_barrier(vm, &map->obj, key);
+	qrtz_barrier(vm, &map->obj, val);
+	return QRTZ_OK;
+}
+
+bool qrtz_mapremove(qrtz_VM *vm, qrtz_Map *map, qrtz_Value key) {
+	if(map->len == 0) return false;
+	size_t i = qrtz_mapfind(vm, map, key, qrtz_maphash(vm, key));
+	if(i == map->cap) return false;
+	qrtz_mapremoveslot(map, i);
+	return true;
+}
+
+void qrtz_mapremoveslot(qrtz_Map *map, size_t i) {
+	// Lookups stop at groups with an empty slot, so if this group has one, no probe sequence
+	// goes through it and the slot can be emptied. Otherwise it must stay as removed.
+	const unsigned char *group = map->ctrl + i / QRTZ_MAPGROUP * QRTZ_MAPGROUP;
+	if(qrtz_groupMatch(group, QRTZ_CEMPTY) != 0) {
+		map->ctrl[i] = QRTZ_CEMPTY;
+		map->used--;
+	} else {
+		map->ctrl[i] = QRTZ_CREMOVED;
+	}
+	map->len--;
+}
+
+void qrtz_mapclear(qrtz_Map *map) {
+	if(map->cap > 0) qrtz_memset(map->ctrl, QRTZ_CEMPTY, map->cap);
+	map->used = 0;
+	map->len = 0;
+}
+
+size_t qrtz_recfield(qrtz_VM *vm, qrtz_RecordType *type, qrtz_Value name) {
+	if(type->fieldIndex != NULL) {
+		qrtz_Value idx;
+		if(!qrtz_mapget(vm, type->fieldIndex, name, &idx)) return type->fieldCount;
+		return QRTZ_ASINT(idx);
+	}
+	for(size_t i = 0; i < type->fieldCount; i++) {
+		if(qrtz_valeq(vm, type->fields[i], name)) return i;
+	}
+	return type->fieldCount;
+}
+
+bool qrtz_recget(qrtz_VM *vm, qrtz_Record *rec, qrtz_Value name, qrtz_Value *val) {
+	size_t i = qrtz_recfield(vm, rec->type, name);
+	if(i == rec->type->fieldCount) return false;
+	*val = rec->values[i];
+	return true;
+}
+
+bool qrtz_recset(qrtz_VM *vm, qrtz_Record *rec, qrtz_Value name, qrtz_Value val) {
+	size_t i = qrtz_recfield(vm, rec->type, name);
+	if(i == rec->type->fieldCount) return false;
+	rec->values[i] = val;
+	qrtz_barrier(vm, &rec->obj, val);
+	return true;
+}
+
+void qrtz_arrayset(qrtz_VM *vm, qrtz_Array *arr, size_t i, qrtz_Value val) {
+	arr->values[i] = val;
+	qrtz_barrier(vm, &arr->obj, val);
+}
+
+void qrtz_pointerset(qrtz_VM *vm, qrtz_Pointer *ptr, qrtz_Value val) {
+	ptr->val = val;
+	qrtz_barrier(vm, &ptr->obj, val);
 }
 
 qrtz_String *qrtz_toStringObject(qrtz_VM *vm, qrtz_Value val) {
-	if(val.tag == QRTZ_VNULL) return qrtz_allocCStringObject(vm, "null");
-	if(val.tag == QRTZ_VBOOL) return qrtz_allocCStringObject(vm, val.boolean ? "true" : "false");
-	if(val.tag == QRTZ_VINT) {
-		return qrtz_allocFStringObject(vm, "%zd", val.integer);
+	qrtz_ValTag tag = QRTZ_VTAG(val);
+	if(tag == QRTZ_VNULL) return qrtz_allocCStringObject(vm, "null");
+	if(tag == QRTZ_VBOOL) return qrtz_allocCStringObject(vm, QRTZ_ASBOOL(val) ? "true" : "false");
+	if(tag == QRTZ_VINT) {
+		return qrtz_allocFStringObject(vm, "%zd", QRTZ_ASINT(val));
+	}
+	if(tag == QRTZ_VNUMBER) {
+		return qrtz_allocFStringObject(vm, "%f", QRTZ_ASNUM(val));
 	}
-	if(val.tag == QRTZ_VNUMBER) {
-		return qrtz_allocFStringObject(vm, "%f", val.number);
+	if(tag == QRTZ_VCFUNC) {
+		return qrtz_allocFStringObject(vm, "<function at %p>", QRTZ_ASCFUNC(val));
 	}
-	if(val.tag == QRTZ_VCFUNC) {
-		return qrtz_allocFStringObject(vm, "<function at %p>", val.cfunc);
+	if(tag == QRTZ_VSSTR) {
+		return qrtz_allocStringObject(vm, QRTZ_SSTRDATA(&val), QRTZ_SSTRLEN(val));
 	}
-	if(val.tag != QRTZ_VOBJ) return NULL;
-	qrtz_Object *o = val.object;
+	if(tag != QRTZ_VOBJ) return NULL;
+	qrtz_Object *o = QRTZ_ASOBJ(val);
 	if(o->tag == QRTZ_OSTR) {
 		return (qrtz_String *)o;
 	}
@@ -306,11 +1734,11 @@ qrtz_String *qrtz_toStringObject(qrtz_VM *vm, qrtz_Value val) {
 		ty = "record";
 		break;
 	}
-	return qrtz_allocFStringObject(vm, "<%s at %p>", ty, val.object);
+	return qrtz_allocFStringObject(vm, "<%s at %p>", ty, o);
 }
 
 bool qrtz_hasError(qrtz_VM *vm) {
-	return vm->curTask->error.tag != QRTZ_VILLEGAL;
+	return QRTZ_VTAG(vm->curTask->error) != QRTZ_VILLEGAL;
 }
 
 qrtz_Exit qrtz_pusherror(qrtz_VM *vm);
@@ -318,14 +1746,11 @@ qrtz_Exit qrtz_pushoom(qrtz_VM *vm);
 qrtz_Exit qrtz_seterror(qrtz_VM *vm, int x);
 
 void qrtz_setoom(qrtz_VM *vm) {
-	vm->curTask->error = (qrtz_Value) {
-		.tag = QRTZ_VOBJ,
-		.object = &vm->oomStr->obj,
-	};
+	vm->curTask->error = QRTZ_MKOBJ(&vm->oomStr->obj);
 }
 
 void qrtz_clearerror(qrtz_VM *vm) {
-	vm->curTask->error.tag = QRTZ_VILLEGAL;
+	vm->curTask->error = QRTZ_MKILLEGAL();
 }
 
 void qrtz_seterroras(qrtz_VM *vm, qrtz_Exit exit) {
@@ -356,8 +1781,5 @@ void qrtz_seterroras(qrtz_VM *vm, qrtz_Exit exit) {
 		qrtz_setoom(vm);
 		return;
 	}
-	vm->curTask->error = (qrtz_Value) {
-		.tag = QRTZ_VOBJ,
-		.object = &s->obj,
-	};
+	vm->curTask->error = QRTZ_MKOBJ(&s->obj);
 }
@@ -20,6 +20,8 @@ typedef enum qrtz_ValTag : char {
 	QRTZ_VCFUNC,
 	// pointer to object
 	QRTZ_VOBJ,
+	// short string stored in the value itself, up to QRTZ_SSTRMAX bytes
+	QRTZ_VSSTR,
 } qrtz_ValTag;
 
 typedef enum qrtz_ObjTag : char {
@@ -37,32 +39,255 @@ typedef enum qrtz_ObjTag : char {
 	QRTZ_OCLOSURE,
 } qrtz_ObjTag;
 
+// Not a tag itself, so switches over tags stay exhaustive. Must be updated along with the last tag.
+#define QRTZ_OCOUNT (QRTZ_OCLOSURE + 1)
+// qrtz_GCStats counts objects per tag
+_Static_assert(QRTZ_OCOUNT == QRTZ_GCKINDS, "QRTZ_GCKINDS must match the number of object tags");
+
+// Values should only ever be inspected and built through the accessor macros below,
+// as their layout depends on QUARTZ_NANBOX.
+#ifdef QUARTZ_NANBOX
+
+// NaN-boxed values. Every value is 8 bytes.
+// Floats are stored as-is, with every NaN canonicalized to a positive quiet NaN.
+// Everything else lives in the payload of a negative quiet NaN, with the tag in bits 48-50
+// and the payload in the lower 48 bits. This means ints are limited to 48 bits,
+// and pointers must fit in 48 bits, which is the case on x86-64 and aarch64.
+typedef uint64_t qrtz_Value;
+
+#define QRTZ_NANBOX_BOXED 0xFFF8000000000000ull
+#define QRTZ_NANBOX_PAYLOAD 0x0000FFFFFFFFFFFFull
+#define QRTZ_NANBOX_CANONNAN 0x7FF8000000000000ull
+#define QRTZ_NANBOX_INTMAX ((intptr_t)0x00007FFFFFFFFFFFll)
+#define QRTZ_NANBOX_INTMIN (-QRTZ_NANBOX_INTMAX - 1)
+
+static inline qrtz_Value qrtz_nanbox(qrtz_ValTag tag, uint64_t payload) {
+	return QRTZ_NANBOX_BOXED | ((uint64_t)(tag & 7) << 48) | (payload & QRTZ_NANBOX_PAYLOAD);
+}
+
+static inline qrtz_ValTag qrtz_nanboxTag(qrtz_Value v) {
+	if((v & QRTZ_NANBOX_BOXED) != QRTZ_NANBOX_BOXED) return QRTZ_VNUMBER;
+	int tag = (v >> 48) & 7;
+	// VILLEGAL is -1, which is stored as 7
+	if(tag == 7) return QRTZ_VILLEGAL;
+	return (qrtz_ValTag)tag;
+}
+
+static inline qrtz_Value qrtz_nanboxNumber(double n) {
+	union { double d; uint64_t u; } pun = {.d = n};
+	if(n != n) return QRTZ_NANBOX_CANONNAN;
+	return pun.u;
+}
+
+static inline double qrtz_nanboxAsNumber(qrtz_Value v) {
+	union { double d; uint64_t u; } pun = {.u = v};
+	return pun.d;
+}
+
+static inline intptr_t qrtz_nanboxAsInt(qrtz_Value v) {
+	// sign-extend the 48-bit payload
+	return (intptr_t)((int64_t)(v << 16) >> 16);
+}
+
+#define QRTZ_VTAG(v) qrtz_nanboxTag(v)
+#define QRTZ_ASBOOL(v) ((bool)((v) & 1))
+#define QRTZ_ASINT(v) qrtz_nanboxAsInt(v)
+#define QRTZ_ASNUM(v) qrtz_nanboxAsNumber(v)
+#define QRTZ_ASCFUNC(v) ((qrtz_CFunction *)(uintptr_t)((v) & QRTZ_NANBOX_PAYLOAD))
+#define QRTZ_ASOBJ(v) ((struct qrtz_Object *)(uintptr_t)((v) & QRTZ_NANBOX_PAYLOAD))
+
+#define QRTZ_MKILLEGAL() qrtz_nanbox(QRTZ_VILLEGAL, 0)
+#define QRTZ_MKNULL() qrtz_nanbox(QRTZ_VNULL, 0)
+#define QRTZ_MKBOOL(b) qrtz_nanbox(QRTZ_VBOOL, (b) ? 1 : 0)
+// i must fit in 48 bits, or it is cut to them. qrtz_mkint checks.
+#define QRTZ_MKINT(i) qrtz_nanbox(QRTZ_VINT, (uint64_t)(intptr_t)(i))
+#define QRTZ_INTFITS(i) ((i) >= QRTZ_NANBOX_INTMIN && (i) <= QRTZ_NANBOX_INTMAX)
+#define QRTZ_MKNUM(n) qrtz_nanboxNumber(n)
+#define QRTZ_MKCFUNC(f) qrtz_nanbox(QRTZ_VCFUNC, (uint64_t)(uintptr_t)(f))
+#define QRTZ_MKOBJ(o) qrtz_nanbox(QRTZ_VOBJ, (uint64_t)(uintptr_t)(o))
+
+// Short strings are stored in the low bytes of the payload, NUL-terminated, with the length in byte 5.
+// Their data is read in-place, so this only works on little-endian machines.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define QRTZ_SSTRMAX 4
+#else
+#define QRTZ_SSTRMAX 0
+#endif
+#define QRTZ_SSTRLEN(v) ((size_t)(((v) >> 40) & 0xFF))
+// takes a pointer to the value, as the bytes live in it
+#define QRTZ_SSTRDATA(vp) ((const char *)(vp))
+
+static inline qrtz_Value qrtz_mksstr(const char *s, size_t len) {
+	uint64_t payload = (uint64_t)len << 40;
+	for(size_t i = 0; i < len; i++) payload |= (uint64_t)(unsigned char)s[i] << (i * 8);
+	return qrtz_nanbox(QRTZ_VSSTR, payload);
+}
+
+#else
+
+// Tagged union values. Every value is 16 bytes, but ints are full intptr_t's.
 typedef struct qrtz_Value {
 	qrtz_ValTag tag;
+	// length of a short string, it goes in what would be padding
+	unsigned char sslen;
 	union {
 		bool boolean;
 		intptr_t integer;
 		double number;
 		qrtz_CFunction *cfunc;
 		struct qrtz_Object *object;
+		// NUL-terminated short string
+		char sstr[8];
 	};
 } qrtz_Value;
 
+#define QRTZ_VTAG(v) ((v).tag)
+#define QRTZ_ASBOOL(v) ((v).boolean)
+#define QRTZ_ASINT(v) ((v).integer)
+#define QRTZ_ASNUM(v) ((v).number)
+#define QRTZ_ASCFUNC(v) ((v).cfunc)
+#define QRTZ_ASOBJ(v) ((v).object)
+
+#define QRTZ_MKILLEGAL() ((qrtz_Value) {.tag = QRTZ_VILLEGAL})
+#define QRTZ_MKNULL() ((qrtz_Value) {.tag = QRTZ_VNULL})
+#define QRTZ_MKBOOL(b) ((qrtz_Value) {.tag = QRTZ_VBOOL, .boolean = (b)})
+#define QRTZ_MKINT(i) ((qrtz_Value) {.tag = QRTZ_VINT, .integer = (i)})
+#define QRTZ_INTFITS(i) true
+#define QRTZ_MKNUM(n) ((qrtz_Value) {.tag = QRTZ_VNUMBER, .number = (n)})
+#define QRTZ_MKCFUNC(f) ((qrtz_Value) {.tag = QRTZ_VCFUNC, .cfunc = (f)})
+#define QRTZ_MKOBJ(o) ((qrtz_Value) {.tag = QRTZ_VOBJ, .object = (struct qrtz_Object *)(o)})
+
+#define QRTZ_SSTRMAX 7
+#define QRTZ_SSTRLEN(v) ((size_t)(v).sslen)
+// takes a pointer to the value, as the bytes live in it
+#define QRTZ_SSTRDATA(vp) ((const char *)(vp)->sstr)
+
+static inline qrtz_Value qrtz_mksstr(const char *s, size_t len) {
+	qrtz_Value v;
+	v.tag = QRTZ_VSSTR;
+	v.sslen = (unsigned char)len;
+	for(size_t i = 0; i < sizeof(v.sstr); i++) v.sstr[i] = i < len ? s[i] : '\0';
+	return v;
+}
+
+#endif
+
+#define QRTZ_ISOBJ(v) (QRTZ_VTAG(v) == QRTZ_VOBJ)
+
+// Builds an int from any intptr_t. Ones too big for the value layout become the nearest float,
+// so they keep their magnitude rather than being cut to their low bits.
+static inline qrtz_Value qrtz_mkint(intptr_t i) {
+	if(!QRTZ_INTFITS(i)) return QRTZ_MKNUM((double)i);
+	return QRTZ_MKINT(i);
+}
+// builds a short string value. len must be at most QRTZ_SSTRMAX.
+#define QRTZ_MKSSTR(s, len) qrtz_mksstr((s), (len))
+
+typedef enum qrtz_GCFlags {
+	// in the remembered set
+	QRTZ_GCREMEMBERED = 1<<0,
+	// not in a page, but allocated on its own, after a qrtz_LargeObject
+	QRTZ_GCLARGE = 1<<1,
+	// An object which was moved, by a minor collection or by compaction.
+	// It is dead, and the first word after the header is where it went.
+	QRTZ_GCFORWARDED = 1<<2,
+	// A young string which was copied to the old generation while still in use.
+	// The copy is in the VM's tenured list, at the index stored in idhash.
+	QRTZ_GCTENURED = 1<<3,
+	// pinned by the host, which makes it a root, and keeps compaction from moving it
+	QRTZ_GCPINNED = 1<<4,
+	// Compaction never moves it, as the host was given pointers into it.
+	// It is never cleared, as those pointers stay valid for as long as the object lives.
+	QRTZ_GCFIXED = 1<<5,
+} qrtz_GCFlags;
+
+// Kept as small as possible, as it is on every object.
+// Mark bits and gray lists are kept on the side, in pages and in the VM.
 typedef struct qrtz_Object {
-	struct qrtz_Object *next;
-	struct qrtz_Object *nextGray;
 	qrtz_ObjTag tag;
-	bool marked;
+	unsigned char gcflags;
+	union {
+		// in the nursery, how many minor collections it survived
+		unsigned char age;
+		// in a page, how far from its start it is, in units of 8 bytes
+		unsigned short pageOffset;
+	};
+	// Identity hash, as objects can move. 0 until first used.
+	// Strings have content hashes, so they never need it.
+	uint32_t idhash;
 } qrtz_Object;
 
+typedef enum qrtz_StrFlags {
+	// the string is in the VM's intern table.
+	// Two interned strings are equal if and only if they are the same object.
+	QRTZ_SINTERNED = 1<<0,
+	// the hash has been computed. It is computed lazily, on first use as a key.
+	QRTZ_SHASHED = 1<<1,
+	// the string is a qrtz_Rope, and has no data of its own
+	QRTZ_SROPE = 1<<2,
+	// the string is a qrtz_ExternString, and its data is owned by the host
+	QRTZ_SEXTERN = 1<<3,
+	// the string is a qrtz_SliceString, and its data is part of another string
+	QRTZ_SSLICE = 1<<4,
+	// a slice whose parent's bytes were handed to the host, so its parent is never copied out of
+	QRTZ_SSHARED = 1<<5,
+} qrtz_StrFlags;
+
 typedef struct qrtz_String {
 	qrtz_Object obj;
-	// cached string hash
+	// cached string hash, only valid with QRTZ_SHASHED
 	size_t hash;
 	size_t len;
+	unsigned char flags;
 	char data[];
 } qrtz_String;
 
+// A lazy concatenation of 2 strings.
+// The bytes are only copied once something needs them contiguous, at which point
+// the children are dropped and the flat copy is kept.
+typedef struct qrtz_Rope {
+	// must match the start of qrtz_String
+	qrtz_Object obj;
+	size_t hash;
+	size_t len;
+	unsigned char flags;
+	// NULL once flattened
+	qrtz_String *left;
+	qrtz_String *right;
+	// NULL until flattened
+	qrtz_String *flat;
+	// 1 more than the deepest child. Flat strings have a depth of 0.
+	size_t depth;
+} qrtz_Rope;
+
+// A string referencing host memory, which is released once it is collected.
+typedef struct qrtz_ExternString {
+	// must match the start of qrtz_String
+	qrtz_Object obj;
+	size_t hash;
+	size_t len;
+	unsigned char flags;
+	const char *ptr;
+	qrtz_StringRelease *release;
+	void *userdata;
+	// NUL-terminated copy, only made if something needs one
+	qrtz_String *cstr;
+} qrtz_ExternString;
+
+// A substring, referencing the bytes of its parent.
+typedef struct qrtz_SliceString {
+	// must match the start of qrtz_String
+	qrtz_Object obj;
+	size_t hash;
+	size_t len;
+	unsigned char flags;
+	// never a rope or a slice
+	qrtz_String *parent;
+	size_t offset;
+	// NUL-terminated copy, only made if something needs one
+	qrtz_String *cstr;
+} qrtz_SliceString;
+
 typedef struct qrtz_Array {
 	qrtz_Object obj;
 	size_t len;
@@ -70,17 +295,28 @@ typedef struct qrtz_Array {
 	qrtz_Value values[];
 } qrtz_Array;
 
+// maps are probed a group of slots at a time
+#define QRTZ_MAPGROUP 16
+// control bytes of slots which are not full. Full slots store the low 7 bits of their key's hash.
+#define QRTZ_CEMPTY 0x80
+#define QRTZ_CREMOVED 0xFE
+#define QRTZ_MAPFULL(map, i) ((map)->ctrl[i] < QRTZ_CEMPTY)
+
 typedef struct qrtz_Map {
 	qrtz_Object obj;
+	// full and removed slots, as both make lookups keep probing
 	size_t used;
+	// 0 or a power of 2, at least QRTZ_MAPGROUP
 	size_t cap;
 	// separate from used, just to keep len() O(1)
 	size_t len;
 	// There first is an array of keys, then an array of values.
-	// They are cap apart.
-	// A key being set to VILLEGAL means unallocated.
-	// A value being set to VILLEGAL means allocated but removed.
+	// They are cap apart, and only set for full slots.
 	qrtz_Value *data;
+	// one control byte per slot, stored in the same allocation, after data
+	unsigned char *ctrl;
+	// qrtz_WeakFlags
+	unsigned char weak;
 } qrtz_Map;
 
 typedef struct qrtz_Pointer {
@@ -96,9 +332,38 @@ typedef struct qrtz_Userdata {
 	qrtz_Value associated[];
 } qrtz_Userdata;
 
+typedef struct qrtz_FinalizerType {
+	char *type;
+	qrtz_Finalizer *finalizer;
+	void *userdata;
+} qrtz_FinalizerType;
+
+// a userdata whose type had a finalizer when it was made
+typedef struct qrtz_Finalizable {
+	// NULL once it is found dead
+	qrtz_Userdata *obj;
+	// copied from the userdata once it is found dead, as it is freed before the finalizer runs
+	void *pointer;
+	qrtz_Finalizer *finalizer;
+	void *userdata;
+} qrtz_Finalizable;
+
+// a call stack and kind of object allocation samples were taken at
+typedef struct qrtz_ProfileSite {
+	// the line of the collapsed stack format, without the bytes
+	char *stack;
+	size_t len;
+	size_t hash;
+	// estimated bytes allocated here
+	size_t bytes;
+} qrtz_ProfileSite;
+
 typedef struct qrtz_CallEntry {
 	int stacktop;
 	bool isC;
+	// the function called and the line it is at, for allocation profiles. NULL if unknown.
+	const char *name;
+	size_t line;
 } qrtz_CallEntry;
 
 typedef struct qrtz_Task {
@@ -125,7 +390,8 @@ typedef struct qrtz_Task {
 } qrtz_Task;
 
 typedef struct qrtz_ProgramEntry {
-	// a NULL name is reserved for the initialization logic
+	// a NULL name is reserved for the initialization logic.
+	// Names are owned by the program, and allocated from the VM.
 	char *name;
 	size_t len;
 	qrtz_Value val;
@@ -136,6 +402,7 @@ typedef struct qrtz_Program {
 	qrtz_Map *globals;
 	qrtz_String *name;
 	size_t entryCount;
+	// owned by the program, and allocated from the VM, like locals
 	qrtz_ProgramEntry *entries;
 	size_t localCount;
 	// Similar to stack entries, VILLEGAL means pointer to value.
@@ -157,15 +424,31 @@ typedef struct qrtz_Instruction {
 	size_t line;
 } qrtz_Instruction;
 
+// The shape shared by every record of a type. Field i of a record is stored in its values[i],
+// so once the index of a field is known, reading it is a single load.
 typedef struct qrtz_RecordType {
 	qrtz_Object obj;
 	qrtz_String *name;
+	size_t fieldCount;
+	// the names of the fields, as strings
+	qrtz_Value *fields;
+	// maps field names to their index.
+	// NULL if there are at most QRTZ_RECSCANMAX fields, in which case they are scanned.
+	qrtz_Map *fieldIndex;
 } qrtz_RecordType;
 
+// An instance of a record type. It has no table of its own, its fields are found through its type.
+typedef struct qrtz_Record {
+	qrtz_Object obj;
+	qrtz_RecordType *type;
+	qrtz_Value values[];
+} qrtz_Record;
+
 typedef struct qrtz_Function {
 	qrtz_Object obj;
 	qrtz_Program *program;
 	size_t codesize;
+	// stored right after the function, in the same allocation
 	qrtz_Instruction *inst;
 } qrtz_Function;
 
@@ -176,41 +459,509 @@ typedef struct qrtz_Closure {
 	qrtz_Pointer *upvals[];
 } qrtz_Closure;
 
+typedef enum qrtz_GCState {
+	// no cycle in progress
+	QRTZ_GCIDLE,
+	// marking incrementally, between allocations
+	QRTZ_GCMARK,
+	// finishing marking in one go, at a safe point
+	QRTZ_GCATOMIC,
+	// freeing unmarked objects incrementally, between allocations
+	QRTZ_GCSWEEP,
+} qrtz_GCState;
+
+// old objects up to this size are allocated in pages, bigger ones on their own
+#define QRTZ_SMALLOBJMAX 256
+#define QRTZ_SIZECLASSES 15
+// Page bitmaps have a bit per 16 bytes, which is the smallest size class.
+// This makes the bit of an object depend only on its offset in the page.
+#define QRTZ_PAGEGRANULES (QRTZ_PAGESIZE / 16)
+
+// A page of equally sized slots, each of which is either free or holds an object.
+typedef struct qrtz_Page {
+	// the next page of the same size class, or the next page to sweep
+	struct qrtz_Page *next;
+	// the next page of the same size class with free slots
+	struct qrtz_Page *nextAvail;
+	// free slots, linked through their first word
+	void *free;
+	size_t sizeClass;
+	size_t slotSize;
+	size_t slotCount;
+	// slots past this one were never used, and are not in the free list
+	size_t fresh;
+	// set while compaction moves objects out of it
+	bool evacuating;
+	// slots holding objects
+	size_t used;
+	char *slots;
+	// set for slots holding objects
+	uint64_t allocated[(QRTZ_PAGEGRANULES + 63) / 64];
+	// set for objects marked by the current cycle
+	uint64_t marked[(QRTZ_PAGEGRANULES + 63) / 64];
+} qrtz_Page;
+
+// The header of an object too big for pages. The object follows it.
+typedef struct qrtz_LargeObject {
+	struct qrtz_LargeObject *next;
+	// of the object, without the header
+	size_t size;
+	bool marked;
+} qrtz_LargeObject;
+
+// a page or large object of one VM, and its copy in another
+typedef struct qrtz_HeapBlock {
+	char *from;
+	char *to;
+} qrtz_HeapBlock;
+
+// Where qrtz_heapClone copied the pages and large objects of a VM to.
+// Open-addressed by the address of the original, cap is a power of 2.
+typedef struct qrtz_HeapCopy {
+	qrtz_HeapBlock *blocks;
+	size_t cap;
+} qrtz_HeapCopy;
+
+// How fast something happens, kept as sums of amounts and the time they took, which older
+// measurements count for less and less in. Short measurements barely move it.
+typedef struct qrtz_Rate {
+	double amount;
+	double time;
+} qrtz_Rate;
+
+// Where marking keeps track of what is left to do. The VM has one, and so does each
+// thread of a parallel mark.
+typedef struct qrtz_Marker {
+	struct qrtz_VM *vm;
+	// Marked objects which still have to be scanned.
+	// If it can't grow, overflow is set, and marked objects are found by scanning the heap.
+	qrtz_Object **gray;
+	size_t grayLen;
+	size_t grayCap;
+	bool overflow;
+	// slices found while marking, whose parents are not marked yet
+	qrtz_Object **slices;
+	size_t slicesLen;
+	size_t slicesCap;
+	// weak maps found while marking, whose dead entries are removed once marking is over
+	qrtz_Object **weak;
+	size_t weakLen;
+	size_t weakCap;
+	// bytes of objects scanned, which mark steps are budgeted in
+	size_t work;
+	// objects marked, and bytes of them, by tag
+	size_t liveCount[QRTZ_GCKINDS];
+	size_t liveBytes[QRTZ_GCKINDS];
+	// Set for the markers of parallel marks, which must set mark bits atomically.
+	// Their lists are not counted in the memory usage.
+	bool parallel;
+} qrtz_Marker;
+
+// an object pinned by the host, and how many times
+typedef struct qrtz_Pin {
+	qrtz_Object *obj;
+	size_t count;
+} qrtz_Pin;
+
 typedef struct qrtz_VM {
 	// context we care about
 	qrtz_Context ctx;
-	// every object there is
-	qrtz_Object *heap;
-	// gray set, stuff the GC is currently marking
-	qrtz_Object *graySet;
+	// Every object not in the nursery is either in a page, or a large object.
+	// Pages of each size class, all of them and the ones with free slots.
+	qrtz_Page *pages[QRTZ_SIZECLASSES];
+	qrtz_Page *availPages[QRTZ_SIZECLASSES];
+	qrtz_LargeObject *largeObjects;
+	// Pages and large objects still to be swept, which are in neither of the above.
+	// Pages are kept by size class, so allocating can sweep the ones it needs.
+	qrtz_Page *sweepPages[QRTZ_SIZECLASSES];
+	qrtz_LargeObject *sweepLarge;
+	// Sweeping on another thread, if the host allows it. The thread takes pages out of sweepPages,
+	// and leaves them in sweptPages, or in releasePages if their dead objects have something to release,
+	// which only the VM's thread can do. All 3 are guarded by sweepLock.
+	bool gcBackgroundSweep;
+	void *sweepThread;
+	bool sweepLock;
+	// set to make the thread stop early, and by the thread once it is done
+	bool sweepStop;
+	bool sweepDone;
+	qrtz_Page *sweptPages;
+	qrtz_Page *releasePages;
+	// memory freed by the thread, which is taken off memUsage by the VM's thread,
+	// and bytes of the objects it found dead, which are added to the stats
+	size_t sweptBytes;
+	size_t sweptObjectBytes;
+	qrtz_Marker marker;
 	size_t memUsage;
 	size_t memTarget;
 	double gcPause;
 	qrtz_Map *globals;
 	qrtz_Map *registry;
 	qrtz_Map *loaded;
+	// copies of the above, which qrtz_reset restores them from. NULL if there is no reset point.
+	qrtz_Map *resetGlobals;
+	qrtz_Map *resetRegistry;
+	qrtz_Map *resetLoaded;
 	// the main task. Cannot suspend, but can wait for others.
 	qrtz_Task *mainTask;
 	// Current task. Shortcut to not have to traverse the waitingFor chain every time.
 	qrtz_Task *curTask;
 	// the out of memory error object
 	qrtz_String *oomStr;
+	// weak intern table of short strings.
+	// Open-addressed, cap is a power of 2, NULL means empty.
+	qrtz_String **strings;
+	size_t stringsLen;
+	size_t stringsCap;
+	// set while a GC cycle is running, to prevent re-entrancy
+	bool gcRunning;
+	// per-VM random seed for string hashes
+	size_t hashSeed;
+	qrtz_GCState gcState;
+	// Objects which change too often to use write barriers, like tasks.
+	// They are scanned again once marking is over.
+	qrtz_Object **grayAgain;
+	size_t grayAgainLen;
+	size_t grayAgainCap;
+	// Bytes allocated so far, which incremental steps are spaced by. Unlike the memory usage,
+	// it goes up when swept memory is reused, so steps keep coming while sweeping lazily.
+	size_t gcAllocated;
+	// the value of gcAllocated at which the next incremental step runs
+	size_t gcStepAt;
+	// 0 for stop-the-world collection
+	size_t gcStepSize;
+	double gcStepMul;
+	// what steps actually use, which the pacer raises when memory gets close to the goal
+	double gcPaceMul;
+	// the step size actually used, which the pacer picks from the pause target, or gcStepSize
+	size_t gcPaceStep;
+	// the pacer is on if either is not 0, and the context has a clock
+	double gcPauseTarget;
+	size_t memLimit;
+	// bytes found alive per second spent collecting, and bytes allocated per second
+	qrtz_Rate gcCollectRate;
+	qrtz_Rate gcAllocRate;
+	// time spent on the current cycle so far
+	double gcCycleTime;
+	// bytes of objects the last cycle found alive
+	size_t gcLive;
+	// when the current or last cycle started, and gcAllocated then
+	double gcCycleStart;
+	size_t gcCycleAllocated;
+	// how many threads may mark at once, if the context can start them
+	size_t gcThreads;
+	qrtz_GCStats gcStats;
+	// how deep calls into the collector are nested, and when the outermost one started
+	size_t gcPauseDepth;
+	double gcPauseStart;
+	// The nursery, then the 2 survivor spaces, in 1 allocation. NULL if disabled.
+	// It is only allocated into while no major cycle is in progress.
+	char *nursery;
+	// of all 3
+	size_t nurserySize;
+	char *bump;
+	char *bumpEnd;
+	char *survivors[2];
+	// the survivor space objects are copied into, the other one holds the previous survivors
+	int toSpace;
+	// only not 0 if the last minor collection ran out of memory
+	size_t toUsed;
+	// bytes of young objects, dead ones included, which the next minor collection frees all but the survivors of
+	size_t youngBytes;
+	// the nursery filled up, and a minor collection should run at the next safe point
+	bool minorPending;
+	// Mark bits of young objects, one per QRTZ_NURSERYALIGN bytes of the nursery. They are only used by a major cycle
+	// which could not promote every young object first, after running out of memory, and are cleared once it is done marking.
+	uint64_t *youngMarks;
+	// the current major cycle started with objects left in the nursery
+	bool youngLeft;
+	// old objects which may reference young ones
+	qrtz_Object **remembered;
+	size_t rememberedLen;
+	size_t rememberedCap;
+	// the remembered set could not grow, so the whole old generation must be scanned
+	bool rememberedOverflow;
+	// interned strings in the nursery, which the intern table must stop referencing once they move or die
+	qrtz_String **youngStrings;
+	size_t youngStringsLen;
+	size_t youngStringsCap;
+	// old copies of young strings with QRTZ_GCTENURED
+	qrtz_Object **tenured;
+	size_t tenuredLen;
+	size_t tenuredCap;
+	// Objects pinned by the host, each in here once, along with how many pins it has.
+	qrtz_Pin *pinned;
+	size_t pinnedLen;
+	size_t pinnedCap;
+	// Open addressed by address, holding the position of each pinned object plus one, or 0 when empty.
+	// Pinned objects never move, so their address is a stable key.
+	size_t *pinIndex;
+	size_t pinIndexCap;
+	qrtz_FinalizerType *finalizerTypes;
+	size_t finalizerTypesLen;
+	size_t finalizerTypesCap;
+	// Userdata with finalizers. The first finalizableLen are alive, and the finalizePending after them
+	// were found dead, and are finalized once the collector is done.
+	qrtz_Finalizable *finalizable;
+	size_t finalizableLen;
+	size_t finalizePending;
+	size_t finalizableCap;
+	// external strings with a release function, which are released even if the context frees everything at once
+	size_t externStrings;
+	// Allocation profiling, see qrtz_setAllocProfile. The next sample is taken once profileAllocated reaches profileAt,
+	// which is SIZE_MAX while profiling is off. Samples are allocated from the context, so they don't count as VM memory.
+	size_t profileRate;
+	size_t profileAt;
+	// bytes of objects the program allocated, unlike gcStats.allocated, which also counts what collections copy
+	size_t profileAllocated;
+	uint64_t profileSeed;
+	qrtz_ProfileSite *profile;
+	size_t profileLen;
+	size_t profileCap;
+	// open addressed by the hash of the stack, holding the index of each site plus one, or 0 when empty
+	size_t *profileIndex;
+	size_t profileIndexCap;
+	uint32_t lastIdHash;
 } qrtz_VM;
 
+// whether an object is in the nursery
+#define QRTZ_ISYOUNG(vm, o) ((uintptr_t)(o) - (uintptr_t)(vm)->nursery < (vm)->nurserySize)
+// nursery objects are kept aligned to this
+#define QRTZ_NURSERYALIGN sizeof(void *)
+// how many words of young mark bits a nursery of this size needs
+#define QRTZ_YOUNGMARKWORDS(size) (((size) / QRTZ_NURSERYALIGN + 63) / 64)
+
+// the page an object which is not large is in
+static inline qrtz_Page *qrtz_pageOf(qrtz_Object *obj) {
+	return (qrtz_Page *)((char *)obj - (size_t)obj->pageOffset * 8);
+}
+
+// the index of the bit of something in a page bitmap
+#define QRTZ_GRANULE(page, p) ((size_t)((char *)(p) - (char *)(page)) / 16)
+
+// Mark bits of old objects. Major cycles usually start with an empty nursery, and when they
+// can't, young objects have mark bits in the VM instead, which qrtz_isLive in gc.c also checks.
+static inline bool qrtz_isMarked(qrtz_Object *obj) {
+	if(obj->gcflags & QRTZ_GCLARGE) return ((qrtz_LargeObject *)obj - 1)->marked;
+	qrtz_Page *page = qrtz_pageOf(obj);
+	size_t g = QRTZ_GRANULE(page, obj);
+	return (page->marked[g / 64] >> (g % 64)) & 1;
+}
+
+// marks an object, returning whether it already was
+static inline bool qrtz_setMarked(qrtz_Object *obj) {
+	if(obj->gcflags & QRTZ_GCLARGE) {
+		qrtz_LargeObject *large = (qrtz_LargeObject *)obj - 1;
+		bool was = large->marked;
+		large->marked = true;
+		return was;
+	}
+	qrtz_Page *page = qrtz_pageOf(obj);
+	size_t g = QRTZ_GRANULE(page, obj);
+	uint64_t bit = 1ull << (g % 64);
+	bool was = (page->marked[g / 64] & bit) != 0;
+	page->marked[g / 64] |= bit;
+	return was;
+}
+
+// The GC only uses other threads where the compiler has atomics built in.
+#if defined(__GNUC__) || defined(__clang__)
+#define QRTZ_THREADS
+
+static inline void qrtz_spinPause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline void qrtz_spinLock(bool *lock) {
+	while(__atomic_exchange_n(lock, true, __ATOMIC_ACQUIRE)) {
+		while(__atomic_load_n(lock, __ATOMIC_RELAXED)) qrtz_spinPause();
+	}
+}
+
+static inline void qrtz_spinUnlock(bool *lock) {
+	__atomic_store_n(lock, false, __ATOMIC_RELEASE);
+}
+#else
+// without threads, nothing is ever contended
+static inline void qrtz_spinLock(bool *lock) {
+	(void)lock;
+}
+
+static inline void qrtz_spinUnlock(bool *lock) {
+	(void)lock;
+}
+#endif
+
+// calls value and object on every reference an object has, which may change them
+typedef struct qrtz_RefVisitor {
+	void (*value)(struct qrtz_RefVisitor *visitor, qrtz_Value *val);
+	void (*object)(struct qrtz_RefVisitor *visitor, qrtz_Object **obj);
+	qrtz_VM *vm;
+} qrtz_RefVisitor;
+
 qrtz_Object *qrtz_allocObject(qrtz_VM *vm, qrtz_ObjTag tag, size_t objSize);
+// allocates straight into the old generation, for objects which must never move
+qrtz_Object *qrtz_allocOldObject(qrtz_VM *vm, qrtz_ObjTag tag, size_t objSize);
 qrtz_String *qrtz_allocStringObject(qrtz_VM *vm, const char *data, size_t len);
 qrtz_Array *qrtz_allocArrayObject(qrtz_VM *vm, size_t cap);
 qrtz_Map *qrtz_allocMapObject(qrtz_VM *vm, size_t cap);
 qrtz_Pointer *qrtz_allocPointerObject(qrtz_VM *vm);
 qrtz_Task *qrtz_allocTaskObject(qrtz_VM *vm, qrtz_Map *globals);
+// The field names are copied. Returns NULL if out of memory, or if two fields have the same name,
+// as only the first of them could ever be found.
+qrtz_RecordType *qrtz_allocRecordTypeObject(qrtz_VM *vm, qrtz_String *name, const qrtz_Value *fields, size_t fieldCount);
+// every field starts as null
+qrtz_Record *qrtz_allocRecordObject(qrtz_VM *vm, qrtz_RecordType *type);
+// The type is copied, and every associated value starts as null.
+// If the type has a finalizer, it is called with the pointer once the userdata is collected.
+qrtz_Userdata *qrtz_allocUserdataObject(qrtz_VM *vm, void *pointer, const char *type, size_t associatedLen);
 
 qrtz_String *qrtz_allocCStringObject(qrtz_VM *vm, const char *s);
 qrtz_String *qrtz_allocFStringObject(qrtz_VM *vm, const char *fmt, ...);
 qrtz_String *qrtz_vallocFStringObject(qrtz_VM *vm, const char *fmt, va_list args); 
+// Formats a string value. Strings short enough to be stored inline never allocate.
+// Returns false if it runs out of memory.
+bool qrtz_vformatval(qrtz_VM *vm, qrtz_Value *out, const char *fmt, va_list args);
 
+// Frees what an object owns, but not the object itself, as its memory belongs to the heap.
+// It must not look at other objects, as they may have been freed already.
+void qrtz_objrelease(qrtz_VM *vm, qrtz_Object *obj);
+// whether qrtz_objrelease does anything for an object
+bool qrtz_objNeedsRelease(qrtz_Object *obj);
+// Gives an object copied from another VM its own copies of what it owns, without fixing its references.
+// Returns false if it runs out of memory, in which case it still owns nothing, and must not be released.
+bool qrtz_objclone(qrtz_VM *vm, qrtz_Object *obj);
+
+// allocates zeroed memory for an old object, in a page if it is small enough
+void *qrtz_heapalloc(qrtz_VM *vm, size_t size);
+// Moves every page and large object to the sweep lists, once marking is over.
+// Until they are swept, allocating sweeps the pages of the size class it needs.
+void qrtz_heapStartSweep(qrtz_VM *vm);
+// starts sweeping on another thread, if the host allows it
+void qrtz_heapSweepInBackground(qrtz_VM *vm);
+// whether nothing is left for qrtz_heapSweep to do but pick up what the background thread did
+bool qrtz_heapSweepDone(qrtz_VM *vm);
+// Sweeps until about budget bytes worth of objects are done.
+// Returns true once there is nothing left to sweep, which, with SIZE_MAX, is always the case.
+bool qrtz_heapSweep(qrtz_VM *vm, size_t budget);
+// calls fn on every old object, including ones which are still to be swept
+void qrtz_heapEach(qrtz_VM *vm, void (*fn)(qrtz_Object *obj, void *userdata), void *userdata);
+// releases every old object, and frees the pages and large objects
+void qrtz_heapDestroy(qrtz_VM *vm);
+// Stops using the heap without freeing it, for contexts which free everything at once.
+// Only what the host gave it is released.
+void qrtz_heapAbandon(qrtz_VM *vm);
+// Copies the pages and large objects of another VM, whose sweeping must be over, and what their objects own.
+// References are left pointing into the original, for qrtz_heapCopyOf to fix.
+// Returns false if it runs out of memory, in which case only the objects copied in full are in the heap.
+bool qrtz_heapClone(qrtz_VM *vm, qrtz_VM *from, qrtz_HeapCopy *copy);
+// where an object of the original is in the copy, or NULL if it was not copied
+qrtz_Object *qrtz_heapCopyOf(qrtz_HeapCopy *copy, qrtz_Object *obj);
+void qrtz_freeHeapCopy(qrtz_VM *vm, qrtz_HeapCopy *copy);
+// Picks the pages compaction should empty, which stop being allocated into.
+// Returns false if no page is worth it. Sweeping must be over.
+bool qrtz_heapStartEvacuation(qrtz_VM *vm);
+// calls fn on every object in the pages being emptied
+void qrtz_heapEachEvacuated(qrtz_VM *vm, void (*fn)(qrtz_Object *obj, void *userdata), void *userdata);
+// Frees the slots of forwarded objects in the pages being emptied, once nothing references them.
+void qrtz_heapFinishEvacuation(qrtz_VM *vm);
 size_t qrtz_objmemsizeof(qrtz_Object *obj);
-size_t qrtz_strhash(const char *s, size_t len);
-size_t qrtz_valhash(qrtz_Value val);
+size_t qrtz_strhash(const char *s, size_t len, size_t seed);
+// gets the hash of a string, computing and caching it if needed
+size_t qrtz_strgethash(qrtz_VM *vm, qrtz_String *s);
+// gets the contiguous bytes of a string, flattening it if needed.
+// They are NUL-terminated, unless it is an external string.
+// Returns NULL if it runs out of memory.
+const char *qrtz_strdata(qrtz_VM *vm, qrtz_String *s);
+// like qrtz_strdata, but always NUL-terminated, which may copy external strings.
+const char *qrtz_strcstr(qrtz_VM *vm, qrtz_String *s);
+qrtz_String *qrtz_allocExternStringObject(qrtz_VM *vm, const char *str, size_t len, qrtz_StringRelease *release, void *userdata);
+// gets part of a string, which must be in bounds.
+// Long enough substrings are slices, which do not copy the bytes.
+qrtz_String *qrtz_substringObject(qrtz_VM *vm, qrtz_String *s, size_t start, size_t len);
+qrtz_String *qrtz_concatStringObjects(qrtz_VM *vm, qrtz_String *a, qrtz_String *b);
+// gets a string as a value, as a short string if it is short enough
+qrtz_Value qrtz_strval(qrtz_String *s);
+// gets any string value, including short strings, as a string object
+qrtz_String *qrtz_strobj(qrtz_VM *vm, qrtz_Value val);
+size_t qrtz_valhash(qrtz_VM *vm, qrtz_Value val);
+// Ropes are flattened to compare them. If that runs out of memory, they are considered different.
+bool qrtz_streq(qrtz_VM *vm, qrtz_String *a, qrtz_String *b);
+bool qrtz_valeq(qrtz_VM *vm, qrtz_Value a, qrtz_Value b);
 qrtz_String *qrtz_toStringObject(qrtz_VM *vm, qrtz_Value val);
 
+// removes a string from the intern table, if it is in it
+void qrtz_uninternString(qrtz_VM *vm, qrtz_String *s);
+// removes every unmarked string from the intern table, so they can't be found again before being swept
+void qrtz_sweepInterned(qrtz_VM *vm);
+
+// gets the value associated with a key. Returns false if it is not present.
+bool qrtz_mapget(qrtz_VM *vm, qrtz_Map *map, qrtz_Value key, qrtz_Value *val);
+qrtz_Exit qrtz_mapset(qrtz_VM *vm, qrtz_Map *map, qrtz_Value key, qrtz_Value val);
+// removes a key. Returns false if it was not present.
+bool qrtz_mapremove(qrtz_VM *vm, qrtz_Map *map, qrtz_Value key);
+// removes the entry in a full slot
+void qrtz_mapremoveslot(qrtz_Map *map, size_t i);
+// removes every entry, keeping the capacity
+void qrtz_mapclear(qrtz_Map *map);
+
+// gets the index of a field, or the field count if the type has no such field
+size_t qrtz_recfield(qrtz_VM *vm, qrtz_RecordType *type, qrtz_Value name);
+// gets a field by name. Returns false if there is no such field.
+bool qrtz_recget(qrtz_VM *vm, qrtz_Record *rec, qrtz_Value name, qrtz_Value *val);
+// sets a field by name. Returns false if there is no such field, as records can't gain fields.
+bool qrtz_recset(qrtz_VM *vm, qrtz_Record *rec, qrtz_Value name, qrtz_Value val);
+
+// sets an element of an array, which must be in bounds
+void qrtz_arrayset(qrtz_VM *vm, qrtz_Array *arr, size_t i, qrtz_Value val);
+void qrtz_pointerset(qrtz_VM *vm, qrtz_Pointer *ptr, qrtz_Value val);
+
+// Starts, advances or finishes a GC cycle, depending on memory usage.
+// This is the only safe point, which is hit when entering the API.
+// Allocating can run incremental steps, but those only ever mark, or sweep objects which a
+// safe point already found to be dead. This means internal code can freely hold on to objects
+// which are not reachable yet, as long as it does not call this.
+void qrtz_checkGC(qrtz_VM *vm);
+// runs an incremental step if one is due. Called when allocating objects.
+void qrtz_gcstep(qrtz_VM *vm);
+// Write barrier, for storing val into obj.
+// Objects which are already marked are not scanned again, so while marking incrementally,
+// anything stored into them is marked right away.
+// Stores into objects which were just allocated, and into tasks and programs, do not need it.
+void qrtz_barrier(qrtz_VM *vm, qrtz_Object *obj, qrtz_Value val);
+void qrtz_barrierobj(qrtz_VM *vm, qrtz_Object *obj, qrtz_Object *child);
+// adds an old object to the remembered set
+void qrtz_remember(qrtz_VM *vm, qrtz_Object *obj);
+// Records that a young interned string exists. Returns false if it can't, in which case
+// the string must not be interned.
+bool qrtz_trackYoungString(qrtz_VM *vm, qrtz_String *s);
+void qrtz_visitRefs(qrtz_RefVisitor *visitor, qrtz_Object *obj);
+// Collects the nursery. This moves objects, so it can only run at a safe point.
+// If promoteAll is set, every survivor goes to the old generation.
+// Returns whether the nursery is empty, which it may not be if it ran out of memory.
+bool qrtz_minorgc(qrtz_VM *vm, bool promoteAll);
+// Moves a string, and the string holding its bytes, out of the nursery, so pointers to
+// its bytes stay valid. Returns the old copy, or NULL if it runs out of memory.
+qrtz_String *qrtz_tenureString(qrtz_VM *vm, qrtz_String *s);
+// Keeps compaction from ever moving a tenured string, or whichever string holds data,
+// once the host was given data as a pointer to its bytes. This lasts for the rest of their lives.
+void qrtz_fixString(qrtz_String *s, const char *data);
+// Pins an old object. Returns false if it runs out of memory.
+bool qrtz_pinObject(qrtz_VM *vm, qrtz_Object *obj);
+// Removes 1 pin of an object. Returns false if it was not pinned.
+bool qrtz_unpinObject(qrtz_VM *vm, qrtz_Object *obj);
+// changes which parts of a map are weak, taking qrtz_WeakFlags
+void qrtz_setMapWeak(qrtz_VM *vm, qrtz_Map *map, unsigned char weak);
+// Keeps track of a new userdata, if its type has a finalizer. Returns false if it runs out of memory.
+bool qrtz_trackFinalizer(qrtz_VM *vm, qrtz_Userdata *u);
+// calls the finalizers of the userdata found dead so far
+void qrtz_runFinalizers(qrtz_VM *vm);
+// calls every finalizer, dead or alive, as the VM is being destroyed
+void qrtz_finalizeAll(qrtz_VM *vm);
+
+// records an allocation sample, once profileAllocated reaches profileAt
+void qrtz_sampleAlloc(qrtz_VM *vm, qrtz_ObjTag tag, size_t size);
+void qrtz_freeAllocProfile(qrtz_VM *vm);
+
 #endif
@@ -0,0 +1,61 @@
+#include "test.h"
+
+static size_t released;
+static size_t finalized;
+
+static void releaseString(void *userdata, const char *str, size_t len) {
+	(void)userdata;
+	(void)str;
+	(void)len;
+	released++;
+}
+
+static void finalizeThing(void *userdata, void *pointer) {
+	(void)userdata;
+	(void)pointer;
+	finalized++;
+}
+
+static const char hostBytes[] = "bytes the host owns, and gets back once the VM is gone";
+
+// fills a VM with small and big objects, some of which the host needs to hear about
+static void fill(qrtz_VM *vm) {
+	for(int i = 0; i < 2000; i++) setGlobal(vm, i, QRTZ_MKOBJ(qrtz_allocFStringObject(vm, "global number %d, long enough", i)));
+	qrtz_Array *big = qrtz_allocArrayObject(vm, QRTZ_ARENABLOCK / sizeof(qrtz_Value) * 2);
+	CHECK(big != NULL);
+	setGlobal(vm, -1, QRTZ_MKOBJ(big));
+	CHECK(qrtz_pushexternstring(vm, hostBytes, sizeof(hostBytes) - 1, releaseString, NULL) == QRTZ_OK);
+	CHECK(qrtz_setfinalizer(vm, "thing", finalizeThing, NULL) == QRTZ_OK);
+	static int thing;
+	CHECK(qrtz_pushuserdata(vm, &thing, "thing", 0) == QRTZ_OK);
+	qrtz_gc(vm);
+}
+
+// Destroying a VM on an arena gives everything back at once, but still tells the host about
+// what it owns, and keeps one block for the next VM.
+static void freeAll(void) {
+	CountingAlloc a;
+	qrtz_Context parent;
+	initCountingContext(&parent, &a);
+	qrtz_Arena arena;
+	qrtz_Context ctx;
+	qrtz_initArenaContext(&ctx, &arena, &parent);
+	released = 0;
+	finalized = 0;
+	for(size_t round = 1; round <= 3; round++) {
+		qrtz_VM *vm = qrtz_create(&ctx);
+		CHECK(vm != NULL);
+		fill(vm);
+		CHECK(a.live > QRTZ_ARENABLOCK * 4);
+		qrtz_destroy(vm);
+		CHECK(released == round && finalized == round);
+		CHECK(a.live == QRTZ_ARENABLOCK);
+	}
+	qrtz_freeArena(&arena);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	freeAll();
+	return 0;
+}
@@ -0,0 +1,121 @@
+#include "test.h"
+
+// a program with a named entry, the initialization entry, and locals, all owned by it
+static qrtz_Program *makeProgram(qrtz_VM *vm) {
+	qrtz_Program *prog = (qrtz_Program *)qrtz_allocObject(vm, QRTZ_OPROGRAM, sizeof(qrtz_Program));
+	CHECK(prog != NULL);
+	prog->entryCount = 2;
+	prog->entries = qrtz_allocArray(vm, sizeof(qrtz_ProgramEntry), 2);
+	CHECK(prog->entries != NULL);
+	prog->entries[0].name = NULL;
+	prog->entries[0].len = 0;
+	prog->entries[0].val = QRTZ_MKNULL();
+	prog->entries[1].name = qrtz_alloc(vm, 4);
+	CHECK(prog->entries[1].name != NULL);
+	memcpy(prog->entries[1].name, "main", 4);
+	prog->entries[1].len = 4;
+	prog->entries[1].val = QRTZ_MKINT(1);
+	prog->localCount = 3;
+	prog->locals = qrtz_allocArray(vm, sizeof(qrtz_Value), 3);
+	CHECK(prog->locals != NULL);
+	for(int i = 0; i < 3; i++) prog->locals[i] = QRTZ_MKINT(10 + i);
+	return prog;
+}
+
+static qrtz_Function *makeFunction(qrtz_VM *vm, qrtz_Program *prog) {
+	size_t n = 4;
+	qrtz_Function *fn = (qrtz_Function *)qrtz_allocObject(vm, QRTZ_OFUNCTION, sizeof(qrtz_Function) + sizeof(qrtz_Instruction) * n);
+	CHECK(fn != NULL);
+	fn->program = prog;
+	fn->codesize = n;
+	fn->inst = (qrtz_Instruction *)(fn + 1);
+	for(size_t i = 0; i < n; i++) {
+		fn->inst[i].op = (unsigned char)i;
+		fn->inst[i].line = i + 1;
+	}
+	return fn;
+}
+
+static qrtz_Value mapGet(qrtz_VM *vm, qrtz_Map *map, int key) {
+	qrtz_Value v = QRTZ_MKNULL();
+	CHECK(qrtz_mapget(vm, map, QRTZ_MKINT(key), &v));
+	return v;
+}
+
+// what the template holds, which neither VM may see change after the other one is changed
+static void checkTemplate(qrtz_VM *vm) {
+	qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	CHECK(s->len == 5 && memcmp(qrtz_strdata(vm, s), "hello", 5) == 0);
+	qrtz_Array *arr = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 1));
+	CHECK(arr->len == 3);
+	for(int i = 0; i < 3; i++) CHECK(QRTZ_ASINT(arr->values[i]) == i);
+	qrtz_Map *map = (qrtz_Map *)QRTZ_ASOBJ(getGlobal(vm, 2));
+	CHECK(QRTZ_ASINT(mapGet(vm, map, 7)) == 70);
+	qrtz_Program *prog = (qrtz_Program *)QRTZ_ASOBJ(getGlobal(vm, 3));
+	CHECK(prog->entries[0].name == NULL);
+	CHECK(prog->entries[1].len == 4 && memcmp(prog->entries[1].name, "main", 4) == 0);
+	for(int i = 0; i < 3; i++) CHECK(QRTZ_ASINT(prog->locals[i]) == 10 + i);
+	qrtz_Function *fn = (qrtz_Function *)QRTZ_ASOBJ(getGlobal(vm, 4));
+	CHECK(fn->program == prog);
+	CHECK(fn->inst == (qrtz_Instruction *)(fn + 1));
+	for(size_t i = 0; i < fn->codesize; i++) CHECK(fn->inst[i].op == i && fn->inst[i].line == i + 1);
+}
+
+static void roundTrip(bool templateFirst) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *tmpl = qrtz_create(&ctx);
+	CHECK(tmpl != NULL);
+	setGlobal(tmpl, 0, QRTZ_MKOBJ(qrtz_allocStringObject(tmpl, "hello", 5)));
+	qrtz_Array *arr = qrtz_allocArrayObject(tmpl, 3);
+	arr->len = 3;
+	for(int i = 0; i < 3; i++) arr->values[i] = QRTZ_MKINT(i);
+	setGlobal(tmpl, 1, QRTZ_MKOBJ(arr));
+	qrtz_Map *map = qrtz_allocMapObject(tmpl, 4);
+	setGlobal(tmpl, 2, QRTZ_MKOBJ(map));
+	CHECK(qrtz_mapset(tmpl, map, QRTZ_MKINT(7), QRTZ_MKINT(70)) == QRTZ_OK);
+	qrtz_Program *prog = makeProgram(tmpl);
+	setGlobal(tmpl, 3, QRTZ_MKOBJ(prog));
+	setGlobal(tmpl, 4, QRTZ_MKOBJ(makeFunction(tmpl, prog)));
+
+	qrtz_VM *clone = qrtz_clone(tmpl, &ctx);
+	CHECK(clone != NULL);
+	checkTemplate(clone);
+
+	// the clone is changed everywhere it could share something with the template
+	arr = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(clone, 1));
+	qrtz_arrayset(clone, arr, 0, QRTZ_MKINT(-1));
+	map = (qrtz_Map *)QRTZ_ASOBJ(getGlobal(clone, 2));
+	CHECK(qrtz_mapset(clone, map, QRTZ_MKINT(7), QRTZ_MKINT(-70)) == QRTZ_OK);
+	for(int i = 0; i < 100; i++) CHECK(qrtz_mapset(clone, map, QRTZ_MKINT(100 + i), QRTZ_MKINT(i)) == QRTZ_OK);
+	prog = (qrtz_Program *)QRTZ_ASOBJ(getGlobal(clone, 3));
+	prog->entries[1].name[0] = 'M';
+	prog->locals[0] = QRTZ_MKINT(-10);
+	qrtz_Function *fn = (qrtz_Function *)QRTZ_ASOBJ(getGlobal(clone, 4));
+	fn->inst[0].op = 99;
+	setGlobal(clone, 0, QRTZ_MKOBJ(qrtz_allocStringObject(clone, "bye", 3)));
+	qrtz_gc(clone);
+	qrtz_gc(tmpl);
+	checkTemplate(tmpl);
+
+	// either can outlive the other
+	if(templateFirst) {
+		qrtz_destroy(tmpl);
+		CHECK(QRTZ_ASINT(mapGet(clone, map, 7)) == -70);
+		CHECK(prog->entries[1].name[0] == 'M');
+		CHECK(fn->inst[0].op == 99);
+		qrtz_destroy(clone);
+	} else {
+		qrtz_destroy(clone);
+		checkTemplate(tmpl);
+		qrtz_destroy(tmpl);
+	}
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	roundTrip(true);
+	roundTrip(false);
+	return 0;
+}
@@ -0,0 +1,131 @@
+#include "test.h"
+
+#define CELLS 2000
+#define STRINGS 200
+
+static qrtz_Array *cells(qrtz_VM *vm, int global) {
+	return (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, global));
+}
+
+static qrtz_Array *makeArray(qrtz_VM *vm, int global, size_t len) {
+	qrtz_Array *arr = qrtz_allocArrayObject(vm, len);
+	CHECK(arr != NULL);
+	arr->len = len;
+	for(size_t i = 0; i < len; i++) arr->values[i] = QRTZ_MKNULL();
+	setGlobal(vm, global, QRTZ_MKOBJ(arr));
+	return arr;
+}
+
+// Objects survive being copied by minor collections, promoted, and moved by compaction,
+// except for pinned ones and strings the host has pointers into, which stay where they are.
+static void survival(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	makeArray(vm, 0, CELLS);
+	for(int i = 0; i < CELLS; i++) {
+		qrtz_Pointer *p = qrtz_allocPointerObject(vm);
+		p->val = QRTZ_MKINT(i);
+		qrtz_arrayset(vm, cells(vm, 0), i, QRTZ_MKOBJ(p));
+		// some of them get copied to the survivor space first
+		if(i % 500 == 0) qrtz_minorgc(vm, false);
+	}
+	makeArray(vm, 1, STRINGS);
+	const char *fixed[STRINGS] = {NULL};
+	for(int i = 0; i < STRINGS; i++) {
+		CHECK(qrtz_pushfstring(vm, "string number %d, long enough", i) == QRTZ_OK);
+		qrtz_Task *task = vm->curTask;
+		qrtz_arrayset(vm, cells(vm, 1), i, task->stack[task->stacklen - 1]);
+		if(i % 10 == 0) fixed[i] = qrtz_tostring(vm, -1, NULL);
+		CHECK(qrtz_pop(vm) == QRTZ_OK);
+	}
+	qrtz_minorgc(vm, true);
+	CHECK(vm->youngBytes == 0);
+
+	qrtz_Object *pinned[CELLS] = {NULL};
+	for(int i = 0; i < CELLS; i += 100) {
+		pinned[i] = QRTZ_ASOBJ(cells(vm, 0)->values[i]);
+		CHECK(qrtz_pinObject(vm, pinned[i]));
+	}
+	// most of the pages end up empty
+	for(int i = 0; i < CELLS; i++) {
+		if(i % 10 != 0) qrtz_arrayset(vm, cells(vm, 0), i, QRTZ_MKNULL());
+	}
+	for(int i = 0; i < STRINGS; i++) {
+		if(i % 5 != 0) qrtz_arrayset(vm, cells(vm, 1), i, QRTZ_MKNULL());
+	}
+	qrtz_Object *before[CELLS];
+	for(int i = 0; i < CELLS; i += 10) before[i] = QRTZ_ASOBJ(cells(vm, 0)->values[i]);
+	qrtz_compact(vm);
+
+	size_t moved = 0;
+	for(int i = 0; i < CELLS; i += 10) {
+		qrtz_Pointer *p = (qrtz_Pointer *)QRTZ_ASOBJ(cells(vm, 0)->values[i]);
+		CHECK(p->obj.tag == QRTZ_OPOINTER && QRTZ_ASINT(p->val) == i);
+		if(pinned[i] != NULL) CHECK(&p->obj == pinned[i]);
+		if(&p->obj != before[i]) moved++;
+	}
+	CHECK(moved > 0);
+	for(int i = 0; i < STRINGS; i += 5) {
+		char expected[64];
+		snprintf(expected, sizeof(expected), "string number %d, long enough", i);
+		qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(cells(vm, 1)->values[i]);
+		CHECK(strcmp(qrtz_strcstr(vm, s), expected) == 0);
+		if(fixed[i] == NULL) continue;
+		CHECK(qrtz_strcstr(vm, s) == fixed[i]);
+		CHECK(strcmp(fixed[i], expected) == 0);
+	}
+
+	// once unpinned, they can move like anything else
+	for(int i = 0; i < CELLS; i += 100) CHECK(qrtz_unpinObject(vm, pinned[i]));
+	qrtz_compact(vm);
+	for(int i = 0; i < CELLS; i += 10) {
+		qrtz_Pointer *p = (qrtz_Pointer *)QRTZ_ASOBJ(cells(vm, 0)->values[i]);
+		CHECK(QRTZ_ASINT(p->val) == i);
+	}
+	qrtz_destroy(vm);
+}
+
+// every pin needs its own unpin, in any order
+static void pinCounts(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	qrtz_Array *arr = makeArray(vm, 0, 1000);
+	qrtz_Object *objs[1000];
+	for(int i = 0; i < 1000; i++) {
+		objs[i] = (qrtz_Object *)qrtz_allocArrayObject(vm, 200);
+		CHECK(!QRTZ_ISYOUNG(vm, objs[i]));
+		qrtz_arrayset(vm, arr, i, QRTZ_MKOBJ(objs[i]));
+	}
+	for(int i = 0; i < 1000; i++) {
+		for(int j = 0; j <= i % 3; j++) CHECK(qrtz_pinObject(vm, objs[i]));
+	}
+	CHECK(vm->pinnedLen == 1000);
+	srand(17);
+	int order[1000];
+	for(int i = 0; i < 1000; i++) order[i] = i;
+	for(int i = 999; i > 0; i--) {
+		int j = rand() % (i + 1);
+		int t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+	for(int k = 0; k < 1000; k++) {
+		int i = order[k];
+		for(int j = 0; j <= i % 3; j++) {
+			CHECK(objs[i]->gcflags & QRTZ_GCPINNED);
+			CHECK(qrtz_unpinObject(vm, objs[i]));
+		}
+		CHECK(!(objs[i]->gcflags & QRTZ_GCPINNED));
+		CHECK(!qrtz_unpinObject(vm, objs[i]));
+	}
+	CHECK(vm->pinnedLen == 0);
+	qrtz_destroy(vm);
+}
+
+int main(void) {
+	survival();
+	pinCounts();
+	return 0;
+}
@@ -0,0 +1,178 @@
+#include "test.h"
+
+// Runs the cycle which is going on to its end, without starting another one.
+static void finishCycle(qrtz_VM *vm) {
+	while(vm->gcState != QRTZ_GCIDLE) {
+		qrtz_gcstep(vm);
+		qrtz_checkGC(vm);
+	}
+}
+
+// Old objects only reuse freed slots once something is promoted, so this fills them with garbage.
+static void reuseFreedSlots(qrtz_VM *vm) {
+	qrtz_Array *arr = qrtz_allocArrayObject(vm, 2000);
+	CHECK(arr != NULL);
+	setGlobal(vm, 100, QRTZ_MKOBJ(arr));
+	for(size_t i = 0; i < 2000; i++) {
+		qrtz_Pointer *p = qrtz_allocPointerObject(vm);
+		CHECK(p != NULL);
+		p->val = QRTZ_MKINT(-1);
+		arr = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 100));
+		arr->len = i + 1;
+		qrtz_arrayset(vm, arr, i, QRTZ_MKOBJ(p));
+	}
+	qrtz_minorgc(vm, true);
+	qrtz_mapremove(vm, vm->globals, QRTZ_MKINT(100));
+}
+
+// Moves the only reference to an unmarked object from an object which may not be scanned yet
+// into one which may be, after `steps` steps of marking. The barrier must keep it alive.
+static bool hideObject(size_t steps) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	qrtz_setGCStepSize(vm, 64);
+
+	// Enough objects for marking to take many steps. The gray stack is last in, first out,
+	// so `black` is scanned before the filler array, and `gray` somewhere in the middle of it.
+	qrtz_Array *filler = qrtz_allocArrayObject(vm, 500);
+	filler->len = 500;
+	for(size_t i = 0; i < 500; i++) filler->values[i] = QRTZ_MKNULL();
+	setGlobal(vm, 0, QRTZ_MKOBJ(filler));
+	for(size_t i = 0; i < 500; i++) {
+		qrtz_Pointer *p = qrtz_allocPointerObject(vm);
+		p->val = QRTZ_MKINT(i);
+		qrtz_arrayset(vm, (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0)), i, QRTZ_MKOBJ(p));
+	}
+	qrtz_Pointer *black = qrtz_allocPointerObject(vm);
+	black->val = QRTZ_MKNULL();
+	setGlobal(vm, 1, QRTZ_MKOBJ(black));
+	qrtz_Pointer *white = qrtz_allocPointerObject(vm);
+	white->val = QRTZ_MKINT(12345);
+	filler = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	qrtz_pointerset(vm, (qrtz_Pointer *)QRTZ_ASOBJ(filler->values[250]), QRTZ_MKOBJ(white));
+	qrtz_gc(vm);
+
+	qrtz_setMemoryTarget(vm, 0);
+	qrtz_checkGC(vm);
+	CHECK(vm->gcState == QRTZ_GCMARK);
+	// marking only finishes at a safe point, so it is over once nothing is left to scan
+	for(size_t i = 0; i < steps && vm->marker.grayLen > 0; i++) qrtz_gcstep(vm);
+	bool marking = vm->marker.grayLen > 0;
+
+	black = (qrtz_Pointer *)QRTZ_ASOBJ(getGlobal(vm, 1));
+	filler = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	qrtz_Pointer *gray = (qrtz_Pointer *)QRTZ_ASOBJ(filler->values[250]);
+	white = (qrtz_Pointer *)QRTZ_ASOBJ(gray->val);
+	qrtz_pointerset(vm, black, QRTZ_MKOBJ(white));
+	qrtz_pointerset(vm, gray, QRTZ_MKNULL());
+	finishCycle(vm);
+	reuseFreedSlots(vm);
+
+	black = (qrtz_Pointer *)QRTZ_ASOBJ(getGlobal(vm, 1));
+	CHECK(QRTZ_ISOBJ(black->val));
+	white = (qrtz_Pointer *)QRTZ_ASOBJ(black->val);
+	CHECK(white->obj.tag == QRTZ_OPOINTER);
+	CHECK(QRTZ_ASINT(white->val) == 12345);
+	qrtz_destroy(vm);
+	return marking;
+}
+
+// Shuffles references between cells while marking runs, and checks every cell against a shadow copy.
+#define CELLS 64
+
+static qrtz_Pointer *cell(qrtz_VM *vm, int i) {
+	return (qrtz_Pointer *)QRTZ_ASOBJ(getGlobal(vm, i));
+}
+
+static void checkCells(qrtz_VM *vm, const int *shadow) {
+	for(int i = 0; i < CELLS; i++) {
+		qrtz_Value v = cell(vm, i)->val;
+		if(shadow[i] < 0) {
+			CHECK(QRTZ_VTAG(v) == QRTZ_VNULL);
+			continue;
+		}
+		CHECK(QRTZ_ISOBJ(v));
+		qrtz_Pointer *payload = (qrtz_Pointer *)QRTZ_ASOBJ(v);
+		CHECK(payload->obj.tag == QRTZ_OPOINTER);
+		CHECK(QRTZ_ASINT(payload->val) == shadow[i]);
+	}
+}
+
+static void shuffle(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	qrtz_setGCStepSize(vm, 128);
+	int shadow[CELLS];
+	for(int i = 0; i < CELLS; i++) {
+		qrtz_Pointer *c = qrtz_allocPointerObject(vm);
+		c->val = QRTZ_MKNULL();
+		setGlobal(vm, i, QRTZ_MKOBJ(c));
+		shadow[i] = -1;
+	}
+	srand(11);
+	size_t cycles = vm->gcStats.cycles;
+	for(int it = 0; it < 100000; it++) {
+		int a = rand() % CELLS, b = rand() % CELLS;
+		switch(rand() % 4) {
+		case 0: {
+			qrtz_Pointer *payload = qrtz_allocPointerObject(vm);
+			payload->val = QRTZ_MKINT(it);
+			qrtz_pointerset(vm, cell(vm, a), QRTZ_MKOBJ(payload));
+			shadow[a] = it;
+			break;
+		}
+		case 1:
+			if(a == b) break;
+			// the only reference moves from b to a
+			qrtz_pointerset(vm, cell(vm, a), cell(vm, b)->val);
+			qrtz_pointerset(vm, cell(vm, b), QRTZ_MKNULL());
+			shadow[a] = shadow[b];
+			shadow[b] = -1;
+			break;
+		case 2:
+			qrtz_pointerset(vm, cell(vm, a), QRTZ_MKNULL());
+			shadow[a] = -1;
+			break;
+		default:
+			// garbage, to keep cycles coming
+			qrtz_allocArrayObject(vm, 8);
+			break;
+		}
+		// a new cycle as soon as the last one is over, so most of the shuffling happens while marking
+		if(vm->gcState == QRTZ_GCIDLE) qrtz_setMemoryTarget(vm, 0);
+		qrtz_checkGC(vm);
+		if(it % 500 == 0) checkCells(vm, shadow);
+	}
+	CHECK(vm->gcStats.cycles > cycles + 100);
+	qrtz_gc(vm);
+	checkCells(vm, shadow);
+	qrtz_destroy(vm);
+}
+
+// Allocating never collects, only safe points do, which native code can reach on its own.
+static void safePoints(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	qrtz_setGCStepSize(vm, 0);
+	while(qrtz_getMemoryUsage(vm) <= qrtz_getMemoryTarget(vm) * 2) CHECK(qrtz_allocArrayObject(vm, 200) != NULL);
+	qrtz_GCStats stats;
+	qrtz_getGCStats(vm, &stats);
+	CHECK(stats.cycles == 0);
+	qrtz_safepoint(vm);
+	qrtz_getGCStats(vm, &stats);
+	CHECK(stats.cycles == 1);
+	qrtz_destroy(vm);
+}
+
+int main(void) {
+	safePoints();
+	size_t steps = 0;
+	while(hideObject(steps)) steps++;
+	// the barrier was exercised at every point of a cycle
+	CHECK(steps > 10);
+	shuffle();
+	return 0;
+}
@@ -0,0 +1,208 @@
+#include "test.h"
+
+// The map's probing, removal and rehashing rules. Also built with QUARTZ_NOSIMD, see CMakeLists.txt,
+// so the portable group matching runs too.
+
+// the slots of a map with four groups, which every test here uses
+#define CAP (QRTZ_MAPGROUP * 4)
+
+static qrtz_Map *newMap(qrtz_VM *vm) {
+	// the most a table of CAP slots holds
+	qrtz_Map *map = qrtz_allocMapObject(vm, CAP / 8 * 7);
+	CHECK(map != NULL && map->cap == CAP);
+	return map;
+}
+
+// the slot key is in, or cap
+static size_t slotOf(qrtz_Map *map, int key) {
+	for(size_t i = 0; i < map->cap; i++) {
+		if(QRTZ_MAPFULL(map, i) && QRTZ_ASINT(map->data[i]) == key) return i;
+	}
+	return map->cap;
+}
+
+// The group probing for key starts at, found by putting it alone in scratch, where it takes the
+// first slot of that group.
+static size_t homeGroup(qrtz_VM *vm, qrtz_Map *scratch, int key) {
+	qrtz_mapclear(scratch);
+	CHECK(qrtz_mapset(vm, scratch, QRTZ_MKINT(key), QRTZ_MKNULL()) == QRTZ_OK);
+	size_t slot = slotOf(scratch, key);
+	CHECK(slot % QRTZ_MAPGROUP == 0);
+	return slot / QRTZ_MAPGROUP;
+}
+
+// Fills keys with count keys whose probing starts at group. Keys come from *next, so they are
+// never reused.
+static void keysIn(qrtz_VM *vm, qrtz_Map *scratch, size_t group, int *keys, size_t count, int *next) {
+	for(size_t n = 0; n < count; (*next)++) {
+		if(homeGroup(vm, scratch, *next) == group) keys[n++] = *next;
+	}
+}
+
+static void setAll(qrtz_VM *vm, qrtz_Map *map, const int *keys, size_t count) {
+	for(size_t i = 0; i < count; i++) {
+		CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(keys[i]), QRTZ_MKINT(keys[i] * 2)) == QRTZ_OK);
+	}
+}
+
+static bool has(qrtz_VM *vm, qrtz_Map *map, int key) {
+	qrtz_Value v;
+	if(!qrtz_mapget(vm, map, QRTZ_MKINT(key), &v)) return false;
+	CHECK(QRTZ_ASINT(v) == key * 2);
+	return true;
+}
+
+static size_t countCtrl(qrtz_Map *map, unsigned char c) {
+	size_t n = 0;
+	for(size_t i = 0; i < map->cap; i++) n += map->ctrl[i] == c;
+	return n;
+}
+
+// A removed slot is emptied if its group has an empty slot, as no lookup goes past that group.
+// In a full group it is marked removed instead, and lookups for keys pushed into later groups
+// keep probing past it, even once the whole group is removed slots.
+static void removal(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	qrtz_Map *scratch = newMap(vm);
+	qrtz_Map *map = newMap(vm);
+	int next = 0;
+	int full[QRTZ_MAPGROUP], pushed[2], missing;
+	keysIn(vm, scratch, 0, full, QRTZ_MAPGROUP, &next);
+	keysIn(vm, scratch, 0, pushed, 2, &next);
+	keysIn(vm, scratch, 0, &missing, 1, &next);
+	setAll(vm, map, full, QRTZ_MAPGROUP);
+	setAll(vm, map, pushed, 2);
+	for(size_t i = 0; i < QRTZ_MAPGROUP; i++) CHECK(slotOf(map, full[i]) / QRTZ_MAPGROUP == 0);
+	CHECK(slotOf(map, pushed[0]) / QRTZ_MAPGROUP != 0);
+	CHECK(map->used == QRTZ_MAPGROUP + 2 && map->len == QRTZ_MAPGROUP + 2);
+
+	// the group the keys were pushed into still has empty slots
+	size_t slot = slotOf(map, pushed[1]);
+	CHECK(qrtz_mapremove(vm, map, QRTZ_MKINT(pushed[1])));
+	CHECK(map->ctrl[slot] == QRTZ_CEMPTY);
+	CHECK(map->used == QRTZ_MAPGROUP + 1 && map->len == QRTZ_MAPGROUP + 1);
+	CHECK(!has(vm, map, pushed[1]));
+
+	for(size_t i = 0; i < QRTZ_MAPGROUP; i++) {
+		slot = slotOf(map, full[i]);
+		CHECK(qrtz_mapremove(vm, map, QRTZ_MKINT(full[i])));
+		CHECK(map->ctrl[slot] == QRTZ_CREMOVED);
+		CHECK(!has(vm, map, full[i]));
+		CHECK(has(vm, map, pushed[0]));
+	}
+	CHECK(countCtrl(map, QRTZ_CREMOVED) == QRTZ_MAPGROUP);
+	CHECK(map->used == QRTZ_MAPGROUP + 1 && map->len == 1);
+	CHECK(!has(vm, map, missing));
+	CHECK(!qrtz_mapremove(vm, map, QRTZ_MKINT(missing)));
+
+	// removed slots are reused before empty ones
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(missing), QRTZ_MKINT(missing * 2)) == QRTZ_OK);
+	CHECK(slotOf(map, missing) / QRTZ_MAPGROUP == 0);
+	CHECK(map->used == QRTZ_MAPGROUP + 1 && map->len == 2);
+	CHECK(has(vm, map, missing) && has(vm, map, pushed[0]));
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// Once a map runs out of empty slots, it is rehashed at the same size if removed slots take up
+// most of it, and only grows once its entries do.
+static void rehash(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	qrtz_Map *scratch = newMap(vm);
+	qrtz_Map *map = newMap(vm);
+	size_t most = CAP / 8 * 7;
+	int next = 0;
+	// three groups of keys which get removed, and what is left of the table in the last one
+	int removed[QRTZ_MAPGROUP * 3], kept[CAP / 8 * 7 - QRTZ_MAPGROUP * 3], extra[CAP];
+	for(size_t g = 0; g < 3; g++) keysIn(vm, scratch, g, removed + g * QRTZ_MAPGROUP, QRTZ_MAPGROUP, &next);
+	size_t keptLen = sizeof(kept) / sizeof(kept[0]);
+	keysIn(vm, scratch, 3, kept, keptLen, &next);
+	keysIn(vm, scratch, 3, extra, 1, &next);
+	setAll(vm, map, removed, QRTZ_MAPGROUP * 3);
+	setAll(vm, map, kept, keptLen);
+	CHECK(map->used == most && map->cap == CAP);
+	for(size_t i = 0; i < QRTZ_MAPGROUP * 3; i++) CHECK(qrtz_mapremove(vm, map, QRTZ_MKINT(removed[i])));
+	CHECK(countCtrl(map, QRTZ_CREMOVED) == QRTZ_MAPGROUP * 3);
+	CHECK(map->used == most && map->len == keptLen);
+
+	// the next key needs an empty slot, and the table has no more to give
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(extra[0]), QRTZ_MKINT(extra[0] * 2)) == QRTZ_OK);
+	CHECK(map->cap == CAP);
+	CHECK(countCtrl(map, QRTZ_CREMOVED) == 0);
+	CHECK(map->used == keptLen + 1 && map->len == keptLen + 1);
+	for(size_t i = 0; i < keptLen; i++) CHECK(has(vm, map, kept[i]));
+	CHECK(has(vm, map, extra[0]));
+	for(size_t i = 0; i < QRTZ_MAPGROUP * 3; i++) CHECK(!has(vm, map, removed[i]));
+
+	// filling it up without removing anything grows it
+	size_t extraLen = most - map->len;
+	for(size_t i = 1; i <= extraLen; i++) extra[i] = next++;
+	setAll(vm, map, extra + 1, extraLen);
+	CHECK(map->cap == CAP && map->used == most);
+	extra[extraLen + 1] = next++;
+	setAll(vm, map, extra + extraLen + 1, 1);
+	CHECK(map->cap == CAP * 2);
+	CHECK(map->used == most + 1 && map->len == most + 1);
+	for(size_t i = 0; i < keptLen; i++) CHECK(has(vm, map, kept[i]));
+	for(size_t i = 0; i <= extraLen + 1; i++) CHECK(has(vm, map, extra[i]));
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// Short strings and string objects with the same bytes hash the same and are the same key,
+// whichever of them the entry was set with.
+static void stringKeys(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	const char *bytes = "abcdefgh";
+	for(size_t len = 0; len <= QRTZ_SSTRMAX; len++) {
+		qrtz_Value sstr = QRTZ_MKSSTR(bytes, len);
+		qrtz_String *str = qrtz_allocStringObject(vm, bytes, len);
+		CHECK(str != NULL);
+		qrtz_Value obj = QRTZ_MKOBJ(str);
+		CHECK(QRTZ_VTAG(sstr) == QRTZ_VSSTR && QRTZ_VTAG(obj) == QRTZ_VOBJ);
+		CHECK(qrtz_valhash(vm, sstr) == qrtz_valhash(vm, obj));
+		CHECK(qrtz_valeq(vm, sstr, obj) && qrtz_valeq(vm, obj, sstr));
+
+		qrtz_Map *map = qrtz_allocMapObject(vm, 4);
+		CHECK(map != NULL);
+		qrtz_Value v;
+		CHECK(qrtz_mapset(vm, map, sstr, QRTZ_MKINT(1)) == QRTZ_OK);
+		CHECK(qrtz_mapget(vm, map, obj, &v) && QRTZ_ASINT(v) == 1);
+		CHECK(qrtz_mapset(vm, map, obj, QRTZ_MKINT(2)) == QRTZ_OK);
+		CHECK(map->len == 1);
+		CHECK(qrtz_mapget(vm, map, sstr, &v) && QRTZ_ASINT(v) == 2);
+		CHECK(qrtz_mapremove(vm, map, obj));
+		CHECK(!qrtz_mapget(vm, map, sstr, &v));
+
+		CHECK(qrtz_mapset(vm, map, obj, QRTZ_MKINT(3)) == QRTZ_OK);
+		CHECK(qrtz_mapget(vm, map, sstr, &v) && QRTZ_ASINT(v) == 3);
+		CHECK(qrtz_mapremove(vm, map, sstr));
+		CHECK(map->len == 0);
+		// a string one byte longer is another key
+		if(len < QRTZ_SSTRMAX) {
+			CHECK(qrtz_mapset(vm, map, obj, QRTZ_MKINT(4)) == QRTZ_OK);
+			CHECK(!qrtz_mapget(vm, map, QRTZ_MKSSTR(bytes, len + 1), &v));
+		}
+	}
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	removal();
+	rehash();
+	stringKeys();
+	return 0;
+}
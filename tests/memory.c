@@ -0,0 +1,126 @@
+#include "test.h"
+#ifdef __unix__
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// The memory primitives against the C library's. Also built without SIMD, without AVX2, and
+// without the C library, see CMakeLists.txt, so every version of them runs on machines which have AVX2.
+
+// longest length checked at every alignment, past a few vectors, with every kind of tail
+#define SHORTMAX 70
+#define MAXALIGN 32
+#define CANARY 0x5A
+
+static const size_t longLens[] = {95, 96, 97, 127, 128, 129, 255, 256, 257, 1000, 4099};
+
+static unsigned char src[4200 + MAXALIGN * 2];
+static unsigned char dst[4200 + MAXALIGN * 2];
+static unsigned char other[4200 + MAXALIGN * 2];
+
+static void fillSource(void) {
+	for(size_t i = 0; i < sizeof(src); i++) src[i] = (unsigned char)(i * 31 + 7);
+}
+
+// Checks dst + off holds expected, and that nothing around it was written.
+static void checkWritten(size_t off, const unsigned char *expected, size_t len) {
+	for(size_t i = 0; i < off; i++) CHECK(dst[i] == CANARY);
+	CHECK(memcmp(dst + off, expected, len) == 0);
+	for(size_t i = off + len; i < sizeof(dst); i++) CHECK(dst[i] == CANARY);
+}
+
+static void copies(size_t len, size_t srcOff, size_t dstOff) {
+	memset(dst, CANARY, sizeof(dst));
+	qrtz_memcpy(dst + dstOff, src + srcOff, len);
+	checkWritten(dstOff, src + srcOff, len);
+}
+
+static void sets(size_t len, size_t dstOff) {
+	unsigned char expected[sizeof(dst)];
+	memset(expected, 0xC3, len);
+	memset(dst, CANARY, sizeof(dst));
+	qrtz_memset(dst + dstOff, (char)0xC3, len);
+	checkWritten(dstOff, expected, len);
+}
+
+static int sign(int n) {
+	return (n > 0) - (n < 0);
+}
+
+// Compares equal bytes, then ones which differ at the start, the middle and the end, both ways,
+// with bytes above 0x7F so they must be compared unsigned.
+static void compares(size_t len, size_t aOff, size_t bOff) {
+	memcpy(other + bOff, src + aOff, len);
+	CHECK(qrtz_memcmp(src + aOff, other + bOff, len) == 0);
+	if(len == 0) return;
+	size_t at[] = {0, len / 2, len - 1};
+	for(size_t i = 0; i < 3; i++) {
+		unsigned char saved = other[bOff + at[i]];
+		unsigned char changes[] = {(unsigned char)(saved + 1), (unsigned char)(saved - 1), (unsigned char)(saved ^ 0x80)};
+		for(size_t j = 0; j < 3; j++) {
+			other[bOff + at[i]] = changes[j];
+			int expected = sign(memcmp(src + aOff, other + bOff, len));
+			CHECK(expected != 0);
+			CHECK(qrtz_memcmp(src + aOff, other + bOff, len) == expected);
+			CHECK(qrtz_memcmp(other + bOff, src + aOff, len) == -expected);
+		}
+		other[bOff + at[i]] = saved;
+	}
+}
+
+static void lengths(size_t len, size_t off) {
+	char *s = (char *)dst + off;
+	memset(dst, 'x', sizeof(dst));
+	s[len] = '\0';
+	CHECK(qrtz_strlen(s) == strlen(s));
+	CHECK(qrtz_strlen(s) == len);
+}
+
+static void everyAlignment(void) {
+	fillSource();
+	for(size_t len = 0; len <= SHORTMAX; len++) {
+		for(size_t a = 0; a <= MAXALIGN; a++) {
+			sets(len, a);
+			lengths(len, a);
+			for(size_t b = 0; b <= MAXALIGN; b++) {
+				copies(len, a, b);
+				compares(len, a, b);
+			}
+		}
+	}
+	for(size_t i = 0; i < sizeof(longLens) / sizeof(longLens[0]); i++) {
+		size_t len = longLens[i];
+		for(size_t a = 0; a <= MAXALIGN; a += 3) {
+			sets(len, a);
+			lengths(len, a);
+			for(size_t b = 0; b <= MAXALIGN; b += 5) {
+				copies(len, a, b);
+				compares(len, a, b);
+			}
+		}
+	}
+}
+
+// strlen reads whole aligned words and vectors, which must never reach into the next page
+static void stopsAtPage(void) {
+#ifdef __unix__
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	char *map = mmap(NULL, page * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	CHECK(map != MAP_FAILED);
+	CHECK(mprotect(map + page, page, PROT_NONE) == 0);
+	memset(map, 'y', page);
+	for(size_t len = 0; len < 100; len++) {
+		char *s = map + page - 1 - len;
+		s[len] = '\0';
+		CHECK(qrtz_strlen(s) == len);
+		s[len] = 'y';
+	}
+	munmap(map, page * 2);
+#endif
+}
+
+int main(void) {
+	everyAlignment();
+	stopsAtPage();
+	return 0;
+}
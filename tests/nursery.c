@@ -0,0 +1,78 @@
+#include "test.h"
+
+// arrays this long are too big for the nursery
+#define BIGLEN 200
+
+static qrtz_Array *bigArray(qrtz_VM *vm, int fill) {
+	qrtz_Array *arr = qrtz_allocArrayObject(vm, BIGLEN);
+	CHECK(arr != NULL);
+	CHECK(!QRTZ_ISYOUNG(vm, &arr->obj));
+	arr->len = BIGLEN;
+	for(size_t i = 0; i < BIGLEN; i++) arr->values[i] = QRTZ_MKINT(fill);
+	return arr;
+}
+
+// Runs out of memory with the nursery full of live objects, so promoting them fails.
+// A major cycle must still free old garbage, and keep what is only referenced by young objects.
+static void promotionFails(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+
+	for(int i = 0; i < 50; i++) setGlobal(vm, i, QRTZ_MKOBJ(bigArray(vm, i)));
+	qrtz_gc(vm);
+	for(int i = 0; i < 50; i++) qrtz_mapremove(vm, vm->globals, QRTZ_MKINT(i));
+
+	// A chain of young pointers, the last of which holds the only reference to an old array.
+	// Nothing collects in between, so nothing moves.
+	qrtz_Pointer *head = qrtz_allocPointerObject(vm);
+	CHECK(QRTZ_ISYOUNG(vm, &head->obj));
+	head->val = QRTZ_MKOBJ(bigArray(vm, 777));
+	size_t len = 1;
+	while((size_t)(vm->bumpEnd - vm->bump) >= sizeof(qrtz_Pointer)) {
+		qrtz_Pointer *p = qrtz_allocPointerObject(vm);
+		CHECK(QRTZ_ISYOUNG(vm, &p->obj));
+		p->val = QRTZ_MKOBJ(head);
+		head = p;
+		len++;
+	}
+	setGlobal(vm, 0, QRTZ_MKOBJ(head));
+
+	a.limit = a.live;
+	size_t cycles = vm->gcStats.cycles;
+	size_t freed = vm->gcStats.freed;
+	qrtz_gc(vm);
+	CHECK(vm->youngBytes != 0);
+	CHECK(vm->gcStats.cycles == cycles + 1);
+	CHECK(vm->gcStats.freed - freed >= 50 * BIGLEN * sizeof(qrtz_Value));
+
+	// what was freed is reused, which would overwrite the array if it was freed too
+	a.limit = 0;
+	for(int i = 0; i < 50; i++) setGlobal(vm, 100 + i, QRTZ_MKOBJ(bigArray(vm, -1)));
+	// what only fit in the survivor space is promoted by the collection after
+	qrtz_minorgc(vm, true);
+	CHECK(qrtz_minorgc(vm, true));
+	CHECK(vm->youngBytes == 0);
+	qrtz_Value v = getGlobal(vm, 0);
+	size_t seen = 0;
+	while(true) {
+		qrtz_Pointer *p = (qrtz_Pointer *)QRTZ_ASOBJ(v);
+		CHECK(p->obj.tag == QRTZ_OPOINTER);
+		seen++;
+		v = p->val;
+		if(QRTZ_ASOBJ(v)->tag != QRTZ_OPOINTER) break;
+	}
+	CHECK(seen == len);
+	qrtz_Array *kept = (qrtz_Array *)QRTZ_ASOBJ(v);
+	CHECK(kept->obj.tag == QRTZ_OARRAY);
+	for(size_t i = 0; i < BIGLEN; i++) CHECK(QRTZ_ASINT(kept->values[i]) == 777);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	promotionFails();
+	return 0;
+}
@@ -0,0 +1,80 @@
+#include "test.h"
+
+// How a soft memory limit bounds the memory target.
+
+#define LIMIT (2 * 1024 * 1024)
+
+// holds `bytes` worth of arrays in global 0, replacing what was there
+static void holdLive(qrtz_VM *vm, size_t bytes) {
+	size_t count = bytes / 4096;
+	qrtz_Array *holder = qrtz_allocArrayObject(vm, count);
+	CHECK(holder != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(holder));
+	for(size_t i = 0; i < count; i++) {
+		qrtz_Array *arr = qrtz_allocArrayObject(vm, 4096 / sizeof(qrtz_Value));
+		CHECK(arr != NULL);
+		qrtz_arrayset(vm, holder, holder->len++, QRTZ_MKOBJ(arr));
+	}
+}
+
+static qrtz_VM *createVM(CountingAlloc *a) {
+	qrtz_Context ctx;
+	initCountingContext(&ctx, a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	// a goal of 5 times the live heap, well over the limit
+	qrtz_setGCPause(vm, 400);
+	return vm;
+}
+
+// The limit lowers the target right away, and every target after a cycle stays under it.
+static void limitCapsTarget(void) {
+	CountingAlloc a;
+	qrtz_VM *vm = createVM(&a);
+	holdLive(vm, LIMIT / 4);
+	qrtz_gc(vm);
+	CHECK(qrtz_getMemoryTarget(vm) > LIMIT);
+	qrtz_setMemoryLimit(vm, LIMIT);
+	CHECK(qrtz_getMemoryTarget(vm) == LIMIT);
+	for(int i = 0; i < 3; i++) {
+		qrtz_gc(vm);
+		CHECK(qrtz_getMemoryTarget(vm) <= LIMIT);
+		CHECK(qrtz_getMemoryTarget(vm) >= vm->gcLive);
+	}
+	// a limit over the goal changes nothing
+	qrtz_setMemoryLimit(vm, (size_t)LIMIT * 100);
+	qrtz_gc(vm);
+	CHECK(qrtz_getMemoryTarget(vm) > LIMIT);
+	qrtz_setMemoryLimit(vm, 0);
+	qrtz_gc(vm);
+	CHECK(qrtz_getMemoryTarget(vm) > LIMIT);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// Once the live heap alone is over the limit, the target goes over it too, rather than having
+// cycles start as soon as the last one ends.
+static void liveOverLimit(void) {
+	CountingAlloc a;
+	qrtz_VM *vm = createVM(&a);
+	qrtz_setMemoryLimit(vm, LIMIT);
+	holdLive(vm, LIMIT * 2);
+	qrtz_gc(vm);
+	size_t live = vm->gcLive;
+	CHECK(live > LIMIT);
+	CHECK(qrtz_getMemoryTarget(vm) >= live);
+	// it still keeps the goal as close to the limit as it can, well under the pause's 5 times
+	CHECK(qrtz_getMemoryTarget(vm) < live * 2);
+	// and comes back under it once the heap shrinks
+	holdLive(vm, LIMIT / 4);
+	qrtz_gc(vm);
+	CHECK(qrtz_getMemoryTarget(vm) <= LIMIT);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	limitCapsTarget();
+	liveOverLimit();
+	return 0;
+}
@@ -0,0 +1,143 @@
+#include "test.h"
+
+// The bytes on the profile's line for a stack, or 0 if there is none. Also counts the lines.
+static size_t stackBytes(qrtz_VM *vm, const char *stack, size_t *lines) {
+	qrtz_Buffer buf;
+	qrtz_initBuf(&buf, &vm->ctx);
+	CHECK(qrtz_writeAllocProfile(vm, &buf) == QRTZ_OK);
+	char prefix[1024];
+	size_t prefixLen = (size_t)snprintf(prefix, sizeof(prefix), "%s ", stack);
+	CHECK(prefixLen < sizeof(prefix));
+	size_t bytes = 0;
+	*lines = 0;
+	size_t i = 0;
+	while(i < buf.len) {
+		char *end = memchr(buf.buf + i, '\n', buf.len - i);
+		CHECK(end != NULL);
+		size_t len = (size_t)(end - (buf.buf + i));
+		if(len > prefixLen && memcmp(buf.buf + i, prefix, prefixLen) == 0) {
+			char num[32];
+			CHECK(len - prefixLen < sizeof(num));
+			memcpy(num, buf.buf + i + prefixLen, len - prefixLen);
+			num[len - prefixLen] = '\0';
+			bytes = strtoull(num, NULL, 10);
+		}
+		(*lines)++;
+		i += len + 1;
+	}
+	qrtz_freeBuf(&buf);
+	return bytes;
+}
+
+// the same, for a kind of object allocated outside of any function
+static size_t siteBytes(qrtz_VM *vm, const char *kind, size_t *lines) {
+	char stack[64];
+	snprintf(stack, sizeof(stack), "main;%s", kind);
+	return stackBytes(vm, stack, lines);
+}
+
+// Collections copy objects around, which must not count as allocating them.
+static void collectionsAreNotSampled(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	qrtz_Pointer *head = NULL;
+	while((size_t)(vm->bumpEnd - vm->bump) >= sizeof(qrtz_Pointer)) {
+		qrtz_Pointer *p = qrtz_allocPointerObject(vm);
+		p->val = head != NULL ? QRTZ_MKOBJ(head) : QRTZ_MKNULL();
+		head = p;
+	}
+	setGlobal(vm, 0, QRTZ_MKOBJ(head));
+
+	// the sample is at most twice the rate away, less than the nursery
+	vm->profileSeed = 1;
+	qrtz_setAllocProfile(vm, QRTZ_NURSERYSIZE / 4);
+	qrtz_minorgc(vm, false);
+	qrtz_minorgc(vm, false);
+	qrtz_compact(vm);
+	qrtz_allocPointerObject(vm);
+	size_t lines;
+	siteBytes(vm, "pointer", &lines);
+	CHECK(lines == 0);
+	qrtz_destroy(vm);
+}
+
+static void samplesEveryAllocation(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	qrtz_setAllocProfile(vm, 1);
+	size_t pointerBytes = 0;
+	for(int i = 0; i < 10; i++) {
+		qrtz_Pointer *p = qrtz_allocPointerObject(vm);
+		// young objects are rounded up
+		pointerBytes += QRTZ_ISYOUNG(vm, &p->obj) ? (sizeof(qrtz_Pointer) + QRTZ_NURSERYALIGN - 1) / QRTZ_NURSERYALIGN * QRTZ_NURSERYALIGN : sizeof(qrtz_Pointer);
+	}
+	for(int i = 0; i < 3; i++) qrtz_allocArrayObject(vm, 200);
+	size_t lines;
+	CHECK(siteBytes(vm, "pointer", &lines) == pointerBytes);
+	CHECK(siteBytes(vm, "array", &lines) >= 3 * 200 * sizeof(qrtz_Value));
+	CHECK(lines == 2);
+
+	qrtz_clearAllocProfile(vm);
+	siteBytes(vm, "pointer", &lines);
+	CHECK(lines == 0);
+	qrtz_allocPointerObject(vm);
+	CHECK(siteBytes(vm, "pointer", &lines) > 0);
+	CHECK(lines == 1);
+	qrtz_destroy(vm);
+}
+
+// Each call is named with its line if known, C functions without a name are [C], and stacks
+// deeper than QRTZ_PROFILEDEPTH keep their innermost calls.
+static void framesAreNamed(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	qrtz_setAllocProfile(vm, 1);
+	qrtz_Task *task = vm->curTask;
+	qrtz_CallEntry *taskCalls = task->calls;
+	static qrtz_CallEntry calls[QRTZ_PROFILEDEPTH + 2];
+	static char names[QRTZ_PROFILEDEPTH + 2][16];
+	task->calls = calls;
+
+	calls[0] = (qrtz_CallEntry){.name = "outer"};
+	calls[1] = (qrtz_CallEntry){.name = "inner", .line = 12};
+	calls[2] = (qrtz_CallEntry){.isC = true};
+	calls[3] = (qrtz_CallEntry){.name = "native", .isC = true};
+	calls[4] = (qrtz_CallEntry){.name = NULL};
+	task->calllen = 5;
+	qrtz_allocPointerObject(vm);
+	size_t lines;
+	CHECK(stackBytes(vm, "main;outer;inner:12;[C];native;?;pointer", &lines) > 0);
+	CHECK(lines == 1);
+
+	for(size_t depth = QRTZ_PROFILEDEPTH; depth <= QRTZ_PROFILEDEPTH + 2; depth++) {
+		char expected[1024];
+		size_t len = (size_t)snprintf(expected, sizeof(expected), "main%s", depth > QRTZ_PROFILEDEPTH ? ";..." : "");
+		for(size_t i = 0; i < depth; i++) {
+			snprintf(names[i], sizeof(names[i]), "f%zu", i);
+			calls[i] = (qrtz_CallEntry){.name = names[i], .line = i % 2 ? i : 0};
+			if(i >= depth - QRTZ_PROFILEDEPTH) {
+				len += (size_t)snprintf(expected + len, sizeof(expected) - len, i % 2 ? ";%s:%zu" : ";%s", names[i], i);
+			}
+		}
+		snprintf(expected + len, sizeof(expected) - len, ";pointer");
+		task->calllen = depth;
+		qrtz_clearAllocProfile(vm);
+		qrtz_allocPointerObject(vm);
+		CHECK(stackBytes(vm, expected, &lines) > 0);
+		CHECK(lines == 1);
+	}
+
+	task->calls = taskCalls;
+	task->calllen = 0;
+	qrtz_destroy(vm);
+}
+
+int main(void) {
+	collectionsAreNotSampled();
+	samplesEveryAllocation();
+	framesAreNamed();
+	return 0;
+}
@@ -0,0 +1,73 @@
+#include "test.h"
+
+// Field lookups on both sides of QRTZ_RECSCANMAX: types with at most that many fields scan them,
+// and bigger ones look them up in their index.
+
+#define MAXFIELDS (QRTZ_RECSCANMAX + 1)
+
+// Names alternate between string objects and short strings, and are looked up as the other kind,
+// which must still find them.
+static qrtz_Value fieldName(qrtz_VM *vm, size_t i, bool asObject) {
+	char buf[8];
+	int len = snprintf(buf, sizeof(buf), "f%zu", i);
+	if(!asObject && (size_t)len <= QRTZ_SSTRMAX) return QRTZ_MKSSTR(buf, (size_t)len);
+	qrtz_String *s = qrtz_allocStringObject(vm, buf, (size_t)len);
+	CHECK(s != NULL);
+	return QRTZ_MKOBJ(s);
+}
+
+static qrtz_RecordType *typeWith(qrtz_VM *vm, size_t fieldCount) {
+	qrtz_Value fields[MAXFIELDS];
+	for(size_t i = 0; i < fieldCount; i++) fields[i] = fieldName(vm, i, i % 2 == 0);
+	return qrtz_allocRecordTypeObject(vm, NULL, fields, fieldCount);
+}
+
+static void lookups(qrtz_VM *vm, size_t fieldCount) {
+	qrtz_RecordType *type = typeWith(vm, fieldCount);
+	CHECK(type != NULL && type->fieldCount == fieldCount);
+	CHECK((type->fieldIndex != NULL) == (fieldCount > QRTZ_RECSCANMAX));
+	for(size_t i = 0; i < fieldCount; i++) {
+		CHECK(qrtz_recfield(vm, type, fieldName(vm, i, i % 2 != 0)) == i);
+		CHECK(qrtz_recfield(vm, type, fieldName(vm, i, i % 2 == 0)) == i);
+	}
+	CHECK(qrtz_recfield(vm, type, fieldName(vm, fieldCount, true)) == fieldCount);
+	CHECK(qrtz_recfield(vm, type, QRTZ_MKINT(0)) == fieldCount);
+
+	qrtz_Record *rec = qrtz_allocRecordObject(vm, type);
+	CHECK(rec != NULL);
+	for(size_t i = 0; i < fieldCount; i++) CHECK(qrtz_recset(vm, rec, fieldName(vm, i, true), QRTZ_MKINT(i * 10)));
+	for(size_t i = 0; i < fieldCount; i++) CHECK(QRTZ_ASINT(rec->values[i]) == (intptr_t)(i * 10));
+	qrtz_Value v;
+	CHECK(qrtz_recget(vm, rec, fieldName(vm, fieldCount - 1, false), &v) && QRTZ_ASINT(v) == (intptr_t)((fieldCount - 1) * 10));
+	CHECK(!qrtz_recget(vm, rec, fieldName(vm, fieldCount, false), &v));
+	CHECK(!qrtz_recset(vm, rec, fieldName(vm, fieldCount, false), QRTZ_MKNULL()));
+}
+
+// a second field of the same name could never be found, so such types are refused
+static void duplicates(qrtz_VM *vm, size_t fieldCount) {
+	qrtz_Value fields[MAXFIELDS];
+	for(size_t i = 0; i < fieldCount; i++) fields[i] = fieldName(vm, i, true);
+	size_t at[] = {1, fieldCount / 2, fieldCount - 1};
+	for(size_t k = 0; k < 3; k++) {
+		qrtz_Value saved = fields[at[k]];
+		// the same bytes, as the other kind of string
+		fields[at[k]] = fieldName(vm, 0, false);
+		CHECK(qrtz_allocRecordTypeObject(vm, NULL, fields, fieldCount) == NULL);
+		fields[at[k]] = saved;
+	}
+	CHECK(qrtz_allocRecordTypeObject(vm, NULL, fields, fieldCount) != NULL);
+}
+
+int main(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	for(size_t n = 1; n <= MAXFIELDS; n++) lookups(vm, n);
+	for(size_t n = 2; n <= MAXFIELDS; n++) duplicates(vm, n);
+	qrtz_destroy(vm);
+	// the names of refused types were freed
+	CHECK(a.live == 0);
+	return 0;
+}
@@ -0,0 +1,79 @@
+#include "test.h"
+
+#define GLOBALS 100
+
+static bool hasKey(qrtz_VM *vm, qrtz_Map *map, int key) {
+	qrtz_Value v;
+	return qrtz_mapget(vm, map, QRTZ_MKINT(key), &v);
+}
+
+static void checkResetPoint(qrtz_VM *vm) {
+	CHECK(vm->globals->len == GLOBALS);
+	for(int i = 0; i < GLOBALS; i++) CHECK(QRTZ_ASINT(getGlobal(vm, i)) == i * 2);
+	CHECK(vm->loaded->len == 1 && hasKey(vm, vm->loaded, 1));
+}
+
+// Everything the program did after the reset point is undone, and all of it can be freed.
+static void restores(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	for(int i = 0; i < GLOBALS; i++) setGlobal(vm, i, QRTZ_MKINT(i * 2));
+	CHECK(qrtz_mapset(vm, vm->loaded, QRTZ_MKINT(1), QRTZ_MKINT(10)) == QRTZ_OK);
+	CHECK(qrtz_setResetPoint(vm) == QRTZ_OK);
+
+	for(int round = 0; round < 3; round++) {
+		setGlobal(vm, 0, QRTZ_MKINT(-1));
+		for(int i = GLOBALS; i < GLOBALS * 3; i++) setGlobal(vm, i, QRTZ_MKOBJ(qrtz_allocPointerObject(vm)));
+		CHECK(qrtz_mapset(vm, vm->loaded, QRTZ_MKINT(2), QRTZ_MKINT(20)) == QRTZ_OK);
+		qrtz_Object *pinned = (qrtz_Object *)qrtz_allocArrayObject(vm, 200);
+		CHECK(qrtz_pinObject(vm, pinned));
+		for(int i = 0; i < 10; i++) CHECK(qrtz_pushint(vm, i) == QRTZ_OK);
+
+		CHECK(qrtz_reset(vm) == QRTZ_OK);
+		checkResetPoint(vm);
+		CHECK(!hasKey(vm, vm->globals, GLOBALS));
+		CHECK(vm->curTask == vm->mainTask && vm->mainTask->stacklen == 0);
+		CHECK(vm->pinnedLen == 0 && !(pinned->gcflags & QRTZ_GCPINNED));
+	}
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// A reset which runs out of memory leaves the VM as it was, so it can be tried again.
+static void failedResetChangesNothing(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	for(int i = 0; i < GLOBALS; i++) setGlobal(vm, i, QRTZ_MKINT(i * 2));
+	CHECK(qrtz_mapset(vm, vm->loaded, QRTZ_MKINT(1), QRTZ_MKINT(10)) == QRTZ_OK);
+	CHECK(qrtz_setResetPoint(vm) == QRTZ_OK);
+
+	// maps only grow, so for going back to need memory, the globals are swapped for a smaller map
+	vm->globals = qrtz_allocMapObject(vm, 0);
+	CHECK(vm->globals != NULL);
+	setGlobal(vm, 0, QRTZ_MKINT(-1));
+	CHECK(qrtz_mapset(vm, vm->loaded, QRTZ_MKINT(2), QRTZ_MKINT(20)) == QRTZ_OK);
+	CHECK(qrtz_pushint(vm, 1) == QRTZ_OK);
+	a.budget = 0;
+	CHECK(qrtz_reset(vm) == QRTZ_ENOMEM);
+	CHECK(vm->globals->len == 1 && QRTZ_ASINT(getGlobal(vm, 0)) == -1);
+	CHECK(vm->loaded->len == 2);
+	CHECK(vm->mainTask->stacklen == 1);
+
+	a.budget = -1;
+	CHECK(qrtz_reset(vm) == QRTZ_OK);
+	checkResetPoint(vm);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	restores();
+	failedResetChangesNothing();
+	return 0;
+}
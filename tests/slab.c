@@ -0,0 +1,85 @@
+#include "test.h"
+
+static void *slabAlloc(qrtz_Context *ctx, void *memory, size_t oldSize, size_t newSize) {
+	return ctx->alloc(ctx->data, memory, oldSize, newSize);
+}
+
+static void fillBytes(unsigned char *p, size_t len) {
+	for(size_t i = 0; i < len; i++) p[i] = (unsigned char)(i * 7 + 1);
+}
+
+static bool sameBytes(const unsigned char *p, size_t len) {
+	for(size_t i = 0; i < len; i++) {
+		if(p[i] != (unsigned char)(i * 7 + 1)) return false;
+	}
+	return true;
+}
+
+// Reallocating keeps the bytes, whether it stays in its size class, moves to another,
+// or goes to and from the parent.
+static void reallocAcrossClasses(void) {
+	CountingAlloc a;
+	qrtz_Context parent;
+	initCountingContext(&parent, &a);
+	qrtz_Slab slab;
+	qrtz_Context ctx;
+	qrtz_initSlabContext(&ctx, &slab, &parent);
+
+	size_t sizes[] = {10, 16, 100, 250, 300, 5000, QRTZ_SLABMAX, QRTZ_SLABMAX + 1, QRTZ_SLABMAX * 4, 700, 20, 1};
+	size_t n = sizeof(sizes) / sizeof(sizes[0]);
+	unsigned char *p = slabAlloc(&ctx, NULL, 0, sizes[0]);
+	CHECK(p != NULL);
+	fillBytes(p, sizes[0]);
+	for(size_t i = 1; i < n; i++) {
+		unsigned char *q = slabAlloc(&ctx, p, sizes[i - 1], sizes[i]);
+		CHECK(q != NULL);
+		size_t kept = sizes[i - 1] < sizes[i] ? sizes[i - 1] : sizes[i];
+		CHECK(sameBytes(q, kept));
+		// sizes in the same class stay in the same block
+		if(sizes[i - 1] == 10 && sizes[i] == 16) CHECK(q == p);
+		fillBytes(q, sizes[i]);
+		p = q;
+	}
+	slabAlloc(&ctx, p, sizes[n - 1], 0);
+
+	// freed blocks are reused by the next allocation of their class
+	void *b = slabAlloc(&ctx, NULL, 0, 100);
+	slabAlloc(&ctx, b, 100, 0);
+	CHECK(slabAlloc(&ctx, NULL, 0, 97) == b);
+	slabAlloc(&ctx, b, 97, 0);
+
+	// only the chunks are left, which go back with the slab
+	CHECK(a.live % QRTZ_SLABCHUNK == 0);
+	qrtz_freeSlab(&slab);
+	CHECK(a.live == 0);
+}
+
+// A VM runs on a slab like on any other context, growing its stacks and maps through every class.
+static void runsVM(void) {
+	CountingAlloc a;
+	qrtz_Context parent;
+	initCountingContext(&parent, &a);
+	qrtz_Slab slab;
+	qrtz_Context ctx;
+	qrtz_initSlabContext(&ctx, &slab, &parent);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	for(int i = 0; i < 5000; i++) setGlobal(vm, i, QRTZ_MKOBJ(qrtz_allocFStringObject(vm, "global number %d, long enough", i)));
+	for(int i = 0; i < 5000; i++) CHECK(qrtz_pushint(vm, i) == QRTZ_OK);
+	qrtz_gc(vm);
+	for(int i = 0; i < 5000; i++) {
+		qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(getGlobal(vm, i));
+		char expected[64];
+		snprintf(expected, sizeof(expected), "global number %d, long enough", i);
+		CHECK(strcmp(qrtz_strcstr(vm, s), expected) == 0);
+	}
+	qrtz_destroy(vm);
+	qrtz_freeSlab(&slab);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	reallocAcrossClasses();
+	runsVM();
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include "test.h"
+
+// What qrtz_getGCStats counts, against collections and live sets the tests know the shape of.
+
+static qrtz_VM *createVM(CountingAlloc *a) {
+	qrtz_Context ctx;
+	initCountingContext(&ctx, a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	return vm;
+}
+
+// Minor collections only count as minor, and major ones also empty the nursery first.
+static void cyclesAreCounted(void) {
+	CountingAlloc a;
+	qrtz_VM *vm = createVM(&a);
+	qrtz_GCStats before, after;
+	qrtz_getGCStats(vm, &before);
+	qrtz_minorgc(vm, false);
+	qrtz_getGCStats(vm, &after);
+	CHECK(after.minorCycles == before.minorCycles + 1 && after.cycles == before.cycles);
+	qrtz_gc(vm);
+	qrtz_getGCStats(vm, &before);
+	CHECK(before.cycles == after.cycles + 1 && before.minorCycles == after.minorCycles + 1);
+	// so do incremental ones, once they finish marking, which takes several steps with enough live
+	qrtz_Map *live = qrtz_allocMapObject(vm, 2000);
+	CHECK(live != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(live));
+	for(int i = 0; i < 2000; i++) CHECK(qrtz_mapset(vm, live, QRTZ_MKINT(i), QRTZ_MKOBJ(qrtz_allocPointerObject(vm))) == QRTZ_OK);
+	qrtz_setGCStepSize(vm, 1);
+	qrtz_setMemoryTarget(vm, 0);
+	qrtz_safepoint(vm);
+	CHECK(vm->gcState == QRTZ_GCMARK);
+	while(vm->gcState == QRTZ_GCMARK) {
+		qrtz_getGCStats(vm, &after);
+		CHECK(after.cycles == before.cycles);
+		qrtz_gcstep(vm);
+		qrtz_safepoint(vm);
+	}
+	qrtz_getGCStats(vm, &after);
+	CHECK(after.cycles == before.cycles + 1);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// Everything allocated between two full collections which nothing keeps is freed by the second,
+// young or old, small or large, and moving objects counts as both.
+static void allocatedBalancesFreed(void) {
+	CountingAlloc a;
+	qrtz_VM *vm = createVM(&a);
+	qrtz_gc(vm);
+	qrtz_GCStats before, after;
+	qrtz_getGCStats(vm, &before);
+	// some survive a minor collection first, and are moved
+	qrtz_Array *kept = qrtz_allocArrayObject(vm, 40);
+	CHECK(kept != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(kept));
+	for(int i = 0; i < 40; i++) qrtz_arrayset(vm, kept, kept->len++, QRTZ_MKOBJ(qrtz_allocPointerObject(vm)));
+	CHECK(QRTZ_ISYOUNG(vm, (qrtz_Object *)kept));
+	qrtz_minorgc(vm, false);
+	CHECK(vm->youngBytes != 0);
+	for(int i = 0; i < 1000; i++) {
+		CHECK(qrtz_allocArrayObject(vm, (size_t)i % 40) != NULL);
+		CHECK(qrtz_allocPointerObject(vm) != NULL);
+		CHECK(qrtz_allocMapObject(vm, (size_t)i % 10) != NULL);
+	}
+	for(int i = 0; i < 10; i++) CHECK(qrtz_allocArrayObject(vm, 10000) != NULL);
+	setGlobal(vm, 0, QRTZ_MKNULL());
+	qrtz_getGCStats(vm, &after);
+	CHECK(after.allocated > before.allocated);
+	qrtz_gc(vm);
+	qrtz_getGCStats(vm, &after);
+	CHECK(after.allocated - before.allocated == after.freed - before.freed);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// The live counts and bytes of each kind go up by exactly what is added to the live set.
+static void liveSetByKind(void) {
+	CountingAlloc a;
+	qrtz_VM *vm = createVM(&a);
+	qrtz_Array *holder = qrtz_allocArrayObject(vm, 30);
+	CHECK(holder != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(holder));
+	qrtz_gc(vm);
+	qrtz_GCStats before, after;
+	qrtz_getGCStats(vm, &before);
+
+	holder = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	char buf[100];
+	memset(buf, 's', sizeof(buf));
+	for(size_t i = 0; i < 10; i++) qrtz_arrayset(vm, holder, holder->len++, QRTZ_MKOBJ(qrtz_allocArrayObject(vm, i * 3)));
+	for(size_t i = 0; i < 3; i++) qrtz_arrayset(vm, holder, holder->len++, QRTZ_MKOBJ(qrtz_allocMapObject(vm, i * 20)));
+	for(size_t i = 0; i < 7; i++) qrtz_arrayset(vm, holder, holder->len++, QRTZ_MKOBJ(qrtz_allocPointerObject(vm)));
+	// too long to be interned, so each is an object of its own
+	for(size_t i = 0; i < 5; i++) qrtz_arrayset(vm, holder, holder->len++, QRTZ_MKOBJ(qrtz_allocStringObject(vm, buf, 60 + i)));
+	for(size_t i = 0; i < holder->len; i++) CHECK(QRTZ_ASOBJ(holder->values[i]) != NULL);
+	// and garbage, which must not count
+	for(size_t i = 0; i < 50; i++) CHECK(qrtz_allocArrayObject(vm, 5) != NULL);
+	qrtz_gc(vm);
+	qrtz_getGCStats(vm, &after);
+
+	size_t count[QRTZ_GCKINDS] = {0}, bytes[QRTZ_GCKINDS] = {0};
+	holder = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	for(size_t i = 0; i < holder->len; i++) {
+		qrtz_Object *obj = QRTZ_ASOBJ(holder->values[i]);
+		count[obj->tag]++;
+		bytes[obj->tag] += qrtz_objmemsizeof(obj);
+	}
+	CHECK(count[QRTZ_OARRAY] == 10 && count[QRTZ_OMAP] == 3 && count[QRTZ_OPOINTER] == 7 && count[QRTZ_OSTR] == 5);
+	for(size_t k = 0; k < QRTZ_GCKINDS; k++) {
+		CHECK(after.liveCount[k] == before.liveCount[k] + count[k]);
+		CHECK(after.liveBytes[k] == before.liveBytes[k] + bytes[k]);
+	}
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	cyclesAreCounted();
+	allocatedBalancesFreed();
+	liveSetByKind();
+	return 0;
+}
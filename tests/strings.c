@@ -0,0 +1,391 @@
+#include "test.h"
+
+static qrtz_Value top(qrtz_VM *vm) {
+	qrtz_Task *task = vm->curTask;
+	return task->stack[task->stacklen - 1];
+}
+
+// The bytes of a short string must outlive the stack slot it was in.
+static void shortStringsStayPut(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(qrtz_pushstring(vm, "ab") == QRTZ_OK);
+	size_t len;
+	qrtz_Exit err;
+	const char *s = qrtz_tolstring(vm, -1, &len, &err);
+	CHECK(err == QRTZ_OK && len == 2);
+	CHECK(qrtz_pushsubstring(vm, -1, 1, 1) == QRTZ_OK);
+	const char *sub = qrtz_tostring(vm, -1, &err);
+	CHECK(err == QRTZ_OK);
+	// the stack grows, and the slots are reused
+	for(int i = 0; i < 10000; i++) CHECK(qrtz_pushstring(vm, "zz") == QRTZ_OK);
+	CHECK(qrtz_popn(vm, 10000) == QRTZ_OK);
+	CHECK(qrtz_pushstring(vm, "yy") == QRTZ_OK);
+	qrtz_compact(vm);
+	CHECK(memcmp(s, "ab", 3) == 0);
+	CHECK(memcmp(sub, "b", 2) == 0);
+	qrtz_destroy(vm);
+}
+
+// Results which fit in a value are built straight into one.
+static void shortResultsDontAllocate(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	size_t allocated = vm->profileAllocated;
+	CHECK(qrtz_pushfstring(vm, "%d", 42) == QRTZ_OK);
+	CHECK(QRTZ_VTAG(top(vm)) == QRTZ_VSSTR);
+	CHECK(qrtz_pushstring(vm, "a") == QRTZ_OK);
+	CHECK(qrtz_concat(vm, 2) == QRTZ_OK);
+	CHECK(QRTZ_VTAG(top(vm)) == QRTZ_VSSTR);
+	CHECK(vm->profileAllocated == allocated);
+	size_t len;
+	CHECK(memcmp(qrtz_tolstring(vm, -1, &len, NULL), "42a", 4) == 0 && len == 3);
+
+	// longer ones still work
+	CHECK(qrtz_pushfstring(vm, "%s-%d", "a long enough string", 12345) == QRTZ_OK);
+	CHECK(qrtz_pushstring(vm, "!") == QRTZ_OK);
+	CHECK(qrtz_concat(vm, 2) == QRTZ_OK);
+	CHECK(strcmp(qrtz_tostring(vm, -1, NULL), "a long enough string-12345!") == 0);
+	qrtz_destroy(vm);
+}
+
+// The host's bytes are only returned as they are along with their length.
+static void externStringsAreTerminated(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	static const char host[] = "external bytes, and more";
+	CHECK(qrtz_pushexternstring(vm, host, 14, NULL, NULL) == QRTZ_OK);
+	size_t len;
+	CHECK(qrtz_tolstring(vm, -1, &len, NULL) == host && len == 14);
+	const char *s = qrtz_tolstring(vm, -1, NULL, NULL);
+	CHECK(s != host && strcmp(s, "external bytes") == 0);
+	CHECK(qrtz_tostring(vm, -1, NULL) == s);
+	qrtz_compact(vm);
+	CHECK(strcmp(s, "external bytes") == 0);
+	qrtz_destroy(vm);
+}
+
+#define INTERNED 300
+
+static qrtz_String *internedString(qrtz_VM *vm, size_t i) {
+	char buf[32];
+	int len = snprintf(buf, sizeof(buf), "interned key %zu", i);
+	qrtz_String *s = qrtz_allocStringObject(vm, buf, (size_t)len);
+	CHECK(s != NULL && (s->flags & QRTZ_SINTERNED));
+	return s;
+}
+
+// Puts the interned strings with an odd i in an array in global 0, and the rest in global 1, if evenToo.
+static qrtz_Array *keepOdd(qrtz_VM *vm, bool evenToo) {
+	for(int g = 0; g < 2; g++) {
+		qrtz_Array *arr = qrtz_allocArrayObject(vm, INTERNED / 2);
+		CHECK(arr != NULL);
+		setGlobal(vm, g, QRTZ_MKOBJ(arr));
+	}
+	for(size_t i = 0; i < INTERNED; i++) {
+		qrtz_String *s = internedString(vm, i);
+		if(i % 2 == 0 && !evenToo) continue;
+		qrtz_Array *arr = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, i % 2 == 0));
+		qrtz_arrayset(vm, arr, arr->len++, QRTZ_MKOBJ(s));
+	}
+	return (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+}
+
+// Every entry of the intern table is one of the kept strings, which are still what new strings
+// with their bytes turn out to be.
+static void onlyKeptInterned(qrtz_VM *vm, size_t before) {
+	qrtz_Array *kept = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	CHECK(vm->stringsLen == before + INTERNED / 2);
+	for(size_t i = 0; i < vm->stringsCap; i++) {
+		qrtz_String *s = vm->strings[i];
+		if(s == NULL || s->len < 13 || memcmp(s->data, "interned key ", 13) != 0) continue;
+		bool found = false;
+		for(size_t j = 0; j < kept->len && !found; j++) found = QRTZ_ASOBJ(kept->values[j]) == &s->obj;
+		CHECK(found);
+	}
+	for(size_t j = 0; j < kept->len; j++) CHECK(&internedString(vm, j * 2 + 1)->obj == QRTZ_ASOBJ(kept->values[j]));
+	CHECK(vm->stringsLen == before + INTERNED / 2);
+}
+
+// Dead interned strings leave the table once a cycle is done with them.
+static void deadStringsAreUninterned(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	size_t before = vm->stringsLen;
+	keepOdd(vm, true);
+	while(vm->youngBytes != 0) CHECK(qrtz_minorgc(vm, true));
+	CHECK(vm->stringsLen == before + INTERNED);
+	// Old strings are left to major cycles, which must drop them as soon as marking is done, as
+	// looking them up while they wait to be swept would bring them back.
+	setGlobal(vm, 1, QRTZ_MKNULL());
+	qrtz_setGCStepSize(vm, 0);
+	qrtz_setMemoryTarget(vm, 0);
+	qrtz_safepoint(vm);
+	CHECK(vm->gcState == QRTZ_GCSWEEP);
+	onlyKeptInterned(vm, before);
+	qrtz_gc(vm);
+	onlyKeptInterned(vm, before);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// Young interned strings are dropped from the table by the minor collection which finds them dead,
+// and the ones it moves are found where they moved to.
+static void youngStringsAreUninterned(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	size_t before = vm->stringsLen;
+	// the VM's own strings are young too, and stay alive
+	size_t youngBefore = vm->youngStringsLen;
+	qrtz_Array *kept = keepOdd(vm, false);
+	CHECK(QRTZ_ISYOUNG(vm, QRTZ_ASOBJ(kept->values[0])));
+	CHECK(vm->youngStringsLen == youngBefore + INTERNED);
+	qrtz_Object *first = QRTZ_ASOBJ(kept->values[0]);
+	// the survivors stay young, in the survivor space
+	qrtz_minorgc(vm, false);
+	CHECK(vm->gcStats.cycles == 0);
+	kept = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	CHECK(QRTZ_ASOBJ(kept->values[0]) != first && QRTZ_ISYOUNG(vm, QRTZ_ASOBJ(kept->values[0])));
+	CHECK(vm->youngStringsLen == youngBefore + INTERNED / 2);
+	onlyKeptInterned(vm, before);
+	while(vm->youngBytes != 0) CHECK(qrtz_minorgc(vm, true));
+	CHECK(vm->youngStringsLen == 0);
+	onlyKeptInterned(vm, before);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// The hash reads words at a time, but must still depend on every byte, and not on where they are.
+static void hashesEveryByte(void) {
+	char src[70 + 16];
+	char aligned[70];
+	for(size_t i = 0; i < sizeof(src); i++) src[i] = (char)(i * 37 + 11);
+	for(size_t len = 0; len <= 70; len++) {
+		for(size_t off = 0; off < 16; off++) {
+			memcpy(aligned, src + off, len);
+			size_t h = qrtz_strhash(src + off, len, 1);
+			CHECK(h == qrtz_strhash(aligned, len, 1));
+			CHECK(h != qrtz_strhash(aligned, len, 2));
+		}
+		size_t h = qrtz_strhash(aligned, len, 1);
+		for(size_t i = 0; i < len; i++) {
+			aligned[i] ^= 0x40;
+			CHECK(qrtz_strhash(aligned, len, 1) != h);
+			aligned[i] ^= 0x40;
+		}
+		// the length is part of it, so a trailing zero counts
+		char zeroed[71] = {0};
+		memcpy(zeroed, aligned, len);
+		CHECK(qrtz_strhash(zeroed, len + 1, 1) != h);
+	}
+}
+
+// Strings too long to be interned are only hashed once used as a key, and every kind of string
+// with the same bytes hashes the same.
+static void hashesAreLazy(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	qrtz_VM *other = qrtz_create(&ctx);
+	CHECK(other != NULL);
+	CHECK(vm->hashSeed != other->hashSeed);
+	qrtz_destroy(other);
+
+	char buf[100];
+	memset(buf, 'h', sizeof(buf));
+	qrtz_String *s = qrtz_allocStringObject(vm, buf, sizeof(buf));
+	CHECK(s != NULL && (s->flags & QRTZ_SHASHED) == 0);
+	qrtz_Map *map = qrtz_allocMapObject(vm, 4);
+	CHECK(map != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(map));
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(0), QRTZ_MKOBJ(s)) == QRTZ_OK);
+	CHECK((s->flags & QRTZ_SHASHED) == 0);
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKOBJ(s), QRTZ_MKINT(1)) == QRTZ_OK);
+	CHECK(s->flags & QRTZ_SHASHED);
+	CHECK(s->hash == qrtz_strhash(buf, sizeof(buf), vm->hashSeed));
+	qrtz_String *same = qrtz_allocStringObject(vm, buf, sizeof(buf));
+	CHECK(same != NULL && same != s && (same->flags & QRTZ_SHASHED) == 0);
+	qrtz_Value v;
+	CHECK(qrtz_mapget(vm, map, QRTZ_MKOBJ(same), &v) && QRTZ_ASINT(v) == 1);
+	CHECK((same->flags & QRTZ_SHASHED) && same->hash == s->hash);
+
+	// interned strings are looked up by their hash as soon as they are made
+	qrtz_String *interned = qrtz_allocStringObject(vm, buf, QRTZ_INTERNLIMIT);
+	CHECK(interned != NULL && (interned->flags & QRTZ_SHASHED));
+	CHECK(interned->hash == qrtz_strhash(buf, QRTZ_INTERNLIMIT, vm->hashSeed));
+	for(size_t len = 0; len <= QRTZ_SSTRMAX; len++) {
+		qrtz_String *obj = qrtz_allocStringObject(vm, buf, len);
+		CHECK(obj != NULL);
+		size_t h = qrtz_strhash(buf, len, vm->hashSeed);
+		CHECK(qrtz_valhash(vm, QRTZ_MKSSTR(buf, len)) == h);
+		CHECK(qrtz_valhash(vm, QRTZ_MKOBJ(obj)) == h);
+	}
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+#define PIECES 2000
+#define PIECEMAX 127
+
+static size_t ropeDepth(qrtz_String *s) {
+	if((s->flags & QRTZ_SROPE) == 0 || ((qrtz_Rope *)s)->flat != NULL) return 0;
+	return ((qrtz_Rope *)s)->depth;
+}
+
+// Piece i, which is at least QRTZ_ROPEMIN bytes unless short is set, so appending it makes a new rope.
+static size_t piece(char *buf, size_t i, bool isShort) {
+	size_t len = isShort ? 1 + i % 9 : QRTZ_ROPEMIN + i % (PIECEMAX - QRTZ_ROPEMIN + 1);
+	for(size_t j = 0; j < len; j++) buf[j] = (char)('a' + (i + j) % 26);
+	return len;
+}
+
+// Builds a rope out of every piece, appending them or prepending them, and checks its depth
+// stays bounded along the way, and that it survives a collection and flattens to the right bytes.
+static void buildRope(qrtz_VM *vm, bool prepend, bool isShort) {
+	char *expected = malloc(PIECES * PIECEMAX);
+	CHECK(expected != NULL);
+	size_t len = 0;
+	qrtz_String *rope = qrtz_allocStringObject(vm, "", 0);
+	CHECK(rope != NULL);
+	for(size_t i = 0; i < PIECES; i++) {
+		char buf[PIECEMAX];
+		size_t n = piece(buf, i, isShort);
+		qrtz_String *p = qrtz_allocStringObject(vm, buf, n);
+		CHECK(p != NULL);
+		if(prepend) {
+			memmove(expected + n, expected, len);
+			memcpy(expected, buf, n);
+			rope = qrtz_concatStringObjects(vm, p, rope);
+		} else {
+			memcpy(expected + len, buf, n);
+			rope = qrtz_concatStringObjects(vm, rope, p);
+		}
+		len += n;
+		CHECK(rope != NULL && rope->len == len);
+		CHECK(ropeDepth(rope) <= QRTZ_ROPEMAXDEPTH);
+	}
+	CHECK(rope->flags & QRTZ_SROPE);
+	setGlobal(vm, 0, QRTZ_MKOBJ(rope));
+	qrtz_gc(vm);
+	rope = (qrtz_String *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	CHECK(rope->len == len && ropeDepth(rope) <= QRTZ_ROPEMAXDEPTH);
+	CHECK(qrtz_valhash(vm, QRTZ_MKOBJ(rope)) == qrtz_strhash(expected, len, vm->hashSeed));
+	const char *data = qrtz_strdata(vm, rope);
+	CHECK(data != NULL && memcmp(data, expected, len) == 0);
+	CHECK(ropeDepth(rope) == 0 && qrtz_strdata(vm, rope) == data);
+	setGlobal(vm, 0, QRTZ_MKNULL());
+	free(expected);
+}
+
+// Chains of concatenations on either side are rebalanced before they get deeper than QRTZ_ROPEMAXDEPTH.
+static void ropesStayBalanced(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	buildRope(vm, false, false);
+	buildRope(vm, true, false);
+	// short pieces are merged into the leaf they are appended to, but prepending them can't be
+	buildRope(vm, false, true);
+	buildRope(vm, true, true);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+#define PARENTLEN 4096
+
+static void countRelease(void *userdata, const char *str, size_t len) {
+	(void)str;
+	(void)len;
+	(*(size_t *)userdata)++;
+}
+
+static qrtz_SliceString *sliceIn(qrtz_VM *vm, int global) {
+	qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(getGlobal(vm, global));
+	CHECK(s->flags & QRTZ_SSLICE);
+	return (qrtz_SliceString *)s;
+}
+
+// A slice using a small part of a parent nothing else keeps alive is copied out of it during
+// marking, so the parent can be freed. Bigger slices keep their parent.
+static void slicesLetParentsDie(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	static char host[PARENTLEN];
+	for(size_t i = 0; i < PARENTLEN; i++) host[i] = (char)('A' + i % 26);
+	size_t released = 0;
+	qrtz_String *parent = qrtz_allocExternStringObject(vm, host, PARENTLEN, countRelease, &released);
+	CHECK(parent != NULL);
+	size_t smallLen = PARENTLEN / QRTZ_SLICECOMPACT - 1;
+	qrtz_String *small = qrtz_substringObject(vm, parent, 1000, smallLen);
+	CHECK(small != NULL && (small->flags & QRTZ_SSLICE));
+	// slices of slices point straight at the bytes
+	qrtz_String *inner = qrtz_substringObject(vm, small, 10, QRTZ_SLICEMIN);
+	CHECK(inner != NULL && ((qrtz_SliceString *)inner)->parent == parent);
+	CHECK(((qrtz_SliceString *)inner)->offset == 1010);
+	setGlobal(vm, 0, QRTZ_MKOBJ(small));
+	setGlobal(vm, 1, QRTZ_MKOBJ(inner));
+	qrtz_gc(vm);
+	CHECK(released == 1);
+	qrtz_SliceString *slice = sliceIn(vm, 0);
+	CHECK(slice->parent->len == smallLen && slice->offset == 0);
+	CHECK(memcmp(qrtz_strdata(vm, (qrtz_String *)slice), host + 1000, smallLen) == 0);
+	slice = sliceIn(vm, 1);
+	CHECK(slice->parent->len == QRTZ_SLICEMIN && slice->offset == 0);
+	CHECK(memcmp(qrtz_strdata(vm, (qrtz_String *)slice), host + 1010, QRTZ_SLICEMIN) == 0);
+
+	// the parent of a slice of more than 1/QRTZ_SLICECOMPACT of it is kept
+	parent = qrtz_allocExternStringObject(vm, host, PARENTLEN, countRelease, &released);
+	CHECK(parent != NULL);
+	size_t bigLen = PARENTLEN / QRTZ_SLICECOMPACT + 1;
+	qrtz_String *big = qrtz_substringObject(vm, parent, 7, bigLen);
+	CHECK(big != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(big));
+	qrtz_gc(vm);
+	CHECK(released == 1);
+	slice = sliceIn(vm, 0);
+	CHECK(&slice->parent->obj == &parent->obj && slice->offset == 7);
+	CHECK(memcmp(qrtz_strdata(vm, (qrtz_String *)slice), host + 7, bigLen) == 0);
+
+	// so is one which something else keeps alive
+	small = qrtz_substringObject(vm, parent, 100, smallLen);
+	CHECK(small != NULL);
+	setGlobal(vm, 1, QRTZ_MKOBJ(small));
+	qrtz_gc(vm);
+	CHECK(released == 1 && &sliceIn(vm, 1)->parent->obj == &parent->obj);
+
+	setGlobal(vm, 0, QRTZ_MKNULL());
+	setGlobal(vm, 1, QRTZ_MKNULL());
+	qrtz_gc(vm);
+	CHECK(released == 2);
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+int main(void) {
+	shortStringsStayPut();
+	shortResultsDontAllocate();
+	externStringsAreTerminated();
+	deadStringsAreUninterned();
+	youngStringsAreUninterned();
+	hashesEveryByte();
+	hashesAreLazy();
+	ropesStayBalanced();
+	slicesLetParentsDie();
+	return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef QRTZ_TEST_H
+#define QRTZ_TEST_H
+
+// Tests poke at the VM's internals, so they include value.h besides the API.
+#include "quartz.h"
+#include "common.h"
+#include "value.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while(0)
+
+// An allocator which counts the bytes it has handed out and not gotten back,
+// and can fail once past a limit, or after a number of allocations.
+typedef struct CountingAlloc {
+	size_t live;
+	// 0 for no limit
+	size_t limit;
+	// allocations left before every one fails, or -1 to never fail
+	long budget;
+} CountingAlloc;
+
+static void *countingAlloc(void *data, void *memory, size_t oldSize, size_t newSize) {
+	CountingAlloc *a = data;
+	if(newSize == 0) {
+		if(memory != NULL) a->live -= oldSize;
+		free(memory);
+		return NULL;
+	}
+	size_t live = a->live - (memory != NULL ? oldSize : 0) + newSize;
+	if(a->limit != 0 && live > a->limit) return NULL;
+	if(a->budget == 0) return NULL;
+	if(a->budget > 0) a->budget--;
+	void *n = realloc(memory, newSize);
+	if(n != NULL) a->live = live;
+	return n;
+}
+
+static void initCountingContext(qrtz_Context *ctx, CountingAlloc *a) {
+	a->live = 0;
+	a->limit = 0;
+	a->budget = -1;
+	qrtz_initContext(ctx);
+	ctx->data = a;
+	ctx->alloc = countingAlloc;
+}
+
+static qrtz_Value getGlobal(qrtz_VM *vm, int key) {
+	qrtz_Value v = QRTZ_MKNULL();
+	qrtz_mapget(vm, vm->globals, QRTZ_MKINT(key), &v);
+	return v;
+}
+
+static void setGlobal(qrtz_VM *vm, int key, qrtz_Value v) {
+	CHECK(qrtz_mapset(vm, vm->globals, QRTZ_MKINT(key), v) == QRTZ_OK);
+}
+
+#endif
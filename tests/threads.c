@@ -0,0 +1,303 @@
+#include "test.h"
+#include <pthread.h>
+#include <sched.h>
+
+// Parallel marking and background sweeping, on threads the context starts with pthreads.
+
+// what the context counts, shared by every thread it starts
+typedef struct Threads {
+	CountingAlloc counts;
+	pthread_mutex_t lock;
+	// starts left before every one fails, or -1 to never fail
+	long startsLeft;
+	size_t started;
+} Threads;
+
+typedef struct Thread {
+	pthread_t id;
+	void (*fn)(void *arg);
+	void *arg;
+} Thread;
+
+// marking and sweeping threads allocate and free concurrently
+static void *lockedAlloc(void *data, void *memory, size_t oldSize, size_t newSize) {
+	Threads *t = data;
+	pthread_mutex_lock(&t->lock);
+	void *n = countingAlloc(&t->counts, memory, oldSize, newSize);
+	pthread_mutex_unlock(&t->lock);
+	return n;
+}
+
+static void *runThread(void *arg) {
+	Thread *th = arg;
+	th->fn(th->arg);
+	return NULL;
+}
+
+// threads are only ever started and joined from the VM's thread
+static void *threadStart(void *data, void fn(void *arg), void *arg) {
+	Threads *t = data;
+	if(t->startsLeft == 0) return NULL;
+	Thread *th = malloc(sizeof(Thread));
+	CHECK(th != NULL);
+	th->fn = fn;
+	th->arg = arg;
+	CHECK(pthread_create(&th->id, NULL, runThread, th) == 0);
+	if(t->startsLeft > 0) t->startsLeft--;
+	t->started++;
+	return th;
+}
+
+static void threadJoin(void *data, void *thread) {
+	(void)data;
+	Thread *th = thread;
+	CHECK(pthread_join(th->id, NULL) == 0);
+	free(th);
+}
+
+// a VM collecting on 4 threads, and sweeping on another, unless threads is NULL
+static qrtz_VM *createVM(Threads *t, CountingAlloc *serial) {
+	qrtz_Context ctx;
+	if(t != NULL) {
+		initCountingContext(&ctx, &t->counts);
+		CHECK(pthread_mutex_init(&t->lock, NULL) == 0);
+		t->started = 0;
+		ctx.data = t;
+		ctx.alloc = lockedAlloc;
+		ctx.threadStart = threadStart;
+		ctx.threadJoin = threadJoin;
+	} else {
+		initCountingContext(&ctx, serial);
+	}
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	// stop-the-world, which is what hands sweeping to the background
+	qrtz_setGCStepSize(vm, 0);
+	qrtz_setMemoryTarget(vm, SIZE_MAX);
+	if(t != NULL) {
+		qrtz_setGCThreads(vm, 4);
+		qrtz_setGCBackgroundSweep(vm, true);
+	}
+	return vm;
+}
+
+// Runs a stop-the-world cycle from a safe point, and waits for the background sweep it starts
+// to be done, without letting the VM pick up what it swept.
+static void collect(qrtz_VM *vm) {
+	qrtz_setMemoryTarget(vm, 0);
+	qrtz_safepoint(vm);
+	CHECK(vm->gcState == QRTZ_GCSWEEP);
+	if(vm->sweepThread == NULL) return;
+	while(!__atomic_load_n(&vm->sweepDone, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static void destroyVM(qrtz_VM *vm, Threads *t, CountingAlloc *serial) {
+	qrtz_destroy(vm);
+	if(t != NULL) {
+		CHECK(t->counts.live == 0);
+		pthread_mutex_destroy(&t->lock);
+	} else {
+		CHECK(serial->live == 0);
+	}
+}
+
+// a graph of arrays over QRTZ_PARALLELMARKMIN, half of which is only reachable through links, if at all
+#define NODES 16384
+#define NODELEN 64
+#define NODESTR 48
+
+static size_t linkOf(size_t i, size_t j) {
+	return (i * 2654435761u + j * 40503u) % NODES;
+}
+
+static void nodeString(char *buf, size_t i) {
+	snprintf(buf, NODESTR + 1, "node %-42zu", i);
+}
+
+static void buildGraph(qrtz_VM *vm) {
+	qrtz_Array **nodes = malloc(sizeof(qrtz_Array *) * NODES);
+	CHECK(nodes != NULL);
+	for(size_t i = 0; i < NODES; i++) {
+		nodes[i] = qrtz_allocArrayObject(vm, NODELEN);
+		CHECK(nodes[i] != NULL);
+		nodes[i]->len = NODELEN;
+		for(size_t j = 0; j < NODELEN; j++) nodes[i]->values[j] = QRTZ_MKNULL();
+	}
+	char buf[NODESTR + 1];
+	for(size_t i = 0; i < NODES; i++) {
+		qrtz_Array *node = nodes[i];
+		qrtz_arrayset(vm, node, 0, QRTZ_MKINT(i));
+		nodeString(buf, i);
+		qrtz_String *s = qrtz_allocStringObject(vm, buf, NODESTR);
+		CHECK(s != NULL);
+		qrtz_arrayset(vm, node, 1, QRTZ_MKOBJ(s));
+		qrtz_Map *map = qrtz_allocMapObject(vm, 1);
+		CHECK(map != NULL);
+		CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(0), QRTZ_MKOBJ(nodes[linkOf(i, 2)])) == QRTZ_OK);
+		qrtz_arrayset(vm, node, 2, QRTZ_MKOBJ(map));
+		for(size_t j = 3; j < NODELEN; j++) {
+			qrtz_Value v = j % 2 == 0 ? QRTZ_MKOBJ(nodes[linkOf(i, j)]) : QRTZ_MKINT(i * j);
+			qrtz_arrayset(vm, node, j, v);
+		}
+	}
+	qrtz_Array *root = qrtz_allocArrayObject(vm, NODES / 2);
+	CHECK(root != NULL);
+	root->len = NODES / 2;
+	for(size_t i = 0; i < NODES / 2; i++) qrtz_arrayset(vm, root, i, QRTZ_MKOBJ(nodes[i * 2]));
+	setGlobal(vm, 0, QRTZ_MKOBJ(root));
+	free(nodes);
+	CHECK(vm->memUsage >= QRTZ_PARALLELMARKMIN);
+}
+
+static qrtz_Array *nodeAt(qrtz_Value v, size_t i) {
+	CHECK(QRTZ_ISOBJ(v) && QRTZ_ASOBJ(v)->tag == QRTZ_OARRAY);
+	qrtz_Array *node = (qrtz_Array *)QRTZ_ASOBJ(v);
+	CHECK(node->len == NODELEN && QRTZ_ASINT(node->values[0]) == (intptr_t)i);
+	return node;
+}
+
+// everything reachable from the root is still what buildGraph made
+static void checkGraph(qrtz_VM *vm) {
+	qrtz_Array *root = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	char buf[NODESTR + 1];
+	for(size_t k = 0; k < NODES / 2; k++) {
+		size_t i = k * 2;
+		qrtz_Array *node = nodeAt(root->values[k], i);
+		nodeString(buf, i);
+		qrtz_String *s = (qrtz_String *)QRTZ_ASOBJ(node->values[1]);
+		CHECK(s->len == NODESTR && memcmp(qrtz_strdata(vm, s), buf, NODESTR) == 0);
+		qrtz_Value link;
+		CHECK(qrtz_mapget(vm, (qrtz_Map *)QRTZ_ASOBJ(node->values[2]), QRTZ_MKINT(0), &link));
+		nodeAt(link, linkOf(i, 2));
+		for(size_t j = 3; j < NODELEN; j++) {
+			if(j % 2 == 0) nodeAt(node->values[j], linkOf(i, j));
+			else CHECK(QRTZ_ASINT(node->values[j]) == (intptr_t)(i * j));
+		}
+	}
+}
+
+// the old objects left once everything is swept, by tag, which is the same on any number of threads
+typedef struct Survivors {
+	size_t count[QRTZ_OCLOSURE + 1];
+} Survivors;
+
+static void countObject(qrtz_Object *obj, void *userdata) {
+	Survivors *s = userdata;
+	s->count[obj->tag]++;
+}
+
+static void survivorsOf(qrtz_VM *vm, Survivors *s) {
+	buildGraph(vm);
+	collect(vm);
+	checkGraph(vm);
+	qrtz_gc(vm);
+	CHECK(vm->gcState == QRTZ_GCIDLE && vm->sweepThread == NULL);
+	checkGraph(vm);
+	memset(s, 0, sizeof(Survivors));
+	qrtz_heapEach(vm, countObject, s);
+}
+
+static void sameSurvivors(const Survivors *a, const Survivors *b) {
+	for(size_t k = 0; k <= QRTZ_OCLOSURE; k++) CHECK(a->count[k] == b->count[k]);
+	CHECK(a->count[QRTZ_OARRAY] > NODES / 2);
+}
+
+// Marks and sweeps the same graph on 1 thread and then others, which must keep the same objects alive.
+// With startsLeft, only that many threads can be started, and the rest of the work stays on the VM's.
+static void parallelCollection(const Survivors *serial, long startsLeft, size_t started) {
+	Threads t;
+	t.startsLeft = startsLeft;
+	qrtz_VM *vm = createVM(&t, NULL);
+	Survivors s;
+	survivorsOf(vm, &s);
+	CHECK(t.started == started);
+	sameSurvivors(serial, &s);
+	destroyVM(vm, &t, NULL);
+}
+
+typedef struct Releases {
+	pthread_t vmThread;
+	size_t count;
+	bool offThread;
+} Releases;
+
+static void release(void *userdata, const char *str, size_t len) {
+	(void)str;
+	(void)len;
+	Releases *r = userdata;
+	r->count++;
+	if(!pthread_equal(pthread_self(), r->vmThread)) r->offThread = true;
+}
+
+#define STRINGS 2000
+
+static const char externBytes[] = "bytes owned by the host, well over the interning limit of 40";
+
+// Dead extern and interned strings must be released on the VM's thread, so the background sweeper
+// leaves the pages they are in for it.
+static void releasedOnVMThread(void) {
+	Threads t;
+	t.startsLeft = -1;
+	qrtz_VM *vm = createVM(&t, NULL);
+	Releases r = {pthread_self(), 0, false};
+	qrtz_Array *dead = qrtz_allocArrayObject(vm, STRINGS * 2);
+	qrtz_Array *live = qrtz_allocArrayObject(vm, STRINGS * 2);
+	CHECK(dead != NULL && live != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(dead));
+	setGlobal(vm, 1, QRTZ_MKOBJ(live));
+	char buf[32];
+	for(size_t i = 0; i < STRINGS * 2; i++) {
+		qrtz_Array *to = i % 2 == 0 ? dead : live;
+		qrtz_String *e = qrtz_allocExternStringObject(vm, externBytes, sizeof(externBytes) - 1, release, &r);
+		int len = snprintf(buf, sizeof(buf), "interned %zu", i);
+		qrtz_String *s = qrtz_allocStringObject(vm, buf, (size_t)len);
+		CHECK(e != NULL && s != NULL && (s->flags & QRTZ_SINTERNED));
+		to->values[to->len++] = QRTZ_MKOBJ(e);
+		qrtz_barrier(vm, &to->obj, QRTZ_MKOBJ(e));
+		to->values[to->len++] = QRTZ_MKOBJ(s);
+		qrtz_barrier(vm, &to->obj, QRTZ_MKOBJ(s));
+	}
+	// only old objects are swept in the background
+	while(vm->youngBytes != 0) CHECK(qrtz_minorgc(vm, true));
+	size_t interned = vm->stringsLen;
+	setGlobal(vm, 0, QRTZ_MKNULL());
+
+	collect(vm);
+	CHECK(t.started > 0 && vm->sweepThread != NULL);
+	CHECK(vm->releasePages != NULL);
+	CHECK(r.count == 0);
+	// the intern table already forgot them once marking was done
+	CHECK(vm->stringsLen == interned - STRINGS);
+
+	qrtz_gc(vm);
+	CHECK(r.count == STRINGS && !r.offThread);
+	CHECK(vm->externStrings == STRINGS);
+	CHECK(vm->stringsLen == interned - STRINGS);
+	// the live interned strings are still the ones new strings with their bytes are
+	live = (qrtz_Array *)QRTZ_ASOBJ(getGlobal(vm, 1));
+	for(size_t i = 0; i < STRINGS; i++) {
+		int len = snprintf(buf, sizeof(buf), "interned %zu", i * 2 + 1);
+		qrtz_String *s = qrtz_allocStringObject(vm, buf, (size_t)len);
+		CHECK(QRTZ_ASOBJ(live->values[i * 2 + 1]) == &s->obj);
+		qrtz_String *e = (qrtz_String *)QRTZ_ASOBJ(live->values[i * 2]);
+		CHECK(memcmp(qrtz_strdata(vm, e), externBytes, sizeof(externBytes) - 1) == 0);
+	}
+	destroyVM(vm, &t, NULL);
+	CHECK(r.count == STRINGS * 2 && !r.offThread);
+}
+
+int main(void) {
+	CountingAlloc a;
+	qrtz_VM *vm = createVM(NULL, &a);
+	Survivors serial;
+	survivorsOf(vm, &serial);
+	destroyVM(vm, NULL, &a);
+
+	// 3 markers and a sweeper for the first cycle, and 3 markers for the full collection, which sweeps itself
+	parallelCollection(&serial, -1, 7);
+	// one marker starts, then every other thread fails to
+	parallelCollection(&serial, 1, 1);
+	parallelCollection(&serial, 0, 0);
+	releasedOnVMThread();
+	return 0;
+}
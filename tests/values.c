@@ -0,0 +1,80 @@
+#include "test.h"
+
+// Also built with QUARTZ_NANBOX, see CMakeLists.txt.
+
+static qrtz_Value top(qrtz_VM *vm) {
+	qrtz_Task *task = vm->curTask;
+	return task->stack[task->stacklen - 1];
+}
+
+// pushes n, and checks it comes back as the int it is, or as the float nearest to it if it doesn't fit
+static void pushInt(qrtz_VM *vm, intptr_t n, bool fits) {
+	CHECK(qrtz_pushint(vm, n) == QRTZ_OK);
+	qrtz_Value v = top(vm);
+	if(fits) {
+		CHECK(QRTZ_VTAG(v) == QRTZ_VINT && QRTZ_ASINT(v) == n);
+	} else {
+		CHECK(QRTZ_VTAG(v) == QRTZ_VNUMBER && QRTZ_ASNUM(v) == (double)n);
+	}
+	CHECK(qrtz_pop(vm) == QRTZ_OK);
+}
+
+static void intRange(void) {
+	CountingAlloc a;
+	qrtz_Context ctx;
+	initCountingContext(&ctx, &a);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	CHECK(vm != NULL);
+	pushInt(vm, 0, true);
+	pushInt(vm, -1, true);
+#ifdef QUARTZ_NANBOX
+	CHECK(QRTZ_NANBOX_INTMAX == ((intptr_t)1 << 47) - 1);
+	pushInt(vm, QRTZ_NANBOX_INTMAX, true);
+	pushInt(vm, QRTZ_NANBOX_INTMIN, true);
+	pushInt(vm, QRTZ_NANBOX_INTMAX + 1, false);
+	pushInt(vm, QRTZ_NANBOX_INTMIN - 1, false);
+	pushInt(vm, (intptr_t)1 << 50, false);
+	pushInt(vm, -((intptr_t)1 << 50), false);
+	pushInt(vm, INTPTR_MAX, false);
+	pushInt(vm, INTPTR_MIN, false);
+	// floats next to the boxed ones are left alone
+	qrtz_Value f = qrtz_mkint(QRTZ_NANBOX_INTMAX + 1);
+	CHECK(QRTZ_VTAG(f) == QRTZ_VNUMBER && QRTZ_ASNUM(f) == 140737488355328.0);
+#else
+	pushInt(vm, ((intptr_t)1 << 47) - 1, true);
+	pushInt(vm, (intptr_t)1 << 50, true);
+	pushInt(vm, INTPTR_MAX, true);
+	pushInt(vm, INTPTR_MIN, true);
+#endif
+	qrtz_destroy(vm);
+	CHECK(a.live == 0);
+}
+
+// every kind of value survives being built and taken apart again
+static void roundTrips(void) {
+	CHECK(QRTZ_VTAG(QRTZ_MKNULL()) == QRTZ_VNULL);
+	CHECK(QRTZ_VTAG(QRTZ_MKILLEGAL()) == QRTZ_VILLEGAL);
+	CHECK(QRTZ_ASBOOL(QRTZ_MKBOOL(true)) && !QRTZ_ASBOOL(QRTZ_MKBOOL(false)));
+	double nums[] = {0.0, -0.0, 1.5, -1e300, 1e-300, 1.0 / 0.0, -1.0 / 0.0};
+	for(size_t i = 0; i < sizeof(nums) / sizeof(nums[0]); i++) {
+		qrtz_Value v = QRTZ_MKNUM(nums[i]);
+		CHECK(QRTZ_VTAG(v) == QRTZ_VNUMBER && QRTZ_ASNUM(v) == nums[i]);
+	}
+	// NaNs stay numbers, and never look like a boxed value
+	qrtz_Value nan = QRTZ_MKNUM(-(0.0 / 0.0));
+	CHECK(QRTZ_VTAG(nan) == QRTZ_VNUMBER && QRTZ_ASNUM(nan) != QRTZ_ASNUM(nan));
+	int x;
+	qrtz_Value obj = QRTZ_MKOBJ(&x);
+	CHECK(QRTZ_ISOBJ(obj) && (void *)QRTZ_ASOBJ(obj) == &x);
+	for(size_t len = 0; len <= QRTZ_SSTRMAX; len++) {
+		qrtz_Value s = QRTZ_MKSSTR("abcdefgh", len);
+		CHECK(QRTZ_VTAG(s) == QRTZ_VSSTR && QRTZ_SSTRLEN(s) == len);
+		CHECK(memcmp(QRTZ_SSTRDATA(&s), "abcdefgh", len) == 0 && QRTZ_SSTRDATA(&s)[len] == '\0');
+	}
+}
+
+int main(void) {
+	intRange();
+	roundTrips();
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include "test.h"
+
+// What finalizers saw, checked once the collector is done.
+typedef struct Finalized {
+	qrtz_VM *vm;
+	qrtz_Map *map;
+	size_t count;
+	void *last;
+	// the length of the map, and whether the collector was running, when the last finalizer ran
+	size_t mapLen;
+	bool collecting;
+} Finalized;
+
+static void finalize(void *userdata, void *pointer) {
+	Finalized *f = userdata;
+	f->count++;
+	f->last = pointer;
+	f->mapLen = f->map->len;
+	f->collecting = f->vm->gcRunning;
+}
+
+static int things[4];
+
+// pushes a userdata and returns it
+static qrtz_Value pushThing(qrtz_VM *vm, int i) {
+	CHECK(qrtz_pushuserdata(vm, &things[i], "thing", 0) == QRTZ_OK);
+	qrtz_Task *task = vm->curTask;
+	return task->stack[task->stacklen - 1];
+}
+
+// an array holding only val
+static qrtz_Value holding(qrtz_VM *vm, qrtz_Value val) {
+	qrtz_Array *arr = qrtz_allocArrayObject(vm, 1);
+	CHECK(arr != NULL);
+	arr->len = 1;
+	arr->values[0] = val;
+	return QRTZ_MKOBJ(arr);
+}
+
+static qrtz_Map *weakMap(qrtz_VM *vm, Finalized *f, qrtz_WeakFlags flags) {
+	qrtz_Map *map = qrtz_allocMapObject(vm, 4);
+	CHECK(map != NULL);
+	setGlobal(vm, 0, QRTZ_MKOBJ(map));
+	// promoted, so it stays where the finalizer looks
+	while(vm->youngBytes != 0) CHECK(qrtz_minorgc(vm, true));
+	map = (qrtz_Map *)QRTZ_ASOBJ(getGlobal(vm, 0));
+	qrtz_setMapWeak(vm, map, flags);
+	f->vm = vm;
+	f->map = map;
+	f->count = 0;
+	CHECK(qrtz_setfinalizer(vm, "thing", finalize, f) == QRTZ_OK);
+	return map;
+}
+
+// Values referencing their own weak key don't keep their entry alive, and finalizers only
+// run once the dead entries are gone and the collector is done.
+static void weakKeys(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	Finalized f;
+	qrtz_Map *map = weakMap(vm, &f, QRTZ_WEAK_KEYS);
+	qrtz_Value dead = pushThing(vm, 0);
+	CHECK(qrtz_mapset(vm, map, dead, holding(vm, dead)) == QRTZ_OK);
+	qrtz_Value kept = pushThing(vm, 1);
+	setGlobal(vm, 1, kept);
+	CHECK(qrtz_mapset(vm, map, kept, holding(vm, kept)) == QRTZ_OK);
+	// strings are held strongly, as an equal one can always be made
+	qrtz_String *name = qrtz_allocCStringObject(vm, "a key long enough not to fit in a value");
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKOBJ(name), QRTZ_MKINT(1)) == QRTZ_OK);
+	CHECK(qrtz_popn(vm, 2) == QRTZ_OK);
+
+	qrtz_gc(vm);
+	CHECK(f.count == 1 && f.last == &things[0]);
+	CHECK(f.mapLen == 2 && !f.collecting);
+	CHECK(map->len == 2);
+	// collecting moved it out of the nursery
+	kept = getGlobal(vm, 1);
+	qrtz_Value v;
+	CHECK(qrtz_mapget(vm, map, kept, &v));
+	CHECK(QRTZ_ASOBJ(((qrtz_Array *)QRTZ_ASOBJ(v))->values[0]) == QRTZ_ASOBJ(kept));
+
+	setGlobal(vm, 1, QRTZ_MKNULL());
+	qrtz_gc(vm);
+	CHECK(f.count == 2 && f.last == &things[1]);
+	CHECK(f.mapLen == 1 && !f.collecting);
+	qrtz_destroy(vm);
+	CHECK(f.count == 2);
+}
+
+// Entries go once their weak value does. Userdata left when the VM is destroyed are finalized then.
+static void weakValues(void) {
+	qrtz_Context ctx;
+	qrtz_initContext(&ctx);
+	qrtz_VM *vm = qrtz_create(&ctx);
+	Finalized f;
+	qrtz_Map *map = weakMap(vm, &f, QRTZ_WEAK_VALUES);
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(1), pushThing(vm, 2)) == QRTZ_OK);
+	qrtz_Value kept = pushThing(vm, 3);
+	setGlobal(vm, 1, kept);
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(2), kept) == QRTZ_OK);
+	CHECK(qrtz_mapset(vm, map, QRTZ_MKINT(3), QRTZ_MKINT(30)) == QRTZ_OK);
+	CHECK(qrtz_popn(vm, 2) == QRTZ_OK);
+
+	// minor collections treat weak maps as strong ones
+	CHECK(qrtz_minorgc(vm, true));
+	CHECK(f.count == 0 && map->len == 3);
+	kept = getGlobal(vm, 1);
+	qrtz_gc(vm);
+	CHECK(f.count == 1 && f.last == &things[2]);
+	CHECK(f.mapLen == 2 && !f.collecting);
+	qrtz_Value v;
+	CHECK(!qrtz_mapget(vm, map, QRTZ_MKINT(1), &v));
+	CHECK(qrtz_mapget(vm, map, QRTZ_MKINT(2), &v) && QRTZ_ASOBJ(v) == QRTZ_ASOBJ(kept));
+	qrtz_destroy(vm);
+	CHECK(f.count == 2 && f.last == &things[3]);
+}
+
+int main(void) {
+	weakKeys();
+	weakValues();
+	return 0;
+}